@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+# Runs an rfinder server allowing one search at a time and checks admission control: a scoped
+# lookup queued behind a content search overtakes it, and a search past the queue limit is
+# rejected with a retry hint.
+# Usage: ./admission_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+PORT=$((20000 + RANDOM % 20000))
+ADDRESS=127.0.0.1:$PORT
+# a pattern std::regex backtracks on, so that content searches run for a while
+SLOW_PATTERN='([0-9]+)+x'
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-admission-XXXXXX)
+TREE=$WORK_DIR/tree
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+mkdir -p "$TREE/slow" "$TREE/a/b"
+seq 1 100000 > "$TREE/slow/numbers0"
+for i in $(seq 1 19); do
+    cp "$TREE/slow/numbers0" "$TREE/slow/numbers$i"
+done
+touch "$TREE/a/b/needle.txt"
+
+"$SERVER" --max-searches 1 --max-queue 2 --content-workers 1 "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+PIDS+=($!)
+if ! wait_for_port "$PORT"; then
+    echo "Server did not start:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+
+# runs a search in the background, noting its name in the order file once it completes
+run_noted() {
+    local name=$1
+    shift
+    ("$CLIENT" "$@" > "$WORK_DIR/$name.out" 2>&1; echo "$name" >> "$WORK_DIR/order") &
+    SEARCH_PIDS+=($!)
+    sleep 0.2
+}
+
+SEARCH_PIDS=()
+run_noted first -E -g "$SLOW_PATTERN" "$ADDRESS" '*' "$TREE/slow"
+run_noted listing -E -g "$SLOW_PATTERN" "$ADDRESS" '*' "$TREE/slow"
+run_noted scoped "$ADDRESS" needle.txt "$TREE/a"
+output=$("$CLIENT" -E -g "$SLOW_PATTERN" "$ADDRESS" '*' "$TREE/slow" 2>&1)
+retry=$(sed -n 's/.*Rejected: .*, retry in \([0-9]*\) ms$/\1/p' <<< "$output")
+if [ -z "$retry" ] || [ "$retry" -lt 100 ] || [ "$retry" -gt 60000 ]; then
+    fail "a search past the queue limit is rejected with a retry hint" "$output"
+else
+    pass "rejected with a retry hint"
+fi
+
+wait "${SEARCH_PIDS[@]}"
+# the first search completes as the scoped one starts, either may be noted first
+order=$(grep -v first "$WORK_DIR/order" | tr '\n' ' ')
+if [ "$order" != "scoped listing " ] || ! grep -qF "$TREE/a/b/needle.txt" "$WORK_DIR/scoped.out" \
+    || ! grep -qF "0 matching lines" "$WORK_DIR/listing.out"; then
+    fail "a queued scoped lookup overtakes a queued content search" "completed: $order"$'\n'"$(cat "$WORK_DIR"/*.out)"
+else
+    pass "scoped lookup overtakes"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
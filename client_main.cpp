@@ -1,7 +1,12 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <stdexcept>
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
 #include "protocol.hpp"
 
 using namespace std::string_literals;
@@ -13,11 +18,27 @@ struct invalid_arg_value final : std::runtime_error {
 };
 
 struct tcp_server_info final {
+    /** IPv4 address, or the socket path of a local server */
     std::string address;
-    int16_t port;
+    int16_t port = 0;
+    /** Reached through a unix domain socket at `address` rather than over TCP */
+    bool local = false;
+
+    static constexpr std::string_view LOCAL_PREFIX = "unix:";
 
+    /**
+     * Parses "address:port", or "unix:/path" for a server on this host.
+     */
     static tcp_server_info parse_from_string(std::string_view str) {
         tcp_server_info info;
+        if (str.substr(0, LOCAL_PREFIX.size()) == LOCAL_PREFIX) {
+            info.address = str.substr(LOCAL_PREFIX.size());
+            info.local = true;
+            if (info.address.empty()) {
+                throw invalid_arg_value("Empty socket path");
+            }
+            return info;
+        }
         size_t colon_pos = str.find(':');
         if (colon_pos == std::string_view::npos) {
             throw invalid_arg_value("Colon separating address and port not found");
@@ -30,6 +51,63 @@ struct tcp_server_info final {
         }
         return info;
     }
+
+    /**
+     * Parses a comma separated list of address:port pairs.
+     */
+    static std::vector<tcp_server_info> parse_list(std::string_view str) {
+        std::vector<tcp_server_info> servers;
+        while (!str.empty()) {
+            size_t comma_pos = std::min(str.find(','), str.size());
+            if (comma_pos > 0) {
+                servers.push_back(parse_from_string(std::string(str.substr(0, comma_pos))));
+            }
+            str.remove_prefix(std::min(comma_pos + 1, str.size()));
+        }
+        if (servers.empty()) {
+            throw invalid_arg_value("No server address");
+        }
+        return servers;
+    }
+
+    /**
+     * Reads one address:port per line, skipping blank lines and # comments.
+     */
+    static std::vector<tcp_server_info> parse_hosts_file(const char* path) {
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            throw invalid_arg_value("Could not open hosts file");
+        }
+        std::vector<tcp_server_info> servers;
+        char line[512];
+        while (fgets(line, sizeof(line), file)) {
+            std::string_view entry = line;
+            entry = entry.substr(0, entry.find('#'));
+            auto begin = entry.find_first_not_of(" \t\r\n");
+            if (begin == std::string_view::npos) {
+                continue;
+            }
+            entry = entry.substr(begin, entry.find_last_not_of(" \t\r\n") - begin + 1);
+            try {
+                servers.push_back(parse_from_string(std::string(entry)));
+            } catch (const invalid_arg_value&) {
+                fclose(file);
+                throw;
+            }
+        }
+        fclose(file);
+        if (servers.empty()) {
+            throw invalid_arg_value("Hosts file lists no servers");
+        }
+        return servers;
+    }
+
+    std::string to_string() const {
+        if (this->local) {
+            return std::string(LOCAL_PREFIX) + this->address;
+        }
+        return this->address + ":" + std::to_string((uint16_t)this->port);
+    }
 };
 
 struct command_parse_error final : std::runtime_error {
@@ -40,16 +118,142 @@ struct command_parse_error final : std::runtime_error {
         : std::runtime_error(msg) {}
 };
 
+/**
+ * Parses a count such as a page size, which has to be positive.
+ * @throws std::logic_error unless text holds a number from 1 to UINT32_MAX.
+ */
+static uint32_t parse_count(const std::string& text) {
+    // stoul accepts "-1" as ULONG_MAX
+    if (text.empty() || text[0] == '-') {
+        throw std::invalid_argument("negative");
+    }
+    auto count = std::stoul(text);
+    if (count == 0 || count > UINT32_MAX) {
+        throw std::out_of_range("count");
+    }
+    return (uint32_t)count;
+}
+
+/**
+ * @returns the directory --cache keeps its entries in, empty if the environment names none.
+ */
+static std::string default_cache_dir() {
+#ifdef __unix__
+    if (const char* xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return std::string(xdg) + "/rfinder";
+    }
+    if (const char* home = getenv("HOME"); home && *home) {
+        return std::string(home) + "/.cache/rfinder";
+    }
+#else
+    if (const char* local = getenv("LOCALAPPDATA"); local && *local) {
+        return std::string(local) + "\\rfinder";
+    }
+#endif
+    return "";
+}
+
 struct command_options final {
     std::string file_name;
     std::string root_path;
+    /** Roots searched together with root_path */
+    std::vector<std::string> extra_roots;
     tcp_server_info server_info;
+    /** Every server to query, server_info being the first one */
+    std::vector<tcp_server_info> servers;
+    /** Stop at the first result of any server instead of collecting all of them */
+    bool first_match = false;
+    /** Limit on a whole search per server when fanning out, 0 for none */
+    int host_timeout_seconds = 0;
     int connection_timeout_seconds = 60;
+    std::vector<std::string> exclude_patterns;
+    uint32_t search_flags = 0;
+    std::string content_pattern;
+    std::vector<proto::metadata_predicate> predicates;
+    /** Query file for bulk mode, "-" for stdin, empty for a single query */
+    std::string bulk_input;
+    int bulk_window = 64;
+    /** Limit on a whole bulk run, 0 for none */
+    int bulk_timeout_seconds = 3600;
+    /** Server state to print instead of searching (server_stats or trace_dump), filename for none */
+    proto::search_mode admin_request = proto::search_mode::filename;
+    /** substring or fuzzy for a ranked search, filename for none */
+    proto::search_mode ranked_search = proto::search_mode::filename;
+    /** Results of a ranked search, 0 for the server default */
+    uint32_t max_results = 0;
+    /** Results per page of a listing search, 0 to list them all at once */
+    uint32_t page_size = 0;
+    /** Cursor of the page to list, empty for the first one */
+    std::string cursor;
+    /** Directory of the result cache, empty to always search */
+    std::string cache_dir;
+    /** Token of the cached answer to revalidate, empty for none */
+    std::string validation_token;
+    /** Cached answer the validation token vouches for */
+    std::string cached_result;
+
+    bool is_admin() const {
+        return this->admin_request != proto::search_mode::filename;
+    }
+
+    bool is_fan_out() const {
+        return this->servers.size() > 1;
+    }
+
+    bool is_bulk() const {
+        return !this->bulk_input.empty();
+    }
+
+    bool is_content_search() const {
+        return !this->content_pattern.empty();
+    }
+
+    bool is_ranked_search() const {
+        return this->ranked_search != proto::search_mode::filename;
+    }
+
+    /**
+     * @returns true if the answer may be taken from the result cache once the server vouches for it.
+     */
+    bool is_cached() const {
+        return !this->cache_dir.empty() && !this->is_admin() && !this->is_listing();
+    }
+
+    /**
+     * @returns true if the search streams its results rather than answering with a single path.
+     */
+    bool is_listing() const {
+        return this->is_content_search() || this->is_ranked_search()
+            || this->search_flags & (proto::flag_all_matches | proto::flag_filename_glob);
+    }
+
+    proto::file_search_request make_request() const {
+        proto::file_search_request req;
+        req.filename = this->file_name;
+        req.root_path = this->root_path;
+        req.extra_roots = this->extra_roots;
+        req.flags = this->search_flags;
+        req.exclude_patterns = this->exclude_patterns;
+        req.predicates = this->predicates;
+        req.max_results = this->max_results;
+        req.page_size = this->page_size;
+        req.cursor = this->cursor;
+        req.validation_token = this->validation_token;
+        if (this->is_admin()) {
+            req.mode = this->admin_request;
+        } else if (this->is_content_search()) {
+            req.mode = proto::search_mode::content;
+            req.content_pattern = this->content_pattern;
+        } else if (this->is_ranked_search()) {
+            req.mode = this->ranked_search;
+        }
+        return req;
+    }
 
     static command_options parse(int argc, char** argv) {
         command_options opts;
-        static const int positional_args_num = 3;
-        if (argc < positional_args_num) {
+        int positional_args_num = 3;
+        if (argc < 2) {
             throw command_parse_error("Not enough arguments");
         }
         // parse options
@@ -67,34 +271,261 @@ struct command_options final {
                     throw command_parse_error("Invalid timeout value");
                 }
                 ++current_arg_idx;
+            } else if (arg == "-x"sv || arg == "--exclude"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Exclude option without value");
+                }
+                opts.exclude_patterns.push_back(argv[current_arg_idx]);
+                ++current_arg_idx;
+            } else if (arg == "--xdev"sv) {
+                opts.search_flags |= proto::flag_one_filesystem;
+                ++current_arg_idx;
+            } else if (arg == "-g"sv || arg == "--grep"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc || !*argv[current_arg_idx]) {
+                    throw command_parse_error("Grep option without pattern");
+                }
+                opts.content_pattern = argv[current_arg_idx];
+                ++current_arg_idx;
+            } else if (arg == "-a"sv || arg == "--all"sv) {
+                opts.search_flags |= proto::flag_all_matches;
+                ++current_arg_idx;
+            } else if (arg == "--glob"sv) {
+                opts.search_flags |= proto::flag_filename_glob;
+                ++current_arg_idx;
+            } else if (arg == "-s"sv || arg == "--substring"sv) {
+                opts.ranked_search = proto::search_mode::substring;
+                ++current_arg_idx;
+            } else if (arg == "-f"sv || arg == "--fuzzy"sv) {
+                opts.ranked_search = proto::search_mode::fuzzy;
+                ++current_arg_idx;
+            } else if (arg == "-k"sv || arg == "--top"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Top option without value");
+                }
+                try {
+                    opts.max_results = parse_count(argv[current_arg_idx]);
+                } catch (std::logic_error& e) {
+                    throw command_parse_error("Invalid top value");
+                }
+                ++current_arg_idx;
+            } else if (arg == "--page"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Page option without size");
+                }
+                try {
+                    opts.page_size = parse_count(argv[current_arg_idx]);
+                } catch (std::logic_error& e) {
+                    throw command_parse_error("Invalid page size");
+                }
+                ++current_arg_idx;
+            } else if (arg == "--cursor"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Cursor option without value");
+                }
+                opts.cursor = argv[current_arg_idx];
+                ++current_arg_idx;
+            } else if (arg == "--cache"sv) {
+                opts.cache_dir = default_cache_dir();
+                if (opts.cache_dir.empty()) {
+                    throw command_parse_error("No cache directory in the environment, use --cache-dir");
+                }
+                ++current_arg_idx;
+            } else if (arg == "--cache-dir"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc || !*argv[current_arg_idx]) {
+                    throw command_parse_error("Cache directory option without directory");
+                }
+                opts.cache_dir = argv[current_arg_idx];
+                ++current_arg_idx;
+            } else if (arg == "-i"sv || arg == "--ignore-case"sv) {
+                opts.search_flags |= proto::flag_ignore_case;
+                ++current_arg_idx;
+            } else if (arg == "--ignore-normalization"sv) {
+                opts.search_flags |= proto::flag_ignore_normalization;
+                ++current_arg_idx;
+            } else if (arg == "-w"sv || arg == "--where"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Where option without expression");
+                }
+                try {
+                    opts.predicates.push_back(proto::metadata_predicate::parse(argv[current_arg_idx]));
+                } catch (const std::exception& e) {
+                    throw command_parse_error("Invalid predicate \""s + argv[current_arg_idx] + "\": " + e.what());
+                }
+                ++current_arg_idx;
+            } else if (arg == "-E"sv || arg == "--regex"sv) {
+                opts.search_flags |= proto::flag_content_regex;
+                ++current_arg_idx;
+            } else if (arg == "-L"sv || arg == "--follow-symlinks"sv) {
+                opts.search_flags |= proto::flag_follow_symlinks;
+                ++current_arg_idx;
+            } else if (arg == "--include-pseudo-fs"sv) {
+                opts.search_flags |= proto::flag_include_pseudo_filesystems;
+                ++current_arg_idx;
+            } else if (arg == "-b"sv || arg == "--bulk"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc || !*argv[current_arg_idx]) {
+                    throw command_parse_error("Bulk option without query file");
+                }
+                opts.bulk_input = argv[current_arg_idx];
+                positional_args_num = 2;
+                ++current_arg_idx;
+            } else if (arg == "-H"sv || arg == "--hosts"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Hosts option without file");
+                }
+                try {
+                    opts.servers = tcp_server_info::parse_hosts_file(argv[current_arg_idx]);
+                } catch (const invalid_arg_value& e) {
+                    throw command_parse_error(argv[current_arg_idx] + ": "s + e.what());
+                }
+                ++current_arg_idx;
+            } else if (arg == "--first"sv) {
+                opts.first_match = true;
+                ++current_arg_idx;
+            } else if (arg == "--host-timeout"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Host timeout option without value");
+                }
+                try {
+                    opts.host_timeout_seconds = std::stoi(argv[current_arg_idx]);
+                } catch (std::invalid_argument& e) {
+                    throw command_parse_error("Invalid host timeout value");
+                }
+                ++current_arg_idx;
+            } else if (arg == "--stats"sv) {
+                opts.admin_request = proto::search_mode::server_stats;
+                positional_args_num = 2;
+                ++current_arg_idx;
+            } else if (arg == "--trace-dump"sv) {
+                opts.admin_request = proto::search_mode::trace_dump;
+                positional_args_num = 2;
+                ++current_arg_idx;
+            } else if (arg == "--window"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Window option without value");
+                }
+                try {
+                    opts.bulk_window = std::stoi(argv[current_arg_idx]);
+                } catch (std::invalid_argument& e) {
+                    throw command_parse_error("Invalid window value");
+                }
+                if (opts.bulk_window < 1) {
+                    throw command_parse_error("Window must be at least 1");
+                }
+                ++current_arg_idx;
+            } else if (arg == "--bulk-timeout"sv) {
+                ++current_arg_idx;
+                if (current_arg_idx >= argc) {
+                    throw command_parse_error("Bulk timeout option without value");
+                }
+                try {
+                    opts.bulk_timeout_seconds = std::stoi(argv[current_arg_idx]);
+                } catch (std::logic_error& e) {
+                    throw command_parse_error("Invalid bulk timeout value");
+                }
+                if (opts.bulk_timeout_seconds < 0) {
+                    throw command_parse_error("Bulk timeout must not be negative");
+                }
+                ++current_arg_idx;
             } else {
                 break;
             }
         }
+        bool hosts_from_file = !opts.servers.empty();
+        if (hosts_from_file) {
+            // the servers replace the address argument
+            --positional_args_num;
+        }
         int remaining_args = argc - current_arg_idx + 1;
         if (remaining_args < positional_args_num) {
             throw command_parse_error("Not enough positional arguments");
         }
         // parse positional arguments
-        try {
-            opts.server_info = tcp_server_info::parse_from_string(argv[current_arg_idx]);
-            ++current_arg_idx;
-        } catch (const invalid_arg_value& e) {
-            throw command_parse_error("Invalid address format: " + std::string(e.what()));
+        if (!hosts_from_file) {
+            try {
+                opts.servers = tcp_server_info::parse_list(argv[current_arg_idx]);
+                ++current_arg_idx;
+            } catch (const invalid_arg_value& e) {
+                throw command_parse_error("Invalid address format: " + std::string(e.what()));
+            }
+        }
+        opts.server_info = opts.servers.front();
+        if (opts.is_bulk() || opts.is_admin()) {
+            if (opts.is_bulk() && opts.is_fan_out()) {
+                throw command_parse_error("Bulk mode takes a single server");
+            }
+            return opts;
         }
         opts.file_name = argv[current_arg_idx];
         ++current_arg_idx;
         if (current_arg_idx < argc) {
             opts.root_path = argv[current_arg_idx];
+            ++current_arg_idx;
+        }
+        for (; current_arg_idx < argc; ++current_arg_idx) {
+            opts.extra_roots.push_back(argv[current_arg_idx]);
         }
         return opts;
     }
 };
 
 static void print_usage(const char* prog_name) {
-    fprintf(stdout, "Usage: %s [OPTIONS]... ADDRESS FILENAME [ROOT]\n", prog_name);
+    fprintf(stdout, "Usage: %s [OPTIONS]... ADDRESS FILENAME [ROOT]...\n", prog_name);
+    fprintf(stdout, "       %s [OPTIONS]... --bulk QUERIES ADDRESS\n", prog_name);
+    fprintf(stdout, "       %s --stats|--trace-dump ADDRESS\n", prog_name);
+    fputs("ADDRESS is host:port or unix:/path for a server listening on a local socket. Several of them\n", stdout);
+    fputs("separated by commas query every server at once, prefixing the results with [ADDRESS].\n", stdout);
+    fputs("Several ROOTs are searched as one tree, reporting a file reachable below more than one once.\n", stdout);
+    fputs("With --grep, FILENAME is a glob selecting the files to search, e.g. '*.cpp' or '*'\n", stdout);
+    fputs("In bulk mode QUERIES ('-' for stdin) holds one query per line, either a bare filename or a JSON\n", stdout);
+    fputs("object with \"filename\" and optional \"root\" (or a \"roots\" array), \"id\", \"grep\", \"regex\", \"all\",\n", stdout);
+    fputs("\"glob\", \"substring\", \"fuzzy\", \"top\", \"page\", \"cursor\", \"ignore_case\", \"ignore_normalization\",\n", stdout);
+    fputs("\"follow_symlinks\", \"xdev\", \"exclude\" and \"where\" keys; other options apply to every query.\n", stdout);
+    fputs("Results are printed as JSON lines in completion order.\n", stdout);
     fputs("Options:\n", stdout);
     fputs("  -t, --timeout SECONDS   Set connection timeout in seconds (default: 60)\n", stdout);
+    fputs("  -x, --exclude GLOB      Do not descend into directories matching GLOB (repeatable)\n", stdout);
+    fputs("      --xdev              Do not leave the filesystem of the root\n", stdout);
+    fputs("      --include-pseudo-fs Descend into pseudo-filesystems skipped by default\n", stdout);
+    fputs("  -L, --follow-symlinks   Descend into symlinked directories\n", stdout);
+    fputs("  -a, --all               Print every file with FILENAME, not only the first one\n", stdout);
+    fputs("      --glob              Treat FILENAME as a glob, e.g. '*.log' (implies --all)\n", stdout);
+    fputs("  -s, --substring         Print the files whose name contains FILENAME in any case, best first\n", stdout);
+    fputs("  -f, --fuzzy             Like --substring, also tolerating typos in FILENAME\n", stdout);
+    fputs("  -k, --top N             Results of --substring and --fuzzy (default: 100)\n", stdout);
+    fputs("      --page N            List the results of --all and --glob N at a time, printing the cursor\n", stdout);
+    fputs("                          of the next page\n", stdout);
+    fputs("      --cursor CURSOR     List the page a previous --page search printed the cursor of\n", stdout);
+    fputs("  -i, --ignore-case       Match FILENAME regardless of case, e.g. readme.md finds README.md\n", stdout);
+    fputs("      --ignore-normalization\n", stdout);
+    fputs("                          Match FILENAME regardless of Unicode normalization (NFC or NFD)\n", stdout);
+    fputs("  -g, --grep PATTERN      Print lines of matching files containing PATTERN\n", stdout);
+    fputs("  -E, --regex             Treat the grep PATTERN as an ECMAScript regular expression\n", stdout);
+    fputs("  -w, --where EXPR        Only match files whose metadata satisfies EXPR (repeatable), e.g.\n", stdout);
+    fputs("                          'size > 1G', 'mtime > 7d', 'type == regular', 'uid == 1000'\n", stdout);
+    fputs("      --cache             Keep single-file answers in the user's cache directory and only ask\n", stdout);
+    fputs("                          the server whether they still hold\n", stdout);
+    fputs("      --cache-dir DIR     Like --cache, keeping the answers in DIR\n", stdout);
+    fputs("  -b, --bulk QUERIES      Run every query of the file over a single connection\n", stdout);
+    fputs("      --window N          Queries outstanding at once in bulk mode (default: 64)\n", stdout);
+    fputs("      --bulk-timeout SECONDS\n", stdout);
+    fputs("                          Give up on a bulk run taking longer, 0 for no limit (default: 3600)\n", stdout);
+    fputs("      --stats             Print the server's queue and rejection counters\n", stdout);
+    fputs("      --trace-dump        Print the request spans the server has sampled as Chrome trace JSON\n", stdout);
+    fputs("  -H, --hosts FILE        Query every host:port listed in FILE (one per line) instead of ADDRESS\n", stdout);
+    fputs("      --first             Stop once any server reports a match (default: collect all results)\n", stdout);
+    fputs("      --host-timeout SECONDS\n", stdout);
+    fputs("                          Give up on a server whose search takes longer (default: no limit)\n", stdout);
 }
 
 struct connection_error final : std::runtime_error {
@@ -107,19 +538,508 @@ struct invalid_server_info_error final : std::runtime_error {
         : std::runtime_error(msg) {}
 };
 
+/**
+ * Splits the received byte stream into responses, which may arrive split or coalesced.
+ */
+struct response_stream final {
+    std::vector<char> buffer;
+    size_t consumed = 0;
+
+    void append(const char* data, size_t size) {
+        if (this->consumed > 0 && this->consumed * 2 >= this->buffer.size()) {
+            this->buffer.erase(this->buffer.begin(), this->buffer.begin() + this->consumed);
+            this->consumed = 0;
+        }
+        this->buffer.insert(this->buffer.end(), data, data + size);
+    }
+
+    /**
+     * @returns false if no complete response has been received yet.
+     */
+    bool next(proto::file_search_response& res) {
+        const char* data = this->buffer.data() + this->consumed;
+        size_t available = this->buffer.size() - this->consumed;
+        size_t size = proto::peek_message_size(data, available);
+        if (size == 0 || size > available) {
+            return false;
+        }
+        res = proto::file_search_response::parse_from_buffer(data, size);
+        this->consumed += size;
+        return true;
+    }
+};
+
+/**
+ * Prints a response, every line starting with the tag.
+ * @returns true if it is the final response of the request.
+ */
+static bool print_response(
+    const proto::file_search_response& res,
+    const command_options& opts,
+    const char* tag = ""
+) {
+    switch (res.status) {
+        case proto::file_search_status::ok:
+            if (opts.is_admin()) {
+                fprintf(stdout, "%s%s", tag, res.payload.c_str());
+            } else {
+                fprintf(stdout, "%sCompleted with message: \"%s\"\n", tag, res.payload.c_str());
+                if (!res.cursor.empty()) {
+                    fprintf(stdout, "%sNext cursor: %s\n", tag, res.cursor.c_str());
+                }
+            }
+            return true;
+        case proto::file_search_status::error:
+            fprintf(stdout, "%sError: %s\n", tag, res.payload.c_str());
+            return true;
+        case proto::file_search_status::rejected:
+            fprintf(stdout, "%sRejected: %s, retry in %u ms\n", tag, res.payload.c_str(), res.retry_after_ms);
+            return true;
+        case proto::file_search_status::not_modified:
+            fprintf(stdout, "%sCompleted with message: \"%s\" (cached)\n", tag, opts.cached_result.c_str());
+            return true;
+        case proto::file_search_status::not_found:
+            fprintf(stdout, "%sCompleted with message: \"%s\"\n", tag, res.payload.c_str());
+            return true;
+        case proto::file_search_status::pending:
+            if (!opts.is_content_search()) {
+                fprintf(stdout, "%sMessage: %s\n", tag, res.payload.c_str());
+            }
+            return false;
+        case proto::file_search_status::match:
+            if (opts.is_content_search()) {
+                fprintf(stdout, "%s%s:%u:%s\n", tag, res.payload.c_str(), res.line_number, res.snippet.c_str());
+            } else {
+                fprintf(stdout, "%s%s\n", tag, res.payload.c_str());
+            }
+            return false;
+        case proto::file_search_status::match_batch: {
+            proto::path_batch_decoder decoder(res.payload);
+            while (decoder.next()) {
+                fprintf(stdout, "%s%s\n", tag, decoder.path.c_str());
+            }
+            return false;
+        }
+    }
+    fprintf(stderr, "%sResponse with unexpected status. Payload: %s\n", tag, res.payload.c_str());
+    return true;
+}
+
+struct json_value final {
+    enum class kind {
+        null,
+        boolean,
+        number,
+        string,
+        array
+    };
+
+    kind type = kind::null;
+    bool boolean = false;
+    /** Content of a string or the literal of a number */
+    std::string text;
+    /** Elements of an array, which may only hold strings */
+    std::vector<std::string> items;
+};
+
+using json_object = std::map<std::string, json_value>;
+
+/**
+ * Parser for the flat JSON objects of bulk query files.
+ */
+struct json_parser final {
+    std::string_view input;
+    size_t pos = 0;
+
+    [[noreturn]] void fail(const char* what) const {
+        throw std::runtime_error("Invalid JSON at offset " + std::to_string(this->pos) + ": " + what);
+    }
+
+    void skip_whitespace() {
+        while (this->pos < this->input.size() && strchr(" \t\r\n", this->input[this->pos])) {
+            ++this->pos;
+        }
+    }
+
+    bool consume(char c) {
+        this->skip_whitespace();
+        if (this->pos < this->input.size() && this->input[this->pos] == c) {
+            ++this->pos;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!this->consume(c)) {
+            this->fail("unexpected character");
+        }
+    }
+
+    static void append_utf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out.push_back((char)cp);
+        } else if (cp < 0x800) {
+            out.push_back((char)(0xc0 | (cp >> 6)));
+            out.push_back((char)(0x80 | (cp & 0x3f)));
+        } else if (cp < 0x10000) {
+            out.push_back((char)(0xe0 | (cp >> 12)));
+            out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+            out.push_back((char)(0x80 | (cp & 0x3f)));
+        } else {
+            out.push_back((char)(0xf0 | (cp >> 18)));
+            out.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+            out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+            out.push_back((char)(0x80 | (cp & 0x3f)));
+        }
+    }
+
+    uint32_t parse_hex4() {
+        if (this->pos + 4 > this->input.size()) {
+            this->fail("truncated \\u escape");
+        }
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = this->input[this->pos++];
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                value |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                value |= c - 'A' + 10;
+            } else {
+                this->fail("invalid \\u escape");
+            }
+        }
+        return value;
+    }
+
+    std::string parse_string() {
+        this->expect('"');
+        std::string out;
+        while (true) {
+            if (this->pos >= this->input.size()) {
+                this->fail("unterminated string");
+            }
+            char c = this->input[this->pos++];
+            if (c == '"') {
+                return out;
+            }
+            if (c != '\\') {
+                out.push_back(c);
+                continue;
+            }
+            if (this->pos >= this->input.size()) {
+                this->fail("unterminated escape");
+            }
+            c = this->input[this->pos++];
+            switch (c) {
+                case '"': case '\\': case '/': out.push_back(c); break;
+                case 'b': out.push_back('\b'); break;
+                case 'f': out.push_back('\f'); break;
+                case 'n': out.push_back('\n'); break;
+                case 'r': out.push_back('\r'); break;
+                case 't': out.push_back('\t'); break;
+                case 'u': {
+                    uint32_t cp = this->parse_hex4();
+                    if (cp >= 0xd800 && cp < 0xdc00 && this->input.substr(this->pos, 2) == "\\u") {
+                        this->pos += 2;
+                        uint32_t low = this->parse_hex4();
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    append_utf8(out, cp);
+                    break;
+                }
+                default:
+                    this->fail("unknown escape");
+            }
+        }
+    }
+
+    json_value parse_value() {
+        this->skip_whitespace();
+        json_value value;
+        if (this->pos >= this->input.size()) {
+            this->fail("missing value");
+        }
+        char c = this->input[this->pos];
+        if (c == '"') {
+            value.type = json_value::kind::string;
+            value.text = this->parse_string();
+        } else if (c == '[') {
+            ++this->pos;
+            value.type = json_value::kind::array;
+            if (!this->consume(']')) {
+                do {
+                    value.items.push_back(this->parse_string());
+                } while (this->consume(','));
+                this->expect(']');
+            }
+        } else if (this->input.substr(this->pos, 4) == "true") {
+            this->pos += 4;
+            value.type = json_value::kind::boolean;
+            value.boolean = true;
+        } else if (this->input.substr(this->pos, 5) == "false") {
+            this->pos += 5;
+            value.type = json_value::kind::boolean;
+        } else if (this->input.substr(this->pos, 4) == "null") {
+            this->pos += 4;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+            size_t end = this->input.find_first_not_of("+-.eE0123456789", this->pos);
+            if (end == std::string_view::npos) {
+                end = this->input.size();
+            }
+            value.type = json_value::kind::number;
+            value.text = this->input.substr(this->pos, end - this->pos);
+            this->pos = end;
+        } else {
+            this->fail("unsupported value");
+        }
+        return value;
+    }
+
+    json_object parse_object() {
+        json_object object;
+        this->expect('{');
+        if (!this->consume('}')) {
+            do {
+                this->skip_whitespace();
+                auto key = this->parse_string();
+                this->expect(':');
+                object[key] = this->parse_value();
+            } while (this->consume(','));
+            this->expect('}');
+        }
+        this->skip_whitespace();
+        if (this->pos != this->input.size()) {
+            this->fail("trailing characters");
+        }
+        return object;
+    }
+};
+
+static std::string json_quote(std::string_view str) {
+    std::string out = "\"";
+    for (char c : str) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+                    out += escaped;
+                } else {
+                    out.push_back(c);
+                }
+        }
+    }
+    out.push_back('"');
+    return out;
+}
+
+/**
+ * Query of a bulk run together with the results collected for it so far.
+ */
+struct bulk_query final {
+    /** JSON encoded id reported with the results */
+    std::string id;
+    proto::file_search_request req;
+    /** JSON encoded results */
+    std::vector<std::string> matches;
+
+    /**
+     * Builds a query from a line of the query file on top of the command line options.
+     * @throws std::runtime_error on malformed lines.
+     */
+    static bulk_query parse(std::string_view line, size_t line_number, const command_options& opts) {
+        bulk_query query;
+        query.id = std::to_string(line_number);
+        query.req = opts.make_request();
+        if (line.empty() || line[0] != '{') {
+            query.req.filename = std::string(line);
+            return query;
+        }
+        auto object = json_parser{line}.parse_object();
+        auto flag = [&](const char* key, uint32_t flag) {
+            auto it = object.find(key);
+            if (it == object.end()) {
+                return;
+            }
+            if (it->second.boolean) {
+                query.req.flags |= flag;
+            } else {
+                query.req.flags &= ~flag;
+            }
+        };
+        for (const auto& [key, value] : object) {
+            if (key == "id") {
+                query.id = value.type == json_value::kind::string ? json_quote(value.text) : value.text;
+            } else if (key == "filename") {
+                query.req.filename = value.text;
+            } else if (key == "root") {
+                query.req.root_path = value.text;
+            } else if (key == "roots") {
+                if (value.items.empty()) {
+                    throw std::runtime_error("Query without roots");
+                }
+                query.req.root_path = value.items.front();
+                query.req.extra_roots.assign(value.items.begin() + 1, value.items.end());
+            } else if (key == "grep") {
+                query.req.mode = proto::search_mode::content;
+                query.req.content_pattern = value.text;
+            } else if (key == "substring" || key == "fuzzy") {
+                if (value.boolean) {
+                    query.req.mode = key == "fuzzy" ? proto::search_mode::fuzzy : proto::search_mode::substring;
+                }
+            } else if (key == "page" || key == "top") {
+                uint32_t count;
+                try {
+                    count = parse_count(value.text);
+                } catch (std::logic_error& e) {
+                    throw std::runtime_error("\"" + key + "\" must be a positive number");
+                }
+                (key == "page" ? query.req.page_size : query.req.max_results) = count;
+            } else if (key == "cursor") {
+                query.req.cursor = value.text;
+            } else if (key == "exclude") {
+                if (value.type != json_value::kind::array) {
+                    throw std::runtime_error("\"exclude\" must be an array of strings");
+                }
+                query.req.exclude_patterns.insert(query.req.exclude_patterns.end(), value.items.begin(), value.items.end());
+            } else if (key == "where") {
+                if (value.type != json_value::kind::array) {
+                    throw std::runtime_error("\"where\" must be an array of strings");
+                }
+                for (const auto& expression : value.items) {
+                    query.req.predicates.push_back(proto::metadata_predicate::parse(expression));
+                }
+            }
+        }
+        flag("regex", proto::flag_content_regex);
+        flag("all", proto::flag_all_matches);
+        flag("glob", proto::flag_filename_glob);
+        flag("ignore_case", proto::flag_ignore_case);
+        flag("ignore_normalization", proto::flag_ignore_normalization);
+        flag("follow_symlinks", proto::flag_follow_symlinks);
+        flag("xdev", proto::flag_one_filesystem);
+        if (query.req.filename.empty() && query.req.mode == proto::search_mode::filename) {
+            throw std::runtime_error("Query without filename");
+        }
+        return query;
+    }
+
+    /**
+     * Collects a response.
+     * @returns true once it is the final one.
+     */
+    bool add_response(const proto::file_search_response& res) {
+        switch (res.status) {
+            case proto::file_search_status::pending:
+                return false;
+            case proto::file_search_status::match:
+                if (this->req.mode == proto::search_mode::content) {
+                    this->matches.push_back("{\"path\":" + json_quote(res.payload)
+                        + ",\"line\":" + std::to_string(res.line_number)
+                        + ",\"text\":" + json_quote(res.snippet) + "}");
+                } else {
+                    this->matches.push_back(json_quote(res.payload));
+                }
+                return false;
+            case proto::file_search_status::match_batch: {
+                proto::path_batch_decoder decoder(res.payload);
+                while (decoder.next()) {
+                    this->matches.push_back(json_quote(decoder.path));
+                }
+                return false;
+            }
+            default:
+                return true;
+        }
+    }
+
+    std::string to_json(const proto::file_search_response& final_response) const {
+        std::string out = "{\"id\":" + this->id
+            + ",\"filename\":" + json_quote(this->req.filename)
+            + ",\"root\":" + json_quote(this->req.root_path);
+        if (final_response.status == proto::file_search_status::ok
+            || final_response.status == proto::file_search_status::not_found) {
+            out += ",\"status\":\"ok\",\"result\":" + json_quote(final_response.payload);
+            if (!final_response.cursor.empty()) {
+                out += ",\"cursor\":" + json_quote(final_response.cursor);
+            }
+        } else if (final_response.status == proto::file_search_status::rejected) {
+            out += ",\"status\":\"rejected\",\"retry_after_ms\":" + std::to_string(final_response.retry_after_ms);
+        } else {
+            out += ",\"status\":\"error\",\"error\":" + json_quote(final_response.payload);
+        }
+        bool listing = this->req.mode == proto::search_mode::content
+            || this->req.mode == proto::search_mode::substring
+            || this->req.mode == proto::search_mode::fuzzy
+            || this->req.flags & (proto::flag_all_matches | proto::flag_filename_glob);
+        if (listing) {
+            out += ",\"matches\":[";
+            for (size_t i = 0; i < this->matches.size(); ++i) {
+                if (i) {
+                    out.push_back(',');
+                }
+                out += this->matches[i];
+            }
+            out.push_back(']');
+        }
+        out.push_back('}');
+        return out;
+    }
+};
+
 #ifdef __unix__
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <cerrno>
 #include <fcntl.h>
+#include <poll.h>
 #include <cstring>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+
+/**
+ * Fills in the socket address of the server.
+ * @returns length of the address.
+ */
+static socklen_t unix_server_address(const tcp_server_info& server_info, sockaddr_storage& storage) {
+    memset(&storage, 0, sizeof(storage));
+    if (server_info.local) {
+        auto* address = (sockaddr_un*)&storage;
+        address->sun_family = AF_UNIX;
+        if (server_info.address.size() >= sizeof(address->sun_path)) {
+            throw invalid_server_info_error("Socket path too long");
+        }
+        memcpy(address->sun_path, server_info.address.c_str(), server_info.address.size() + 1);
+        return sizeof(sockaddr_un);
+    }
+    auto* address = (sockaddr_in*)&storage;
+    address->sin_family = AF_INET;
+    if (inet_pton(AF_INET, server_info.address.c_str(), &address->sin_addr) != 1) {
+        throw invalid_server_info_error("Invalid address");
+    }
+    address->sin_port = htons(server_info.port);
+    return sizeof(sockaddr_in);
+}
 
 struct unix_connection_state final {
     int client_socket;
 
-    unix_connection_state() {
-        this->client_socket = socket(AF_INET, SOCK_STREAM, 0);
+    explicit unix_connection_state(const tcp_server_info& server_info) {
+        this->client_socket = socket(server_info.local ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
         if (this->client_socket == -1) {
             throw std::runtime_error("Could not create socket");
         }
@@ -133,11 +1053,14 @@ struct unix_connection_state final {
     }
 };
 
-static void unix_send_request(
-    const command_options& opts
+/**
+ * Connects without blocking for longer than the timeout and returns the socket in blocking mode.
+ */
+static void unix_connect(
+    unix_connection_state& cstate,
+    const tcp_server_info& server_info,
+    int timeout_seconds
 ) {
-    const auto& server_info = opts.server_info;
-    unix_connection_state cstate;
     int client_socket = cstate.client_socket;
 
     int flags = fcntl(client_socket, F_GETFL, 0);
@@ -148,20 +1071,13 @@ static void unix_send_request(
         throw std::runtime_error("Failed to set socket to non-blocking mode");
     }
 
-    sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    auto ptoned = inet_pton(AF_INET, server_info.address.data(), &server_address.sin_addr);
-    if (ptoned == 0) {
-        throw invalid_server_info_error("Invalid address");
-    }
-    server_address.sin_port = htons(server_info.port);
-    fprintf(stdout, "Connecting to the server...\n");
+    sockaddr_storage server_address;
+    socklen_t server_address_size = unix_server_address(server_info, server_address);
 
-    auto result = connect(client_socket, (sockaddr*)&server_address, sizeof(server_address));
+    auto result = connect(client_socket, (sockaddr*)&server_address, server_address_size);
     if (result == -1 && errno != EINPROGRESS) {
         throw connection_error("Could not connect to server");
     }
-    auto timeout_seconds = opts.connection_timeout_seconds;
     fd_set write_fds;
     FD_ZERO(&write_fds);
     FD_SET(client_socket, &write_fds);
@@ -187,40 +1103,407 @@ static void unix_send_request(
     if (fcntl(client_socket, F_SETFL, flags) == -1) {
         throw std::runtime_error("Failed to restore socket to blocking mode");
     }
-    fprintf(stdout, "Connected to the server\n");
+}
 
-    proto::file_search_request req;
-    req.filename = opts.file_name;
-    req.root_path = opts.root_path;
+/**
+ * @returns the final response.
+ */
+static proto::file_search_response unix_send_request(
+    const command_options& opts
+) {
+    unix_connection_state cstate(opts.server_info);
+    int client_socket = cstate.client_socket;
+    fprintf(stdout, "Connecting to the server...\n");
+    unix_connect(cstate, opts.server_info, opts.connection_timeout_seconds);
+    fprintf(stdout, "Connected to the server\n");
 
-    auto buffer = req.serialize();
+    auto buffer = opts.make_request().serialize();
     if (send(client_socket, buffer.data(), buffer.size(), 0) == -1) {
         throw std::runtime_error("Could not send request");
     }
+    response_stream stream;
+    proto::file_search_response res;
     while (true) {
-        char res_buf[1024] = {0};
+        char res_buf[4096];
         ssize_t res_bytes = read(client_socket, res_buf, sizeof(res_buf));
         if (res_bytes == -1) {
             throw std::runtime_error("Could not read response");
         } else if(res_bytes == 0) {
             fprintf(stdout, "Connection closed by the server\n");
-            break;
+            res.status = proto::file_search_status::error;
+            res.payload = "Connection closed by the server";
+            return res;
+        }
+        stream.append(res_buf, res_bytes);
+        while (stream.next(res)) {
+            if (print_response(res, opts)) {
+                return res;
+            }
+        }
+    }
+}
+
+/**
+ * Creates the directory and its missing parents.
+ */
+static void unix_make_dirs(const std::string& dir) {
+    for (size_t end = dir.find('/', 1); ; end = dir.find('/', end + 1)) {
+        auto parent = dir.substr(0, end);
+        if (mkdir(parent.c_str(), 0700) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Could not create " + parent + ": " + strerror(errno));
         }
-        auto res = proto::file_search_response::parse_from_buffer(res_buf, res_bytes);
-        if (res.status == proto::file_search_status::ok) {
-            fprintf(stdout, "Completed with message: \"%s\"\n", res.payload.c_str());
+        if (end == std::string::npos) {
+            return;
+        }
+    }
+}
+
+struct getline_buffer final {
+    char* data = 0;
+    size_t capacity = 0;
+
+    ~getline_buffer() {
+        free(this->data);
+    }
+};
+
+/**
+ * Runs every query of the bulk input over one connection, keeping up to opts.bulk_window
+ * of them outstanding, and prints their results as JSON lines in completion order.
+ */
+static void unix_run_bulk(const command_options& opts) {
+    FILE* input = opts.bulk_input == "-" ? stdin : fopen(opts.bulk_input.c_str(), "r");
+    if (!input) {
+        throw std::runtime_error("Could not open " + opts.bulk_input + ": " + strerror(errno));
+    }
+    std::unique_ptr<FILE, int(*)(FILE*)> input_guard(input == stdin ? 0 : input, fclose);
+
+    unix_connection_state cstate(opts.server_info);
+    int client_socket = cstate.client_socket;
+    unix_connect(cstate, opts.server_info, opts.connection_timeout_seconds);
+    int flags = fcntl(client_socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(client_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+        throw std::runtime_error("Failed to set socket to non-blocking mode");
+    }
+
+    std::unordered_map<uint32_t, bulk_query> outstanding;
+    std::vector<char> outgoing;
+    size_t outgoing_sent = 0;
+    uint32_t next_request_id = 1;
+    size_t line_number = 0;
+    bool input_done = false;
+    bool write_shut = false;
+    response_stream stream;
+    proto::file_search_response res;
+
+    getline_buffer line_buffer;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opts.bulk_timeout_seconds);
+
+    while (!input_done || !outstanding.empty()) {
+        while (!input_done && outstanding.size() < (size_t)opts.bulk_window) {
+            ssize_t line_length = getline(&line_buffer.data, &line_buffer.capacity, input);
+            const char* line = line_buffer.data;
+            if (line_length == -1) {
+                input_done = true;
+                break;
+            }
+            ++line_number;
+            while (line_length > 0 && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r')) {
+                --line_length;
+            }
+            if (line_length == 0) {
+                continue;
+            }
+            bulk_query query;
+            try {
+                query = bulk_query::parse(std::string_view(line, line_length), line_number, opts);
+            } catch (const std::exception& e) {
+                fprintf(stdout, "{\"id\":%zu,\"status\":\"error\",\"error\":%s}\n",
+                    line_number, json_quote(e.what()).c_str());
+                continue;
+            }
+            query.req.request_id = next_request_id++;
+            auto serialized = query.req.serialize();
+            outgoing.insert(outgoing.end(), serialized.begin(), serialized.end());
+            outstanding.emplace(query.req.request_id, std::move(query));
+        }
+        if (outgoing_sent == outgoing.size()) {
+            outgoing.clear();
+            outgoing_sent = 0;
+            if (input_done && !write_shut) {
+                // lets the server close the connection once the last search is answered
+                shutdown(client_socket, SHUT_WR);
+                write_shut = true;
+            }
+        }
+        if (input_done && outstanding.empty()) {
             break;
         }
-        if (res.status == proto::file_search_status::error) {
-            fprintf(stdout, "Error: %s\n", res.payload.c_str());
+
+        pollfd poll_fd;
+        poll_fd.fd = client_socket;
+        poll_fd.events = POLLIN | (outgoing_sent < outgoing.size() ? POLLOUT : 0);
+        poll_fd.revents = 0;
+        int timeout_ms = -1;
+        if (opts.bulk_timeout_seconds > 0) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) {
+                for (const auto& [request_id, query] : outstanding) {
+                    fprintf(stdout, "{\"id\":%s,\"status\":\"error\",\"error\":\"Timed out\"}\n", query.id.c_str());
+                }
+                fflush(stdout);
+                throw std::runtime_error("Bulk run timed out after " + std::to_string(opts.bulk_timeout_seconds)
+                    + " seconds with " + std::to_string(outstanding.size()) + " queries outstanding");
+            }
+            timeout_ms = (int)std::min<int64_t>(remaining.count() + 1, INT32_MAX);
+        }
+        if (poll(&poll_fd, 1, timeout_ms) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("poll() failed: " + std::string(strerror(errno)));
+        }
+        if (poll_fd.revents & POLLOUT) {
+            ssize_t sent = send(client_socket, outgoing.data() + outgoing_sent, outgoing.size() - outgoing_sent, MSG_NOSIGNAL);
+            if (sent == -1 && errno != EAGAIN && errno != EINTR) {
+                throw std::runtime_error("Could not send requests: " + std::string(strerror(errno)));
+            }
+            if (sent > 0) {
+                outgoing_sent += sent;
+            }
+        }
+        if (poll_fd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            char res_buf[64 * 1024];
+            ssize_t res_bytes = read(client_socket, res_buf, sizeof(res_buf));
+            if (res_bytes == -1) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Could not read responses: " + std::string(strerror(errno)));
+            }
+            if (res_bytes == 0) {
+                throw std::runtime_error("Connection closed by the server with "
+                    + std::to_string(outstanding.size()) + " queries outstanding");
+            }
+            stream.append(res_buf, res_bytes);
+            while (stream.next(res)) {
+                auto query = outstanding.find(res.request_id);
+                if (query == outstanding.end()) {
+                    fprintf(stderr, "Response to unknown request %u\n", res.request_id);
+                    continue;
+                }
+                if (query->second.add_response(res)) {
+                    fprintf(stdout, "%s\n", query->second.to_json(res).c_str());
+                    outstanding.erase(query);
+                }
+            }
+            fflush(stdout);
+        }
+    }
+}
+
+/**
+ * One server of a fanned out query, connected without blocking.
+ */
+struct fan_out_host final {
+    tcp_server_info server;
+    std::string tag;
+    int fd = -1;
+    bool connected = false;
+    bool done = false;
+    std::vector<char> outgoing;
+    size_t outgoing_sent = 0;
+    response_stream stream;
+    std::chrono::steady_clock::time_point deadline;
+
+    explicit fan_out_host(const tcp_server_info& server)
+        : server(server), tag("[" + server.to_string() + "] ") {}
+
+    fan_out_host(const fan_out_host&) = delete;
+    fan_out_host& operator=(const fan_out_host&) = delete;
+
+    ~fan_out_host() {
+        this->finish();
+    }
+
+    void start_connect() {
+        sockaddr_storage server_address;
+        socklen_t server_address_size = unix_server_address(this->server, server_address);
+        this->fd = socket(this->server.local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (this->fd == -1) {
+            throw std::runtime_error("Could not create socket");
+        }
+        if (connect(this->fd, (sockaddr*)&server_address, server_address_size) == -1 && errno != EINPROGRESS) {
+            throw connection_error("Could not connect to server");
+        }
+    }
+
+    void finish() {
+        if (this->fd != -1) {
+            close(this->fd);
+            this->fd = -1;
+        }
+        this->done = true;
+    }
+
+    void fail(const std::string& message) {
+        fprintf(stdout, "%sError: %s\n", this->tag.c_str(), message.c_str());
+        this->finish();
+    }
+};
+
+/**
+ * @returns true if the response carries a found file or matching line.
+ */
+static bool is_search_result(const proto::file_search_response& res, const command_options& opts) {
+    switch (res.status) {
+        case proto::file_search_status::match:
+        case proto::file_search_status::match_batch:
+            return true;
+        case proto::file_search_status::ok:
+            return !opts.is_admin() && !opts.is_listing();
+        default:
+            return false;
+    }
+}
+
+/**
+ * Sends the query to every server at once and prints their results as they arrive, each line
+ * tagged with the server it came from. In first match mode only the earliest result is printed.
+ */
+static void unix_fan_out(const command_options& opts) {
+    auto request = opts.make_request().serialize();
+    auto now = std::chrono::steady_clock::now();
+    auto connect_timeout = std::chrono::seconds(opts.connection_timeout_seconds);
+    auto search_timeout = std::chrono::seconds(opts.host_timeout_seconds);
+
+    std::vector<std::unique_ptr<fan_out_host>> hosts;
+    for (const auto& server : opts.servers) {
+        auto host = std::make_unique<fan_out_host>(server);
+        host->outgoing = request;
+        host->deadline = now + connect_timeout;
+        try {
+            host->start_connect();
+        } catch (const std::exception& e) {
+            host->fail(e.what());
+        }
+        hosts.push_back(std::move(host));
+    }
+
+    bool found = false;
+    std::vector<pollfd> poll_fds;
+    std::vector<fan_out_host*> polled;
+    while (!found) {
+        now = std::chrono::steady_clock::now();
+        poll_fds.clear();
+        polled.clear();
+        auto next_deadline = std::chrono::steady_clock::time_point::max();
+        for (auto& host : hosts) {
+            if (host->done) {
+                continue;
+            }
+            if (now >= host->deadline) {
+                host->fail(host->connected ? "Search timed out" : "Connection timed out");
+                continue;
+            }
+            next_deadline = std::min(next_deadline, host->deadline);
+            pollfd poll_fd;
+            poll_fd.fd = host->fd;
+            poll_fd.events = !host->connected || host->outgoing_sent < host->outgoing.size() ? POLLOUT : POLLIN;
+            poll_fd.revents = 0;
+            poll_fds.push_back(poll_fd);
+            polled.push_back(host.get());
+        }
+        if (poll_fds.empty()) {
             break;
         }
-        if (res.status == proto::file_search_status::pending) {
-            fprintf(stdout, "Message: %s\n", res.payload.c_str());
-            continue;
+        int timeout_ms = -1;
+        if (next_deadline != std::chrono::steady_clock::time_point::max()) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(next_deadline - now);
+            timeout_ms = (int)remaining.count() + 1;
+        }
+        if (poll(poll_fds.data(), poll_fds.size(), timeout_ms) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("poll() failed: " + std::string(strerror(errno)));
+        }
+        for (size_t i = 0; i < poll_fds.size() && !found; ++i) {
+            auto& host = *polled[i];
+            short revents = poll_fds[i].revents;
+            if (!revents) {
+                continue;
+            }
+            if (!host.connected) {
+                int sock_error = 0;
+                socklen_t len = sizeof(sock_error);
+                getsockopt(host.fd, SOL_SOCKET, SO_ERROR, &sock_error, &len);
+                if (sock_error != 0) {
+                    host.fail("Connection failed: "s + strerror(sock_error));
+                    continue;
+                }
+                host.connected = true;
+                if (opts.host_timeout_seconds > 0) {
+                    host.deadline = std::chrono::steady_clock::now() + search_timeout;
+                } else {
+                    host.deadline = std::chrono::steady_clock::time_point::max();
+                }
+            }
+            if (host.outgoing_sent < host.outgoing.size()) {
+                ssize_t sent = send(host.fd, host.outgoing.data() + host.outgoing_sent,
+                    host.outgoing.size() - host.outgoing_sent, MSG_NOSIGNAL);
+                if (sent == -1 && errno != EAGAIN && errno != EINTR) {
+                    host.fail("Could not send request: "s + strerror(errno));
+                    continue;
+                }
+                if (sent > 0) {
+                    host.outgoing_sent += sent;
+                }
+                if (host.outgoing_sent == host.outgoing.size()) {
+                    shutdown(host.fd, SHUT_WR);
+                }
+                continue;
+            }
+            char res_buf[64 * 1024];
+            ssize_t res_bytes = read(host.fd, res_buf, sizeof(res_buf));
+            if (res_bytes == -1) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    host.fail("Could not read response: "s + strerror(errno));
+                }
+                continue;
+            }
+            if (res_bytes == 0) {
+                host.fail("Connection closed by the server");
+                continue;
+            }
+            host.stream.append(res_buf, res_bytes);
+            proto::file_search_response res;
+            try {
+                while (!host.done && host.stream.next(res)) {
+                    if (res.status == proto::file_search_status::pending) {
+                        continue;
+                    }
+                    if (opts.first_match && is_search_result(res, opts)) {
+                        if (res.status == proto::file_search_status::match_batch) {
+                            proto::path_batch_decoder decoder(res.payload);
+                            decoder.next();
+                            fprintf(stdout, "%s%s\n", host.tag.c_str(), decoder.path.c_str());
+                        } else {
+                            print_response(res, opts, host.tag.c_str());
+                        }
+                        found = true;
+                        break;
+                    }
+                    if (print_response(res, opts, host.tag.c_str())) {
+                        host.finish();
+                    }
+                }
+            } catch (const std::exception& e) {
+                host.fail(e.what());
+            }
+            fflush(stdout);
         }
-        fprintf(stderr, "Response with unexpected status. Payload: %s\n", res.payload.c_str());
-        return;
     }
 }
 
@@ -275,9 +1558,15 @@ struct win32_client_state final {
     }
 };
 
-static void win32_send_request(
+/**
+ * @returns the final response.
+ */
+static proto::file_search_response win32_send_request(
     const command_options& opts
 ) {
+    if (opts.server_info.local) {
+        throw std::runtime_error("Unix domain sockets are not supported on this platform");
+    }
     win32_client_state cstate(opts.server_info);
     for (addrinfo* addr = cstate.server_info; addr != 0; addr = addr->ai_next) {
         cstate.client_socket = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
@@ -298,10 +1587,7 @@ static void win32_send_request(
     if (cstate.client_socket == INVALID_SOCKET) {
         throw std::runtime_error("Unable to connect to server!");
     }
-    proto::file_search_request req;
-    req.filename = opts.file_name;
-    req.root_path = opts.root_path;
-    auto payload = req.serialize();
+    auto payload = opts.make_request().serialize();
     auto socket_ret = send(cstate.client_socket, payload.data(), (int)payload.size(), 0);
     if (socket_ret == SOCKET_ERROR) {
         throw std::runtime_error("send failed with error: " + std::to_string(WSAGetLastError()));
@@ -313,34 +1599,167 @@ static void win32_send_request(
         throw std::runtime_error("shutdown failed with error: " + std::to_string(WSAGetLastError()));
     }
 
-    char recvbuf[1024];
+    char recvbuf[4096];
     constexpr int recvbuflen = sizeof(recvbuf);
+    response_stream stream;
+    proto::file_search_response res;
     do {
         socket_ret = recv(cstate.client_socket, recvbuf, recvbuflen, 0);
         if (socket_ret > 0) {
-            auto res = proto::file_search_response::parse_from_buffer(recvbuf, socket_ret);
-            if (res.status == proto::file_search_status::ok) {
-                fprintf(stdout, "Completed with message: \"%s\"\n", res.payload.c_str());
-                break;
-            }
-            if (res.status == proto::file_search_status::error) {
-                fprintf(stdout, "Error: %s\n", res.payload.c_str());
-                break;
-            }
-            if (res.status == proto::file_search_status::pending) {
-                fprintf(stdout, "Message: %s\n", res.payload.c_str());
-                continue;
+            stream.append(recvbuf, socket_ret);
+            while (stream.next(res)) {
+                if (print_response(res, opts)) {
+                    return res;
+                }
             }
-            fprintf(stderr, "Response with unexpected status. Payload: %s\n", res.payload.c_str());
         } else if (socket_ret == 0) {
             fprintf(stdout, "Connection closed\n");
         } else {
             fprintf(stderr, "recv failed with error: %d\n", WSAGetLastError());
         }
     } while (socket_ret > 0);
+    res.status = proto::file_search_status::error;
+    res.payload = "Connection closed";
+    return res;
 }
 
+/**
+ * Creates the directory and its missing parents.
+ */
+static void win32_make_dirs(const std::string& dir) {
+    for (size_t end = dir.find_first_of("\\/", 3); ; end = dir.find_first_of("\\/", end + 1)) {
+        auto parent = dir.substr(0, end);
+        if (!CreateDirectoryA(parent.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+            throw std::runtime_error("Could not create " + parent + ": error " + std::to_string(GetLastError()));
+        }
+        if (end == std::string::npos) {
+            return;
+        }
+    }
+}
+
+#endif
+
+/**
+ * Entry of the result cache for one server and search, in a file named after a hash of both.
+ * Entries are replaced by renaming a complete file over them, so that concurrent clients never
+ * read half of one.
+ */
+struct result_cache final {
+    static constexpr std::string_view MAGIC = "rfinder-result-cache 1\n";
+
+    std::string path;
+    /** Server and search, telling apart searches whose hashes collide */
+    std::string key;
+
+    result_cache(const std::string& dir, const command_options& opts) {
+        auto req = opts.make_request();
+        req.validation_token.clear();
+        auto serialized = req.serialize();
+        this->key = opts.server_info.to_string() + '\n';
+        this->key.append(serialized.begin(), serialized.end());
+        // FNV-1a
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (char c : this->key) {
+            hash ^= (unsigned char)c;
+            hash *= 0x100000001b3ull;
+        }
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+#ifdef __unix__
+        this->path = dir + '/' + name;
+#else
+        this->path = dir + '\\' + name;
 #endif
+    }
+
+    /**
+     * @returns false if no answer to the search is cached.
+     */
+    bool load(std::string& token, std::string& result) const {
+        std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(this->path.c_str(), "rb"), fclose);
+        if (!file) {
+            return false;
+        }
+        std::string contents;
+        char chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), file.get())) > 0) {
+            contents.append(chunk, n);
+        }
+        std::string_view in = contents;
+        if (in.substr(0, MAGIC.size()) != MAGIC) {
+            return false;
+        }
+        in.remove_prefix(MAGIC.size());
+        std::string fields[3];
+        for (auto& field : fields) {
+            auto newline = in.find('\n');
+            if (newline == std::string_view::npos) {
+                return false;
+            }
+            size_t size = std::strtoull(std::string(in.substr(0, newline)).c_str(), nullptr, 10);
+            in.remove_prefix(newline + 1);
+            if (size > in.size()) {
+                return false;
+            }
+            field.assign(in.data(), size);
+            in.remove_prefix(size);
+        }
+        if (fields[0] != this->key) {
+            return false;
+        }
+        token = std::move(fields[1]);
+        result = std::move(fields[2]);
+        return true;
+    }
+
+    void store(const std::string& token, const std::string& result) const {
+#ifdef __unix__
+        auto temporary = this->path + ".tmp" + std::to_string(getpid());
+#else
+        auto temporary = this->path + ".tmp" + std::to_string(GetCurrentProcessId());
+#endif
+        FILE* file = fopen(temporary.c_str(), "wb");
+        if (!file) {
+            throw std::runtime_error("Could not write " + temporary);
+        }
+        std::string contents(MAGIC);
+        for (const auto* field : {&this->key, &token, &result}) {
+            contents += std::to_string(field->size()) + '\n';
+            contents += *field;
+        }
+        bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+        written = fclose(file) == 0 && written;
+#ifndef __unix__
+        // rename does not replace existing files on Windows
+        remove(this->path.c_str());
+#endif
+        if (!written || rename(temporary.c_str(), this->path.c_str()) != 0) {
+            remove(temporary.c_str());
+            throw std::runtime_error("Could not write " + this->path);
+        }
+    }
+
+    /**
+     * Keeps the answer if the server issued a token for it, drops the entry if the server
+     * answered without one.
+     */
+    void update(const proto::file_search_response& res) const {
+        if (res.status == proto::file_search_status::not_found) {
+            remove(this->path.c_str());
+            return;
+        }
+        if (res.status != proto::file_search_status::ok) {
+            return;
+        }
+        if (res.validation_token.empty()) {
+            remove(this->path.c_str());
+        } else {
+            this->store(res.validation_token, res.payload);
+        }
+    }
+};
 
 int main(int argc, char** argv) {
     command_options opts;
@@ -352,21 +1771,72 @@ int main(int argc, char** argv) {
         return 1;
     }
     
-    fputs("**********\n", stdout);
-    fprintf(stdout, "Server address: %s\nServer port: %d\nFilename: %s\nRoot path: %s\nConnection timeout: %ds\n", 
-        opts.server_info.address.c_str(), 
-        opts.server_info.port,
-        opts.file_name.c_str(),
-        opts.root_path.c_str(),
-        opts.connection_timeout_seconds);
-    fputs("**********\n\n", stdout);
+    if (opts.is_bulk()) {
+        try {
+#ifdef __unix__
+            unix_run_bulk(opts);
+#else
+            throw std::runtime_error("Bulk mode is not supported on this platform");
+#endif
+        } catch (const std::exception& e) {
+            fprintf(stderr, "Error while processing queries: %s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    if (opts.is_fan_out()) {
+        try {
+#ifdef __unix__
+            unix_fan_out(opts);
+#else
+            throw std::runtime_error("Querying several servers is not supported on this platform");
+#endif
+        } catch (const std::exception& e) {
+            fprintf(stderr, "Error while processing request: %s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!opts.is_admin()) {
+        std::string roots = opts.root_path;
+        for (const auto& root : opts.extra_roots) {
+            roots += ", " + root;
+        }
+        fputs("**********\n", stdout);
+        fprintf(stdout, "Server: %s\nFilename: %s\nRoot path: %s\nConnection timeout: %ds\n", 
+            opts.server_info.to_string().c_str(), 
+            opts.file_name.c_str(),
+            roots.c_str(),
+            opts.connection_timeout_seconds);
+        fputs("**********\n\n", stdout);
+    }
+
+    std::unique_ptr<result_cache> cache;
+    if (opts.is_cached()) {
+        try {
+#ifdef __unix__
+            unix_make_dirs(opts.cache_dir);
+#else
+            win32_make_dirs(opts.cache_dir);
+#endif
+            cache = std::make_unique<result_cache>(opts.cache_dir, opts);
+            cache->load(opts.validation_token, opts.cached_result);
+        } catch (const std::exception& e) {
+            fprintf(stderr, "Not using the result cache: %s\n", e.what());
+        }
+    }
 
     try {
 #ifdef __unix__
-        unix_send_request(opts);
+        auto res = unix_send_request(opts);
 #else 
-        win32_send_request(opts);
+        auto res = win32_send_request(opts);
 #endif
+        if (cache) {
+            cache->update(res);
+        }
     } catch (const std::exception& e) {
         fprintf(stderr, "Error while processing request: %s\n", e.what());
     }
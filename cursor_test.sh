@@ -0,0 +1,141 @@
+#!/usr/bin/env bash
+# Runs an rfinder server and checks that paged listings resume where the previous page stopped:
+# the pages of a search list every match of the unpaged search once, and cursors are refused once
+# taken, for another search, or after they expired.
+# Usage: ./cursor_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+PORT=$((20000 + RANDOM % 20000))
+ADDRESS=127.0.0.1:$PORT
+PAGE=7
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-cursor-XXXXXX)
+TREE=$WORK_DIR/tree
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+# one directory larger than a page, so that a page stops in the middle of it
+for dir in a a/b a/b/c d; do
+    mkdir -p "$TREE/$dir"
+done
+for i in $(seq 1 12); do
+    touch "$TREE/a/b/file$i.log"
+done
+for dir in . a a/b/c d; do
+    touch "$TREE/$dir/top.log" "$TREE/$dir/other.txt"
+done
+
+"$SERVER" --cursor-ttl 1 "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+PIDS+=($!)
+if ! wait_for_port "$PORT"; then
+    echo "Server did not start:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+
+# prints the paths of a response
+paths_of() {
+    grep "^$TREE/" <<< "$1"
+}
+
+# prints the cursor of the next page, nothing on the last one
+cursor_of() {
+    sed -n 's/^Next cursor: //p' <<< "$1"
+}
+
+expected=$(paths_of "$("$CLIENT" --glob "$ADDRESS" '*.log' "$TREE" 2>&1)" | sort)
+listed=""
+pages=0
+cursor=""
+while true; do
+    if [ -z "$cursor" ]; then
+        output=$("$CLIENT" --glob --page "$PAGE" "$ADDRESS" '*.log' "$TREE" 2>&1)
+    else
+        output=$("$CLIENT" --glob --page "$PAGE" --cursor "$cursor" "$ADDRESS" '*.log' "$TREE" 2>&1)
+    fi
+    pages=$((pages + 1))
+    page_paths=$(paths_of "$output")
+    if [ "$(grep -c . <<< "$page_paths")" -gt "$PAGE" ] || [ "$pages" -gt 10 ]; then
+        fail "a page holds at most $PAGE matches" "$output"
+        break
+    fi
+    listed+="$page_paths"$'\n'
+    cursor=$(cursor_of "$output")
+    if [ -z "$cursor" ]; then
+        break
+    fi
+done
+listed=$(grep . <<< "$listed" | sort)
+if [ "$(grep -c . <<< "$expected")" -ne 16 ] || [ "$listed" != "$expected" ] || [ "$pages" -ne $(((16 + PAGE - 1) / PAGE)) ]; then
+    fail "the pages list every match once" "$(diff <(echo "$expected") <(echo "$listed"))"
+else
+    pass "pages round trip"
+fi
+
+output=$("$CLIENT" --glob --page "$PAGE" "$ADDRESS" '*.log' "$TREE" 2>&1)
+cursor=$(cursor_of "$output")
+"$CLIENT" --glob --page "$PAGE" --cursor "$cursor" "$ADDRESS" '*.log' "$TREE" > /dev/null 2>&1
+output=$("$CLIENT" --glob --page "$PAGE" --cursor "$cursor" "$ADDRESS" '*.log' "$TREE" 2>&1)
+if ! grep -qF "Unknown or expired cursor" <<< "$output" || [ -n "$(paths_of "$output")" ]; then
+    fail "a cursor is taken by the page it was asked for" "$output"
+else
+    pass "taken cursor"
+fi
+
+output=$("$CLIENT" --glob --page "$PAGE" "$ADDRESS" '*.log' "$TREE" 2>&1)
+cursor=$(cursor_of "$output")
+output=$("$CLIENT" --glob --page "$PAGE" --cursor "$cursor" "$ADDRESS" '*.txt' "$TREE" 2>&1)
+if ! grep -qF "Unknown or expired cursor" <<< "$output" || [ -n "$(paths_of "$output")" ]; then
+    fail "a cursor only resumes the search it was issued for" "$output"
+else
+    pass "cursor of another search"
+fi
+
+output=$("$CLIENT" --glob --page "$PAGE" "$ADDRESS" '*.log' "$TREE" 2>&1)
+cursor=$(cursor_of "$output")
+sleep 2
+output=$("$CLIENT" --glob --page "$PAGE" --cursor "$cursor" "$ADDRESS" '*.log' "$TREE" 2>&1)
+if ! grep -qF "Unknown or expired cursor" <<< "$output" || [ -n "$(paths_of "$output")" ]; then
+    fail "a cursor expires after --cursor-ttl" "$output"
+else
+    pass "expired cursor"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
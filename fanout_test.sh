@@ -0,0 +1,138 @@
+#!/usr/bin/env bash
+# Runs several rfinder servers on localhost ports and checks that one client queries them all:
+# collect-all and first-match modes, hosts files, unreachable hosts and per-host timeouts.
+# Usage: ./fanout_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+SERVERS=3
+BASE_PORT=$((20000 + RANDOM % 20000))
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-fanout-XXXXXX)
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+mkdir -p "$WORK_DIR/tree/a/b" "$WORK_DIR/tree/c"
+touch "$WORK_DIR/tree/a/b/needle.txt" "$WORK_DIR/tree/c/hay.txt"
+
+ADDRESSES=()
+for i in $(seq 0 $((SERVERS - 1))); do
+    port=$((BASE_PORT + i))
+    "$SERVER" "$port" > "$WORK_DIR/server-$i.log" 2>&1 &
+    PIDS+=($!)
+    if ! wait_for_port "$port"; then
+        echo "Server on port $port did not start:"
+        cat "$WORK_DIR/server-$i.log"
+        exit 1
+    fi
+    ADDRESSES+=("127.0.0.1:$port")
+done
+ALL=$(IFS=,; echo "${ADDRESSES[*]}")
+FOUND="Completed with message: \"$WORK_DIR/tree/a/b/needle.txt\""
+
+output=$("$CLIENT" "$ALL" needle.txt "$WORK_DIR/tree" 2>&1)
+missing=0
+for address in "${ADDRESSES[@]}"; do
+    if ! grep -qF "[$address] $FOUND" <<< "$output"; then
+        fail "collect-all reports the match of $address" "$output"
+        missing=1
+    fi
+done
+if [ "$missing" -eq 0 ]; then
+    pass "collect-all"
+fi
+
+output=$("$CLIENT" --first "$ALL" needle.txt "$WORK_DIR/tree" 2>&1)
+if [ "$(grep -cF "$FOUND" <<< "$output")" -ne 1 ]; then
+    fail "first-match prints a single match" "$output"
+else
+    pass "first-match"
+fi
+
+output=$("$CLIENT" --first "$ALL" missing.txt "$WORK_DIR/tree" 2>&1)
+if [ "$(grep -cF 'Completed with message: "Not found"' <<< "$output")" -ne "$SERVERS" ]; then
+    fail "first-match waits for every server when none finds the file" "$output"
+else
+    pass "first-match without a match"
+fi
+
+printf '%s\n' "${ADDRESSES[@]}" > "$WORK_DIR/hosts"
+output=$("$CLIENT" --hosts "$WORK_DIR/hosts" needle.txt "$WORK_DIR/tree" 2>&1)
+if [ "$(grep -cF "$FOUND" <<< "$output")" -ne "$SERVERS" ]; then
+    fail "hosts file queries every listed server" "$output"
+else
+    pass "hosts file"
+fi
+
+# the port right after the servers is assumed to be free
+UNREACHABLE=127.0.0.1:$((BASE_PORT + SERVERS))
+output=$("$CLIENT" "$ALL,$UNREACHABLE" needle.txt "$WORK_DIR/tree" 2>&1)
+if ! grep -qF "[$UNREACHABLE] Error" <<< "$output" || [ "$(grep -cF "$FOUND" <<< "$output")" -ne "$SERVERS" ]; then
+    fail "an unreachable server does not hide the others" "$output"
+else
+    pass "unreachable server"
+fi
+
+# a listener which never answers stands for a server stuck in a long search
+if command -v python3 > /dev/null; then
+    SILENT_PORT=$((BASE_PORT + SERVERS + 1))
+    python3 -c "
+import socket, time
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', $SILENT_PORT))
+s.listen(8)
+time.sleep(60)
+" &
+    PIDS+=($!)
+    wait_for_port "$SILENT_PORT"
+    started=$(date +%s)
+    output=$("$CLIENT" --host-timeout 1 "$ALL,127.0.0.1:$SILENT_PORT" needle.txt "$WORK_DIR/tree" 2>&1)
+    elapsed=$(($(date +%s) - started))
+    if ! grep -qF "[127.0.0.1:$SILENT_PORT] Error" <<< "$output" || [ "$elapsed" -gt 5 ] \
+        || [ "$(grep -cF "$FOUND" <<< "$output")" -ne "$SERVERS" ]; then
+        fail "a silent server is given up after the host timeout" "$output"
+    else
+        pass "host timeout"
+    fi
+else
+    echo "skipped: host timeout (needs python3)"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,186 @@
+#include <stdexcept>
+#include "federation.hpp"
+
+auto federation::peer_route::parse(std::string_view route) -> peer_route {
+    auto eq = route.rfind('=');
+    if (eq == std::string_view::npos || eq == 0) {
+        throw std::invalid_argument("Expected PREFIX=ADDRESS:PORT");
+    }
+    auto colon = route.rfind(':');
+    if (colon == std::string_view::npos || colon < eq) {
+        throw std::invalid_argument("Expected ADDRESS:PORT after the prefix");
+    }
+    peer_route parsed;
+    parsed.prefix = route.substr(0, eq);
+    if (parsed.prefix.back() != '/' && parsed.prefix.back() != '\\') {
+        parsed.prefix.push_back('/');
+    }
+    parsed.address = route.substr(eq + 1, colon - eq - 1);
+    int port = std::stoi(std::string(route.substr(colon + 1)));
+    if (port <= 0 || port > UINT16_MAX) {
+        throw std::invalid_argument("Invalid port");
+    }
+    parsed.port = (uint16_t)port;
+    return parsed;
+}
+
+auto federation::find_route(
+    const std::vector<peer_route>& routes,
+    std::string_view dir
+) -> const peer_route* {
+    const peer_route* best = 0;
+    for (const auto& route : routes) {
+        if (dir.substr(0, route.prefix.size()) != route.prefix) {
+            continue;
+        }
+        if (!best || route.prefix.size() > best->prefix.size()) {
+            best = &route;
+        }
+    }
+    return best;
+}
+
+#ifdef __unix__
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static bool is_final(proto::file_search_status status) {
+    return status == proto::file_search_status::ok
+        || status == proto::file_search_status::error
+        || status == proto::file_search_status::rejected
+        || status == proto::file_search_status::not_modified
+        || status == proto::file_search_status::not_found;
+}
+
+struct unix_peer_socket final {
+    int fd = -1;
+
+    ~unix_peer_socket() {
+        if (this->fd != -1) {
+            close(this->fd);
+        }
+    }
+};
+
+/**
+ * Waits for the events until the deadline.
+ * @returns false on timeout or error.
+ */
+static bool unix_wait(int fd, short events, std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) {
+            return false;
+        }
+        pollfd poll_fd {fd, events, 0};
+        int ready = poll(&poll_fd, 1, (int)remaining);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        return ready > 0;
+    }
+}
+
+bool federation::forward(
+    const peer_route& route,
+    const proto::file_search_request& req,
+    std::chrono::steady_clock::time_point deadline,
+    const response_handler& on_response
+) {
+    sockaddr_in peer_address;
+    peer_address.sin_family = AF_INET;
+    peer_address.sin_port = htons(route.port);
+    if (inet_pton(AF_INET, route.address.c_str(), &peer_address.sin_addr) != 1) {
+        return false;
+    }
+    unix_peer_socket peer;
+    peer.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (peer.fd == -1) {
+        return false;
+    }
+    if (connect(peer.fd, (sockaddr*)&peer_address, sizeof(peer_address)) == -1) {
+        if (errno != EINPROGRESS || !unix_wait(peer.fd, POLLOUT, deadline)) {
+            return false;
+        }
+        int sock_error = 0;
+        socklen_t len = sizeof(sock_error);
+        if (getsockopt(peer.fd, SOL_SOCKET, SO_ERROR, &sock_error, &len) == -1 || sock_error != 0) {
+            return false;
+        }
+    }
+
+    auto request = req.serialize();
+    size_t sent_total = 0;
+    while (sent_total < request.size()) {
+        ssize_t sent = send(peer.fd, request.data() + sent_total, request.size() - sent_total, MSG_NOSIGNAL);
+        if (sent == -1 && (errno == EAGAIN || errno == EINTR)) {
+            if (!unix_wait(peer.fd, POLLOUT, deadline)) {
+                return false;
+            }
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        sent_total += sent;
+    }
+    shutdown(peer.fd, SHUT_WR);
+
+    std::vector<char> buffer;
+    size_t consumed = 0;
+    while (true) {
+        if (!unix_wait(peer.fd, POLLIN, deadline)) {
+            return false;
+        }
+        char chunk[64 * 1024];
+        ssize_t received = read(peer.fd, chunk, sizeof(chunk));
+        if (received == -1 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        buffer.insert(buffer.end(), chunk, chunk + received);
+        while (true) {
+            size_t size = proto::peek_message_size(buffer.data() + consumed, buffer.size() - consumed);
+            if (size == 0 || size > buffer.size() - consumed) {
+                break;
+            }
+            auto res = proto::file_search_response::parse_from_buffer(buffer.data() + consumed, size);
+            consumed += size;
+            if (is_final(res.status)) {
+                // a peer which found nothing answered for its whole subtree as well
+                bool completed = res.status == proto::file_search_status::ok
+                    || res.status == proto::file_search_status::not_found
+                    || res.status == proto::file_search_status::not_modified;
+                return on_response(res) && completed;
+            }
+            if (res.status != proto::file_search_status::pending && !on_response(res)) {
+                return false;
+            }
+        }
+        if (consumed * 2 >= buffer.size()) {
+            buffer.erase(buffer.begin(), buffer.begin() + consumed);
+            consumed = 0;
+        }
+    }
+}
+
+#else
+
+bool federation::forward(
+    const peer_route&,
+    const proto::file_search_request&,
+    std::chrono::steady_clock::time_point,
+    const response_handler&
+) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __FEDERATION_HPP__
+#define __FEDERATION_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "protocol.hpp"
+
+namespace federation {
+
+/**
+ * Subtree served by a peer rfinder server, usually the file server of a network mount.
+ */
+struct peer_route final {
+    /** Absolute directory path ending with a path separator */
+    std::string prefix;
+    std::string address;
+    uint16_t port;
+
+    /**
+     * Parses "PREFIX=ADDRESS:PORT", e.g. "/mnt/nfs=10.0.0.5:8080".
+     * @throws std::invalid_argument on malformed routes.
+     */
+    static peer_route parse(std::string_view route);
+};
+
+/**
+ * @returns the route whose prefix covers the directory (which ends with a separator), or null.
+ */
+const peer_route* find_route(const std::vector<peer_route>& routes, std::string_view dir);
+
+/**
+ * Receives a response of a peer, returns false to stop the forward.
+ */
+using response_handler = std::function<bool(proto::file_search_response& res)>;
+
+/**
+ * Runs the request on the peer, passing its responses up to the final one to on_response as
+ * they arrive. Pending responses are dropped.
+ * @returns false if the peer could not be reached, did not answer by the deadline, did not
+ * complete the search (answering not_found completes it) or on_response stopped the forward.
+ */
+bool forward(
+    const peer_route& route,
+    const proto::file_search_request& req,
+    std::chrono::steady_clock::time_point deadline,
+    const response_handler& on_response
+);
+
+} // federation
+
+#endif // __FEDERATION_HPP__
@@ -0,0 +1,136 @@
+#!/usr/bin/env bash
+# Runs an rfinder server routing a subtree to a peer server and checks that searches below it are
+# answered by the peer: hits and misses alike, without crawling the routed subtree locally, unless
+# the peer fails, and then without reporting what it sent twice.
+# Usage: ./federation_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+BASE_PORT=$((20000 + RANDOM % 20000))
+FRONT=127.0.0.1:$BASE_PORT
+PEER=127.0.0.1:$((BASE_PORT + 1))
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-federation-XXXXXX)
+TREE=$WORK_DIR/tree
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+# starts a server with the given arguments, logging to the given file without buffering
+start_server() {
+    local log=$1 port=$2
+    shift 2
+    stdbuf -oL "$SERVER" "$@" "$port" > "$log" 2>&1 &
+    PIDS+=($!)
+    if ! wait_for_port "$port"; then
+        echo "Server on port $port did not start:"
+        cat "$log"
+        exit 1
+    fi
+}
+
+mkdir -p "$TREE/local/a" "$TREE/nfs/b/c"
+touch "$TREE/local/a/near.txt" "$TREE/nfs/b/c/far.txt" "$TREE/local/a/both.txt" "$TREE/nfs/b/both.txt"
+
+start_server "$WORK_DIR/peer.log" "${PEER##*:}"
+start_server "$WORK_DIR/front.log" "${FRONT##*:}" --route "$TREE/nfs=$PEER"
+
+# @returns 0 if the front server crawled a routed subtree itself
+crawled_locally() {
+    grep -qF "crawling it locally" "$WORK_DIR/front.log"
+}
+
+output=$("$CLIENT" "$FRONT" far.txt "$TREE" 2>&1)
+if ! grep -qF "Completed with message: \"$TREE/nfs/b/c/far.txt\"" <<< "$output" || crawled_locally; then
+    fail "a file below the routed subtree is found by the peer" "$output"$'\n'"$(cat "$WORK_DIR/front.log")"
+else
+    pass "peer hit"
+fi
+
+output=$("$CLIENT" "$FRONT" missing.txt "$TREE" 2>&1)
+if ! grep -qF 'Completed with message: "Not found"' <<< "$output" || crawled_locally; then
+    fail "a miss of the peer is no reason to crawl its subtree locally" "$output"$'\n'"$(cat "$WORK_DIR/front.log")"
+else
+    pass "peer miss"
+fi
+
+output=$("$CLIENT" -a "$FRONT" both.txt "$TREE" 2>&1)
+if ! grep -qF "$TREE/local/a/both.txt" <<< "$output" || ! grep -qF "$TREE/nfs/b/both.txt" <<< "$output" \
+    || [ "$(grep -c "^$TREE/.*both.txt$" <<< "$output")" -ne 2 ] || crawled_locally; then
+    fail "every match is reported once, local and routed alike" "$output"$'\n'"$(cat "$WORK_DIR/front.log")"
+else
+    pass "all matches"
+fi
+
+# a peer which streams a match and then drops the connection stands for one failing midway
+if command -v python3 > /dev/null; then
+    FAILING_FRONT=127.0.0.1:$((BASE_PORT + 2))
+    FAILING_PEER_PORT=$((BASE_PORT + 3))
+    python3 -c "
+import socket, struct, time
+def string(s):
+    return struct.pack('>I', len(s)) + s
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', $FAILING_PEER_PORT))
+s.listen(8)
+while True:
+    c, _ = s.accept()
+    c.recv(65536)
+    # status 3 is match: payload, line number, snippet, request id
+    body = struct.pack('>H', 3) + string(b'$TREE/nfs/both.txt') + struct.pack('>I', 0) + string(b'') + struct.pack('>I', 0)
+    c.sendall(struct.pack('>I', 4 + len(body)) + body)
+    time.sleep(0.2)
+    c.close()
+" &
+    PIDS+=($!)
+    wait_for_port "$FAILING_PEER_PORT"
+    touch "$TREE/nfs/both.txt"
+    start_server "$WORK_DIR/failing.log" "${FAILING_FRONT##*:}" --route "$TREE/nfs=127.0.0.1:$FAILING_PEER_PORT"
+    output=$("$CLIENT" -a "$FAILING_FRONT" both.txt "$TREE" 2>&1)
+    if [ "$(grep -c "^$TREE/nfs/both.txt$" <<< "$output")" -ne 1 ] || ! grep -qF "$TREE/nfs/b/both.txt" <<< "$output" \
+        || ! grep -qF "crawling it locally" "$WORK_DIR/failing.log"; then
+        fail "the local crawl of a failed peer's subtree skips what the peer sent" "$output"$'\n'"$(cat "$WORK_DIR/failing.log")"
+    else
+        pass "peer failing midway"
+    fi
+else
+    echo "skipped: peer failing midway (needs python3)"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+# Runs an rfinder server and checks filename folding: exact lookups stay exact, -i matches names
+# regardless of case, ASCII or not, --ignore-normalization matches NFC and NFD spellings of a name,
+# and both combine, for lookups and globs alike.
+# Usage: ./folding_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+PORT=$((20000 + RANDOM % 20000))
+ADDRESS=127.0.0.1:$PORT
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-folding-XXXXXX)
+TREE=$WORK_DIR/tree
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+# "é" precomposed (NFC) and as "e" followed by a combining acute accent (NFD)
+NFC_E=$(printf '\xc3\xa9')
+NFC_CAPITAL_E=$(printf '\xc3\x89')
+NFD_E=$(printf 'e\xcc\x81')
+NFC_CAPITAL_A=$(printf '\xc3\x84')
+NFC_A=$(printf '\xc3\xa4')
+
+mkdir -p "$TREE/Sub"
+touch "$TREE/Sub/README.md" "$TREE/Caf${NFD_E}.txt" "$TREE/Sub/${NFC_CAPITAL_A}rger.log"
+
+"$SERVER" "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+PIDS+=($!)
+if ! wait_for_port "$PORT"; then
+    echo "Server did not start:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+
+# checks that a lookup with the options before the address answers the expected message
+check() {
+    local name=$1 expected=$2
+    shift 2
+    local output
+    output=$("$CLIENT" "$@" "$ADDRESS" "$name" "$TREE" 2>&1)
+    if ! grep -qxF "Completed with message: \"$expected\"" <<< "$output"; then
+        fail "${*:-exact} lookup of $name answers $expected" "$output"
+    else
+        pass "${*:-exact} lookup of $name"
+    fi
+}
+
+check readme.md "Not found"
+check readme.md "$TREE/Sub/README.md" -i
+check README.MD "$TREE/Sub/README.md" --ignore-case
+check "${NFC_A}RGER.LOG" "$TREE/Sub/${NFC_CAPITAL_A}rger.log" -i
+check "Caf${NFD_E}.txt" "$TREE/Caf${NFD_E}.txt"
+check "Caf${NFC_E}.txt" "Not found"
+check "Caf${NFC_E}.txt" "$TREE/Caf${NFD_E}.txt" --ignore-normalization
+check "caf${NFC_E}.txt" "Not found" --ignore-normalization
+check "CAF${NFC_CAPITAL_E}.TXT" "Not found" -i
+check "CAF${NFC_CAPITAL_E}.TXT" "$TREE/Caf${NFD_E}.txt" -i --ignore-normalization
+
+output=$("$CLIENT" -i --glob "$ADDRESS" '*.MD' "$TREE" 2>&1)
+if [ "$(grep -c "^$TREE/" <<< "$output")" -ne 1 ] || ! grep -qxF "$TREE/Sub/README.md" <<< "$output"; then
+    fail "-i globs match regardless of case" "$output"
+else
+    pass "-i glob"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
@@ -1,8 +1,122 @@
+#include <algorithm>
 #include <queue>
 #include <string>
 #include <cstring>
+#include <ctime>
 #include <stdexcept>
 #include "fs.hpp"
+#include "snapshot.hpp"
+#include "unicode.hpp"
+
+static bool compare(uint64_t actual, fs::comparison op, uint64_t expected) {
+    switch (op) {
+        case fs::comparison::eq: return actual == expected;
+        case fs::comparison::ne: return actual != expected;
+        case fs::comparison::lt: return actual < expected;
+        case fs::comparison::le: return actual <= expected;
+        case fs::comparison::gt: return actual > expected;
+        case fs::comparison::ge: return actual >= expected;
+    }
+    return false;
+}
+
+static uint64_t age_seconds(int64_t timestamp) {
+    int64_t now = (int64_t)time(0);
+    return now > timestamp ? now - timestamp : 0;
+}
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+static const char PATH_SEPARATOR = '\\';
+
+static bool is_path_separator(char c) {
+    return c == '\\' || c == '/';
+}
+#else
+static const char PATH_SEPARATOR = '/';
+
+static bool is_path_separator(char c) {
+    return c == '/';
+}
+#endif
+
+/**
+ * Collapses repeated separators, "." and ".." components without consulting the filesystem,
+ * and ends the path with a separator.
+ */
+static std::string normalize_root(std::string_view root) {
+    bool absolute = is_path_separator(root.front());
+    std::vector<std::string_view> components;
+    size_t begin = 0;
+    while (begin < root.size()) {
+        size_t end = begin;
+        while (end < root.size() && !is_path_separator(root[end])) {
+            ++end;
+        }
+        auto component = root.substr(begin, end - begin);
+        begin = end + 1;
+        if (component.empty() || component == ".") {
+            continue;
+        }
+        if (component == ".." && !components.empty() && components.back() != "..") {
+            components.pop_back();
+            continue;
+        }
+        // nothing is above the root directory
+        if (component == ".." && absolute) {
+            continue;
+        }
+        components.push_back(component);
+    }
+    std::string normalized;
+    if (absolute) {
+        normalized.push_back(PATH_SEPARATOR);
+    }
+    for (auto component : components) {
+        normalized.append(component);
+        normalized.push_back(PATH_SEPARATOR);
+    }
+    if (normalized.empty()) {
+        normalized = std::string(".") + PATH_SEPARATOR;
+    }
+    return normalized;
+}
+
+std::vector<std::string> fs::normalize_roots(const std::vector<std::string>& roots) {
+    std::vector<std::string> normalized;
+    for (const auto& root : roots) {
+        if (root.empty()) {
+            throw std::runtime_error("Empty root path is not allowed for security and cross-platform compatibility reasons.");
+        }
+        normalized.push_back(normalize_root(root));
+    }
+    // a root sorts right before the roots nested below it, or the roots between them are nested too
+    std::sort(normalized.begin(), normalized.end());
+    std::vector<std::string> outermost;
+    for (auto& root : normalized) {
+        if (!outermost.empty() && root.compare(0, outermost.back().size(), outermost.back()) == 0) {
+            continue;
+        }
+        outermost.push_back(std::move(root));
+    }
+    return outermost;
+}
+
+std::string fs::find_file(std::string_view filename, std::string_view root, const search_options& options) {
+    return fs::find_file(filename, std::vector<std::string>{std::string(root)}, options);
+}
+
+void fs::walk(std::string_view root, const search_options& options, const entry_visitor& visit) {
+    fs::walk(std::vector<std::string>{std::string(root)}, options, visit);
+}
+
+void fs::find_all(
+    std::string_view root,
+    const name_matcher& matcher,
+    const search_options& options,
+    const entry_visitor& visit
+) {
+    fs::find_all(std::vector<std::string>{std::string(root)}, matcher, options, visit);
+}
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
 
@@ -58,9 +172,20 @@ static std::string win32_combine_path(const std::string& dir, const char* filena
     }
 }
 
-static std::string win32_find_file_iter(
+static bool win32_is_excluded(const fs::prune_rules& rules, const char* dir_name) {
+    for (const auto& pattern : rules.exclude_patterns) {
+        if (PathMatchSpecA(dir_name, pattern.c_str())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename Visitor>
+static void win32_walk(
     std::queue<std::string>& to_visit,
-    std::string_view filename
+    const fs::prune_rules& rules,
+    Visitor&& visit
 ) {
     while (!to_visit.empty()) {
         auto dir_to_search = to_visit.front();
@@ -78,16 +203,90 @@ static std::string win32_find_file_iter(
         do {
             bool is_dir = data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
             const auto name = std::string_view(data.cFileName);
-            if (is_dir && name != "." && name != "..") {
-                to_visit.emplace(win32_combine_path(dir_to_search, name.data()));
-            } else if (name == filename) {
-                return win32_combine_path(dir_to_search, name.data());
+            if (is_dir) {
+                if (name != "." && name != ".." && !win32_is_excluded(rules, data.cFileName)) {
+                    to_visit.emplace(win32_combine_path(dir_to_search, name.data()));
+                }
+                continue;
+            }
+            auto type = data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT
+                ? fs::entry_type::symlink
+                : fs::entry_type::regular;
+            if (!visit(dir_to_search, data.cFileName, type)) {
+                return;
             }
         } while (FindNextFileA(listing.handle, &data));
     }
-    return "";
 }
 
+static bool win32_satisfies_predicates(const std::string& path, const std::vector<fs::metadata_predicate>& predicates) {
+    using fs::metadata_field;
+    using fs::file_kind;
+    if (predicates.empty()) {
+        return true;
+    }
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+        return false;
+    }
+    for (const auto& predicate : predicates) {
+        uint64_t actual = 0;
+        switch (predicate.field) {
+            case metadata_field::size:
+                actual = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+                break;
+            case metadata_field::mtime_age: {
+                // FILETIME counts 100ns intervals since 1601-01-01
+                uint64_t ticks = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+                actual = age_seconds((int64_t)(ticks / 10000000ull) - 11644473600ll);
+                break;
+            }
+            case metadata_field::type:
+                if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+                    actual = (uint64_t)file_kind::symlink;
+                } else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                    actual = (uint64_t)file_kind::directory;
+                } else {
+                    actual = (uint64_t)file_kind::regular;
+                }
+                break;
+            case metadata_field::uid:
+            case metadata_field::gid:
+                // no POSIX ownership on Windows
+                return false;
+        }
+        if (!compare(actual, predicate.op, predicate.value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool fs::satisfies_predicates(const entry& e, const search_options& options) {
+    return win32_satisfies_predicates(e.path(), options.predicates);
+}
+
+void fs::set_listing_cache_budget(size_t) {}
+
+auto fs::get_listing_cache_stats() -> listing_cache_stats {
+    return {};
+}
+
+void fs::set_subtree_filter_config(const subtree_filter_config&) {}
+
+size_t fs::build_subtree_filters(std::string_view root, const search_options& options, const entry_visitor& visit) {
+    fs::walk(root, options, visit);
+    return 0;
+}
+
+auto fs::get_subtree_filter_stats() -> subtree_filter_stats {
+    return {};
+}
+
+void fs::save_warm_state(snapshot::writer&) {}
+
+void fs::load_warm_state(snapshot::reader&) {}
+
 bool fs::dir_exists(std::string_view absolute_path) noexcept {
     auto attrs = GetFileAttributesA(absolute_path.data());
     if (attrs == INVALID_FILE_ATTRIBUTES) {
@@ -96,21 +295,129 @@ bool fs::dir_exists(std::string_view absolute_path) noexcept {
     return attrs & FILE_ATTRIBUTE_DIRECTORY;
 }
 
-std::string fs::find_file(std::string_view filename, std::string_view root) {
-    if (root.empty()) {
-        throw std::runtime_error("Empty root path is not allowed for security and cross-platform compatibility reasons.");
+uint64_t fs::path_fingerprint(std::string_view, std::string_view) noexcept {
+    return 0;
+}
+
+bool fs::is_reported(std::string_view, std::string_view, const search_options&) {
+    return false;
+}
+
+void fs::set_search_history_config(const search_history_config&) {}
+
+auto fs::get_search_history_stats() -> search_history_stats {
+    return search_history_stats{};
+}
+
+static void win32_start_walk(const std::vector<std::string>& roots, std::queue<std::string>& to_visit) {
+    for (const auto& root : roots) {
+        if (root.empty()) {
+            throw std::runtime_error("Empty root path is not allowed for security and cross-platform compatibility reasons.");
+        }
+        to_visit.push(root);
     }
+}
+
+std::string fs::find_file(std::string_view filename, const std::vector<std::string>& roots, const search_options& options) {
+    std::queue<std::string> to_visit;
+    win32_start_walk(roots, to_visit);
+    std::string found;
+    auto folded = unicode::fold(filename, options.name_fold);
+    win32_walk(to_visit, options.prune, [&](const std::string& dir, const char* name, fs::entry_type) {
+        bool name_matches = options.name_fold
+            ? unicode::folded_equals(name, folded, options.name_fold)
+            : filename == name;
+        if (!name_matches) {
+            return true;
+        }
+        auto path = win32_combine_path(dir, name);
+        if (!win32_satisfies_predicates(path, options.predicates)) {
+            return true;
+        }
+        found = std::move(path);
+        return false;
+    });
+    return found;
+}
+
+void fs::walk(const std::vector<std::string>& roots, const search_options& options, const entry_visitor& visit) {
     std::queue<std::string> to_visit;
-    to_visit.push(std::string(root));
-    return win32_find_file_iter(to_visit, filename);
+    win32_start_walk(roots, to_visit);
+    std::string dir_with_separator;
+    win32_walk(to_visit, options.prune, [&](const std::string& dir, const char* name, fs::entry_type type) {
+        // directories are queued without a trailing separator
+        dir_with_separator = dir;
+        if (dir_with_separator.back() != '\\' && dir_with_separator.back() != '/') {
+            dir_with_separator += '\\';
+        }
+        return visit(fs::entry{dir_with_separator, name, type});
+    });
+}
+
+/**
+ * Matches a name against a matcher whose text has already been folded with the fold mode.
+ */
+static bool win32_name_matches(const fs::name_matcher& matcher, const char* name, unsigned fold) {
+    switch (matcher.type) {
+        case fs::name_matcher::kind::exact:
+            return fold ? unicode::folded_equals(name, matcher.text, fold) : matcher.text == name;
+        case fs::name_matcher::kind::glob:
+            return PathMatchSpecA(fold ? unicode::fold(name, fold).c_str() : name, matcher.text.c_str());
+        default:
+            return true;
+    }
+}
+
+void fs::find_all(
+    const std::vector<std::string>& roots,
+    const name_matcher& matcher,
+    const search_options& options,
+    const entry_visitor& visit
+) {
+    auto folded = matcher;
+    folded.text = unicode::fold(matcher.text, options.name_fold);
+    fs::walk(roots, options, [&](const fs::entry& e) {
+        if (!win32_name_matches(folded, e.name.data(), options.name_fold) || !fs::satisfies_predicates(e, options)) {
+            return true;
+        }
+        return visit(e);
+    });
+}
+
+size_t fs::find_page(
+    const std::vector<std::string>&,
+    const name_matcher&,
+    const search_options&,
+    size_t,
+    std::string&,
+    const entry_visitor&
+) {
+    throw std::runtime_error("Paged traversals are not supported on this platform");
 }
 
 #elif __unix__
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <poll.h>
+#include <unistd.h>
 
 struct unix_dir_guard final {
     DIR* dir = 0;
@@ -125,52 +432,2284 @@ struct unix_dir_guard final {
     }
 };
 
-static std::string find_file_iter(
-    std::queue<std::string>& to_visit,
-    std::string_view filename
-) {
-    while (!to_visit.empty()) {
-        std::string dir_to_search = to_visit.front();
-        to_visit.pop();
+struct unix_pending_dir final {
+    std::string path;
+    dev_t dev;
+    /** As the parent listed it, orders the descent in large-directory mode */
+    ino_t ino = 0;
+};
 
-        unix_dir_guard directory {opendir(dir_to_search.c_str())};
-        if (!directory.dir) {
-            continue;
+/**
+ * statfs(2) magic numbers of filesystems which expose kernel state rather than files.
+ */
+static const unsigned long UNIX_PSEUDO_FS_MAGICS[] = {
+    0x9fa0,     // proc
+    0x62656572, // sysfs
+    0x1cd1,     // devpts
+    0x27e0eb,   // cgroup
+    0x63677270, // cgroup2
+    0x64626720, // debugfs
+    0x74726163, // tracefs
+    0x73636673, // securityfs
+    0xcafe4a11, // bpf
+    0x6165676c, // pstore
+    0x62656570, // configfs
+    0x65735543, // fusectl
+    0x19800202, // mqueue
+    0x42494e4d, // binfmt_misc
+    0xf97cff8c, // selinuxfs
+    0x6e736673, // nsfs
+    0xde5e81e4, // efivarfs
+    0x0187,     // autofs
+};
+
+struct unix_pruner final {
+    const fs::prune_rules& rules;
+    std::unordered_map<dev_t, bool> pseudo_devices;
+
+    bool needs_device() const {
+        return this->rules.one_filesystem || this->rules.skip_pseudo_filesystems;
+    }
+
+    bool is_excluded(const char* dir_name) const {
+        for (const auto& pattern : this->rules.exclude_patterns) {
+            if (fnmatch(pattern.c_str(), dir_name, 0) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool is_pseudo_device(dev_t dev, const std::string& path) {
+        auto cached = this->pseudo_devices.find(dev);
+        if (cached != this->pseudo_devices.end()) {
+            return cached->second;
+        }
+        struct statfs fs_info;
+        bool pseudo = false;
+        if (statfs(path.c_str(), &fs_info) == 0) {
+            for (auto magic : UNIX_PSEUDO_FS_MAGICS) {
+                if ((unsigned long)fs_info.f_type == magic) {
+                    pseudo = true;
+                    break;
+                }
+            }
+        }
+        this->pseudo_devices.emplace(dev, pseudo);
+        return pseudo;
+    }
+
+    /**
+     * Decides on a directory which resides on another device than its parent, i.e. a mount point.
+     * Staying on the filesystem of the parent also keeps a traversal of several roots on theirs.
+     */
+    bool is_pruned_mount(dev_t dev, const std::string& path) {
+        if (this->rules.one_filesystem) {
+            return true;
+        }
+        return this->rules.skip_pseudo_filesystems && this->is_pseudo_device(dev, path);
+    }
+};
+
+/**
+ * Open-addressing set of (device, inode) pairs of visited directories.
+ * Inode 0 is never handed out by Linux filesystems and marks an empty slot.
+ */
+struct unix_visited_set final {
+    struct slot final {
+        dev_t dev;
+        ino_t ino;
+    };
+
+    std::vector<slot> slots = std::vector<slot>(256, slot{0, 0});
+    size_t count = 0;
+
+    static size_t hash(dev_t dev, ino_t ino) {
+        uint64_t x = (uint64_t)ino ^ ((uint64_t)dev * 0x9e3779b97f4a7c15ull);
+        x ^= x >> 31;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 29;
+        return (size_t)x;
+    }
+
+    /**
+     * @returns false if the pair has already been inserted.
+     */
+    bool insert(dev_t dev, ino_t ino) {
+        if ((this->count + 1) * 10 > this->slots.size() * 7) {
+            this->grow();
         }
-        
-        dirent* dir_entry = 0;
+        size_t mask = this->slots.size() - 1;
+        for (size_t i = hash(dev, ino) & mask; ; i = (i + 1) & mask) {
+            auto& s = this->slots[i];
+            if (s.ino == 0) {
+                s = slot{dev, ino};
+                ++this->count;
+                return true;
+            }
+            if (s.ino == ino && s.dev == dev) {
+                return false;
+            }
+        }
+    }
+
+    void grow() {
+        std::vector<slot> old(this->slots.size() * 2, slot{0, 0});
+        old.swap(this->slots);
+        this->count = 0;
+        for (const auto& s : old) {
+            if (s.ino != 0) {
+                this->insert(s.dev, s.ino);
+            }
+        }
+    }
+};
+
+/**
+ * Compile-time switches of a traversal kernel, so that features a request does not use
+ * cost no branch in the per-entry loop.
+ */
+template<bool FollowSymlinks, bool NeedsDevice, bool HasExcludes>
+struct unix_walk_policy final {
+    static constexpr bool follow_symlinks = FollowSymlinks;
+    static constexpr bool needs_device = NeedsDevice;
+    static constexpr bool needs_stat = FollowSymlinks || NeedsDevice;
+    static constexpr bool has_excludes = HasExcludes;
+};
+
+/**
+ * Directory entry as the traversal kernel sees it, read from the kernel or from a cached listing.
+ */
+struct unix_dir_item final {
+    /** NUL-terminated */
+    const char* name;
+    /** DT_* type, DT_UNKNOWN if the filesystem did not tell */
+    unsigned char type;
+    /** dev identifies the entry (not a symlink target); set for directories of cached listings */
+    bool has_stat;
+    dev_t dev;
+    /** d_ino of the entry, or its st_ino if has_stat */
+    ino_t ino;
+};
+
+/**
+ * Reads the entries of a directory with readdir(3), or in large-directory mode straight from
+ * getdents64(2) into a buffer of a few megabytes, so that a directory of millions of entries takes
+ * a handful of system calls instead of one per 32 KiB glibc batch.
+ */
+struct unix_dir_reader final {
+    static constexpr size_t LARGE_BUFFER_SIZE = 4u << 20;
+
+    /** Reused by the readers of a thread, unless one of them is still open */
+    struct buffer_slot final {
+        std::unique_ptr<char[]> data;
+        bool busy = false;
+    };
+
+    DIR* dir = 0;
+    int fd = -1;
+    char* buffer = 0;
+    std::unique_ptr<char[]> own_buffer;
+    buffer_slot* slot = 0;
+    size_t filled = 0;
+    size_t offset = 0;
+    /** Cookie of the position right after the last entry returned, see seek */
+    off_t position = 0;
+
+    unix_dir_reader(const std::string& path, bool large) {
+        if (!large) {
+            this->dir = opendir(path.c_str());
+            if (this->dir) {
+                this->fd = dirfd(this->dir);
+            }
+            return;
+        }
+        this->fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (this->fd == -1) {
+            return;
+        }
+        static thread_local buffer_slot thread_slot;
+        if (thread_slot.busy) {
+            this->own_buffer.reset(new char[LARGE_BUFFER_SIZE]);
+            this->buffer = this->own_buffer.get();
+            return;
+        }
+        if (!thread_slot.data) {
+            thread_slot.data.reset(new char[LARGE_BUFFER_SIZE]);
+        }
+        thread_slot.busy = true;
+        this->slot = &thread_slot;
+        this->buffer = thread_slot.data.get();
+    }
+
+    unix_dir_reader(const unix_dir_reader&) = delete;
+    unix_dir_reader& operator=(const unix_dir_reader&) = delete;
+
+    ~unix_dir_reader() {
+        if (this->dir) {
+            closedir(this->dir);
+        } else if (this->fd != -1) {
+            close(this->fd);
+        }
+        if (this->slot) {
+            this->slot->busy = false;
+        }
+    }
+
+    bool is_open() const {
+        return this->fd != -1;
+    }
+
+    /**
+     * Continues from a position a reader of the same directory returned. Filesystems keep such
+     * cookies valid while other entries are added or removed.
+     */
+    bool seek(off_t position) {
+        this->position = position;
+        if (this->dir) {
+            seekdir(this->dir, position);
+            return true;
+        }
+        this->filled = 0;
+        this->offset = 0;
+        return lseek(this->fd, position, SEEK_SET) != (off_t)-1;
+    }
+
+    /**
+     * Skips "." and "..". item.name stays valid until the next call.
+     * @returns false at the end of the directory or on error.
+     */
+    bool next(unix_dir_item& item) {
         while (true) {
-            dir_entry = readdir(directory.dir);
-            if (!dir_entry) {
-                break;
+            const char* name;
+            unsigned char type;
+            ino_t ino;
+            if (this->dir) {
+                dirent* dir_entry = readdir(this->dir);
+                if (!dir_entry) {
+                    return false;
+                }
+                name = dir_entry->d_name;
+                type = dir_entry->d_type;
+                ino = dir_entry->d_ino;
+                this->position = dir_entry->d_off;
+            } else {
+                if (this->offset >= this->filled) {
+                    long read = syscall(SYS_getdents64, this->fd, this->buffer, LARGE_BUFFER_SIZE);
+                    if (read <= 0) {
+                        return false;
+                    }
+                    this->filled = (size_t)read;
+                    this->offset = 0;
+                }
+                // records are laid out like struct dirent64
+                auto* dir_entry = (const dirent64*)(this->buffer + this->offset);
+                this->offset += dir_entry->d_reclen;
+                name = dir_entry->d_name;
+                type = dir_entry->d_type;
+                ino = dir_entry->d_ino;
+                this->position = dir_entry->d_off;
             }
-            if (dir_entry->d_type == DT_DIR && strcmp(dir_entry->d_name, ".") && strcmp(dir_entry->d_name, "..")) {
-                to_visit.push(dir_to_search + dir_entry->d_name + '/');
+            if (!strcmp(name, ".") || !strcmp(name, "..")) {
                 continue;
             }
-            if (!strcmp(dir_entry->d_name, filename.data())) {
-                return std::string(dir_to_search) + std::string(filename);
-            }
+            item = unix_dir_item{name, type, false, 0, ino};
+            return true;
+        }
+    }
+};
+
+/**
+ * Subdirectories met while reading one directory, queued in inode order once it is read: inodes
+ * are mostly allocated close to the data of their directory, so the descent reads the disk in
+ * fewer seeks than in the hash order the directory lists them in.
+ */
+struct unix_inode_batch final {
+    std::vector<unix_pending_dir> dirs;
+
+    void push(unix_pending_dir&& dir) {
+        this->dirs.push_back(std::move(dir));
+    }
+
+    template<typename Queue>
+    void flush_to(Queue& to_visit) {
+        std::sort(this->dirs.begin(), this->dirs.end(), [](const unix_pending_dir& a, const unix_pending_dir& b) {
+            return a.ino < b.ino;
+        });
+        for (auto& dir : this->dirs) {
+            to_visit.push(std::move(dir));
+        }
+        this->dirs.clear();
+    }
+};
+
+/**
+ * Reports every entry.
+ */
+struct unix_any_matcher final {
+    bool operator()(const char*) const {
+        return true;
+    }
+};
+
+/**
+ * Reports entries named exactly like a string_view, which does not have to be NUL-terminated.
+ * The name must not be empty nor contain NUL, see unix_is_valid_name.
+ */
+struct unix_exact_matcher final {
+    std::string_view name;
+
+    bool operator()(const char* entry_name) const {
+        // strncmp stops at the end of the entry name, so a shorter one is never read past its terminator
+        return entry_name[0] == this->name[0]
+            && strncmp(entry_name, this->name.data(), this->name.size()) == 0
+            && entry_name[this->name.size()] == '\0';
+    }
+};
+
+/**
+ * Reports entries whose name matches an fnmatch(3) glob.
+ */
+struct unix_glob_matcher final {
+    const char* pattern;
+
+    bool operator()(const char* entry_name) const {
+        return fnmatch(this->pattern, entry_name, 0) == 0;
+    }
+};
+
+/**
+ * Reports entries whose name equals a key under a fold mode. Keeps the key folded once per traversal.
+ */
+struct unix_folded_exact_matcher final {
+    std::string folded;
+    unsigned mode;
+
+    bool operator()(const char* entry_name) const {
+        return unicode::folded_equals(entry_name, this->folded, this->mode);
+    }
+};
+
+/**
+ * Reports entries whose folded name matches a folded glob. fnmatch folds the case of ASCII names
+ * itself, so only non-ASCII names are folded here.
+ */
+struct unix_folded_glob_matcher final {
+    std::string pattern;
+    unsigned mode;
+
+    bool operator()(const char* entry_name) const {
+        if (unicode::is_ascii(entry_name)) {
+            int flags = this->mode & unicode::fold_case ? FNM_CASEFOLD : 0;
+            return fnmatch(this->pattern.c_str(), entry_name, flags) == 0;
         }
+        return fnmatch(this->pattern.c_str(), unicode::fold(entry_name, this->mode).c_str(), 0) == 0;
     }
-    return "";
+};
+
+static bool unix_is_valid_name(std::string_view name) {
+    return !name.empty() && name.size() <= NAME_MAX && name.find('\0') == std::string_view::npos;
 }
 
-bool fs::dir_exists(std::string_view absolute_path) noexcept {
-    struct stat statbuf;
-    if (stat(absolute_path.data(), &statbuf) != 0) {
-        return false;
+/**
+ * fstatat relative to the open directory, or by full path when the listing came from the cache
+ * and no descriptor is open.
+ */
+static int unix_stat_entry(int dir_fd, const std::string& dir, const char* name, struct stat& statbuf, int flags) {
+    if (dir_fd != -1) {
+        return fstatat(dir_fd, name, &statbuf, flags);
     }
-    return S_ISDIR(statbuf.st_mode);
+    return fstatat(AT_FDCWD, (dir + name).c_str(), &statbuf, flags);
 }
 
-std::string fs::find_file(std::string_view filename, std::string_view root) {
-    if (root.empty()) {
-        throw std::runtime_error("Empty root path is not allowed for security and cross-platform compatibility reasons.");
+/**
+ * Snapshot of a directory shared by every traversal reading it. Never modified once published.
+ */
+struct unix_listing final {
+    struct item final {
+        uint32_t name_offset;
+        unsigned char type;
+        bool has_stat;
+        dev_t dev;
+        ino_t ino;
+    };
+
+    struct timespec mtime;
+    struct timespec ctime;
+    /** NUL-terminated names */
+    std::string names;
+    std::vector<item> items;
+
+    size_t bytes() const {
+        return sizeof(*this) + this->names.capacity() + this->items.capacity() * sizeof(item);
     }
-    std::queue<std::string> to_visit;
-    to_visit.push(std::string(root));
-    return find_file_iter(to_visit, filename);
+
+    unix_dir_item at(size_t i) const {
+        const auto& it = this->items[i];
+        return unix_dir_item{this->names.data() + it.name_offset, it.type, it.has_stat, it.dev, it.ino};
+    }
+};
+
+/**
+ * Server-wide cache of directory listings keyed by the (device, inode) of the directory.
+ * A listing is only served while the mtime and ctime of the directory are unchanged; it is split
+ * in shards with their own lock and LRU list, each evicting beyond its share of the byte budget.
+ */
+struct unix_listing_cache final {
+    static constexpr size_t SHARD_COUNT = 16;
+    /**
+     * Directories changed this recently are not cached: a change later within the same timestamp
+     * tick would leave mtime and ctime as they were.
+     */
+    static constexpr time_t UNSTABLE_SECONDS = 2;
+
+    struct key final {
+        dev_t dev;
+        ino_t ino;
+
+        bool operator==(const key& other) const {
+            return this->dev == other.dev && this->ino == other.ino;
+        }
+    };
+
+    struct key_hash final {
+        size_t operator()(const key& k) const {
+            return unix_visited_set::hash(k.dev, k.ino);
+        }
+    };
+
+    using entry = std::pair<key, std::shared_ptr<const unix_listing>>;
+
+    struct shard final {
+        std::mutex mutex;
+        /** Most recently used first */
+        std::list<entry> lru;
+        std::unordered_map<key, std::list<entry>::iterator, key_hash> index;
+        size_t bytes = 0;
+    };
+
+    std::atomic<size_t> budget {0};
+    shard shards[SHARD_COUNT];
+    std::atomic<uint64_t> hits {0};
+    std::atomic<uint64_t> misses {0};
+    std::atomic<uint64_t> evictions {0};
+
+    static bool same_time(const struct timespec& a, const struct timespec& b) {
+        return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+    }
+
+    bool enabled() const {
+        return this->budget.load(std::memory_order_relaxed) != 0;
+    }
+
+    shard& shard_of(const key& k) {
+        return this->shards[key_hash{}(k) % SHARD_COUNT];
+    }
+
+    void erase(shard& s, std::list<entry>::iterator it) {
+        s.bytes -= it->second->bytes();
+        s.index.erase(it->first);
+        s.lru.erase(it);
+    }
+
+    /**
+     * @returns the listing of the directory if it is cached and still valid, null otherwise.
+     * A cold lookup leaves its place in the LRU list as it is.
+     */
+    std::shared_ptr<const unix_listing> find(const struct stat& dir_stat, bool cold = false) {
+        key k {dir_stat.st_dev, dir_stat.st_ino};
+        auto& s = this->shard_of(k);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto found = s.index.find(k);
+        if (found == s.index.end()) {
+            return nullptr;
+        }
+        auto it = found->second;
+        if (!same_time(it->second->mtime, dir_stat.st_mtim) || !same_time(it->second->ctime, dir_stat.st_ctim)) {
+            this->erase(s, it);
+            return nullptr;
+        }
+        if (!cold) {
+            s.lru.splice(s.lru.begin(), s.lru, it);
+        }
+        return it->second;
+    }
+
+    /**
+     * Listings beyond this size would be evicted right away, readers stop building them.
+     */
+    size_t max_listing_bytes() const {
+        return this->budget.load(std::memory_order_relaxed) / SHARD_COUNT;
+    }
+
+    /**
+     * A cold listing goes last in the LRU list and only into the room left, evicting nothing.
+     */
+    void insert(const struct stat& dir_stat, std::shared_ptr<const unix_listing> listing, bool cold = false) {
+        time_t now = time(0);
+        if (dir_stat.st_mtim.tv_sec >= now - UNSTABLE_SECONDS || dir_stat.st_ctim.tv_sec >= now - UNSTABLE_SECONDS) {
+            return;
+        }
+        key k {dir_stat.st_dev, dir_stat.st_ino};
+        size_t shard_budget = this->max_listing_bytes();
+        if (listing->bytes() > shard_budget) {
+            return;
+        }
+        auto& s = this->shard_of(k);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto found = s.index.find(k);
+        if (found != s.index.end()) {
+            this->erase(s, found->second);
+        }
+        if (cold) {
+            if (s.bytes + listing->bytes() > shard_budget) {
+                return;
+            }
+            s.bytes += listing->bytes();
+            s.lru.emplace_back(k, std::move(listing));
+            s.index.emplace(k, std::prev(s.lru.end()));
+            return;
+        }
+        s.bytes += listing->bytes();
+        s.lru.emplace_front(k, std::move(listing));
+        s.index.emplace(k, s.lru.begin());
+        while (s.bytes > shard_budget) {
+            this->erase(s, std::prev(s.lru.end()));
+            ++this->evictions;
+        }
+    }
+};
+
+static unix_listing_cache listing_cache;
+
+/**
+ * Directories holding a mount point, by device and inode, read from /proc/self/mountinfo and read
+ * again once the kernel flags it as changed. Only subdirectories of these can be on another device
+ * than their parent, so traversals which need devices stat the subdirectories of these alone and
+ * give the others the device of their parent.
+ */
+struct unix_mount_table final {
+    using dir_set = std::unordered_set<unix_listing_cache::key, unix_listing_cache::key_hash>;
+
+    std::mutex mutex;
+    int fd = -1;
+    std::shared_ptr<const dir_set> parents;
+
+    /**
+     * @returns the directories holding a mount point, null if the mount table cannot be read.
+     */
+    std::shared_ptr<const dir_set> current() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->fd == -1) {
+            this->fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+            if (this->fd == -1) {
+                return nullptr;
+            }
+        }
+        pollfd changed {this->fd, POLLPRI, 0};
+        if (!this->parents || (poll(&changed, 1, 0) == 1 && changed.revents & (POLLPRI | POLLERR))) {
+            this->parents = this->read();
+        }
+        return this->parents;
+    }
+
+    /**
+     * Reading the file from its start clears the change flag.
+     */
+    std::shared_ptr<const dir_set> read() const {
+        std::string table;
+        char chunk[16 * 1024];
+        off_t offset = 0;
+        while (true) {
+            ssize_t n = pread(this->fd, chunk, sizeof(chunk), offset);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            table.append(chunk, n);
+            offset += n;
+        }
+        auto dirs = std::make_shared<dir_set>();
+        size_t line = 0;
+        while (line < table.size()) {
+            size_t line_end = table.find('\n', line);
+            if (line_end == std::string::npos) {
+                line_end = table.size();
+            }
+            // the fifth field is the mount point, with spaces and the like escaped as octal
+            size_t field = line;
+            for (int i = 0; i < 4 && field < line_end; ++i) {
+                field = table.find(' ', field);
+                field = field == std::string::npos || field > line_end ? line_end : field + 1;
+            }
+            size_t field_end = std::min(table.find(' ', field), line_end);
+            std::string mount_point;
+            for (size_t i = field; i < field_end; ++i) {
+                if (table[i] == '\\' && i + 3 < field_end) {
+                    mount_point.push_back((char)(((table[i + 1] - '0') << 6) | ((table[i + 2] - '0') << 3) | (table[i + 3] - '0')));
+                    i += 3;
+                } else {
+                    mount_point.push_back(table[i]);
+                }
+            }
+            line = line_end + 1;
+            size_t slash = mount_point.rfind('/');
+            if (mount_point.size() < 2 || slash == std::string::npos) {
+                continue;
+            }
+            auto parent = slash == 0 ? std::string("/") : mount_point.substr(0, slash);
+            struct stat statbuf;
+            if (fstatat(AT_FDCWD, parent.c_str(), &statbuf, AT_NO_AUTOMOUNT) == 0) {
+                dirs->insert(unix_listing_cache::key{statbuf.st_dev, statbuf.st_ino});
+            }
+        }
+        return dirs;
+    }
+};
+
+static unix_mount_table mount_table;
+
+/** Filters hold names folded like this, so that they serve searches in every fold mode */
+static const unsigned FILTER_FOLD_MODE = unicode::fold_case | unicode::fold_normalization;
+
+/**
+ * 64-bit FNV-1a with a final avalanche, so that both halves can serve as independent hashes.
+ */
+static uint64_t unix_name_hash(std::string_view name) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (char c : name) {
+        h ^= (unsigned char)c;
+        h *= 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Directories crawled below one root and the Bloom filters of their larger subtrees.
+ * Directories are numbered in depth-first order, so that every subtree is a contiguous range.
+ */
+struct unix_filter_set final {
+    struct dir final {
+        uint32_t path_offset;
+        uint32_t path_size;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        struct timespec ctime;
+    };
+
+    struct filter final {
+        /** Directories of the subtree, its own first */
+        uint32_t first_dir;
+        uint32_t end_dir;
+        uint32_t first_word;
+        uint32_t word_count;
+        unsigned hash_count;
+        /** Estimated from the bits set */
+        double false_positive_rate;
+    };
+
+    /** Ends with a path separator */
+    std::string root;
+    fs::prune_rules prune;
+    /** NUL-terminated paths of the directories, ending with a path separator */
+    std::string paths;
+    std::vector<dir> dirs;
+    std::vector<filter> filters;
+    std::vector<uint64_t> words;
+    /** Filter of a directory by its path */
+    std::unordered_map<std::string_view, uint32_t> by_path;
+    /** Set once a filter was found stale, so that lookups stop validating it */
+    std::unique_ptr<std::atomic<bool>[]> stale;
+
+    const char* path_of(uint32_t d) const {
+        return this->paths.data() + this->dirs[d].path_offset;
+    }
+
+    static void bit_positions(uint64_t hash, uint64_t& h1, uint64_t& h2) {
+        h1 = (uint32_t)hash;
+        h2 = (hash >> 32) | 1;
+    }
+
+    void add(const filter& f, uint64_t hash) {
+        uint64_t bits = (uint64_t)f.word_count * 64;
+        uint64_t h1, h2;
+        bit_positions(hash, h1, h2);
+        for (unsigned i = 0; i < f.hash_count; ++i) {
+            uint64_t bit = (h1 + i * h2) % bits;
+            this->words[f.first_word + bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+
+    bool may_contain(const filter& f, uint64_t hash) const {
+        uint64_t bits = (uint64_t)f.word_count * 64;
+        uint64_t h1, h2;
+        bit_positions(hash, h1, h2);
+        for (unsigned i = 0; i < f.hash_count; ++i) {
+            uint64_t bit = (h1 + i * h2) % bits;
+            if (!(this->words[f.first_word + bit / 64] >> (bit % 64) & 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @returns false if a directory of the subtree changed since the crawl, so that the filter may
+     * miss names added since.
+     */
+    bool is_current(const filter& f) const {
+        for (uint32_t d = f.first_dir; d < f.end_dir; ++d) {
+            const auto& crawled = this->dirs[d];
+            struct stat statbuf;
+            if (stat(this->path_of(d), &statbuf) != 0
+                || statbuf.st_dev != crawled.dev || statbuf.st_ino != crawled.ino
+                || !unix_listing_cache::same_time(statbuf.st_mtim, crawled.mtime)
+                || !unix_listing_cache::same_time(statbuf.st_ctim, crawled.ctime)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t bytes() const {
+        return sizeof(*this) + this->paths.capacity() + this->dirs.capacity() * sizeof(dir)
+            + this->filters.capacity() * (sizeof(filter) + sizeof(std::atomic<bool>))
+            + this->words.capacity() * sizeof(uint64_t)
+            + this->by_path.size() * (sizeof(std::string_view) + sizeof(uint32_t) + 2 * sizeof(void*));
+    }
+};
+
+/**
+ * Filter sets of every crawled root, replaced as a whole when a root is crawled again.
+ */
+struct unix_filter_registry final {
+    std::mutex mutex;
+    fs::subtree_filter_config config;
+    std::vector<std::shared_ptr<const unix_filter_set>> sets;
+    std::atomic<uint64_t> checks {0};
+    std::atomic<uint64_t> skipped {0};
+    std::atomic<uint64_t> invalidations {0};
+};
+
+static unix_filter_registry filter_registry;
+
+/**
+ * Filters consulted by a traversal looking for a single name before it reads a directory.
+ */
+struct unix_filter_probe final {
+    std::vector<std::shared_ptr<const unix_filter_set>> sets;
+    uint64_t hash = 0;
+
+    /**
+     * @returns true if a current filter of the directory rules the name out of its subtree.
+     */
+    bool rules_out(const std::string& dir) const {
+        for (const auto& set : this->sets) {
+            auto found = set->by_path.find(dir);
+            if (found == set->by_path.end() || set->stale[found->second].load(std::memory_order_relaxed)) {
+                continue;
+            }
+            ++filter_registry.checks;
+            const auto& f = set->filters[found->second];
+            // "maybe" descends anyway, so only a filter ruling the name out has to be validated
+            if (set->may_contain(f, this->hash)) {
+                continue;
+            }
+            if (!set->is_current(f)) {
+                if (!set->stale[found->second].exchange(true)) {
+                    ++filter_registry.invalidations;
+                }
+                continue;
+            }
+            ++filter_registry.skipped;
+            return true;
+        }
+        return false;
+    }
+};
+
+/**
+ * @returns true if a search with these rules descends nowhere a crawl with the others did not.
+ */
+static bool unix_prunes_at_least(const fs::prune_rules& search, const fs::prune_rules& crawl) {
+    if ((crawl.one_filesystem && !search.one_filesystem)
+        || (crawl.skip_pseudo_filesystems && !search.skip_pseudo_filesystems)) {
+        return false;
+    }
+    for (const auto& pattern : crawl.exclude_patterns) {
+        const auto& excluded = search.exclude_patterns;
+        if (std::find(excluded.begin(), excluded.end(), pattern) == excluded.end()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Gathers the filters a traversal looking for the name may trust.
+ * @returns false if none applies.
+ */
+static bool unix_open_filters(const fs::search_options& options, std::string_view name, unix_filter_probe& probe) {
+    // the crawl records symlinks as names, a traversal following them finds names beyond them
+    if (options.follow_symlinks) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(filter_registry.mutex);
+        for (const auto& set : filter_registry.sets) {
+            if (unix_prunes_at_least(options.prune, set->prune)) {
+                probe.sets.push_back(set);
+            }
+        }
+    }
+    if (probe.sets.empty()) {
+        return false;
+    }
+    probe.hash = unix_name_hash(unicode::fold(name, FILTER_FOLD_MODE));
+    return true;
+}
+
+/**
+ * Directories a lookup expands before the others, most likely to hold the name first.
+ */
+struct unix_search_guide final {
+    std::vector<std::string> dirs;
+
+    /**
+     * @returns 1 + the index of the first directory the path leads to or lies below, 0 if none.
+     */
+    size_t rank(const std::string& path) const {
+        for (size_t i = 0; i < this->dirs.size(); ++i) {
+            const auto& dir = this->dirs[i];
+            size_t common = std::min(dir.size(), path.size());
+            if (dir.compare(0, common, path, 0, common) == 0) {
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @returns true if the path lies in or below one of the directories.
+     */
+    bool covers(const std::string& path) const {
+        return std::any_of(this->dirs.begin(), this->dirs.end(), [&](const std::string& dir) {
+            return path.compare(0, dir.size(), dir) == 0;
+        });
+    }
+};
+
+/**
+ * Decaying frequency table of the directories lookups found their names in, by folded name and by
+ * extension. Scores halve every half life; a hit adds 1 to the decayed score of its directory.
+ *
+ * Scores all decay at the same rate, so they keep their order over time: a directory is ranked by
+ * its heat, log2 of its score at the epoch, which never has to be decayed. Shapes are split in
+ * shards with their own lock, each evicting the shape whose best directory is coldest beyond its
+ * share of max_shapes, found in a heat-ordered set.
+ */
+struct unix_search_history final {
+    static constexpr size_t SHARD_COUNT = 16;
+
+    struct hot_dir final {
+        std::string path;
+        /** log2 of the score the directory would have had at the epoch */
+        double heat;
+    };
+
+    struct shape final {
+        std::vector<hot_dir> dirs;
+        /** Of the hottest directory */
+        double heat;
+    };
+
+    struct shard final {
+        std::mutex mutex;
+        std::unordered_map<std::string, shape> shapes;
+        /** Heat and key of every shape, coldest first */
+        std::set<std::pair<double, std::string>> by_heat;
+    };
+
+    std::atomic<size_t> max_shapes {0};
+    std::atomic<unsigned> dirs_per_shape {4};
+    std::atomic<int64_t> half_life_seconds {7 * 24 * 3600};
+    shard shards[SHARD_COUNT];
+    std::atomic<uint64_t> guided {0};
+    std::atomic<uint64_t> guided_hits {0};
+
+    bool enabled() const {
+        return this->max_shapes.load(std::memory_order_relaxed) != 0;
+    }
+
+    shard& shard_of(const std::string& key) {
+        return this->shards[std::hash<std::string>{}(key) % SHARD_COUNT];
+    }
+
+    double half_lives(time_t now) const {
+        return (double)now / std::max<int64_t>(1, this->half_life_seconds.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * Keys of the name and of its extension, the most specific first. Names without an extension
+     * (or dot files) have a single key.
+     */
+    static std::vector<std::string> keys_of(std::string_view name) {
+        auto folded = unicode::fold(name, FILTER_FOLD_MODE);
+        std::vector<std::string> keys {"n:" + folded};
+        auto dot = folded.rfind('.');
+        if (dot != std::string::npos && dot != 0 && dot + 1 < folded.size()) {
+            keys.push_back("e:" + folded.substr(dot + 1));
+        }
+        return keys;
+    }
+
+    /**
+     * Remembered directories of the name, then of its extension, hottest first.
+     */
+    void guide(std::string_view name, unix_search_guide& guide) {
+        size_t limit = this->dirs_per_shape.load(std::memory_order_relaxed);
+        for (const auto& key : keys_of(name)) {
+            std::vector<const hot_dir*> ranked;
+            auto& s = this->shard_of(key);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto found = s.shapes.find(key);
+            if (found == s.shapes.end()) {
+                continue;
+            }
+            for (const auto& dir : found->second.dirs) {
+                ranked.push_back(&dir);
+            }
+            std::sort(ranked.begin(), ranked.end(), [](const hot_dir* a, const hot_dir* b) {
+                return a->heat > b->heat;
+            });
+            for (const auto* dir : ranked) {
+                if (guide.dirs.size() >= limit) {
+                    return;
+                }
+                if (std::find(guide.dirs.begin(), guide.dirs.end(), dir->path) == guide.dirs.end()) {
+                    guide.dirs.push_back(dir->path);
+                }
+            }
+        }
+    }
+
+    void record(std::string_view name, const std::string& dir) {
+        size_t max_shapes = this->max_shapes.load(std::memory_order_relaxed);
+        if (max_shapes == 0) {
+            return;
+        }
+        size_t shard_shapes = std::max<size_t>(1, max_shapes / SHARD_COUNT);
+        size_t max_dirs = 2 * (size_t)this->dirs_per_shape.load(std::memory_order_relaxed);
+        double now = this->half_lives(time(0));
+        for (const auto& key : keys_of(name)) {
+            auto& s = this->shard_of(key);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto found = s.shapes.find(key);
+            if (found == s.shapes.end()) {
+                if (s.shapes.size() >= shard_shapes) {
+                    s.shapes.erase(s.by_heat.begin()->second);
+                    s.by_heat.erase(s.by_heat.begin());
+                }
+                found = s.shapes.emplace(key, shape{{}, 0}).first;
+            } else {
+                s.by_heat.erase({found->second.heat, key});
+            }
+            auto& dirs = found->second.dirs;
+            auto hot = std::find_if(dirs.begin(), dirs.end(), [&](const hot_dir& h) {
+                return h.path == dir;
+            });
+            if (hot != dirs.end()) {
+                // log2(2^(heat - now) + 1) + now, the decayed score plus the hit
+                hot->heat = now + std::log2(std::exp2(hot->heat - now) + 1);
+            } else {
+                // twice as many directories as lookups use, so that a rising one can overtake
+                if (dirs.size() >= max_dirs) {
+                    dirs.erase(std::min_element(dirs.begin(), dirs.end(), [](const hot_dir& a, const hot_dir& b) {
+                        return a.heat < b.heat;
+                    }));
+                }
+                dirs.push_back(hot_dir{dir, now});
+            }
+            double heat = dirs.front().heat;
+            for (const auto& d : dirs) {
+                heat = std::max(heat, d.heat);
+            }
+            found->second.heat = heat;
+            s.by_heat.emplace(heat, key);
+        }
+    }
+
+    void clear() {
+        for (auto& s : this->shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.shapes.clear();
+            s.by_heat.clear();
+        }
+    }
+
+    size_t size() {
+        size_t shapes = 0;
+        for (auto& s : this->shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            shapes += s.shapes.size();
+        }
+        return shapes;
+    }
+};
+
+static unix_search_history search_history;
+
+void fs::set_search_history_config(const search_history_config& config) {
+    search_history.dirs_per_shape = config.dirs_per_shape;
+    search_history.half_life_seconds = config.half_life.count();
+    search_history.max_shapes = config.max_shapes;
+    if (config.max_shapes == 0) {
+        search_history.clear();
+    }
+}
+
+auto fs::get_search_history_stats() -> search_history_stats {
+    search_history_stats stats;
+    stats.shapes = search_history.size();
+    stats.guided_lookups = search_history.guided.load(std::memory_order_relaxed);
+    stats.guided_hits = search_history.guided_hits.load(std::memory_order_relaxed);
+    return stats;
+}
+
+/**
+ * Queue of the directories left to read. Without a guide it is the plain breadth-first queue;
+ * with one, directories leading to or lying below a remembered directory wait in the lane of
+ * their rank and go first, breadth-first within the lane.
+ */
+struct unix_guided_queue final {
+    std::queue<unix_pending_dir>& plain;
+    const unix_search_guide* guide;
+    std::vector<std::queue<unix_pending_dir>> lanes;
+
+    unix_guided_queue(std::queue<unix_pending_dir>& plain, const unix_search_guide* guide)
+        : plain(plain), guide(guide) {
+        if (guide) {
+            this->lanes.resize(guide->dirs.size());
+        }
+    }
+
+    /** Leaves the directories still in the lanes to the plain queue, a paged traversal saves */
+    ~unix_guided_queue() {
+        for (auto& lane : this->lanes) {
+            while (!lane.empty()) {
+                this->plain.push(std::move(lane.front()));
+                lane.pop();
+            }
+        }
+    }
+
+    void push(unix_pending_dir&& dir) {
+        if (this->guide) {
+            if (size_t rank = this->guide->rank(dir.path)) {
+                this->lanes[rank - 1].push(std::move(dir));
+                return;
+            }
+        }
+        this->plain.push(std::move(dir));
+    }
+
+    /**
+     * @returns false once no directory is left.
+     */
+    bool pop(unix_pending_dir& dir) {
+        for (auto& lane : this->lanes) {
+            if (!lane.empty()) {
+                dir = std::move(lane.front());
+                lane.pop();
+                return true;
+            }
+        }
+        if (this->plain.empty()) {
+            return false;
+        }
+        dir = std::move(this->plain.front());
+        this->plain.pop();
+        return true;
+    }
+};
+
+/**
+ * Directory a paged traversal stopped in, and the position of the reader in it.
+ */
+struct unix_dir_position final {
+    unix_pending_dir dir;
+    off_t offset = 0;
+    /** Set while the directory is still to be finished */
+    bool active = false;
+};
+
+struct unix_traversal final {
+    const fs::search_options& options;
+    unix_pruner pruner;
+    unix_visited_set visited;
+    /** Subtree filters of a lookup of a single name, null if none applies */
+    const unix_filter_probe* filters = 0;
+    /**
+     * Of a paged traversal, which reads past the listing cache: where to resume, then where it
+     * stopped. Null for other traversals.
+     */
+    unix_dir_position* position = 0;
+    /** Remembered directories of a lookup to expand first, null for a plain breadth-first traversal */
+    const unix_search_guide* guide = 0;
+    /**
+     * Of traversals which need the device of subdirectories, whether those of the directory being
+     * read are stat'ed, see unix_mount_table
+     */
+    bool stat_subdirs = false;
+
+    bool needs_stat() const {
+        return this->options.follow_symlinks || this->pruner.needs_device();
+    }
+
+    /**
+     * Tells whether a directory entry is a directory to descend into, resolving DT_UNKNOWN
+     * and (when following symlinks) DT_LNK with fstatat. Stat is filled if it was needed.
+     */
+    template<typename Policy>
+    bool is_directory(
+        int dir_fd,
+        const std::string& dir,
+        const unix_dir_item& item,
+        struct stat& statbuf,
+        bool& has_stat
+    ) const {
+        has_stat = false;
+        switch (item.type) {
+            case DT_DIR:
+                return true;
+            case DT_UNKNOWN:
+                if (unix_stat_entry(dir_fd, dir, item.name, statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+                    return false;
+                }
+                has_stat = true;
+                if (!S_ISLNK(statbuf.st_mode)) {
+                    return S_ISDIR(statbuf.st_mode);
+                }
+                [[fallthrough]];
+            case DT_LNK:
+                if constexpr (!Policy::follow_symlinks) {
+                    return false;
+                }
+                has_stat = unix_stat_entry(dir_fd, dir, item.name, statbuf, 0) == 0;
+                return has_stat && S_ISDIR(statbuf.st_mode);
+            default:
+                return false;
+        }
+    }
+};
+
+static fs::entry_type unix_entry_type(unsigned char type, const struct stat& statbuf, bool has_stat) {
+    if (has_stat) {
+        if (S_ISREG(statbuf.st_mode)) {
+            return fs::entry_type::regular;
+        }
+        return S_ISLNK(statbuf.st_mode) ? fs::entry_type::symlink : fs::entry_type::other;
+    }
+    switch (type) {
+        case DT_REG: return fs::entry_type::regular;
+        case DT_LNK: return fs::entry_type::symlink;
+        default: return fs::entry_type::other;
+    }
+}
+
+/**
+ * Queues an entry which is a directory to descend into, or else calls
+ * visit(dir, dir_fd, name, type) if the matcher accepts its name.
+ * @returns false once visit asked to stop.
+ */
+template<typename Policy, typename Matcher, typename Visitor, typename Queue>
+static bool unix_visit_item(
+    const unix_pending_dir& dir_to_search,
+    int dir_fd,
+    const unix_dir_item& item,
+    Queue& to_visit,
+    unix_traversal& traversal,
+    const Matcher& matches,
+    Visitor& visit
+) {
+    auto& pruner = traversal.pruner;
+    struct stat statbuf;
+    bool has_stat = false;
+    if (traversal.is_directory<Policy>(dir_fd, dir_to_search.path, item, statbuf, has_stat)) {
+        if constexpr (Policy::has_excludes) {
+            if (pruner.is_excluded(item.name)) {
+                return true;
+            }
+        }
+        // a subdirectory which is not a mount point is on the device of its parent
+        unix_pending_dir subdir {dir_to_search.path + item.name + '/', dir_to_search.dev, item.ino};
+        if constexpr (Policy::needs_stat) {
+            if (!has_stat) {
+                if (item.has_stat) {
+                    statbuf.st_dev = item.dev;
+                    statbuf.st_ino = item.ino;
+                    has_stat = true;
+                } else if (traversal.stat_subdirs) {
+                    if (unix_stat_entry(dir_fd, dir_to_search.path, item.name, statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+                        return true;
+                    }
+                    has_stat = true;
+                }
+            }
+            if (has_stat) {
+                subdir.dev = statbuf.st_dev;
+                subdir.ino = statbuf.st_ino;
+            }
+            if (subdir.dev != dir_to_search.dev && pruner.is_pruned_mount(subdir.dev, subdir.path)) {
+                return true;
+            }
+            if (Policy::follow_symlinks && !traversal.visited.insert(subdir.dev, subdir.ino)) {
+                return true;
+            }
+        }
+        if (traversal.options.delegate_subtree && traversal.options.delegate_subtree(subdir.path)) {
+            return true;
+        }
+        to_visit.push(std::move(subdir));
+        return true;
+    }
+    if (!matches(item.name)) {
+        return true;
+    }
+    return visit(dir_to_search.path, dir_fd, item.name, unix_entry_type(item.type, statbuf, has_stat));
+}
+
+/**
+ * Reads a directory through the listing cache. A valid cached listing costs a single stat and no
+ * descriptor; otherwise entries are visited as the directory is read, and its listing is published
+ * for other traversals if the reading was not stopped and the listing fits the cache.
+ * @returns false once visit asked to stop.
+ */
+template<typename Policy, typename Matcher, typename Visitor, typename Queue>
+static bool unix_walk_cached(
+    const unix_pending_dir& dir_to_search,
+    Queue& to_visit,
+    unix_traversal& traversal,
+    const Matcher& matches,
+    Visitor& visit
+) {
+    struct stat dir_stat;
+    if (stat(dir_to_search.path.c_str(), &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
+        return true;
+    }
+    bool cold = traversal.options.cold_listing_cache;
+    auto listing = listing_cache.find(dir_stat, cold);
+    if (listing) {
+        ++listing_cache.hits;
+        for (size_t i = 0; i < listing->items.size(); ++i) {
+            auto item = listing->at(i);
+            // mounting a filesystem on a subdirectory changes its device but not the listing,
+            // devices are taken from the mount table instead
+            item.has_stat = false;
+            if (!unix_visit_item<Policy>(dir_to_search, -1, item, to_visit, traversal, matches, visit)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    ++listing_cache.misses;
+
+    unix_dir_reader reader(dir_to_search.path, traversal.options.large_directories);
+    if (!reader.is_open()) {
+        return true;
+    }
+    auto fresh = std::make_shared<unix_listing>();
+    fresh->mtime = dir_stat.st_mtim;
+    fresh->ctime = dir_stat.st_ctim;
+    size_t max_bytes = listing_cache.max_listing_bytes();
+    bool caching = true;
+    unix_dir_item dir_item;
+    while (reader.next(dir_item)) {
+        // a listing outgrowing the cache is dropped, later items have no offset in it
+        unix_listing::item it {caching ? (uint32_t)fresh->names.size() : 0, dir_item.type, false, 0, dir_item.ino};
+        if (it.type == DT_UNKNOWN || (traversal.stat_subdirs && it.type == DT_DIR)) {
+            struct stat statbuf;
+            if (fstatat(reader.fd, dir_item.name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+                it.type = IFTODT(statbuf.st_mode);
+                it.has_stat = true;
+                it.dev = statbuf.st_dev;
+                it.ino = statbuf.st_ino;
+            }
+        }
+        if (caching) {
+            fresh->names.append(dir_item.name);
+            fresh->names.push_back('\0');
+            fresh->items.push_back(it);
+            if (sizeof(unix_listing) + fresh->names.size() + fresh->items.size() * sizeof(unix_listing::item) > max_bytes) {
+                caching = false;
+                fresh.reset();
+            }
+        }
+        unix_dir_item item {dir_item.name, it.type, it.has_stat, it.dev, it.ino};
+        if (!unix_visit_item<Policy>(dir_to_search, reader.fd, item, to_visit, traversal, matches, visit)) {
+            return false;
+        }
+    }
+    if (caching) {
+        fresh->names.shrink_to_fit();
+        fresh->items.shrink_to_fit();
+        listing_cache.insert(dir_stat, std::move(fresh), cold);
+    }
+    return true;
+}
+
+/**
+ * Visits the entries of a single directory from a reader position (0 for its start), queueing
+ * its subdirectories to to_visit. A paged traversal records where it stopped.
+ * @returns false once visit asked to stop.
+ */
+template<typename Policy, typename Matcher, typename Visitor, typename Queue>
+static bool unix_walk_dir(
+    const unix_pending_dir& dir_to_search,
+    off_t start,
+    bool cached,
+    Queue& to_visit,
+    unix_traversal& traversal,
+    const Matcher& matches,
+    Visitor& visit
+) {
+    if (cached) {
+        return unix_walk_cached<Policy>(dir_to_search, to_visit, traversal, matches, visit);
+    }
+    unix_dir_reader reader(dir_to_search.path, traversal.options.large_directories);
+    if (!reader.is_open() || (start != 0 && !reader.seek(start))) {
+        return true;
+    }
+    unix_dir_item item;
+    while (reader.next(item)) {
+        if (!unix_visit_item<Policy>(dir_to_search, reader.fd, item, to_visit, traversal, matches, visit)) {
+            if (traversal.position) {
+                *traversal.position = unix_dir_position{dir_to_search, reader.position, true};
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Breadth-first traversal calling visit(dir, dir_fd, name, type) for every non-directory entry
+ * accepted by the matcher until it returns false. dir_fd is -1 for entries of cached listings.
+ * In large-directory mode the subdirectories of every directory are queued in inode order.
+ * A guided traversal reads the directories leading to and below the guide's first.
+ */
+template<typename Policy, typename Matcher, typename Visitor>
+static void unix_walk(
+    std::queue<unix_pending_dir>& to_visit,
+    unix_traversal& traversal,
+    const Matcher& matches,
+    Visitor&& visit
+) {
+    // positions in cached listings would not survive their eviction
+    bool cached = listing_cache.enabled() && !traversal.position;
+    bool large = traversal.options.large_directories;
+    std::shared_ptr<const unix_mount_table::dir_set> mount_parents;
+    if constexpr (Policy::needs_stat) {
+        mount_parents = mount_table.current();
+    }
+    unix_inode_batch batch;
+    unix_guided_queue queue(to_visit, traversal.guide);
+    while (true) {
+        unix_pending_dir dir_to_search;
+        off_t start = 0;
+        if (traversal.position && traversal.position->active) {
+            // the directory a previous page stopped in goes first
+            dir_to_search = std::move(traversal.position->dir);
+            start = traversal.position->offset;
+            traversal.position->active = false;
+        } else if (queue.pop(dir_to_search)) {
+            if (traversal.filters && traversal.filters->rules_out(dir_to_search.path)) {
+                continue;
+            }
+        } else {
+            return;
+        }
+        if (traversal.options.on_directory) {
+            traversal.options.on_directory(dir_to_search.path);
+        }
+        if constexpr (Policy::needs_stat) {
+            // without a mount table every subdirectory could be a mount point
+            traversal.stat_subdirs = !mount_parents
+                || mount_parents->count(unix_listing_cache::key{dir_to_search.dev, dir_to_search.ino});
+        }
+        if (!large) {
+            if (!unix_walk_dir<Policy>(dir_to_search, start, cached, queue, traversal, matches, visit)) {
+                return;
+            }
+            continue;
+        }
+        bool more = unix_walk_dir<Policy>(dir_to_search, start, cached, batch, traversal, matches, visit);
+        batch.flush_to(queue);
+        if (!more) {
+            return;
+        }
+    }
+}
+
+/**
+ * Runs the kernel instantiation whose policy fits the options, picked once per traversal.
+ */
+template<typename Matcher, typename Visitor>
+static void unix_dispatch_walk(
+    std::queue<unix_pending_dir>& to_visit,
+    unix_traversal& traversal,
+    const Matcher& matches,
+    Visitor&& visit
+) {
+    int policy = (traversal.options.follow_symlinks ? 4 : 0)
+        | (traversal.pruner.needs_device() ? 2 : 0)
+        | (traversal.options.prune.exclude_patterns.empty() ? 0 : 1);
+    switch (policy) {
+        case 0: return unix_walk<unix_walk_policy<false, false, false>>(to_visit, traversal, matches, visit);
+        case 1: return unix_walk<unix_walk_policy<false, false, true>>(to_visit, traversal, matches, visit);
+        case 2: return unix_walk<unix_walk_policy<false, true, false>>(to_visit, traversal, matches, visit);
+        case 3: return unix_walk<unix_walk_policy<false, true, true>>(to_visit, traversal, matches, visit);
+        case 4: return unix_walk<unix_walk_policy<true, false, false>>(to_visit, traversal, matches, visit);
+        case 5: return unix_walk<unix_walk_policy<true, false, true>>(to_visit, traversal, matches, visit);
+        case 6: return unix_walk<unix_walk_policy<true, true, false>>(to_visit, traversal, matches, visit);
+        default: return unix_walk<unix_walk_policy<true, true, true>>(to_visit, traversal, matches, visit);
+    }
+}
+
+/**
+ * Prepares a traversal of the trees below the roots. Of several roots, those which are the same
+ * directory as an earlier one (through a bind mount or a symlink) are left out.
+ * @returns false if no root is left, roots which cannot be stat-ed are when the traversal needs their device.
+ */
+static bool unix_start_walk(
+    const std::vector<std::string>& roots,
+    unix_traversal& traversal,
+    std::queue<unix_pending_dir>& to_visit
+) {
+    bool several = roots.size() > 1;
+    for (const auto& root : roots) {
+        if (root.empty()) {
+            throw std::runtime_error("Empty root path is not allowed for security and cross-platform compatibility reasons.");
+        }
+        unix_pending_dir root_dir {root, 0};
+        if (several || traversal.needs_stat()) {
+            struct stat statbuf;
+            if (stat(root.c_str(), &statbuf) != 0 || !traversal.visited.insert(statbuf.st_dev, statbuf.st_ino)) {
+                continue;
+            }
+            root_dir.dev = statbuf.st_dev;
+            root_dir.ino = statbuf.st_ino;
+        }
+        if (root_dir.path.back() != '/') {
+            root_dir.path.push_back('/');
+        }
+        to_visit.push(std::move(root_dir));
+    }
+    return !to_visit.empty();
+}
+
+/**
+ * Files met below several roots are reported once, by their own (device, inode) pair: a bind
+ * mount shows the same files under another path. Hard links of a file are thus reported once too.
+ */
+struct unix_duplicate_filter final {
+    bool enabled;
+    unix_visited_set seen;
+
+    bool is_first(const std::string& dir, int dir_fd, const char* name) {
+        if (!this->enabled) {
+            return true;
+        }
+        struct stat statbuf;
+        if (unix_stat_entry(dir_fd, dir, name, statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+            return true;
+        }
+        return this->seen.insert(statbuf.st_dev, statbuf.st_ino);
+    }
+};
+
+static unsigned unix_statx_mask(const std::vector<fs::metadata_predicate>& predicates) {
+    unsigned mask = 0;
+    for (const auto& predicate : predicates) {
+        switch (predicate.field) {
+            case fs::metadata_field::size: mask |= STATX_SIZE; break;
+            case fs::metadata_field::mtime_age: mask |= STATX_MTIME; break;
+            case fs::metadata_field::type: mask |= STATX_TYPE; break;
+            case fs::metadata_field::uid: mask |= STATX_UID; break;
+            case fs::metadata_field::gid: mask |= STATX_GID; break;
+        }
+    }
+    return mask;
+}
+
+static fs::file_kind unix_file_kind(mode_t mode) {
+    switch (mode & S_IFMT) {
+        case S_IFDIR: return fs::file_kind::directory;
+        case S_IFLNK: return fs::file_kind::symlink;
+        case S_IFIFO: return fs::file_kind::fifo;
+        case S_IFSOCK: return fs::file_kind::socket;
+        case S_IFBLK: return fs::file_kind::block_device;
+        case S_IFCHR: return fs::file_kind::char_device;
+        default: return fs::file_kind::regular;
+    }
+}
+
+bool fs::satisfies_predicates(const entry& e, const search_options& options) {
+    if (options.predicates.empty()) {
+        return true;
+    }
+    unsigned mask = unix_statx_mask(options.predicates);
+    int flags = AT_NO_AUTOMOUNT | (options.follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW);
+    struct statx stx;
+    int result = e.dir_fd != -1
+        ? statx(e.dir_fd, e.name.data(), flags, mask, &stx)
+        : statx(AT_FDCWD, e.path().c_str(), flags, mask, &stx);
+    if (result != 0 || (stx.stx_mask & mask) != mask) {
+        return false;
+    }
+    for (const auto& predicate : options.predicates) {
+        uint64_t actual = 0;
+        switch (predicate.field) {
+            case metadata_field::size: actual = stx.stx_size; break;
+            case metadata_field::mtime_age: actual = age_seconds(stx.stx_mtime.tv_sec); break;
+            case metadata_field::type: actual = (uint64_t)unix_file_kind(stx.stx_mode); break;
+            case metadata_field::uid: actual = stx.stx_uid; break;
+            case metadata_field::gid: actual = stx.stx_gid; break;
+        }
+        if (!compare(actual, predicate.op, predicate.value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void fs::set_listing_cache_budget(size_t budget_bytes) {
+    listing_cache.budget = budget_bytes;
+}
+
+auto fs::get_listing_cache_stats() -> listing_cache_stats {
+    listing_cache_stats stats;
+    stats.hits = listing_cache.hits;
+    stats.misses = listing_cache.misses;
+    stats.evictions = listing_cache.evictions;
+    for (auto& s : listing_cache.shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        stats.bytes += s.bytes;
+        stats.listings += s.lru.size();
+    }
+    return stats;
+}
+
+void fs::set_subtree_filter_config(const subtree_filter_config& config) {
+    std::lock_guard<std::mutex> lock(filter_registry.mutex);
+    filter_registry.config = config;
+}
+
+/**
+ * Sizes a filter for the names with the configured rate, within the configured bytes.
+ */
+static unix_filter_set::filter unix_size_filter(size_t names, const fs::subtree_filter_config& config) {
+    double rate = std::min(std::max(config.false_positive_rate, 1e-9), 0.5);
+    double wanted_bits = std::ceil(names * -std::log(rate) / (M_LN2 * M_LN2));
+    size_t max_words = std::max<size_t>(1, config.max_bytes / sizeof(uint64_t));
+    size_t words = std::min(max_words, (size_t)std::ceil(wanted_bits / 64));
+    unix_filter_set::filter f {};
+    f.word_count = (uint32_t)std::min<size_t>(words, UINT32_MAX / 64);
+    double hashes = std::round((double)f.word_count * 64 / names * M_LN2);
+    f.hash_count = (unsigned)std::min(std::max(hashes, 1.0), 16.0);
+    return f;
+}
+
+/**
+ * Indexes the filters of a set by path and replaces the set of the same root.
+ */
+static void unix_publish_filters(std::shared_ptr<unix_filter_set> set) {
+    for (uint32_t i = 0; i < set->filters.size(); ++i) {
+        const auto& dir = set->dirs[set->filters[i].first_dir];
+        set->by_path.emplace(std::string_view(set->paths).substr(dir.path_offset, dir.path_size), i);
+    }
+    std::lock_guard<std::mutex> lock(filter_registry.mutex);
+    auto same_root = std::find_if(filter_registry.sets.begin(), filter_registry.sets.end(),
+        [&](const std::shared_ptr<const unix_filter_set>& s) { return s->root == set->root; });
+    if (same_root != filter_registry.sets.end()) {
+        *same_root = std::move(set);
+    } else {
+        filter_registry.sets.push_back(std::move(set));
+    }
+}
+
+size_t fs::build_subtree_filters(std::string_view root, const search_options& options, const entry_visitor& visit) {
+    subtree_filter_config config;
+    {
+        std::lock_guard<std::mutex> lock(filter_registry.mutex);
+        config = filter_registry.config;
+    }
+    // a crawl leaving names out would build filters ruling them out
+    if (config.min_names == 0 || options.follow_symlinks || !options.predicates.empty() || options.delegate_subtree) {
+        fs::walk(root, options, visit);
+        return 0;
+    }
+    if (root.empty()) {
+        throw std::runtime_error("Empty root path is not allowed for security and cross-platform compatibility reasons.");
+    }
+    auto set = std::make_shared<unix_filter_set>();
+    set->root = std::string(root);
+    if (set->root.back() != '/') {
+        set->root.push_back('/');
+    }
+    set->prune = options.prune;
+
+    // directories in the order the walk reads them, stat before their names are read
+    struct crawled_dir final {
+        std::string path;
+        struct stat statbuf;
+        bool unstable;
+    };
+    std::vector<crawled_dir> crawled;
+    std::unordered_map<std::string, uint32_t> crawled_ids;
+    std::vector<std::pair<uint32_t, uint64_t>> names;
+    // a change later within the same timestamp tick, or during the crawl, would go unnoticed
+    time_t unstable_since = time(0) - unix_listing_cache::UNSTABLE_SECONDS;
+    auto crawl_options = options;
+    crawl_options.on_directory = [&](const std::string& dir) {
+        if (options.on_directory) {
+            options.on_directory(dir);
+        }
+        if (crawled.size() >= UINT32_MAX) {
+            throw std::runtime_error("Tree too large to filter");
+        }
+        crawled_dir d {dir, {}, false};
+        if (stat(dir.c_str(), &d.statbuf) != 0) {
+            d.unstable = true;
+        } else {
+            d.unstable = d.statbuf.st_mtim.tv_sec >= unstable_since || d.statbuf.st_ctim.tv_sec >= unstable_since;
+        }
+        crawled_ids.emplace(dir, (uint32_t)crawled.size());
+        crawled.push_back(std::move(d));
+    };
+    fs::walk(set->root, crawl_options, [&](const entry& e) {
+        // the entries of a directory follow its on_directory call
+        auto id = (uint32_t)crawled.size() - 1;
+        if (crawled.empty() || crawled.back().path != e.dir) {
+            auto found = crawled_ids.find(std::string(e.dir));
+            if (found == crawled_ids.end()) {
+                return visit(e);
+            }
+            id = found->second;
+        }
+        names.emplace_back(id, unix_name_hash(unicode::fold(e.name, FILTER_FOLD_MODE)));
+        return visit(e);
+    });
+    if (crawled.empty()) {
+        return 0;
+    }
+
+    // sorted paths put every subtree right after its directory
+    std::vector<uint32_t> order(crawled.size());
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return crawled[a].path < crawled[b].path;
+    });
+    auto dir_count = (uint32_t)crawled.size();
+    std::vector<uint32_t> sorted_ids(dir_count);
+    std::vector<uint32_t> parents(dir_count, 0);
+    std::vector<uint32_t> subtree_ends(dir_count);
+    std::vector<char> unstable(dir_count);
+    std::vector<uint32_t> ancestors;
+    for (uint32_t d = 0; d < dir_count; ++d) {
+        auto& c = crawled[order[d]];
+        if (set->paths.size() + c.path.size() >= UINT32_MAX) {
+            throw std::runtime_error("Tree too large to filter");
+        }
+        sorted_ids[order[d]] = d;
+        const auto& st = c.statbuf;
+        set->dirs.push_back(unix_filter_set::dir{
+            (uint32_t)set->paths.size(), (uint32_t)c.path.size(), st.st_dev, st.st_ino, st.st_mtim, st.st_ctim
+        });
+        set->paths += c.path;
+        set->paths.push_back('\0');
+        unstable[d] = c.unstable;
+        while (!ancestors.empty() && c.path.compare(0, crawled[order[ancestors.back()]].path.size(),
+                crawled[order[ancestors.back()]].path) != 0) {
+            subtree_ends[ancestors.back()] = d;
+            ancestors.pop_back();
+        }
+        parents[d] = ancestors.empty() ? d : ancestors.back();
+        ancestors.push_back(d);
+    }
+    for (uint32_t d : ancestors) {
+        subtree_ends[d] = dir_count;
+    }
+    for (uint32_t d = dir_count - 1; d > 0; --d) {
+        unstable[parents[d]] |= unstable[d];
+    }
+    std::vector<size_t> first_names(dir_count + 1, 0);
+    for (const auto& name : names) {
+        ++first_names[sorted_ids[name.first] + 1];
+    }
+    for (uint32_t d = 0; d < dir_count; ++d) {
+        first_names[d + 1] += first_names[d];
+    }
+    std::vector<uint64_t> hashes(names.size());
+    {
+        auto next = first_names;
+        for (const auto& name : names) {
+            hashes[next[sorted_ids[name.first]]++] = name.second;
+        }
+    }
+    names = {};
+    crawled = {};
+    crawled_ids = {};
+
+    std::vector<uint64_t> distinct;
+    for (uint32_t d = 0; d < dir_count; ++d) {
+        size_t subtree_names = first_names[subtree_ends[d]] - first_names[d];
+        if (subtree_names < config.min_names || unstable[d]) {
+            continue;
+        }
+        // names like index.js or Makefile repeat all over large trees, size for the distinct ones
+        distinct.assign(hashes.begin() + first_names[d], hashes.begin() + first_names[subtree_ends[d]]);
+        std::sort(distinct.begin(), distinct.end());
+        distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+        auto f = unix_size_filter(distinct.size(), config);
+        f.first_dir = d;
+        f.end_dir = subtree_ends[d];
+        if (set->words.size() + f.word_count >= UINT32_MAX) {
+            break;
+        }
+        f.first_word = (uint32_t)set->words.size();
+        set->words.resize(set->words.size() + f.word_count);
+        for (uint64_t hash : distinct) {
+            set->add(f, hash);
+        }
+        uint64_t bits_set = 0;
+        for (uint32_t w = 0; w < f.word_count; ++w) {
+            bits_set += __builtin_popcountll(set->words[f.first_word + w]);
+        }
+        f.false_positive_rate = std::pow((double)bits_set / ((double)f.word_count * 64), f.hash_count);
+        set->filters.push_back(f);
+    }
+    set->words.shrink_to_fit();
+    set->stale = std::make_unique<std::atomic<bool>[]>(set->filters.size());
+    size_t built = set->filters.size();
+    unix_publish_filters(std::move(set));
+    return built;
+}
+
+auto fs::get_subtree_filter_stats() -> subtree_filter_stats {
+    subtree_filter_stats stats;
+    stats.checks = filter_registry.checks;
+    stats.skipped_subtrees = filter_registry.skipped;
+    stats.invalidations = filter_registry.invalidations;
+    std::lock_guard<std::mutex> lock(filter_registry.mutex);
+    for (const auto& set : filter_registry.sets) {
+        stats.filters += set->filters.size();
+        stats.bytes += set->bytes();
+        for (const auto& f : set->filters) {
+            stats.false_positive_rate += f.false_positive_rate;
+        }
+    }
+    if (stats.filters) {
+        stats.false_positive_rate /= stats.filters;
+    }
+    return stats;
+}
+
+static void unix_save_time(snapshot::writer& out, const struct timespec& t) {
+    out.u64((uint64_t)t.tv_sec);
+    out.u64((uint64_t)t.tv_nsec);
+}
+
+static struct timespec unix_load_time(snapshot::reader& in) {
+    struct timespec t;
+    t.tv_sec = (time_t)in.u64();
+    t.tv_nsec = (long)in.u64();
+    return t;
+}
+
+void fs::save_warm_state(snapshot::writer& out) {
+    // least recently used first, so that inserting them in order restores the order
+    for (auto& s : listing_cache.shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (auto it = s.lru.rbegin(); it != s.lru.rend(); ++it) {
+            const auto& listing = *it->second;
+            out.u8(1);
+            out.u64((uint64_t)it->first.dev);
+            out.u64((uint64_t)it->first.ino);
+            unix_save_time(out, listing.mtime);
+            unix_save_time(out, listing.ctime);
+            out.string(listing.names);
+            out.pods(listing.items);
+        }
+    }
+    out.u8(0);
+
+    std::vector<std::shared_ptr<const unix_filter_set>> sets;
+    {
+        std::lock_guard<std::mutex> lock(filter_registry.mutex);
+        sets = filter_registry.sets;
+    }
+    out.u64(sets.size());
+    for (const auto& set : sets) {
+        out.string(set->root);
+        out.u8(set->prune.one_filesystem);
+        out.u8(set->prune.skip_pseudo_filesystems);
+        out.u64(set->prune.exclude_patterns.size());
+        for (const auto& pattern : set->prune.exclude_patterns) {
+            out.string(pattern);
+        }
+        out.string(set->paths);
+        out.pods(set->dirs);
+        out.pods(set->filters);
+        out.pods(set->words);
+        for (size_t i = 0; i < set->filters.size(); ++i) {
+            out.u8(set->stale[i].load(std::memory_order_relaxed));
+        }
+    }
+}
+
+void fs::load_warm_state(snapshot::reader& in) {
+    while (in.u8()) {
+        struct stat dir_stat;
+        dir_stat.st_dev = (dev_t)in.u64();
+        dir_stat.st_ino = (ino_t)in.u64();
+        auto listing = std::make_shared<unix_listing>();
+        listing->mtime = dir_stat.st_mtim = unix_load_time(in);
+        listing->ctime = dir_stat.st_ctim = unix_load_time(in);
+        listing->names = in.string();
+        in.pods(listing->items);
+        for (const auto& item : listing->items) {
+            if (item.name_offset >= listing->names.size()) {
+                throw std::runtime_error("Malformed listing in snapshot");
+            }
+        }
+        if (listing_cache.enabled()) {
+            listing_cache.insert(dir_stat, std::move(listing));
+        }
+    }
+
+    uint64_t set_count = in.u64();
+    for (uint64_t i = 0; i < set_count; ++i) {
+        auto set = std::make_shared<unix_filter_set>();
+        set->root = in.string();
+        set->prune.one_filesystem = in.u8();
+        set->prune.skip_pseudo_filesystems = in.u8();
+        uint64_t pattern_count = in.u64();
+        for (uint64_t j = 0; j < pattern_count; ++j) {
+            set->prune.exclude_patterns.push_back(in.string());
+        }
+        set->paths = in.string();
+        in.pods(set->dirs);
+        in.pods(set->filters);
+        in.pods(set->words);
+        for (const auto& dir : set->dirs) {
+            if ((uint64_t)dir.path_offset + dir.path_size >= set->paths.size()) {
+                throw std::runtime_error("Malformed subtree filter in snapshot");
+            }
+        }
+        for (const auto& f : set->filters) {
+            if (f.first_dir >= f.end_dir || f.end_dir > set->dirs.size() || f.word_count == 0
+                || (uint64_t)f.first_word + f.word_count > set->words.size()) {
+                throw std::runtime_error("Malformed subtree filter in snapshot");
+            }
+        }
+        set->stale = std::make_unique<std::atomic<bool>[]>(set->filters.size());
+        for (size_t j = 0; j < set->filters.size(); ++j) {
+            set->stale[j] = in.u8() != 0;
+        }
+        unix_publish_filters(std::move(set));
+    }
+}
+
+bool fs::dir_exists(std::string_view absolute_path) noexcept {
+    struct stat statbuf;
+    if (stat(absolute_path.data(), &statbuf) != 0) {
+        return false;
+    }
+    return S_ISDIR(statbuf.st_mode);
+}
+
+uint64_t fs::path_fingerprint(std::string_view root, std::string_view path) noexcept {
+    if (root.empty() || root.back() != '/' || path.size() <= root.size() || path.compare(0, root.size(), root) != 0) {
+        return 0;
+    }
+    // changes within the timestamp granularity could go unnoticed, like for the listing cache
+    time_t unstable_since = time(0) - unix_listing_cache::UNSTABLE_SECONDS;
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto mix = [&h](uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            h ^= (value >> (i * 8)) & 0xff;
+            h *= 0x100000001b3ull;
+        }
+    };
+    std::string component(root);
+    size_t next = root.size();
+    while (true) {
+        struct stat statbuf;
+        bool last = next > path.size();
+        // the entry itself is not followed, the directories leading to it are
+        if ((last ? lstat(component.c_str(), &statbuf) : stat(component.c_str(), &statbuf)) != 0
+            || (!last && !S_ISDIR(statbuf.st_mode))
+            || statbuf.st_mtim.tv_sec >= unstable_since || statbuf.st_ctim.tv_sec >= unstable_since) {
+            return 0;
+        }
+        mix(statbuf.st_dev);
+        mix(statbuf.st_ino);
+        mix(statbuf.st_mtim.tv_sec);
+        mix(statbuf.st_mtim.tv_nsec);
+        mix(statbuf.st_ctim.tv_sec);
+        mix(statbuf.st_ctim.tv_nsec);
+        mix(statbuf.st_size);
+        if (last) {
+            break;
+        }
+        size_t end = std::min(path.find('/', next), path.size());
+        auto name = path.substr(next, end - next);
+        if (name.empty() || name == "." || name == "..") {
+            return 0;
+        }
+        component.assign(path.data(), end);
+        next = end + 1;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+bool fs::is_reported(std::string_view root, std::string_view path, const search_options& options) {
+    if (root.empty() || root.back() != '/' || path.size() <= root.size() || path.compare(0, root.size(), root) != 0
+        || path.back() == '/') {
+        return false;
+    }
+    unix_pruner pruner {options.prune, {}};
+    struct stat statbuf;
+    if (stat(std::string(root).c_str(), &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+        return false;
+    }
+    dev_t parent_dev = statbuf.st_dev;
+    std::string component(root);
+    size_t next = root.size();
+    while (true) {
+        size_t end = path.find('/', next);
+        bool last = end == std::string_view::npos;
+        end = last ? path.size() : end;
+        auto name = path.substr(next, end - next);
+        if (name.empty() || name == "." || name == "..") {
+            return false;
+        }
+        component.assign(path.data(), end);
+        if (lstat(component.c_str(), &statbuf) != 0) {
+            return false;
+        }
+        bool is_dir = S_ISDIR(statbuf.st_mode);
+        if (S_ISLNK(statbuf.st_mode) && options.follow_symlinks) {
+            struct stat target;
+            is_dir = stat(component.c_str(), &target) == 0 && S_ISDIR(target.st_mode);
+            if (is_dir) {
+                statbuf = target;
+            }
+        }
+        if (last) {
+            // directories are descended into, never reported
+            return !is_dir;
+        }
+        if (!is_dir || pruner.is_excluded(component.c_str() + next)) {
+            return false;
+        }
+        component.push_back('/');
+        if (statbuf.st_dev != parent_dev && pruner.is_pruned_mount(statbuf.st_dev, component)) {
+            return false;
+        }
+        if (options.delegate_subtree && options.delegate_subtree(component)) {
+            return false;
+        }
+        parent_dev = statbuf.st_dev;
+        next = end + 1;
+    }
+}
+
+std::string fs::find_file(std::string_view filename, const std::vector<std::string>& roots, const search_options& options) {
+    unix_traversal traversal {options, unix_pruner{options.prune, {}}, {}};
+    std::queue<unix_pending_dir> to_visit;
+    if (!unix_start_walk(roots, traversal, to_visit) || !unix_is_valid_name(filename)) {
+        return "";
+    }
+    unix_filter_probe probe;
+    if (unix_open_filters(options, filename, probe)) {
+        traversal.filters = &probe;
+    }
+    bool learning = search_history.enabled();
+    unix_search_guide guide;
+    if (learning) {
+        search_history.guide(filename, guide);
+        if (!guide.dirs.empty()) {
+            traversal.guide = &guide;
+            search_history.guided.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    std::string found;
+    size_t found_dir_size = 0;
+    auto report = [&](const std::string& dir, int dir_fd, const char* name, fs::entry_type type) {
+        if (!fs::satisfies_predicates(fs::entry{dir, name, type, dir_fd}, options)) {
+            return true;
+        }
+        // the name on disk, which differs from filename when names are folded
+        found = dir + name;
+        found_dir_size = dir.size();
+        return false;
+    };
+    if (options.name_fold) {
+        unix_dispatch_walk(to_visit, traversal,
+            unix_folded_exact_matcher{unicode::fold(filename, options.name_fold), options.name_fold}, report);
+    } else {
+        unix_dispatch_walk(to_visit, traversal, unix_exact_matcher{filename}, report);
+    }
+    if (learning && !found.empty()) {
+        auto dir = found.substr(0, found_dir_size);
+        if (guide.covers(dir)) {
+            search_history.guided_hits.fetch_add(1, std::memory_order_relaxed);
+        }
+        search_history.record(filename, dir);
+    }
+    return found;
+}
+
+void fs::walk(const std::vector<std::string>& roots, const search_options& options, const entry_visitor& visit) {
+    unix_traversal traversal {options, unix_pruner{options.prune, {}}, {}};
+    std::queue<unix_pending_dir> to_visit;
+    if (!unix_start_walk(roots, traversal, to_visit)) {
+        return;
+    }
+    unix_duplicate_filter duplicates {roots.size() > 1, {}};
+    unix_dispatch_walk(to_visit, traversal, unix_any_matcher{},
+        [&](const std::string& dir, int dir_fd, const char* name, fs::entry_type type) {
+            return !duplicates.is_first(dir, dir_fd, name) || visit(fs::entry{dir, name, type, dir_fd});
+        });
+}
+
+/**
+ * Runs the kernel instantiated for the matcher, with the subtree filters of exact names.
+ */
+template<typename Report>
+static void unix_find_matching(
+    std::queue<unix_pending_dir>& to_visit,
+    unix_traversal& traversal,
+    const fs::name_matcher& matcher,
+    Report& report
+) {
+    const auto& options = traversal.options;
+    unix_filter_probe probe;
+    switch (matcher.type) {
+        case fs::name_matcher::kind::any:
+            unix_dispatch_walk(to_visit, traversal, unix_any_matcher{}, report);
+            break;
+        case fs::name_matcher::kind::exact:
+            if (!unix_is_valid_name(matcher.text)) {
+                break;
+            }
+            if (unix_open_filters(options, matcher.text, probe)) {
+                traversal.filters = &probe;
+            }
+            if (options.name_fold) {
+                unix_dispatch_walk(to_visit, traversal,
+                    unix_folded_exact_matcher{unicode::fold(matcher.text, options.name_fold), options.name_fold}, report);
+            } else {
+                unix_dispatch_walk(to_visit, traversal, unix_exact_matcher{matcher.text}, report);
+            }
+            traversal.filters = 0;
+            break;
+        case fs::name_matcher::kind::glob:
+            if (options.name_fold) {
+                unix_dispatch_walk(to_visit, traversal,
+                    unix_folded_glob_matcher{unicode::fold(matcher.text, options.name_fold), options.name_fold}, report);
+            } else {
+                unix_dispatch_walk(to_visit, traversal, unix_glob_matcher{matcher.text.c_str()}, report);
+            }
+            break;
+    }
+}
+
+void fs::find_all(
+    const std::vector<std::string>& roots,
+    const name_matcher& matcher,
+    const search_options& options,
+    const entry_visitor& visit
+) {
+    unix_traversal traversal {options, unix_pruner{options.prune, {}}, {}};
+    std::queue<unix_pending_dir> to_visit;
+    if (!unix_start_walk(roots, traversal, to_visit)) {
+        return;
+    }
+    unix_duplicate_filter duplicates {roots.size() > 1, {}};
+    auto report = [&](const std::string& dir, int dir_fd, const char* name, fs::entry_type type) {
+        fs::entry e {dir, name, type, dir_fd};
+        return !fs::satisfies_predicates(e, options) || !duplicates.is_first(dir, dir_fd, name) || visit(e);
+    };
+    unix_find_matching(to_visit, traversal, matcher, report);
+}
+
+static constexpr uint8_t FRONTIER_FORMAT = 1;
+
+/**
+ * Stores the pairs sorted, as varint deltas: inodes of a tree are mostly allocated close together.
+ */
+static void unix_save_pairs(snapshot::writer& out, const unix_visited_set& set) {
+    std::vector<std::pair<uint64_t, uint64_t>> pairs;
+    pairs.reserve(set.count);
+    for (const auto& slot : set.slots) {
+        if (slot.ino != 0) {
+            pairs.emplace_back(slot.dev, slot.ino);
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    out.varint(pairs.size());
+    std::pair<uint64_t, uint64_t> previous {0, 0};
+    for (const auto& pair : pairs) {
+        out.varint(pair.first - previous.first);
+        out.varint(pair.first == previous.first ? pair.second - previous.second : pair.second);
+        previous = pair;
+    }
+}
+
+static void unix_load_pairs(snapshot::reader& in, unix_visited_set& set) {
+    uint64_t count = in.varint();
+    std::pair<uint64_t, uint64_t> previous {0, 0};
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t dev = previous.first + in.varint();
+        uint64_t ino = in.varint();
+        previous = {dev, dev == previous.first ? previous.second + ino : ino};
+        set.insert(previous.first, previous.second);
+    }
+}
+
+/**
+ * Serializes what a paged traversal still has to do: the directory it stopped in, the queued
+ * directories front-coded against each other (siblings share most of their path) and the
+ * (device, inode) sets which keep it from visiting a directory or reporting a file twice.
+ */
+static std::string unix_save_frontier(
+    const unix_dir_position& position,
+    std::queue<unix_pending_dir>& to_visit,
+    const unix_traversal& traversal,
+    const unix_duplicate_filter& duplicates
+) {
+    snapshot::writer out;
+    out.u8(FRONTIER_FORMAT);
+    out.u8(position.active);
+    if (position.active) {
+        out.string(position.dir.path);
+        out.varint(position.dir.dev);
+        out.varint(position.dir.ino);
+        out.u64((uint64_t)position.offset);
+    }
+    out.varint(to_visit.size());
+    std::string previous;
+    while (!to_visit.empty()) {
+        const auto& dir = to_visit.front();
+        size_t shared = 0;
+        size_t max_shared = std::min(dir.path.size(), previous.size());
+        while (shared < max_shared && dir.path[shared] == previous[shared]) {
+            ++shared;
+        }
+        out.varint(shared);
+        out.varint(dir.path.size() - shared);
+        out.out.append(dir.path, shared, std::string::npos);
+        out.varint(dir.dev);
+        out.varint(dir.ino);
+        previous = std::move(to_visit.front().path);
+        to_visit.pop();
+    }
+    unix_save_pairs(out, traversal.visited);
+    unix_save_pairs(out, duplicates.seen);
+    return std::move(out.out);
+}
+
+static void unix_load_frontier(
+    std::string_view frontier,
+    unix_dir_position& position,
+    std::queue<unix_pending_dir>& to_visit,
+    unix_traversal& traversal,
+    unix_duplicate_filter& duplicates
+) {
+    snapshot::reader in(frontier);
+    if (in.u8() != FRONTIER_FORMAT) {
+        throw std::runtime_error("Unknown traversal frontier format");
+    }
+    position.active = in.u8();
+    if (position.active) {
+        position.dir.path = in.string();
+        position.dir.dev = in.varint();
+        position.dir.ino = in.varint();
+        position.offset = (off_t)in.u64();
+    }
+    uint64_t count = in.varint();
+    std::string previous;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t shared = in.varint();
+        uint64_t suffix = in.varint();
+        if (shared > previous.size()) {
+            throw std::runtime_error("Malformed traversal frontier");
+        }
+        in.need(suffix);
+        unix_pending_dir dir {previous.substr(0, shared), 0};
+        dir.path.append(in.p, suffix);
+        in.p += suffix;
+        dir.dev = in.varint();
+        dir.ino = in.varint();
+        previous = dir.path;
+        to_visit.push(std::move(dir));
+    }
+    unix_load_pairs(in, traversal.visited);
+    unix_load_pairs(in, duplicates.seen);
+}
+
+size_t fs::find_page(
+    const std::vector<std::string>& roots,
+    const name_matcher& matcher,
+    const search_options& options,
+    size_t limit,
+    std::string& frontier,
+    const entry_visitor& visit
+) {
+    unix_traversal traversal {options, unix_pruner{options.prune, {}}, {}};
+    unix_dir_position position;
+    traversal.position = &position;
+    std::queue<unix_pending_dir> to_visit;
+    unix_duplicate_filter duplicates {roots.size() > 1, {}};
+    if (frontier.empty()) {
+        if (!unix_start_walk(roots, traversal, to_visit)) {
+            return 0;
+        }
+    } else {
+        unix_load_frontier(frontier, position, to_visit, traversal, duplicates);
+    }
+    size_t visited = 0;
+    auto report = [&](const std::string& dir, int dir_fd, const char* name, fs::entry_type type) {
+        fs::entry e {dir, name, type, dir_fd};
+        if (!fs::satisfies_predicates(e, options) || !duplicates.is_first(dir, dir_fd, name)) {
+            return true;
+        }
+        ++visited;
+        return visit(e) && visited < limit;
+    };
+    if (limit > 0) {
+        unix_find_matching(to_visit, traversal, matcher, report);
+    }
+    frontier = position.active || !to_visit.empty()
+        ? unix_save_frontier(position, to_visit, traversal, duplicates)
+        : std::string();
+    return visited;
 }
 
 #else
@@ -1,22 +1,362 @@
 #ifndef __FS_HPP__
 #define __FS_HPP__
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
 #include <string_view>
+#include <vector>
+
+namespace snapshot {
+    struct writer;
+    struct reader;
+}
 
 namespace fs {
 
+/**
+ * Rules deciding which directories a search does not descend into.
+ * All of them are evaluated before the directory is opened.
+ */
+struct prune_rules final {
+    /** fnmatch(3) globs matched against directory names, e.g. "node_modules" or ".git" */
+    std::vector<std::string> exclude_patterns;
+    /** Stay on the device the root resides on, like find -xdev */
+    bool one_filesystem = false;
+    /** Skip mounted pseudo-filesystems (procfs, sysfs, cgroupfs, ...) below the root */
+    bool skip_pseudo_filesystems = true;
+};
+
+enum class metadata_field : uint16_t {
+    /** Size in bytes */
+    size,
+    /** Seconds elapsed since the last modification */
+    mtime_age,
+    /** One of file_kind */
+    type,
+    uid,
+    gid
+};
+
+enum class comparison : uint16_t {
+    eq,
+    ne,
+    lt,
+    le,
+    gt,
+    ge
+};
+
+enum class file_kind : uint64_t {
+    regular,
+    directory,
+    symlink,
+    fifo,
+    socket,
+    block_device,
+    char_device
+};
+
+/**
+ * Condition on the metadata of a matched file, similar to find -size, -mtime, -type or -uid.
+ */
+struct metadata_predicate final {
+    metadata_field field;
+    comparison op;
+    uint64_t value;
+};
+
+struct search_options final {
+    prune_rules prune;
+    /**
+     * All of them have to hold for a file to match. They are only evaluated for files which
+     * already passed the name check, with a single statx asking for the needed fields only.
+     */
+    std::vector<metadata_predicate> predicates;
+    /**
+     * Descend into symlinked directories. Every directory is then identified by its
+     * (device, inode) pair and visited at most once, which also breaks symlink cycles.
+     */
+    bool follow_symlinks = false;
+    /** unicode::fold_mode bits applied when comparing names, 0 compares bytes */
+    unsigned name_fold = 0;
+    /**
+     * Read directories in batches of a few megabytes and descend into the subdirectories of each
+     * in inode order, for trees with directories of millions of entries. Has no effect on Windows.
+     */
+    bool large_directories = false;
+    /**
+     * Consulted with every directory (ending with a path separator) the traversal is about
+     * to descend into. Returning true means the subtree is searched elsewhere and is skipped.
+     */
+    std::function<bool(const std::string& dir)> delegate_subtree;
+    /**
+     * Called before the traversal reads a directory (ending with a path separator), e.g. to pace
+     * a crawl or to pass on what was found so far. Not called on Windows.
+     */
+    std::function<void(const std::string& dir)> on_directory;
+    /**
+     * Read the listing cache without refreshing what is found and add listings only where it has
+     * room, so that a background crawl does not evict the listings searches read. Has no effect on Windows.
+     */
+    bool cold_listing_cache = false;
+};
+
 /**
  * Finds a file by its name in a filetree, starting from the specified root and return its full path.
  * @throws std::runtime exceptions on system errors.
  * @returns empty string if file not found.
  */
-std::string find_file(std::string_view filename, std::string_view root);
+std::string find_file(std::string_view filename, std::string_view root, const search_options& options = {});
+
+/**
+ * Like find_file, but walks the trees below several roots as a single breadth-first traversal,
+ * which ends at the first match found below any of them. Roots are expected to be distinct and
+ * not nested, see normalize_roots.
+ */
+std::string find_file(std::string_view filename, const std::vector<std::string>& roots, const search_options& options = {});
+
+/**
+ * Collapses repeated separators, "." and ".." components of the roots without resolving symlinks,
+ * ends them with a path separator, sorts them and drops those nested inside another.
+ * @throws std::runtime_error on empty roots.
+ */
+std::vector<std::string> normalize_roots(const std::vector<std::string>& roots);
+
+enum class entry_type {
+    regular,
+    symlink,
+    other
+};
+
+/**
+ * Non-directory entry met during a traversal.
+ */
+struct entry final {
+    /** Directory containing the entry, ending with a path separator */
+    std::string_view dir;
+    /** NUL-terminated */
+    std::string_view name;
+    /** Type of the entry, or of its target if it is a followed symlink */
+    entry_type type;
+    /**
+     * Open descriptor of dir on unix while the entry is being visited,
+     * -1 elsewhere and for entries served from the listing cache
+     */
+    int dir_fd = -1;
+
+    std::string path() const {
+        return std::string(this->dir) + std::string(this->name);
+    }
+};
+
+/**
+ * Receives every non-directory entry of a traversal, returns false to stop it.
+ */
+using entry_visitor = std::function<bool(const entry&)>;
+
+/**
+ * Walks the filetree below root breadth-first with the same rules find_file uses.
+ * @throws std::runtime exceptions on system errors.
+ */
+void walk(std::string_view root, const search_options& options, const entry_visitor& visit);
+
+/**
+ * Walks the trees below several roots as a single traversal, visiting an entry met below more
+ * than one of them (through bind mounts) once, by its device and inode on unix.
+ */
+void walk(const std::vector<std::string>& roots, const search_options& options, const entry_visitor& visit);
+
+/**
+ * Which entry names find_all reports.
+ */
+struct name_matcher final {
+    enum class kind : uint8_t {
+        any,
+        /** Equal to text, see search_options::name_fold */
+        exact,
+        /** fnmatch(3) glob in text (PathMatchSpec on Windows) */
+        glob
+    };
+    kind type = kind::any;
+    std::string text;
+};
+
+/**
+ * Walks like walk, but only visits entries whose name matches and which satisfy options.predicates.
+ * The traversal is specialized at compile time for the matcher and the options in effect.
+ * @throws std::runtime exceptions on system errors.
+ */
+void find_all(
+    std::string_view root,
+    const name_matcher& matcher,
+    const search_options& options,
+    const entry_visitor& visit
+);
+
+/**
+ * find_all over several roots, as a single traversal like walk.
+ */
+void find_all(
+    const std::vector<std::string>& roots,
+    const name_matcher& matcher,
+    const search_options& options,
+    const entry_visitor& visit
+);
+
+/**
+ * Like find_all, but visits at most `limit` entries and leaves where it stopped in frontier, so that
+ * a later call with the same roots, matcher, options and frontier continues right after the last
+ * entry visited, instead of walking the tree again. Frontier is empty to start a traversal, and
+ * empty again once the traversal is complete. Paged traversals read directories past the listing
+ * cache: the position in a directory is the offset cookie of its filesystem, which stays valid
+ * while other entries are added or removed. Not supported on Windows.
+ * @throws std::runtime_error on system errors and malformed frontiers.
+ * @returns number of entries visited.
+ */
+size_t find_page(
+    const std::vector<std::string>& roots,
+    const name_matcher& matcher,
+    const search_options& options,
+    size_t limit,
+    std::string& frontier,
+    const entry_visitor& visit
+);
+
+/**
+ * Evaluates options.predicates against a visited entry, fetching only the metadata they need.
+ * @returns true if there are no predicates or all of them hold.
+ */
+bool satisfies_predicates(const entry& e, const search_options& options);
+
+struct listing_cache_stats final {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t bytes = 0;
+    size_t listings = 0;
+};
+
+/**
+ * Lets traversals of all threads share directory listings (names, types and the identity of
+ * subdirectories), keyed by the device and inode of the directory and revalidated against its
+ * mtime and ctime whenever they are reused. Least recently used listings are evicted beyond
+ * budget_bytes; 0 disables the cache, which is the default. Has no effect on Windows.
+ */
+void set_listing_cache_budget(size_t budget_bytes);
+
+listing_cache_stats get_listing_cache_stats();
+
+struct subtree_filter_config final {
+    /** Directories with fewer names below them get no filter, 0 disables the filters */
+    size_t min_names = 0;
+    /** Bits of a single filter, a subtree with more names gets a higher false positive rate */
+    size_t max_bytes = 256u << 10;
+    /** Target rate of filters answering "maybe" for a name that is not in their subtree */
+    double false_positive_rate = 0.01;
+};
+
+struct subtree_filter_stats final {
+    size_t filters = 0;
+    /** Filter bits and the directory table validating them */
+    size_t bytes = 0;
+    /** Filters consulted by lookups */
+    uint64_t checks = 0;
+    /** Subtrees lookups did not descend into */
+    uint64_t skipped_subtrees = 0;
+    /** Filters found stale by a directory changed since they were built */
+    uint64_t invalidations = 0;
+    /** Mean of the false positive rates estimated from the bits set in each filter */
+    double false_positive_rate = 0;
+};
+
+/**
+ * Applies to the filters built from then on. Has no effect on Windows.
+ */
+void set_subtree_filter_config(const subtree_filter_config& config);
+
+/**
+ * Walks the tree below root like walk, passing every entry to visit, and from the same crawl
+ * replaces the filters of root with a Bloom filter of the folded names below every directory
+ * holding at least config.min_names of them. find_file, and find_all with an exact matcher, skip a
+ * subtree whose filter rules the name out. A filter is trusted only while every directory of its
+ * subtree has the device, inode, mtime and ctime it was crawled with, which costs a stat per
+ * directory instead of reading them.
+ * Options following symlinks, with predicates or delegating subtrees walk without building filters.
+ * Searches following symlinks or pruning less than the crawl do not use the filters.
+ * @throws std::runtime exceptions on system errors.
+ * @returns number of filters built.
+ */
+size_t build_subtree_filters(std::string_view root, const search_options& options, const entry_visitor& visit);
+
+subtree_filter_stats get_subtree_filter_stats();
+
+struct search_history_config final {
+    /** Names and extensions whose hits are remembered, 0 disables the history, which is the default */
+    size_t max_shapes = 0;
+    /** Remembered directories a lookup expands first */
+    unsigned dirs_per_shape = 4;
+    /** Time after which a hit weighs half as much */
+    std::chrono::seconds half_life {7 * 24 * 3600};
+};
+
+struct search_history_stats final {
+    /** Names and extensions remembered */
+    size_t shapes = 0;
+    /** Lookups which had remembered directories to expand first */
+    uint64_t guided_lookups = 0;
+    /** Guided lookups whose match was in or below one of them */
+    uint64_t guided_hits = 0;
+};
+
+/**
+ * Has find_file remember the directories its matches were found in, by name and by extension, in
+ * a frequency table whose scores decay with config.half_life. Later lookups of the same name, or
+ * failing that of the same extension, read the directories leading to and below the best scored
+ * ones before the others. They still read every directory they would have, so misses and matches
+ * elsewhere are found as before, though the first match reported may not be the breadth-first one.
+ * Has no effect on Windows.
+ */
+void set_search_history_config(const search_history_config& config);
+
+search_history_stats get_search_history_stats();
+
+/**
+ * Saves the cached listings and the subtree filters for a successor process.
+ */
+void save_warm_state(snapshot::writer& out);
+
+/**
+ * Restores what save_warm_state saved, within the listing cache budget in effect. Listings and
+ * filters are revalidated against the directories when they are used, like those read here.
+ * @throws std::runtime_error on malformed snapshots.
+ */
+void load_warm_state(snapshot::reader& in);
 
 /**
  * Check if specified path is an existing directory
  */
 bool dir_exists(std::string_view absolute_path) noexcept;
 
+/**
+ * Digest of the device, inode, mtime, ctime and size of path and of every directory from root
+ * (ending with a path separator) down to it. It changes when an entry is added to, removed from or
+ * renamed in one of these directories, or when the entry at path is modified.
+ * @returns 0 if path is not below root, a component cannot be stat'ed or changed within the last
+ * seconds, or on Windows.
+ */
+uint64_t path_fingerprint(std::string_view root, std::string_view path) noexcept;
+
+/**
+ * Tells whether a traversal of root (ending with a path separator) under the options would report
+ * the entry at path, going by the same rules component by component: excluded names, mount points
+ * left out, symlinked directories not followed and subtrees delegated elsewhere. Names and
+ * predicates are not checked. Components are looked up with lstat.
+ * @returns false on Windows.
+ */
+bool is_reported(std::string_view root, std::string_view path, const search_options& options);
+
 } // fs
 
 #endif // __FS_HPP__
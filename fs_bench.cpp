@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include "fs.hpp"
+
+#ifdef __unix__
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <fnmatch.h>
+
+/**
+ * Generated tree of `fanout` directories per level, `depth` levels deep,
+ * with `files_per_dir` regular files and one symlink back to the root in every directory.
+ */
+struct bench_tree final {
+    /**
+     * Spool-like root of `files` regular files next to `subdirs` directories of `files_per_subdir` files.
+     */
+    struct spool_layout final {
+        int files;
+        int subdirs;
+        int files_per_subdir;
+    };
+
+    std::string root;
+    int entries = 0;
+
+    bench_tree(int depth, int fanout, int files_per_dir)
+        : root(make_root()) {
+        this->populate(this->root, depth, fanout, files_per_dir);
+    }
+
+    explicit bench_tree(const spool_layout& layout)
+        : root(make_root()) {
+        for (int i = 0; i < layout.files; ++i) {
+            this->create_file(this->root + "msg" + std::to_string(i));
+        }
+        for (int i = 0; i < layout.subdirs; ++i) {
+            auto sub = this->root + "queue" + std::to_string(i) + '/';
+            mkdir(sub.c_str(), 0755);
+            ++this->entries;
+            for (int j = 0; j < layout.files_per_subdir; ++j) {
+                this->create_file(sub + "msg" + std::to_string(j));
+            }
+        }
+    }
+
+    ~bench_tree() {
+        nftw(this->root.c_str(), remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    }
+
+    static std::string make_root() {
+        char tmpl[] = "/tmp/rfinder-bench-XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            throw std::runtime_error("mkdtemp failed");
+        }
+        return std::string(tmpl) + '/';
+    }
+
+    void create_file(const std::string& path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            close(fd);
+        }
+        ++this->entries;
+    }
+
+    void populate(const std::string& dir, int depth, int fanout, int files_per_dir) {
+        for (int i = 0; i < files_per_dir; ++i) {
+            this->create_file(dir + "file" + std::to_string(i) + ".txt");
+        }
+        symlink(this->root.c_str(), (dir + "loop").c_str());
+        ++this->entries;
+        if (depth == 0) {
+            return;
+        }
+        for (int i = 0; i < fanout; ++i) {
+            auto sub = dir + "dir" + std::to_string(i) + '/';
+            mkdir(sub.c_str(), 0755);
+            ++this->entries;
+            this->populate(sub, depth - 1, fanout, files_per_dir);
+        }
+    }
+
+    static int remove_entry(const char* path, const struct stat*, int, FTW*) {
+        return remove(path);
+    }
+};
+
+template<typename Search>
+static void bench(const char* name, const bench_tree& tree, int iterations, Search&& search) {
+    // warm the dentry cache so that only traversal overhead is compared
+    search();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        if (search()) {
+            throw std::runtime_error("Unexpected match");
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    printf("%-28s %10.0f us/search %8.1f ns/entry\n", name, ns / 1000, ns / tree.entries);
+}
+
+static void bench_miss(const char* name, const bench_tree& tree, const fs::search_options& options, int iterations) {
+    bench(name, tree, iterations, [&] {
+        return !fs::find_file("no-such-file", tree.root, options).empty();
+    });
+}
+
+static void bench_glob_miss(const char* name, const bench_tree& tree, const fs::search_options& options, int iterations) {
+    fs::name_matcher matcher {fs::name_matcher::kind::glob, "*.no-such-ext"};
+    bench(name, tree, iterations, [&] {
+        bool found = false;
+        fs::find_all(tree.root, matcher, options, [&](const fs::entry&) {
+            found = true;
+            return false;
+        });
+        return found;
+    });
+}
+
+/**
+ * Compares searches filtering names in the visitor of the generic walk, as all-matches searches
+ * and grep did before, with find_all running the kernel specialized on the matcher and policy.
+ */
+static void bench_kernel(const bench_tree& tree, const fs::search_options& options, int iterations) {
+    const std::string pattern = "*.no-such-ext";
+    bench("glob, generic walk", tree, iterations, [&] {
+        bool found = false;
+        fs::walk(tree.root, options, [&](const fs::entry& entry) {
+            found = fnmatch(pattern.c_str(), entry.name.data(), 0) == 0;
+            return !found;
+        });
+        return found;
+    });
+    bench_glob_miss("glob, template kernel", tree, options, iterations);
+
+    const std::string name = "no-such-file";
+    bench("exact, generic walk", tree, iterations, [&] {
+        bool found = false;
+        fs::walk(tree.root, options, [&](const fs::entry& entry) {
+            found = entry.name == name;
+            return !found;
+        });
+        return found;
+    });
+    fs::name_matcher matcher {fs::name_matcher::kind::exact, name};
+    bench("exact, template kernel", tree, iterations, [&] {
+        bool found = false;
+        fs::find_all(tree.root, matcher, options, [&](const fs::entry&) {
+            found = true;
+            return false;
+        });
+        return found;
+    });
+}
+
+/**
+ * Times lookups of a name which has to be found.
+ */
+static void bench_hit(const char* name, const std::string& filename, const bench_tree& tree,
+                      const fs::search_options& options, int iterations) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        if (fs::find_file(filename, tree.root, options).empty()) {
+            throw std::runtime_error("Missed " + filename);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    printf("%-28s %10.0f us/search\n", name, ns / 1000);
+}
+
+/**
+ * Compares lookups of names in the last directory a breadth-first traversal reads, with and
+ * without the search history pointing at it.
+ */
+static void bench_search_history(bench_tree& tree, const fs::search_options& options, int iterations) {
+    auto deepest = tree.root + "dir7/dir7/dir7/dir7/";
+    tree.create_file(deepest + "needle.cfg");
+    tree.create_file(deepest + "other.cfg");
+    bench_hit("deep hit, breadth-first", "needle.cfg", tree, options, iterations);
+
+    fs::search_history_config config;
+    config.max_shapes = 4096;
+    fs::set_search_history_config(config);
+    // the lookup to learn from
+    fs::find_file("needle.cfg", tree.root, options);
+    bench_hit("deep hit, learned name", "needle.cfg", tree, options, iterations);
+    bench_hit("deep hit, learned extension", "other.cfg", tree, options, 1);
+    bench("miss, learned extension", tree, iterations, [&] {
+        return !fs::find_file("missing.cfg", tree.root, options).empty();
+    });
+    auto history = fs::get_search_history_stats();
+    printf("search history: %zu shapes, %llu guided lookups, %llu in remembered directories\n", history.shapes,
+        (unsigned long long)history.guided_lookups, (unsigned long long)history.guided_hits);
+    fs::set_search_history_config(fs::search_history_config{});
+}
+
+/**
+ * Evicts clean page, dentry and inode caches, which needs root.
+ * @returns false if they could not be dropped.
+ */
+static bool drop_caches() {
+    sync();
+    FILE* f = fopen("/proc/sys/vm/drop_caches", "w");
+    if (!f) {
+        return false;
+    }
+    bool dropped = fputs("3", f) >= 0;
+    return fclose(f) == 0 && dropped;
+}
+
+/**
+ * Times searches starting with nothing cached, as on a server whose caches were evicted.
+ */
+static void bench_cold_miss(const char* name, const bench_tree& tree, const fs::search_options& options, int iterations) {
+    std::chrono::steady_clock::duration elapsed {};
+    for (int i = 0; i < iterations; ++i) {
+        if (!drop_caches()) {
+            printf("%-28s skipped, caches cannot be dropped\n", name);
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (!fs::find_file("no-such-file", tree.root, options).empty()) {
+            throw std::runtime_error("Unexpected match");
+        }
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    printf("%-28s %10.0f us/search %8.1f ns/entry\n", name, ns / 1000, ns / tree.entries);
+}
+
+/**
+ * Compares readdir with the large-directory mode on a directory of `files` entries.
+ */
+static void bench_huge_directory(int files, int iterations) {
+    bench_tree spool(bench_tree::spool_layout{files, 1024, 16});
+    auto created = std::chrono::steady_clock::now();
+    printf("Tree %s: %d entries\n", spool.root.c_str(), spool.entries);
+    // every search reads the whole directory, fewer of them keep the run short
+    iterations = std::max(1, iterations / 4);
+
+    fs::search_options plain;
+    bench_miss("huge directory, readdir", spool, plain, iterations);
+
+    fs::search_options large;
+    large.large_directories = true;
+    bench_miss("huge directory, getdents64", spool, large, iterations);
+    bench_glob_miss("huge directory, glob, large", spool, large, iterations);
+
+    bench_cold_miss("huge directory, readdir, cold", spool, plain, 3);
+    bench_cold_miss("huge directory, large, cold", spool, large, 3);
+
+    // the budget a server shares by default, which a listing of the directory may not fit in
+    std::this_thread::sleep_until(created + std::chrono::seconds(3));
+    fs::set_listing_cache_budget(64u << 20);
+    bench_miss("huge directory, readdir, cache", spool, plain, iterations);
+    bench_miss("huge directory, large, cache", spool, large, iterations);
+    auto cache = fs::get_listing_cache_stats();
+    printf("listing cache: %zu listings, %zu KiB, %llu hits, %llu misses\n", cache.listings, cache.bytes / 1024,
+        (unsigned long long)cache.hits, (unsigned long long)cache.misses);
+    fs::set_listing_cache_budget(0);
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 20;
+    // entries of the generated huge directory, 0 skips it
+    int huge_directory_files = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    try {
+        bench_tree tree(4, 8, 16);
+        auto created = std::chrono::steady_clock::now();
+        printf("Tree %s: %d entries\n", tree.root.c_str(), tree.entries);
+
+        fs::search_options plain;
+        plain.prune.skip_pseudo_filesystems = false;
+        bench_miss("readdir only", tree, plain, iterations);
+
+        fs::search_options defaults;
+        bench_miss("default prune rules", tree, defaults, iterations);
+
+        fs::search_options follow;
+        follow.follow_symlinks = true;
+        bench_miss("follow symlinks", tree, follow, iterations);
+
+        bench_glob_miss("glob, default prune rules", tree, defaults, iterations);
+        bench_kernel(tree, defaults, iterations);
+
+        bench_search_history(tree, defaults, iterations);
+
+        // directories changed within the last seconds are never cached
+        std::this_thread::sleep_until(created + std::chrono::seconds(3));
+        fs::set_listing_cache_budget(256u << 20);
+        bench_miss("listing cache, default prune", tree, defaults, iterations);
+        bench_miss("listing cache, follow", tree, follow, iterations);
+        auto cache = fs::get_listing_cache_stats();
+        printf("listing cache: %zu listings, %zu KiB, %llu hits, %llu misses\n", cache.listings, cache.bytes / 1024,
+            (unsigned long long)cache.hits, (unsigned long long)cache.misses);
+        fs::set_listing_cache_budget(0);
+
+        fs::subtree_filter_config filter_config;
+        filter_config.min_names = 1000;
+        fs::set_subtree_filter_config(filter_config);
+        fs::build_subtree_filters(tree.root, defaults, [](const fs::entry&) { return true; });
+        bench_miss("subtree filters, default", tree, defaults, iterations);
+        auto filters = fs::get_subtree_filter_stats();
+        printf("subtree filters: %zu filters, %zu KiB, %.2g false positive rate, %llu subtrees skipped\n",
+            filters.filters, filters.bytes / 1024, filters.false_positive_rate,
+            (unsigned long long)filters.skipped_subtrees);
+
+        if (huge_directory_files > 0) {
+            bench_huge_directory(huge_directory_files, iterations);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Benchmark failed: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+#else
+
+int main() {
+    fputs("rfinder-fs-bench is only available on unix\n", stderr);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,530 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <regex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "grep.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const char* scalar_find_literal(const char* begin, const char* end, std::string_view needle) {
+    const size_t n = needle.size();
+    const char* p = begin;
+    while (p + n <= end) {
+        p = (const char*)memchr(p, needle[0], end - p - n + 1);
+        if (!p) {
+            return end;
+        }
+        if (!memcmp(p + 1, needle.data() + 1, n - 1)) {
+            return p;
+        }
+        ++p;
+    }
+    return end;
+}
+
+const char* grep::find_literal(const char* begin, const char* end, std::string_view needle) noexcept {
+    const size_t n = needle.size();
+    if (n == 0) {
+        return begin;
+    }
+    if ((size_t)(end - begin) < n) {
+        return end;
+    }
+    if (n == 1) {
+        auto found = (const char*)memchr(begin, needle[0], end - begin);
+        return found ? found : end;
+    }
+    const char* p = begin;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i second = _mm_set1_epi8(needle[1]);
+    // both loads have to stay inside the buffer: p + 1 + 16 <= end
+    while (end - p >= 17) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)p);
+        __m128i block_second = _mm_loadu_si128((const __m128i*)(p + 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(block_first, first),
+            _mm_cmpeq_epi8(block_second, second)
+        ));
+        while (mask) {
+            const char* candidate = p + __builtin_ctz(mask);
+            if (candidate + n > end) {
+                return end;
+            }
+            if (!memcmp(candidate + 2, needle.data() + 2, n - 2)) {
+                return candidate;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    return scalar_find_literal(p, end, needle);
+}
+
+#ifdef __unix__
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const size_t MAX_LINE_LENGTH = 512;
+static const size_t BINARY_PROBE_SIZE = 8 * 1024;
+static const size_t MAX_QUEUED_FILES = 4096;
+static const size_t READ_CHUNK_SIZE = 256 * 1024;
+/** Matches a search holds for its thread to report before the pool stops taking its files */
+static const size_t MAX_READY_MATCHES = 1024;
+/** Matches a search holds before scanning threads wait, only reached by files matching a lot */
+static const size_t MAX_HELD_MATCHES = 64 * MAX_READY_MATCHES;
+
+static uint32_t count_lines(const char* begin, const char* end) {
+    uint32_t lines = 0;
+    while (begin < end) {
+        begin = (const char*)memchr(begin, '\n', end - begin);
+        if (!begin) {
+            break;
+        }
+        ++lines;
+        ++begin;
+    }
+    return lines;
+}
+
+/**
+ * A content search shared by its thread and the scanning threads. Scanning threads queue the
+ * matches they find, and the search thread reports them, so that a client slow to take them
+ * holds back its own search only.
+ */
+struct grep_state final {
+    const grep::query& query;
+    const grep::match_callback& on_match;
+    std::regex regex;
+    std::mutex emit_mutex;
+    /** Scanning threads waiting for the search thread to take the ready matches */
+    std::condition_variable room;
+    std::deque<grep::match> ready;
+    /** Size of ready, read without the lock */
+    std::atomic<size_t> ready_count {0};
+    std::atomic<bool> stopped {false};
+    std::atomic<size_t> matches {0};
+    /** Wakes the search thread up once ready is no longer empty */
+    std::function<void()> on_ready;
+
+    /**
+     * Queues a match for the search thread, waiting while MAX_HELD_MATCHES are queued.
+     * @returns false if the search was stopped.
+     */
+    bool emit(grep::match&& m) {
+        {
+            std::unique_lock<std::mutex> lock(this->emit_mutex);
+            this->room.wait(lock, [this] {
+                return this->ready.size() < MAX_HELD_MATCHES || this->stopped.load(std::memory_order_relaxed);
+            });
+            if (this->stopped.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            this->ready.push_back(std::move(m));
+            if (this->ready_count.fetch_add(1) != 0) {
+                return true;
+            }
+        }
+        this->on_ready();
+        return true;
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(this->emit_mutex);
+        this->stopped = true;
+        this->room.notify_all();
+    }
+
+    /**
+     * Reports the queued matches, called by the search thread only.
+     * @returns true if the queue was full, which keeps the pool from taking files of the search.
+     */
+    bool report_ready() {
+        std::deque<grep::match> taken;
+        {
+            std::lock_guard<std::mutex> lock(this->emit_mutex);
+            taken.swap(this->ready);
+            this->ready_count = 0;
+            this->room.notify_all();
+        }
+        for (const auto& m : taken) {
+            if (this->stopped.load(std::memory_order_relaxed)) {
+                break;
+            }
+            ++this->matches;
+            if (!this->on_match(m)) {
+                this->stop();
+            }
+        }
+        return taken.size() >= MAX_READY_MATCHES;
+    }
+
+    /**
+     * @returns pointer to the start of the first matching line in [begin, end), or end.
+     */
+    const char* next_matching_line(const char* begin, const char* end) const {
+        if (!this->query.regex) {
+            const char* found = grep::find_literal(begin, end, this->query.pattern);
+            if (found == end) {
+                return end;
+            }
+            while (found > begin && found[-1] != '\n') {
+                --found;
+            }
+            return found;
+        }
+        for (const char* line = begin; line < end; ) {
+            auto line_end = (const char*)memchr(line, '\n', end - line);
+            if (!line_end) {
+                line_end = end;
+            }
+            if (std::regex_search(line, line_end, this->regex)) {
+                return line;
+            }
+            line = line_end + 1;
+        }
+        return end;
+    }
+
+    /**
+     * Bytes kept from the end of a piece of a line longer than the read buffer, so that a match
+     * spanning two pieces is still found. Regular expressions only get a line's worth of context.
+     */
+    size_t piece_overlap() const {
+        return this->query.regex ? MAX_LINE_LENGTH : this->query.pattern.size() - 1;
+    }
+
+    /**
+     * Reports the matching lines of [begin, end), which ends at a line boundary.
+     * @param continued the first line began in a previous chunk and was already reported
+     * @returns false if the search was stopped.
+     */
+    bool scan_lines(const std::string& path, const char* begin, const char* end, uint32_t& line_number, bool continued) {
+        const char* counted_up_to = begin;
+        const char* cursor = begin;
+        while (cursor < end && !this->stopped.load(std::memory_order_relaxed)) {
+            const char* line = this->next_matching_line(cursor, end);
+            if (line == end) {
+                break;
+            }
+            auto line_end = (const char*)memchr(line, '\n', end - line);
+            if (!line_end) {
+                line_end = end;
+            }
+            line_number += count_lines(counted_up_to, line);
+            counted_up_to = line;
+            size_t line_length = std::min((size_t)(line_end - line), MAX_LINE_LENGTH);
+            if (!(continued && line == begin)
+                && !this->emit(grep::match{path, line_number, std::string(line, line_length)})) {
+                return false;
+            }
+            cursor = line_end + 1;
+        }
+        line_number += count_lines(counted_up_to, end);
+        return true;
+    }
+
+    /**
+     * Reads the file a chunk at a time into buffer, carrying the unterminated last line of a chunk
+     * over to the next one. Unlike a mapping, reading survives the file being truncated meanwhile:
+     * the scan just ends early.
+     */
+    void scan_file(const std::string& path, std::vector<char>& buffer) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd == -1) {
+            return;
+        }
+        struct stat statbuf;
+        if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            this->scan_descriptor(fd, path, buffer);
+        }
+        close(fd);
+    }
+
+    void scan_descriptor(int fd, const std::string& path, std::vector<char>& buffer) {
+        char* data = buffer.data();
+        size_t carried = 0;
+        off_t offset = 0;
+        uint32_t line_number = 1;
+        // the line at the start of the buffer was already reported from a previous piece
+        bool continued = false;
+        while (!this->stopped.load(std::memory_order_relaxed)) {
+            ssize_t n = pread(fd, data + carried, buffer.size() - carried, offset);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                return;
+            }
+            if (offset == 0 && memchr(data, 0, std::min((size_t)n, BINARY_PROBE_SIZE))) {
+                return;
+            }
+            offset += n;
+            const char* end = data + carried + n;
+            if (n == 0) {
+                this->scan_lines(path, data, end, line_number, continued);
+                return;
+            }
+            // the carried bytes hold no line terminator
+            auto last_newline = (const char*)memrchr(data + carried, '\n', n);
+            if (last_newline) {
+                const char* lines_end = last_newline + 1;
+                if (!this->scan_lines(path, data, lines_end, line_number, continued)) {
+                    return;
+                }
+                continued = false;
+                carried = end - lines_end;
+                memmove(data, lines_end, carried);
+            } else if (end < data + buffer.size()) {
+                carried = end - data;
+            } else {
+                // a piece of a line longer than the buffer
+                if (!continued && this->next_matching_line(data, end) != end) {
+                    if (!this->emit(grep::match{path, line_number, std::string(data, MAX_LINE_LENGTH)})) {
+                        return;
+                    }
+                    continued = true;
+                }
+                carried = this->piece_overlap();
+                memmove(data, end - carried, carried);
+            }
+        }
+    }
+};
+
+/**
+ * Pool of threads scanning the files of every content search, so that concurrent searches share
+ * a fixed number of threads. Each search queues the paths its traversal enumerates as a job,
+ * and the threads take files from the jobs in turn, passing over those with a full match queue.
+ */
+struct scan_pool final {
+    struct job final {
+        grep_state& state;
+        std::deque<std::string> paths;
+        /** Files taken by threads and not scanned yet */
+        size_t scanning = 0;
+        /** Wakes the search thread for room in paths, ready matches, or the last file scanned */
+        std::condition_variable progress;
+    };
+
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::vector<job*> jobs;
+    size_t next_job = 0;
+    unsigned workers = 0;
+    bool started = false;
+
+    void start() {
+        unsigned count = this->workers ? this->workers : std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < count; ++i) {
+            // threads live as long as the process, the pool is never destroyed
+            std::thread([this] { this->run(); }).detach();
+        }
+        this->started = true;
+    }
+
+    void add(job& j) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->started) {
+            this->start();
+        }
+        this->jobs.push_back(&j);
+    }
+
+    void wake(job& j) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        j.progress.notify_all();
+    }
+
+    /**
+     * Reports the ready matches of the job, called by its search thread without the lock.
+     */
+    void report(job& j) {
+        if (j.state.report_ready()) {
+            // files of the job were passed over while its queue was full
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->work_available.notify_all();
+        }
+    }
+
+    /**
+     * Queues a file of the job, reporting ready matches while the queue is full.
+     */
+    void push(job& j, std::string path) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            j.progress.wait(lock, [&j] {
+                return j.paths.size() < MAX_QUEUED_FILES || j.state.stopped.load(std::memory_order_relaxed)
+                    || j.state.ready_count.load() != 0;
+            });
+            if (j.state.ready_count.load() == 0 || j.state.stopped.load(std::memory_order_relaxed)) {
+                break;
+            }
+            lock.unlock();
+            this->report(j);
+            lock.lock();
+        }
+        if (j.state.stopped.load(std::memory_order_relaxed)) {
+            return;
+        }
+        j.paths.push_back(std::move(path));
+        this->work_available.notify_one();
+    }
+
+    /**
+     * Reports the matches of the files queued by the job until they are scanned, or dropped
+     * once it was stopped.
+     */
+    void finish(job& j) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            if (j.state.stopped.load(std::memory_order_relaxed)) {
+                j.paths.clear();
+            }
+            j.progress.wait(lock, [&j] {
+                return (j.paths.empty() && j.scanning == 0) || j.state.ready_count.load() != 0;
+            });
+            if (j.state.ready_count.load() == 0) {
+                break;
+            }
+            lock.unlock();
+            this->report(j);
+            lock.lock();
+        }
+        this->jobs.erase(std::find(this->jobs.begin(), this->jobs.end(), &j));
+    }
+
+    job* take(std::string& path) {
+        for (size_t i = 0; i < this->jobs.size(); ++i) {
+            job* j = this->jobs[(this->next_job + i) % this->jobs.size()];
+            if (!j->paths.empty() && j->state.ready_count.load(std::memory_order_relaxed) < MAX_READY_MATCHES) {
+                this->next_job = (this->next_job + i + 1) % this->jobs.size();
+                path = std::move(j->paths.front());
+                j->paths.pop_front();
+                ++j->scanning;
+                j->progress.notify_all();
+                return j;
+            }
+        }
+        return 0;
+    }
+
+    void run() {
+        std::vector<char> buffer(READ_CHUNK_SIZE);
+        std::string path;
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            job* j = 0;
+            this->work_available.wait(lock, [&] { return (j = this->take(path)) != 0; });
+            auto& state = j->state;
+            lock.unlock();
+            if (!state.stopped.load(std::memory_order_relaxed)) {
+                // literal patterns longer than a chunk still fit with their overlap
+                if (buffer.size() < 4 * state.query.pattern.size()) {
+                    buffer.resize(4 * state.query.pattern.size());
+                }
+                state.scan_file(path, buffer);
+            }
+            lock.lock();
+            --j->scanning;
+            if (j->paths.empty() && j->scanning == 0) {
+                j->progress.notify_all();
+            }
+        }
+    }
+};
+
+static scan_pool& shared_pool() {
+    static auto* pool = new scan_pool();
+    return *pool;
+}
+
+void grep::set_workers(unsigned workers) {
+    auto& pool = shared_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.workers = workers;
+}
+
+size_t grep::search(
+    const std::vector<std::string>& roots,
+    const query& q,
+    const fs::search_options& options,
+    const match_callback& on_match
+) {
+    if (q.pattern.empty()) {
+        throw std::runtime_error("Empty content pattern");
+    }
+    grep_state state {q, on_match, {}, {}, {}, {}, {0}, {false}, {0}, {}};
+    if (q.regex) {
+        state.regex = std::regex(q.pattern, std::regex::ECMAScript | std::regex::optimize);
+    }
+
+    auto& pool = shared_pool();
+    scan_pool::job job {state, {}, 0, {}};
+    state.on_ready = [&pool, &job] { pool.wake(job); };
+    pool.add(job);
+    try {
+        fs::name_matcher matcher;
+        if (!q.filename_glob.empty()) {
+            matcher.type = fs::name_matcher::kind::glob;
+            matcher.text = q.filename_glob;
+        }
+        fs::find_all(roots, matcher, options, [&](const fs::entry& entry) {
+            if (state.ready_count.load(std::memory_order_relaxed) != 0) {
+                pool.report(job);
+            }
+            if (state.stopped.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            if (entry.type != fs::entry_type::regular) {
+                return true;
+            }
+            pool.push(job, entry.path());
+            return true;
+        });
+    } catch (...) {
+        state.stop();
+        pool.finish(job);
+        throw;
+    }
+    pool.finish(job);
+    return state.matches;
+}
+
+#else
+
+void grep::set_workers(unsigned) {}
+
+size_t grep::search(
+    const std::vector<std::string>&,
+    const query&,
+    const fs::search_options&,
+    const match_callback&
+) {
+    throw std::runtime_error("Content search is not supported on this platform");
+}
+
+#endif
+
+size_t grep::search(
+    std::string_view root,
+    const query& q,
+    const fs::search_options& options,
+    const match_callback& on_match
+) {
+    return grep::search(std::vector<std::string>{std::string(root)}, q, options, on_match);
+}
@@ -0,0 +1,74 @@
+#ifndef __GREP_HPP__
+#define __GREP_HPP__
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "fs.hpp"
+
+namespace grep {
+
+struct query final {
+    /** Literal text, or an ECMAScript regular expression if `regex` is set */
+    std::string pattern;
+    bool regex = false;
+    /** fnmatch(3) glob the file names have to match, empty to search every file */
+    std::string filename_glob;
+};
+
+struct match final {
+    std::string path;
+    uint32_t line_number;
+    /** Matching line without its terminator, cut to a sane length */
+    std::string line;
+};
+
+/**
+ * Receives matches one at a time, returns false to stop the search.
+ */
+using match_callback = std::function<bool(const match&)>;
+
+/**
+ * Sizes the pool of threads scanning the files of all content searches, 0 for one per CPU
+ * (the default). Has no effect once a search started the pool.
+ */
+void set_workers(unsigned workers);
+
+/**
+ * Searches contents of the regular files below root, enumerated with fs::walk.
+ * Files are scanned by the threads of the pool shared with concurrent searches (see set_workers),
+ * which queue their matches for the callback invoked from the calling thread, so that a slow
+ * callback holds back this search only.
+ * Binary files (a NUL byte in their first block) are skipped.
+ * @throws std::runtime_error on system errors and std::regex_error on invalid patterns.
+ * @returns number of matching lines reported.
+ */
+size_t search(
+    std::string_view root,
+    const query& q,
+    const fs::search_options& options,
+    const match_callback& on_match
+);
+
+/**
+ * Like search, for the files below several roots enumerated by a single fs::walk.
+ */
+size_t search(
+    const std::vector<std::string>& roots,
+    const query& q,
+    const fs::search_options& options,
+    const match_callback& on_match
+);
+
+/**
+ * Finds the first occurrence of needle in [begin, end).
+ * Candidates are filtered on their first two bytes with SIMD compares before being verified.
+ * @returns pointer to the occurrence or end if there is none.
+ */
+const char* find_literal(const char* begin, const char* end, std::string_view needle) noexcept;
+
+} // grep
+
+#endif // __GREP_HPP__
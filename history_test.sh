@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+# Runs an rfinder server remembering where lookups hit and checks that the remembered location is
+# searched first, and that it never answers for a file that moved or went away.
+# Usage: ./history_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+PORT=$((20000 + RANDOM % 20000))
+ADDRESS=127.0.0.1:$PORT
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-history-XXXXXX)
+TREE=$WORK_DIR/tree
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+mkdir -p "$TREE/a/b/c" "$TREE/d" "$TREE/e"
+touch "$TREE/a/b/c/needle.cfg" "$TREE/a/b/c/other.cfg"
+
+"$SERVER" --search-history 64 "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+PIDS+=($!)
+if ! wait_for_port "$PORT"; then
+    echo "Server did not start:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+
+# checks that a lookup answers the expected message
+check() {
+    local what=$1 expected=$2
+    shift 2
+    local output
+    output=$("$CLIENT" "$ADDRESS" "$@" 2>&1)
+    if ! grep -qxF "Completed with message: \"$expected\"" <<< "$output"; then
+        fail "$what" "$output"
+    else
+        pass "$what"
+    fi
+}
+
+check "a first lookup crawls breadth-first" "$TREE/a/b/c/needle.cfg" needle.cfg "$TREE"
+touch "$TREE/e/needle.cfg"
+check "a learned location goes before shallower directories" "$TREE/a/b/c/needle.cfg" needle.cfg "$TREE"
+check "a learned extension leads to its directory" "$TREE/a/b/c/other.cfg" other.cfg "$TREE"
+mv "$TREE/a/b/c/needle.cfg" "$TREE/d/needle.cfg"
+rm "$TREE/e/needle.cfg"
+check "a file that moved is found where it went" "$TREE/d/needle.cfg" needle.cfg "$TREE"
+rm "$TREE/d/needle.cfg"
+check "a file that went away is not found" "Not found" needle.cfg "$TREE"
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
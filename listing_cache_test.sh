@@ -0,0 +1,107 @@
+#!/usr/bin/env bash
+# Runs an rfinder server with its directory listing cache and checks that cached listings never
+# hide changes: files created in or removed from a cached directory, and new subdirectories.
+# Usage: ./listing_cache_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+PORT=$((20000 + RANDOM % 20000))
+ADDRESS=127.0.0.1:$PORT
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-listing-cache-XXXXXX)
+TREE=$WORK_DIR/tree
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+mkdir -p "$TREE/a/b" "$TREE/c"
+touch "$TREE/a/b/old.txt" "$TREE/c/old.txt"
+
+"$SERVER" --listing-cache 16 "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+PIDS+=($!)
+if ! wait_for_port "$PORT"; then
+    echo "Server did not start:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+
+# checks that a lookup answers the expected message
+check() {
+    local what=$1 expected=$2
+    shift 2
+    local output
+    output=$("$CLIENT" "$ADDRESS" "$@" 2>&1)
+    if ! grep -qxF "Completed with message: \"$expected\"" <<< "$output"; then
+        fail "$what" "$output"
+    else
+        pass "$what"
+    fi
+}
+
+# listings of directories changed within the last seconds are not cached
+settle() {
+    sleep 3
+}
+
+# prints a metric of the server's --stats
+metric() {
+    "$CLIENT" --stats "$ADDRESS" 2>&1 | sed -n "s/^$1 //p"
+}
+
+settle
+check "miss before caching" "Not found" new.txt "$TREE"
+check "miss read from the cache" "Not found" new.txt "$TREE"
+hits=$(metric rfinder_listing_cache_hits_total)
+if [ "${hits:-0}" -eq 0 ]; then
+    fail "the repeated search reads cached listings" "$("$CLIENT" --stats "$ADDRESS" 2>&1 | grep listing_cache)"
+else
+    pass "cached listings read"
+fi
+
+touch "$TREE/a/new.txt"
+check "a file created in a cached directory is found" "$TREE/a/new.txt" new.txt "$TREE"
+settle
+check "a changed directory cached again still holds the file" "$TREE/a/new.txt" new.txt "$TREE"
+rm "$TREE/a/new.txt"
+check "a file removed from a cached directory is not reported" "Not found" new.txt "$TREE"
+settle
+mkdir "$TREE/a/b/d"
+touch "$TREE/a/b/d/new.txt"
+check "a file in a new subdirectory of a cached directory is found" "$TREE/a/b/d/new.txt" new.txt "$TREE"
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "protocol.hpp"
+
+#ifdef __unix__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Opens a connection, asks for the server stats (answered without searching) and reads the reply.
+ * @returns false if any step failed.
+ */
+static bool one_connection(const sockaddr_storage& address, socklen_t address_size, const std::vector<char>& request) {
+    int fd = socket(address.ss_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = connect(fd, (const sockaddr*)&address, address_size) == 0
+        && send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+    if (ok) {
+        shutdown(fd, SHUT_WR);
+        char buffer[16 * 1024];
+        size_t received = 0;
+        while (true) {
+            ssize_t n = read(fd, buffer + received, sizeof(buffer) - received);
+            if (n <= 0) {
+                break;
+            }
+            received += n;
+            size_t size = proto::peek_message_size(buffer, received);
+            if (size != 0 && size <= received) {
+                break;
+            }
+        }
+        ok = received > 0;
+    }
+    close(fd);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s ADDRESS:PORT|unix:PATH [SECONDS] [CLIENT_THREADS]\n", argv[0]);
+        return 1;
+    }
+    std::string target = argv[1];
+    int seconds = argc > 2 ? std::atoi(argv[2]) : 5;
+    unsigned threads = argc > 3 ? std::atoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency()) * 4;
+
+    sockaddr_storage address;
+    socklen_t address_size;
+    memset(&address, 0, sizeof(address));
+    auto colon = target.find(':');
+    if (target.compare(0, 5, "unix:") == 0) {
+        auto& local = (sockaddr_un&)address;
+        local.sun_family = AF_UNIX;
+        if (target.size() - 5 >= sizeof(local.sun_path)) {
+            fprintf(stderr, "Socket path too long\n");
+            return 1;
+        }
+        memcpy(local.sun_path, target.c_str() + 5, target.size() - 4);
+        address_size = sizeof(local);
+    } else if (colon != std::string::npos) {
+        auto& inet = (sockaddr_in&)address;
+        inet.sin_family = AF_INET;
+        inet.sin_port = htons(std::atoi(target.c_str() + colon + 1));
+        if (inet_pton(AF_INET, target.substr(0, colon).c_str(), &inet.sin_addr) != 1) {
+            fprintf(stderr, "Invalid address\n");
+            return 1;
+        }
+        address_size = sizeof(inet);
+    } else {
+        fprintf(stderr, "Expected ADDRESS:PORT or unix:PATH\n");
+        return 1;
+    }
+    proto::file_search_request req;
+    req.mode = proto::search_mode::server_stats;
+    auto request = req.serialize();
+
+    std::atomic<bool> stop {false};
+    std::atomic<uint64_t> completed {0};
+    std::atomic<uint64_t> failed {0};
+    std::vector<std::thread> clients;
+    for (unsigned i = 0; i < threads; ++i) {
+        clients.emplace_back([&] {
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (one_connection(address, address_size, request)) {
+                    ++completed;
+                } else {
+                    ++failed;
+                }
+            }
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for (auto& t : clients) {
+        t.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%u client threads: %.0f connections/s, %llu failed\n",
+        threads, completed / elapsed, (unsigned long long)failed.load());
+    return 0;
+}
+
+#else
+
+int main() {
+    fputs("rfinder-load-bench is only available on unix\n", stderr);
+    return 1;
+}
+
+#endif
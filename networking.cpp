@@ -1,47 +1,126 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <cstring>
 #include <cassert>
 #include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "grep.hpp"
 #include "networking.hpp"
+#include "snapshot.hpp"
 #include "threading.hpp"
+#include "tracing.hpp"
+#include "trigram.hpp"
 
 using namespace std::string_literals;
 
 #ifdef __unix__
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
-static void unix_send_response(
+static bool unix_send_response(
     int conn_fd,
     const proto::file_search_response& response
 ) {
     auto serialized_res = response.serialize();
-    write(conn_fd, serialized_res.data(), serialized_res.size()); 
+    const char* data = serialized_res.data();
+    size_t remaining = serialized_res.size();
+    while (remaining > 0) {
+        ssize_t sent = send(conn_fd, data, remaining, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        remaining -= sent;
+    }
+    return true;
+}
+
+/**
+ * @returns false if the peer closed the connection before the first byte.
+ */
+static bool unix_read_exact(int connection_fd, char* buffer, size_t size) {
+    size_t total = size;
+    while (size > 0) {
+        ssize_t valread = read(connection_fd, buffer, size);
+        if (valread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (valread == 0 && size == total) {
+            return false;
+        }
+        if (valread <= 0) {
+            throw std::runtime_error("Could not read from connection");
+        }
+        buffer += valread;
+        size -= valread;
+    }
+    return true;
 }
 
-static proto::file_search_request unix_process_accepted(int connection_fd) {
+static const size_t MAX_REQUEST_SIZE = 64 * 1024;
+
+/**
+ * @param arrived_ns if not null, set to when the first bytes of the request arrived
+ * @returns false if the client has closed the connection instead of sending another request.
+ */
+static bool unix_read_request(int connection_fd, proto::file_search_request& req, uint64_t* arrived_ns) {
     assert(connection_fd != -1);    
-    char buffer[1024] = {0};
-    int valread = read(connection_fd, buffer, sizeof(buffer));
-    if (valread == -1) {
-        throw std::runtime_error("Could not read from connection");
+    std::vector<char> buffer(sizeof(uint32_t));
+    if (!unix_read_exact(connection_fd, buffer.data(), buffer.size())) {
+        return false;
+    }
+    if (arrived_ns) {
+        *arrived_ns = tracing::now_ns();
+    }
+    size_t request_size = proto::peek_message_size(buffer.data(), buffer.size());
+    if (request_size < buffer.size() || request_size > MAX_REQUEST_SIZE) {
+        throw std::runtime_error("Invalid request size");
     }
-    return proto::file_search_request::parse_from_buffer(buffer, valread);
+    buffer.resize(request_size);
+    if (!unix_read_exact(connection_fd, buffer.data() + sizeof(uint32_t), request_size - sizeof(uint32_t))) {
+        throw std::runtime_error("Connection closed in the middle of a request");
+    }
+    req = proto::file_search_request::parse_from_buffer(buffer.data(), buffer.size());
+    return true;
 }
 
+/** Descriptor of a socket received from another process */
+struct adopted_socket final {
+    int fd;
+};
 
 struct socket_guard final {
     int fd;
 
-    socket_guard() {
-        this->fd = socket(AF_INET, SOCK_STREAM, 0);
+    explicit socket_guard(int domain = AF_INET) {
+        this->fd = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
         if (this->fd == -1) {
             throw std::runtime_error("Could not create socket");
         }
     }
 
+    explicit socket_guard(adopted_socket adopted)
+        : fd(adopted.fd) {}
+
     ~socket_guard() {
         if (this->fd) {
             close(this->fd);
@@ -49,71 +128,766 @@ struct socket_guard final {
     }
 };
 
-static void unix_callback(
+static bool unix_callback(
     const void* task_handle,
     const proto::file_search_response& res
 ) {
-    const auto* handle = (threading::unix_task_handle*)task_handle;
-    unix_send_response(handle->connection_fd, res);
+    auto* handle = (threading::unix_task_handle*)task_handle;
+    tracing::span span("write_response", handle->trace_id);
+    std::lock_guard<std::mutex> lock(handle->connection->write_mutex);
+    return unix_send_response(handle->connection->fd, res);
 }
 
-static void unix_listen(const net::tcp_server& server) {
-    socket_guard server_socket;
+/**
+ * Connections whose reader thread is still running. Once a successor took the listening sockets
+ * over, their reads are shut down, so that no request is admitted that the exit would cut off,
+ * while the responses of those already admitted are still written.
+ */
+struct unix_open_connections final {
+    std::mutex mutex;
+    std::condition_variable readers_done;
+    std::unordered_set<int> fds;
+    bool stopping = false;
+
+    /**
+     * @returns false, registering nothing, if limit connections are open already.
+     */
+    bool try_add(int fd, size_t limit) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->fds.size() >= limit) {
+            return false;
+        }
+        this->fds.insert(fd);
+        // accepted by a reactor that had not noticed the stop yet
+        if (this->stopping) {
+            shutdown(fd, SHUT_RD);
+        }
+        return true;
+    }
+
+    void remove(int fd) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->fds.erase(fd);
+        this->readers_done.notify_all();
+    }
+
+    /**
+     * @returns false if readers were still running at the deadline.
+     */
+    bool stop_reading(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->stopping = true;
+        for (int fd : this->fds) {
+            shutdown(fd, SHUT_RD);
+        }
+        return this->readers_done.wait_until(lock, deadline, [this] { return this->fds.empty(); });
+    }
+};
+
+static unix_open_connections open_connections;
+
+/**
+ * Reads requests of one client and starts a search for each of them.
+ * Clients older than proto::pipelined_requests_version send a single request per connection.
+ */
+static void unix_read_requests(
+    const std::shared_ptr<threading::unix_connection>& connection,
+    const std::string& client_address,
+    const threading::search_config& config,
+    bool serves_state
+) {
+    uint64_t reader_started_ns = tracing::now_ns();
+    bool first_request = true;
+    while (true) {
+        proto::file_search_request req;
+        // a keep-alive connection idles before its next request, which is no part of reading it
+        uint64_t read_started_ns = 0;
+        try {
+            if (!unix_read_request(connection->fd, req, tracing::enabled() ? &read_started_ns : 0)) {
+                return;
+            }
+        } catch (const std::exception& e) {
+            fprintf(stderr, "Dropping connection: %s\n", e.what());
+            shutdown(connection->fd, SHUT_RD);
+            return;
+        }
+        uint32_t trace_id = tracing::sample();
+        if (trace_id) {
+            if (first_request) {
+                tracing::record("accept_handoff", trace_id, connection->accepted_ns, reader_started_ns);
+            }
+            tracing::record("read_request", trace_id, read_started_ns, tracing::now_ns());
+        }
+        first_request = false;
+        fprintf(stdout, "Received request: filename: \"%s\", Root path: \"%s\"\n", 
+                req.filename.c_str(), req.root_path.c_str());
+        if (req.mode == proto::search_mode::content) {
+            fprintf(stdout, "Content pattern: \"%s\"\n", req.content_pattern.c_str());
+        }
+        bool pipelined = req.version >= proto::pipelined_requests_version;
+
+        if (req.mode == proto::search_mode::server_stats || req.mode == proto::search_mode::trace_dump) {
+            proto::file_search_response res;
+            if (!serves_state) {
+                // traces hold the searched paths and the names of clients
+                res.status = req.version >= proto::admission_control_version
+                    ? proto::file_search_status::rejected
+                    : proto::file_search_status::error;
+                res.payload = "Server state is only served to local clients";
+            } else {
+                res.status = proto::file_search_status::ok;
+                res.payload = req.mode == proto::search_mode::server_stats
+                    ? threading::scheduler_stats()
+                    : tracing::chrome_trace_json();
+            }
+            res.request_id = req.request_id;
+            std::lock_guard<std::mutex> lock(connection->write_mutex);
+            if (!unix_send_response(connection->fd, res) || !pipelined) {
+                return;
+            }
+            continue;
+        }
+
+        auto task_handle = std::make_unique<threading::unix_task_handle>();
+        task_handle->req = std::move(req);
+        task_handle->config = config;
+        task_handle->callback = unix_callback;
+        task_handle->connection = connection;
+        task_handle->client_address = client_address;
+        task_handle->trace_id = trace_id;
+        try {
+            threading::find_file_task(std::move(task_handle));
+        } catch (const std::exception& e) {
+            fprintf(stderr, "Could not start search: %s\n", e.what());
+            return;
+        }
+        if (!pipelined) {
+            return;
+        }
+    }
+}
+
+static void unix_serve_connection(
+    std::shared_ptr<threading::unix_connection> connection,
+    std::string client_address,
+    threading::search_config config,
+    bool serves_state
+) {
+    // registered by the reactor; the connection, and so its descriptor, outlives the registration
+    unix_read_requests(connection, client_address, config, serves_state);
+    open_connections.remove(connection->fd);
+}
+
+/**
+ * Creates a listening socket of one reactor. Every reactor binds its own socket to the same
+ * address with SO_REUSEPORT, so the kernel spreads incoming connections across their queues.
+ */
+static std::unique_ptr<socket_guard> unix_reactor_socket(const net::tcp_server& server) {
+    auto server_socket = std::make_unique<socket_guard>();
+    int enable = 1;
+    if (setsockopt(server_socket->fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0
+        || setsockopt(server_socket->fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+        throw std::runtime_error("Could not set socket options: "s + strerror(errno));
+    }
+    if (server.defer_accept_seconds > 0) {
+        int seconds = server.defer_accept_seconds;
+        if (setsockopt(server_socket->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) != 0) {
+            throw std::runtime_error("Could not enable deferred accept: "s + strerror(errno));
+        }
+    }
 
     sockaddr_in server_address;
     server_address.sin_family = AF_INET;
     inet_pton(AF_INET, server.address, &server_address.sin_addr);
     server_address.sin_port = htons(server.port);
 
-    if (bind(server_socket.fd, (sockaddr*)&server_address, sizeof(server_address)) == -1) {
+    if (bind(server_socket->fd, (sockaddr*)&server_address, sizeof(server_address)) == -1) {
         throw std::runtime_error("Could not bind socket: "s + strerror(errno));
     }
-    if (listen(server_socket.fd, 5) != 0) { 
+    if (listen(server_socket->fd, server.backlog) != 0) { 
         throw std::runtime_error("Listen failed: "s + strerror(errno));
     } 
-    fd_set read_descriptors;
-    int max_fd = server_socket.fd;
+    return server_socket;
+}
 
-    while (true) {
-        FD_ZERO(&read_descriptors);
-        FD_SET(server_socket.fd, &read_descriptors);
+/**
+ * SO_REUSEPORT lets any process of the same user bind the port too, which would silently split the
+ * connections between two servers. Before binding, a connection attempt tells whether something
+ * already listens there.
+ */
+static void unix_check_port_free(const net::tcp_server& server) {
+    socket_guard probe;
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, server.address, &address.sin_addr);
+    if (address.sin_addr.s_addr == htonl(INADDR_ANY)) {
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    address.sin_port = htons(server.port);
+    if (connect(probe.fd, (sockaddr*)&address, sizeof(address)) == 0) {
+        throw std::runtime_error("Could not bind socket: another server listens on port " + std::to_string(server.port));
+    }
+}
 
-        timeval timeout;
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
+/**
+ * Listening sockets are non-blocking and polled, so that a reactor waking up for a connection a
+ * successor process accepted first goes back to waiting instead of blocking in accept.
+ */
+static void unix_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        throw std::runtime_error("Could not make socket non-blocking: "s + strerror(errno));
+    }
+}
 
-        int ready_fds = select(max_fd + 1, &read_descriptors, 0, 0, &timeout);
+/**
+ * Creates a listening unix domain socket at path, replacing a stale one left by a previous run.
+ * A socket some server still listens on is only replaced with replace_live, for the one a
+ * predecessor hands over from. Who may connect is decided by the permissions of the socket
+ * file, created with the umask.
+ */
+static std::unique_ptr<socket_guard> unix_local_socket(const std::string& path, int backlog, bool replace_live = false) {
+    sockaddr_un local_address;
+    memset(&local_address, 0, sizeof(local_address));
+    local_address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(local_address.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    memcpy(local_address.sun_path, path.c_str(), path.size() + 1);
 
-        if (ready_fds == -1) {
-            throw std::runtime_error("Select failed: "s + strerror(errno));
+    struct stat statbuf;
+    if (lstat(path.c_str(), &statbuf) == 0) {
+        if (!S_ISSOCK(statbuf.st_mode)) {
+            throw std::runtime_error("Not a socket: " + path);
         }
-        if (ready_fds == 0) {
-            continue;
+        if (!replace_live) {
+            // only a socket nobody listens on refuses connections
+            socket_guard probe(AF_UNIX);
+            if (connect(probe.fd, (sockaddr*)&local_address, sizeof(local_address)) == 0) {
+                throw std::runtime_error("Could not bind " + path + ": another server listens on it");
+            }
+            if (errno != ECONNREFUSED && errno != ENOENT) {
+                throw std::runtime_error("Could not bind " + path + ": " + strerror(errno));
+            }
+        }
+        unlink(path.c_str());
+    }
+    auto local_socket = std::make_unique<socket_guard>(AF_UNIX);
+    if (bind(local_socket->fd, (sockaddr*)&local_address, sizeof(local_address)) == -1) {
+        throw std::runtime_error("Could not bind " + path + ": " + strerror(errno));
+    }
+    if (listen(local_socket->fd, backlog) != 0) {
+        throw std::runtime_error("Listen failed: "s + strerror(errno));
+    }
+    return local_socket;
+}
+
+/**
+ * Name the scheduler shares capacity by: the IP address of TCP peers, the uid of local ones.
+ */
+static std::string unix_client_name(int client_socket, const sockaddr_storage& client_address) {
+    if (client_address.ss_family == AF_UNIX) {
+        ucred credentials;
+        socklen_t credentials_size = sizeof(credentials);
+        if (getsockopt(client_socket, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) != 0) {
+            return "unix";
         }
+        return "uid:" + std::to_string(credentials.uid);
+    }
+    char address[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &((const sockaddr_in&)client_address).sin_addr, address, sizeof(address));
+    return address;
+}
+
+/**
+ * Whether the client may read the server state (stats and traces): over the unix socket, from a
+ * loopback address or, with remote_admin, from anywhere.
+ */
+static bool unix_serves_state(const net::tcp_server& server, const sockaddr_storage& client_address) {
+    if (server.remote_admin || client_address.ss_family == AF_UNIX) {
+        return true;
+    }
+    return client_address.ss_family == AF_INET
+        && ntohl(((const sockaddr_in&)client_address).sin_addr.s_addr) >> 24 == 127;
+}
+
+/** Becomes readable once a successor took the listening sockets over, which stops every reactor */
+static int stop_pipe[2] = {-1, -1};
+
+/** Set by SIGTERM and SIGINT, which stop the reactors like a takeover */
+static volatile sig_atomic_t terminating = 0;
 
-        if (FD_ISSET(server_socket.fd, &read_descriptors)) {
-            sockaddr_in client_address;
+static void unix_on_terminate(int) {
+    int saved_errno = errno;
+    terminating = 1;
+    char stop = 1;
+    while (write(stop_pipe[1], &stop, 1) == -1 && errno == EINTR) {}
+    errno = saved_errno;
+}
+
+/**
+ * @returns the inode of the socket file at path, 0 if there is none.
+ */
+static ino_t unix_socket_inode(const std::string& path) {
+    struct stat statbuf;
+    return lstat(path.c_str(), &statbuf) == 0 && S_ISSOCK(statbuf.st_mode) ? statbuf.st_ino : 0;
+}
+
+/**
+ * Accepts connections of one listening socket and hands each to a reader thread.
+ * Returns once a successor took the listening sockets over.
+ */
+static void unix_run_reactor(int listen_fd, const net::tcp_server& server) {
+    pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Poll failed: "s + strerror(errno));
+        }
+        if (fds[1].revents) {
+            return;
+        }
+        while (true) {
+            sockaddr_storage client_address;
             socklen_t client_address_size = sizeof(client_address);
-            int client_socket = accept(
-                server_socket.fd, 
+            int client_socket = accept4(
+                listen_fd, 
                 (sockaddr*)&client_address,
-                &client_address_size
+                &client_address_size,
+                SOCK_CLOEXEC
             );
             if (client_socket == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    // out of resources: leave the connections queued until some are released
+                    fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    break;
+                }
                 throw std::runtime_error("Accept failed: "s + strerror(errno));
             } 
-            auto req = unix_process_accepted(client_socket);
-            fprintf(stdout, "Received request: filename: \"%s\", Root path: \"%s\"\n", 
-                    req.filename.c_str(), req.root_path.c_str());
+            uint64_t accepted_ns = tracing::now_ns();
+            auto client_name = unix_client_name(client_socket, client_address);
+            // every connection holds a reader thread, which the cap keeps from piling up
+            if (!open_connections.try_add(client_socket, server.max_connections)) {
+                fprintf(stderr, "Refusing connection from %s: %zu connections open\n",
+                    client_name.c_str(), server.max_connections);
+                close(client_socket);
+                continue;
+            }
+            auto connection = std::make_shared<threading::unix_connection>(client_socket);
+            connection->accepted_ns = accepted_ns;
+            std::thread(unix_serve_connection, std::move(connection), std::move(client_name), server.search_config,
+                unix_serves_state(server, client_address)).detach();
+        }
+    }
+}
 
-            auto task_handle = std::make_unique<threading::unix_task_handle>();
-            task_handle->req = std::move(req);
-            task_handle->callback = unix_callback;
-            task_handle->connection_fd = client_socket;
-            threading::find_file_task(std::move(task_handle));
-            max_fd = std::max(max_fd, client_socket);
+/**
+ * CPUs the process may run on, which cpusets and taskset narrow down from the online ones.
+ */
+static std::vector<unsigned> unix_allowed_cpus() {
+    std::vector<unsigned> allowed;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                allowed.push_back(cpu);
+            }
+        }
+    }
+    if (allowed.empty()) {
+        allowed.push_back(0);
+    }
+    return allowed;
+}
+
+static void unix_pin_to_cpu(std::thread::native_handle_type thread, unsigned cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int result = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if (result != 0) {
+        fprintf(stderr, "Could not pin reactor to CPU %u: %s\n", cpu, strerror(result));
+    }
+}
+
+static const uint32_t HANDOFF_MAGIC = 0x50554652; // "RFUP"
+static const size_t MAX_HANDOFF_SOCKETS = 1024;
+/** Time a successor gets to load the snapshot and confirm it is ready to accept */
+static const int HANDOFF_CONFIRM_SECONDS = 120;
+
+/**
+ * Message handing the listening sockets over. The descriptors travel alongside it as SCM_RIGHTS:
+ * the TCP sockets, then the local socket if any, then a memfd holding the snapshot if any.
+ */
+struct unix_handoff_header final {
+    uint32_t magic;
+    uint32_t tcp_sockets;
+    uint32_t has_local_socket;
+    uint32_t has_snapshot;
+};
+
+/**
+ * Listening sockets and warm state taken over from the previous server.
+ */
+struct unix_inheritance final {
+    std::vector<std::unique_ptr<socket_guard>> tcp_sockets;
+    std::unique_ptr<socket_guard> local_socket;
+    /** Confirms the takeover to the previous server once written to */
+    std::unique_ptr<socket_guard> predecessor;
+};
+
+/**
+ * Writes the warm state to an anonymous memory file.
+ * @returns its descriptor, -1 if it could not be created.
+ */
+static int unix_write_snapshot() {
+    snapshot::writer out;
+    out.u32(snapshot::format_version);
+    fs::save_warm_state(out);
+    trigram::save_indexes(out);
+    int fd = memfd_create("rfinder-snapshot", MFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    const char* data = out.out.data();
+    size_t remaining = out.out.size();
+    while (remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            close(fd);
+            return -1;
         }
+        data += written;
+        remaining -= written;
     }
+    return fd;
+}
+
+static void unix_read_snapshot(int fd) {
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0 || statbuf.st_size == 0) {
+        return;
+    }
+    void* data = mmap(0, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map the snapshot: %s\n", strerror(errno));
+        return;
+    }
+    try {
+        snapshot::reader in(std::string_view((const char*)data, statbuf.st_size));
+        if (in.u32() != snapshot::format_version) {
+            throw std::runtime_error("Snapshot of another version");
+        }
+        fs::load_warm_state(in);
+        trigram::load_indexes(in);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Starting partly cold: %s\n", e.what());
+    }
+    munmap(data, statbuf.st_size);
+}
+
+/**
+ * Sends the listening sockets and a snapshot of the warm state to a successor of the same user.
+ * @returns true once the successor confirmed it accepts connections on them.
+ */
+static bool unix_hand_over(int successor_fd, const std::vector<int>& tcp_fds, int local_fd) {
+    ucred credentials;
+    socklen_t credentials_size = sizeof(credentials);
+    if (getsockopt(successor_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) != 0
+        || credentials.uid != geteuid()) {
+        fputs("Refusing handoff to a process of another user\n", stderr);
+        return false;
+    }
+    int snapshot_fd = unix_write_snapshot();
+    std::vector<int> fds = tcp_fds;
+    if (local_fd != -1) {
+        fds.push_back(local_fd);
+    }
+    if (snapshot_fd != -1) {
+        fds.push_back(snapshot_fd);
+    }
+    unix_handoff_header header {HANDOFF_MAGIC, (uint32_t)tcp_fds.size(), local_fd != -1, snapshot_fd != -1};
+    iovec data {&header, sizeof(header)};
+    std::vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)), 0);
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    cmsghdr* rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    memcpy(CMSG_DATA(rights), fds.data(), fds.size() * sizeof(int));
+    bool sent = sendmsg(successor_fd, &message, MSG_NOSIGNAL) == (ssize_t)sizeof(header);
+    if (snapshot_fd != -1) {
+        close(snapshot_fd);
+    }
+    if (!sent) {
+        return false;
+    }
+    // keep accepting until the successor is ready, it may fail to start
+    timeval timeout {HANDOFF_CONFIRM_SECONDS, 0};
+    setsockopt(successor_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char confirmation = 0;
+    return read(successor_fd, &confirmation, 1) == 1;
+}
+
+/**
+ * Waits for a successor on the upgrade socket, hands everything over and stops the reactors.
+ */
+static void unix_await_successor(std::unique_ptr<socket_guard> upgrade_socket, std::vector<int> tcp_fds, int local_fd) {
+    while (true) {
+        int successor_fd = accept4(upgrade_socket->fd, 0, 0, SOCK_CLOEXEC);
+        if (successor_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "Upgrade socket failed: %s\n", strerror(errno));
+            return;
+        }
+        bool handed_over = unix_hand_over(successor_fd, tcp_fds, local_fd);
+        close(successor_fd);
+        if (handed_over) {
+            fputs("Successor took over, no longer accepting connections\n", stdout);
+            char stop = 1;
+            while (write(stop_pipe[1], &stop, 1) == -1 && errno == EINTR) {}
+            return;
+        }
+        fputs("Handoff failed, still serving\n", stderr);
+    }
+}
+
+/**
+ * Asks the server listening on the upgrade socket for its listening sockets and warm state.
+ * @returns false if no server answers there.
+ */
+static bool unix_take_over(const std::string& path, unix_inheritance& inheritance) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    auto predecessor = std::make_unique<socket_guard>(AF_UNIX);
+    if (connect(predecessor->fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        return false;
+    }
+
+    unix_handoff_header header;
+    iovec data {&header, sizeof(header)};
+    std::vector<char> control(CMSG_SPACE((MAX_HANDOFF_SOCKETS + 2) * sizeof(int)), 0);
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    ssize_t received;
+    do {
+        received = recvmsg(predecessor->fd, &message, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+
+    std::vector<int> fds;
+    for (cmsghdr* c = CMSG_FIRSTHDR(&message); c; c = CMSG_NXTHDR(&message, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t first = fds.size();
+            fds.resize(first + count);
+            memcpy(fds.data() + first, CMSG_DATA(c), count * sizeof(int));
+        }
+    }
+    size_t expected = received == (ssize_t)sizeof(header) && header.magic == HANDOFF_MAGIC
+        ? (size_t)header.tcp_sockets + (header.has_local_socket ? 1 : 0) + (header.has_snapshot ? 1 : 0)
+        : 0;
+    if (expected == 0 || fds.size() != expected || (message.msg_flags & MSG_CTRUNC)) {
+        for (int fd : fds) {
+            close(fd);
+        }
+        throw std::runtime_error("Malformed handoff from the running server");
+    }
+    size_t i = 0;
+    for (; i < header.tcp_sockets; ++i) {
+        inheritance.tcp_sockets.push_back(std::make_unique<socket_guard>(adopted_socket{fds[i]}));
+    }
+    if (header.has_local_socket) {
+        inheritance.local_socket = std::make_unique<socket_guard>(adopted_socket{fds[i++]});
+    }
+    if (header.has_snapshot) {
+        unix_read_snapshot(fds[i]);
+        close(fds[i]);
+    }
+    inheritance.predecessor = std::move(predecessor);
+    return true;
+}
+
+static bool unix_is_bound_to(int fd, const net::tcp_server& server) {
+    sockaddr_in address;
+    socklen_t address_size = sizeof(address);
+    in_addr expected;
+    return getsockname(fd, (sockaddr*)&address, &address_size) == 0 && address.sin_family == AF_INET
+        && ntohs(address.sin_port) == server.port
+        && inet_pton(AF_INET, server.address, &expected) == 1 && address.sin_addr.s_addr == expected.s_addr;
+}
+
+static bool unix_is_bound_to(int fd, const std::string& path) {
+    sockaddr_un address;
+    socklen_t address_size = sizeof(address);
+    return getsockname(fd, (sockaddr*)&address, &address_size) == 0 && address.sun_family == AF_UNIX
+        && path == address.sun_path;
+}
+
+static void unix_listen(const net::tcp_server& server) {
+    tracing::start(server.trace_config);
+    auto cpus = unix_allowed_cpus();
+    unsigned reactors = server.reactors ? server.reactors : cpus.size();
+    if (pipe2(stop_pipe, O_CLOEXEC) != 0) {
+        throw std::runtime_error("Could not create pipe: "s + strerror(errno));
+    }
+    struct sigaction on_terminate;
+    memset(&on_terminate, 0, sizeof(on_terminate));
+    on_terminate.sa_handler = unix_on_terminate;
+    sigemptyset(&on_terminate.sa_mask);
+    sigaction(SIGTERM, &on_terminate, 0);
+    sigaction(SIGINT, &on_terminate, 0);
+    fs::set_listing_cache_budget(server.search_config.listing_cache_bytes);
+    fs::set_subtree_filter_config(server.search_config.subtree_filters);
+    fs::set_search_history_config(server.search_config.search_history);
+    grep::set_workers(server.search_config.content_workers);
+
+    // bind every socket up front so that a taken port fails the start rather than a thread;
+    // sockets taken over keep the connections queued on them while the servers switch
+    unix_inheritance inheritance;
+    if (!server.upgrade_socket_path.empty() && unix_take_over(server.upgrade_socket_path, inheritance)) {
+        fprintf(stdout, "Took over %zu sockets from the running server\n", inheritance.tcp_sockets.size());
+    }
+    std::vector<std::unique_ptr<socket_guard>> sockets;
+    for (auto& inherited : inheritance.tcp_sockets) {
+        if (unix_is_bound_to(inherited->fd, server)) {
+            sockets.push_back(std::move(inherited));
+        }
+    }
+    // sockets added to those taken over join the group of the predecessor on purpose
+    if (sockets.empty()) {
+        unix_check_port_free(server);
+    }
+    while (sockets.size() < reactors) {
+        sockets.push_back(unix_reactor_socket(server));
+    }
+    reactors = sockets.size();
+    std::unique_ptr<socket_guard> local_socket;
+    ino_t local_inode = 0;
+    if (!server.unix_socket_path.empty()) {
+        local_socket = inheritance.local_socket && unix_is_bound_to(inheritance.local_socket->fd, server.unix_socket_path)
+            ? std::move(inheritance.local_socket)
+            : unix_local_socket(server.unix_socket_path, server.backlog);
+        local_inode = unix_socket_inode(server.unix_socket_path);
+    }
+    // nobody would accept the connections queued on sockets this configuration does not listen on
+    inheritance.tcp_sockets.clear();
+    inheritance.local_socket.reset();
+    std::vector<int> listening_fds;
+    for (const auto& s : sockets) {
+        unix_set_nonblocking(s->fd);
+        listening_fds.push_back(s->fd);
+    }
+    if (local_socket) {
+        unix_set_nonblocking(local_socket->fd);
+    }
+    threading::start_scheduler(server.scheduler_config);
+    fs::search_options index_options;
+    index_options.prune = server.search_config.prune_defaults;
+    index_options.large_directories = server.search_config.large_directories;
+    trigram::start_indexing(server.search_config.index_roots, index_options, server.search_config.index_refresh);
+    fs::search_options prewarm_options = index_options;
+    // peers keep their own subtrees warm
+    prewarm_options.delegate_subtree = [routes = server.search_config.routes](const std::string& dir) {
+        return federation::find_route(routes, dir) != 0;
+    };
+    prewarm::start(server.prewarm, std::move(prewarm_options));
+
+    bool took_over = inheritance.predecessor != nullptr;
+    if (took_over) {
+        char ready = 1;
+        if (write(inheritance.predecessor->fd, &ready, 1) != 1) {
+            fputs("The previous server did not wait for the takeover\n", stderr);
+        }
+        inheritance.predecessor.reset();
+    }
+    ino_t upgrade_inode = 0;
+    if (!server.upgrade_socket_path.empty()) {
+        // the predecessor may not have closed its upgrade socket yet
+        auto upgrade_socket = unix_local_socket(server.upgrade_socket_path, 1, took_over);
+        chmod(server.upgrade_socket_path.c_str(), 0600);
+        upgrade_inode = unix_socket_inode(server.upgrade_socket_path);
+        std::thread(unix_await_successor, std::move(upgrade_socket), listening_fds,
+            local_socket ? local_socket->fd : -1).detach();
+    }
+
+    if (local_socket) {
+        std::thread([fd = local_socket->fd, &server] {
+            try {
+                unix_run_reactor(fd, server);
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Local listener stopped: %s\n", e.what());
+            }
+        }).detach();
+    }
+
+    // the calling thread serves the first socket, so a fatal accept error still ends listen()
+    for (unsigned i = 1; i < reactors; ++i) {
+        std::thread reactor([fd = sockets[i]->fd, &server] {
+            try {
+                unix_run_reactor(fd, server);
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Reactor stopped: %s\n", e.what());
+            }
+        });
+        if (server.pin_reactors) {
+            unix_pin_to_cpu(reactor.native_handle(), cpus[i % cpus.size()]);
+        }
+        reactor.detach();
+    }
+    if (server.pin_reactors) {
+        unix_pin_to_cpu(pthread_self(), cpus[0]);
+    }
+    unix_run_reactor(sockets[0]->fd, server);
+
+    // a successor took the socket files over with the sockets, otherwise nobody listens there anymore
+    if (terminating) {
+        fputs("Terminated, no longer accepting connections\n", stdout);
+        if (local_inode && unix_socket_inode(server.unix_socket_path) == local_inode) {
+            unlink(server.unix_socket_path.c_str());
+        }
+        if (upgrade_inode && unix_socket_inode(server.upgrade_socket_path) == upgrade_inode) {
+            unlink(server.upgrade_socket_path.c_str());
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() + server.drain_timeout;
+    // clients keep sending requests on open connections, only those already admitted are drained
+    if (!open_connections.stop_reading(deadline) || !threading::wait_idle(deadline)) {
+        fprintf(stderr, "Searches still running after %lld s, exiting anyway\n", (long long)server.drain_timeout.count());
+    }
+    // idle worker threads still wait on the scheduler, whose destructor would wait for them forever
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
 }
 
 #elif defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
@@ -149,7 +923,7 @@ struct win32_server_state final {
         return std::runtime_error(std::string(op) + " failed with error: " + std::to_string(WSAGetLastError()));
     }
 
-    void proccess_request(SOCKET client_socket) const {
+    void proccess_request(SOCKET client_socket, const threading::search_config& config) const {
         assert(this->listen_socket != INVALID_SOCKET);
         assert(client_socket != INVALID_SOCKET);
         char recvbuf[1024];
@@ -163,6 +937,7 @@ struct win32_server_state final {
                     req.filename.c_str(), req.root_path.c_str());
             auto task_handle = std::make_unique<threading::win32_task_handle>();
             task_handle->req = std::move(req);
+            task_handle->config = config;
             task_handle->callback = win32_send_response;
             task_handle->connection_socket = client_socket;
             task_handle->messaging_thread_handle = 0;
@@ -207,7 +982,7 @@ static void win32_listen(const net::tcp_server& server) {
     freeaddrinfo(sstate.obtained_addrinfo);
     sstate.obtained_addrinfo = 0;
 
-    auto listen_result = listen(sstate.listen_socket, SOMAXCONN);
+    auto listen_result = listen(sstate.listen_socket, server.backlog);
     if (listen_result == SOCKET_ERROR) {
         throw sstate.err("listen");
     }
@@ -217,13 +992,16 @@ static void win32_listen(const net::tcp_server& server) {
         if (client_socket == INVALID_SOCKET) {
             throw sstate.err("accept");
         }
-        sstate.proccess_request(client_socket);
+        sstate.proccess_request(client_socket, server.search_config);
     }
 }
 #endif
 
 void net::tcp_server::listen() const {
     printf("Listening on %s:%d\n", this->address, this->port);
+    if (!this->unix_socket_path.empty()) {
+        printf("Listening on unix:%s\n", this->unix_socket_path.c_str());
+    }
 #ifdef __unix__
     unix_listen(*this);
 #elif defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
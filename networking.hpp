@@ -1,14 +1,46 @@
 #ifndef __NETWORKING_HPP__
 #define __NETWORKING_HPP__
 
+#include <chrono>
 #include <cstdint>
+#include <string>
+#include "prewarm.hpp"
 #include "protocol.hpp"
+#include "threading.hpp"
+#include "tracing.hpp"
 
 namespace net {
 
     struct tcp_server final {
         const char* address;
         uint16_t port;
+        threading::search_config search_config;
+        threading::scheduler_config scheduler_config;
+        /** Threads accepting connections, each on its own SO_REUSEPORT socket; 0 for one per CPU */
+        unsigned reactors = 0;
+        /** Pin every reactor thread to its own CPU */
+        bool pin_reactors = true;
+        /** Pending connection queue of every listening socket, capped by net.core.somaxconn */
+        int backlog = 4096;
+        /** Wake the acceptor only once the request has arrived (TCP_DEFER_ACCEPT), 0 to disable */
+        int defer_accept_seconds = 0;
+        /** Connections served at once, each by its own reader thread; more are closed right away */
+        size_t max_connections = 1024;
+        /** Answer stats and trace dumps to any client, not only to local and loopback ones */
+        bool remote_admin = false;
+        /** Path of a unix domain socket to listen on alongside TCP, empty for none */
+        std::string unix_socket_path;
+        /**
+         * Unix domain socket through which a server started later with the same path takes the
+         * listening sockets and warm state over, and this one takes them over from a running one.
+         * Empty disables upgrades.
+         */
+        std::string upgrade_socket_path;
+        /** Time searches in flight get to complete once a successor took over, or SIGTERM or SIGINT stopped the server */
+        std::chrono::seconds drain_timeout {30};
+        tracing::trace_config trace_config;
+        /** Crawls keeping the kernel caches of some trees warm while no search runs */
+        prewarm::crawl_config prewarm;
 
         void listen() const;
     };
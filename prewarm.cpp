@@ -0,0 +1,167 @@
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include "prewarm.hpp"
+
+static struct {
+    std::atomic<uint64_t> passes {0};
+    std::atomic<uint64_t> entries {0};
+    std::atomic<uint64_t> pauses {0};
+} counters;
+
+prewarm::crawl_stats prewarm::get_stats() {
+    crawl_stats stats;
+    stats.passes = counters.passes.load(std::memory_order_relaxed);
+    stats.entries = counters.entries.load(std::memory_order_relaxed);
+    stats.pauses = counters.pauses.load(std::memory_order_relaxed);
+    return stats;
+}
+
+#ifdef __unix__
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "threading.hpp"
+
+/** ioprio_set(2) has no glibc wrapper nor header */
+static constexpr int UNIX_IOPRIO_WHO_PROCESS = 1;
+static constexpr int UNIX_IOPRIO_CLASS_IDLE = 3;
+static constexpr int UNIX_IOPRIO_CLASS_SHIFT = 13;
+
+/**
+ * Leaves the CPU and the disk to the calling thread only when nothing else wants them.
+ * On Linux both calls apply to the calling thread alone when given 0.
+ */
+static void unix_lower_priority() {
+    sched_param param {};
+    if (sched_setscheduler(0, SCHED_IDLE, &param) != 0) {
+        fprintf(stderr, "Could not run the pre-warming crawler with SCHED_IDLE: %s\n", strerror(errno));
+    }
+    if (syscall(SYS_ioprio_set, UNIX_IOPRIO_WHO_PROCESS, 0, UNIX_IOPRIO_CLASS_IDLE << UNIX_IOPRIO_CLASS_SHIFT) != 0) {
+        fprintf(stderr, "Could not give the pre-warming crawler the idle I/O class: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Holds the crawl back while searches are admitted and to the configured rate.
+ */
+struct unix_crawl_pacer final {
+    static constexpr std::chrono::milliseconds POLL_INTERVAL {100};
+    /** Sleeping for less than this while ahead of the rate costs more wakeups than it smooths */
+    static constexpr std::chrono::milliseconds MIN_SLEEP {10};
+
+    const prewarm::crawl_config& config;
+    uint64_t admitted = 0;
+    std::chrono::steady_clock::time_point quiet_since;
+    std::chrono::steady_clock::time_point window_start;
+    uint64_t window_entries = 0;
+
+    explicit unix_crawl_pacer(const prewarm::crawl_config& config)
+        : config(config), admitted(threading::current_activity().admitted),
+          quiet_since(std::chrono::steady_clock::now()) {}
+
+    bool is_disturbed() const {
+        auto activity = threading::current_activity();
+        return activity.in_flight != 0 || activity.admitted != this->admitted;
+    }
+
+    /**
+     * Sleeps until no search was admitted for the idle delay.
+     */
+    void wait_idle() {
+        while (true) {
+            auto activity = threading::current_activity();
+            auto now = std::chrono::steady_clock::now();
+            if (activity.in_flight != 0 || activity.admitted != this->admitted) {
+                this->admitted = activity.admitted;
+                this->quiet_since = now;
+            } else if (now - this->quiet_since >= this->config.idle_delay) {
+                this->window_start = now;
+                this->window_entries = 0;
+                return;
+            }
+            std::this_thread::sleep_for(POLL_INTERVAL);
+        }
+    }
+
+    /**
+     * Waits for searches to be idle again if one arrived, called before every directory is read.
+     */
+    void yield() {
+        if (this->is_disturbed()) {
+            counters.pauses.fetch_add(1, std::memory_order_relaxed);
+            this->wait_idle();
+        }
+    }
+
+    /**
+     * Counts and paces every non-directory entry the crawler visits.
+     */
+    void step() {
+        counters.entries.fetch_add(1, std::memory_order_relaxed);
+        this->yield();
+        if (this->config.entries_per_second == 0) {
+            return;
+        }
+        ++this->window_entries;
+        auto due = this->window_start + std::chrono::nanoseconds(
+            this->window_entries * 1000000000ull / this->config.entries_per_second);
+        if (due - std::chrono::steady_clock::now() >= MIN_SLEEP) {
+            std::this_thread::sleep_until(due);
+        }
+    }
+};
+
+static void unix_crawl(const prewarm::crawl_config& config, fs::search_options options) {
+    unix_lower_priority();
+    unix_crawl_pacer pacer(config);
+    auto previous = std::move(options.on_directory);
+    options.on_directory = [&pacer, &previous](const std::string& dir) {
+        pacer.yield();
+        if (previous) {
+            previous(dir);
+        }
+    };
+    options.cold_listing_cache = true;
+    while (true) {
+        pacer.wait_idle();
+        auto started = std::chrono::steady_clock::now();
+        uint64_t entries = counters.entries.load(std::memory_order_relaxed);
+        for (const auto& root : config.roots) {
+            try {
+                fs::walk(root, options, [&pacer](const fs::entry&) {
+                    pacer.step();
+                    return true;
+                });
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Could not pre-warm %s: %s\n", root.c_str(), e.what());
+            }
+        }
+        counters.passes.fetch_add(1, std::memory_order_relaxed);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        fprintf(stdout, "Pre-warmed %llu entries in %.1f s\n",
+            (unsigned long long)(counters.entries.load(std::memory_order_relaxed) - entries), seconds);
+        if (config.period.count() <= 0) {
+            return;
+        }
+        std::this_thread::sleep_until(started + config.period);
+    }
+}
+
+void prewarm::start(const crawl_config& config, fs::search_options options) {
+    if (config.roots.empty()) {
+        return;
+    }
+    std::thread([config, options = std::move(options)]() mutable {
+        unix_crawl(config, std::move(options));
+    }).detach();
+}
+
+#else
+
+void prewarm::start(const crawl_config&, fs::search_options) {}
+
+#endif
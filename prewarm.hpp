@@ -0,0 +1,44 @@
+#ifndef __PREWARM_HPP__
+#define __PREWARM_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "fs.hpp"
+
+namespace prewarm {
+
+struct crawl_config final {
+    /** Trees walked to keep their dentries and inodes cached, none disables the crawler */
+    std::vector<std::string> roots;
+    /** Entries visited per second, 0 for no limit */
+    unsigned entries_per_second = 5000;
+    /** Time without searches before a pass starts, or resumes after yielding to one */
+    std::chrono::seconds idle_delay {30};
+    /** Time between the starts of passes, 0 to crawl once */
+    std::chrono::seconds period {3600};
+};
+
+struct crawl_stats final {
+    uint64_t passes = 0;
+    uint64_t entries = 0;
+    /** Times the crawler yielded to searches */
+    uint64_t pauses = 0;
+};
+
+/**
+ * Starts a background thread walking the roots with fs::walk while the server is idle, so that the
+ * kernel still has their directories cached when searches come. The thread runs with SCHED_IDLE
+ * and the idle I/O class, and stops at the next entry once the scheduler admits a search.
+ * options.delegate_subtree, if set, decides which subtrees the crawler leaves out. The listings it
+ * reads only fill the room left in the listing cache, see fs::search_options::cold_listing_cache.
+ * Has no effect on Windows.
+ */
+void start(const crawl_config& config, fs::search_options options);
+
+crawl_stats get_stats();
+
+} // prewarm
+
+#endif // __PREWARM_HPP__
@@ -0,0 +1,163 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include "protocol.hpp"
+
+/** Heap allocations made by the process so far, single threaded */
+static uint64_t allocations = 0;
+
+void* operator new(size_t size) {
+    ++allocations;
+    if (void* ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+/** Keeps the benchmarked calls from being optimized out */
+static size_t sink = 0;
+
+/**
+ * Runs the operation for about the given time and prints its cost per call.
+ */
+template<typename Operation>
+static void bench(const char* name, size_t message_size, double seconds, Operation&& operation) {
+    // warm up the allocator and the caches
+    for (int i = 0; i < 100; ++i) {
+        operation();
+    }
+    uint64_t ops = 0;
+    uint64_t allocations_before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration<double>(seconds);
+    auto now = start;
+    do {
+        for (int i = 0; i < 64; ++i) {
+            operation();
+        }
+        ops += 64;
+        now = std::chrono::steady_clock::now();
+    } while (now < deadline);
+    double ns = std::chrono::duration<double, std::nano>(now - start).count() / ops;
+    printf("%-34s %8zu B %10.1f ns/op %8.1f MB/s %6.2f allocs/op\n", name, message_size, ns,
+        message_size / ns * 1e3, (double)(allocations - allocations_before) / ops);
+}
+
+static std::string make_path(size_t size, size_t seed) {
+    std::string path = "/srv/data/" + std::to_string(seed) + '/';
+    while (path.size() < size) {
+        path += "subdirectory/";
+    }
+    path.resize(size);
+    return path;
+}
+
+static void bench_request(const char* name, const proto::file_search_request& req, double seconds) {
+    auto serialized = req.serialize();
+    std::string label = std::string("request encode, ") + name;
+    bench(label.c_str(), serialized.size(), seconds, [&] {
+        sink += req.serialize().size();
+    });
+    label = std::string("request decode, ") + name;
+    bench(label.c_str(), serialized.size(), seconds, [&] {
+        sink += proto::file_search_request::parse_from_buffer(serialized.data(), serialized.size()).filename.size();
+    });
+}
+
+static void bench_response(const char* name, const proto::file_search_response& res, double seconds) {
+    auto serialized = res.serialize();
+    std::string label = std::string("response encode, ") + name;
+    bench(label.c_str(), serialized.size(), seconds, [&] {
+        sink += res.serialize().size();
+    });
+    label = std::string("response decode, ") + name;
+    bench(label.c_str(), serialized.size(), seconds, [&] {
+        sink += proto::file_search_response::parse_from_buffer(serialized.data(), serialized.size()).payload.size();
+    });
+}
+
+static void bench_batch(size_t paths, double seconds) {
+    std::vector<std::string> batch;
+    for (size_t i = 0; i < paths; ++i) {
+        batch.push_back(make_path(64, i / 16) + "file" + std::to_string(i) + ".txt");
+    }
+    proto::path_batch_encoder encoder;
+    for (const auto& path : batch) {
+        encoder.add(path);
+    }
+    auto encoded = encoder.encoded;
+    std::string label = "path batch encode, " + std::to_string(paths) + " paths";
+    bench(label.c_str(), encoded.size(), seconds, [&] {
+        encoder.clear();
+        for (const auto& path : batch) {
+            encoder.add(path);
+        }
+        sink += encoder.encoded.size();
+    });
+    label = "path batch decode, " + std::to_string(paths) + " paths";
+    bench(label.c_str(), encoded.size(), seconds, [&] {
+        proto::path_batch_decoder decoder(encoded);
+        while (decoder.next()) {
+            sink += decoder.path.size();
+        }
+    });
+}
+
+int main(int argc, char** argv) {
+    // time spent on each row
+    double seconds = argc > 1 ? std::atof(argv[1]) : 0.5;
+
+    for (size_t size : {16, 256, 4096}) {
+        proto::file_search_request req;
+        req.filename = std::string(size, 'f');
+        req.root_path = "/srv/data";
+        bench_request(("filename " + std::to_string(size) + " B").c_str(), req, seconds);
+    }
+    proto::file_search_request full;
+    full.filename = "*.log";
+    full.root_path = "/srv/data";
+    full.flags = proto::flag_filename_glob | proto::flag_ignore_case;
+    for (int i = 0; i < 16; ++i) {
+        full.exclude_patterns.push_back("exclude-" + std::to_string(i));
+        full.extra_roots.push_back(make_path(32, i));
+    }
+    full.predicates.push_back(proto::metadata_predicate::parse("size > 1M"));
+    full.predicates.push_back(proto::metadata_predicate::parse("mtime < 7d"));
+    full.page_size = 1000;
+    full.cursor = std::string(32, 'c');
+    bench_request("every field", full, seconds);
+
+    proto::file_search_response match;
+    match.status = proto::file_search_status::match;
+    match.payload = make_path(64, 0);
+    bench_response("match", match, seconds);
+    match.snippet = std::string(200, 's');
+    match.line_number = 1234;
+    bench_response("grep match", match, seconds);
+    for (size_t size : {4096, 65536, 1 << 20}) {
+        proto::file_search_response batch;
+        batch.status = proto::file_search_status::match_batch;
+        batch.payload = std::string(size, 'b');
+        bench_response(("batch " + std::to_string(size) + " B").c_str(), batch, seconds);
+    }
+    proto::file_search_response ok;
+    ok.status = proto::file_search_status::ok;
+    ok.payload = "1000 matches";
+    ok.cursor = std::string(32, 'c');
+    bench_response("ok with cursor", ok, seconds);
+
+    bench_batch(64, seconds);
+    bench_batch(4096, seconds);
+    return sink == 0;
+}
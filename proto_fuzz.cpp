@@ -0,0 +1,206 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "protocol.hpp"
+
+/**
+ * Aborts on a broken invariant, so that the fuzzer keeps the input which broke it.
+ */
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        fprintf(stderr, "Invariant broken: %s\n", what);
+        abort();
+    }
+}
+
+static bool same_request(const proto::file_search_request& a, const proto::file_search_request& b) {
+    if (a.predicates.size() != b.predicates.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.predicates.size(); ++i) {
+        if (a.predicates[i].field != b.predicates[i].field || a.predicates[i].op != b.predicates[i].op
+            || a.predicates[i].value != b.predicates[i].value) {
+            return false;
+        }
+    }
+    return a.filename == b.filename && a.root_path == b.root_path && a.flags == b.flags
+        && a.exclude_patterns == b.exclude_patterns && a.mode == b.mode && a.content_pattern == b.content_pattern
+        && a.request_id == b.request_id && a.max_results == b.max_results && a.extra_roots == b.extra_roots
+        && a.page_size == b.page_size && a.cursor == b.cursor && a.validation_token == b.validation_token;
+}
+
+static bool same_response(const proto::file_search_response& a, const proto::file_search_response& b) {
+    return a.status == b.status && a.payload == b.payload && a.line_number == b.line_number
+        && a.snippet == b.snippet && a.retry_after_ms == b.retry_after_ms && a.request_id == b.request_id
+        && a.cursor == b.cursor && a.validation_token == b.validation_token;
+}
+
+/**
+ * Parses the input as a request and as a response. Parsers may only throw std::runtime_error on
+ * malformed input, and whatever they accept has to survive a serialize and parse round trip.
+ * The input is copied to a buffer of its exact size, so that AddressSanitizer reports any read past it.
+ */
+static void check_input(const uint8_t* data, size_t size) {
+    std::unique_ptr<char[]> buffer(new char[size]);
+    memcpy(buffer.get(), data, size);
+
+    try {
+        auto req = proto::file_search_request::parse_from_buffer(buffer.get(), size);
+        auto serialized = req.serialize();
+        check(proto::peek_message_size(serialized.data(), serialized.size()) == serialized.size(),
+            "request size field differs from its size");
+        auto reparsed = proto::file_search_request::parse_from_buffer(serialized.data(), serialized.size());
+        check(reparsed.version == proto::protocol_version, "request not serialized with the current version");
+        check(same_request(req, reparsed), "request changed by a round trip");
+    } catch (const std::runtime_error&) {
+    }
+    try {
+        auto res = proto::file_search_response::parse_from_buffer(buffer.get(), size);
+        auto serialized = res.serialize();
+        check(proto::peek_message_size(serialized.data(), serialized.size()) == serialized.size(),
+            "response size field differs from its size");
+        auto reparsed = proto::file_search_response::parse_from_buffer(serialized.data(), serialized.size());
+        check(same_response(res, reparsed), "response changed by a round trip");
+        if (res.status == proto::file_search_status::match_batch) {
+            proto::path_batch_decoder decoder(res.payload);
+            proto::path_batch_encoder encoder;
+            while (decoder.next()) {
+                encoder.add(decoder.path);
+            }
+            check(encoder.encoded.size() <= res.payload.size(), "path batch grew when encoded again");
+        }
+    } catch (const std::runtime_error&) {
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    check_input(data, size);
+    return 0;
+}
+
+#ifndef RFINDER_LIBFUZZER
+
+/**
+ * Valid messages of every kind, starting points for the mutations.
+ */
+static std::vector<std::vector<char>> make_seeds() {
+    std::vector<std::vector<char>> seeds;
+    proto::file_search_request req;
+    req.filename = "main.cpp";
+    req.root_path = "/home";
+    seeds.push_back(req.serialize());
+    req.flags = proto::flag_filename_glob | proto::flag_ignore_case;
+    req.exclude_patterns = {"node_modules", ".git"};
+    req.mode = proto::search_mode::content;
+    req.content_pattern = "TODO";
+    req.predicates.push_back(proto::metadata_predicate::parse("size > 1K"));
+    req.request_id = 7;
+    req.max_results = 100;
+    req.extra_roots = {"/srv", "/opt"};
+    req.page_size = 500;
+    req.cursor = "0123456789abcdef0123456789abcdef";
+    req.validation_token = "0123456789abcdef/home/user/main.cpp";
+    seeds.push_back(req.serialize());
+
+    proto::file_search_response res;
+    res.status = proto::file_search_status::ok;
+    res.payload = "3 matches";
+    res.cursor = "fedcba9876543210fedcba9876543210";
+    res.validation_token = "fedcba9876543210/home/user/main.cpp";
+    seeds.push_back(res.serialize());
+    res.status = proto::file_search_status::not_modified;
+    seeds.push_back(res.serialize());
+    res.status = proto::file_search_status::not_found;
+    seeds.push_back(res.serialize());
+    res.status = proto::file_search_status::match;
+    res.payload = "/home/user/main.cpp";
+    res.line_number = 42;
+    res.snippet = "// TODO";
+    seeds.push_back(res.serialize());
+    res.status = proto::file_search_status::rejected;
+    res.retry_after_ms = 250;
+    seeds.push_back(res.serialize());
+    proto::path_batch_encoder encoder;
+    encoder.add("/usr/include/stdio.h");
+    encoder.add("/usr/include/stdlib.h");
+    encoder.add("/usr/include/sys/stat.h");
+    res.status = proto::file_search_status::match_batch;
+    res.payload = encoder.encoded;
+    seeds.push_back(res.serialize());
+    return seeds;
+}
+
+static void mutate(std::vector<char>& input, std::mt19937_64& random) {
+    int mutations = 1 + random() % 4;
+    for (int i = 0; i < mutations; ++i) {
+        switch (random() % 4) {
+            case 0:
+                if (!input.empty()) {
+                    input[random() % input.size()] ^= (char)(1u << (random() % 8));
+                }
+                break;
+            case 1:
+                if (!input.empty()) {
+                    input[random() % input.size()] = (char)random();
+                }
+                break;
+            case 2:
+                input.resize(input.empty() ? 0 : random() % input.size());
+                break;
+            default:
+                input.insert(input.begin() + (input.empty() ? 0 : random() % input.size()), (char)random());
+                break;
+        }
+    }
+}
+
+/**
+ * Stand-in for libFuzzer when the compiler does not ship it: replays the given inputs,
+ * or runs random mutations of valid messages.
+ */
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--mutate") != 0) {
+        for (int i = 1; i < argc; ++i) {
+            FILE* file = fopen(argv[i], "rb");
+            if (!file) {
+                fprintf(stderr, "Could not open %s\n", argv[i]);
+                return 1;
+            }
+            std::vector<uint8_t> input;
+            uint8_t chunk[4096];
+            size_t n;
+            while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+                input.insert(input.end(), chunk, chunk + n);
+            }
+            fclose(file);
+            check_input(input.data(), input.size());
+        }
+        printf("Replayed %d inputs\n", argc - 1);
+        return 0;
+    }
+    unsigned long long runs = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    std::mt19937_64 random(argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1);
+    auto seeds = make_seeds();
+    for (unsigned long long i = 0; i < runs; ++i) {
+        auto input = seeds[random() % seeds.size()];
+        mutate(input, random);
+        // most mutations are caught by the size field alone, keep it consistent in half of the runs
+        if (random() % 2 && input.size() >= sizeof(uint32_t)) {
+            uint32_t size = (uint32_t)input.size();
+            for (int byte = 0; byte < 4; ++byte) {
+                input[byte] = (char)(size >> (24 - byte * 8));
+            }
+        }
+        check_input((const uint8_t*)input.data(), input.size());
+    }
+    printf("Ran %llu mutated inputs\n", runs);
+    return 0;
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <algorithm>
 #include <stdexcept>
 #include "protocol.hpp"
 
@@ -8,25 +9,136 @@
 #include <winsock.h>
 #endif
 
+static void append_u16(std::vector<char>& buffer, uint16_t value) {
+    value = htons(value);
+    char* value_ptr = (char*)&value;
+    buffer.insert(buffer.end(), value_ptr, value_ptr + sizeof(value));
+}
+
+static void append_u32(std::vector<char>& buffer, uint32_t value) {
+    value = htonl(value);
+    char* value_ptr = (char*)&value;
+    buffer.insert(buffer.end(), value_ptr, value_ptr + sizeof(value));
+}
+
+static void append_u64(std::vector<char>& buffer, uint64_t value) {
+    append_u32(buffer, (uint32_t)(value >> 32));
+    append_u32(buffer, (uint32_t)value);
+}
+
+static void append_string(std::vector<char>& buffer, const std::string& str) {
+    append_u32(buffer, str.size());
+    buffer.insert(buffer.end(), str.begin(), str.end());
+}
+
+/**
+ * Sequential reader over a received message which refuses to read past its end.
+ */
+struct buffer_reader final {
+    const char* current;
+    const char* end;
+
+    size_t remaining() const {
+        return this->end - this->current;
+    }
+
+    void require(size_t size) const {
+        if (size > this->remaining()) {
+            throw std::runtime_error("Truncated message");
+        }
+    }
+
+    uint16_t read_u16() {
+        uint16_t value;
+        this->require(sizeof(value));
+        memcpy(&value, this->current, sizeof(value));
+        this->current += sizeof(value);
+        return ntohs(value);
+    }
+
+    uint32_t read_u32() {
+        uint32_t value;
+        this->require(sizeof(value));
+        memcpy(&value, this->current, sizeof(value));
+        this->current += sizeof(value);
+        return ntohl(value);
+    }
+
+    uint64_t read_u64() {
+        uint64_t high = this->read_u32();
+        return (high << 32) | this->read_u32();
+    }
+
+    std::string read_string() {
+        uint32_t len = this->read_u32();
+        this->require(len);
+        std::string out(this->current, len);
+        this->current += len;
+        return out;
+    }
+};
+
+size_t proto::peek_message_size(const char* buffer, size_t size) {
+    uint32_t message_size;
+    if (size < sizeof(message_size)) {
+        return 0;
+    }
+    memcpy(&message_size, buffer, sizeof(message_size));
+    return ntohl(message_size);
+}
+
 std::vector<char> proto::file_search_request::serialize() const {
     std::vector<char> buffer;
-    uint32_t payload_size = sizeof(uint32_t)*3 + this->filename.size() + this->root_path.size();
+    size_t payload_size = sizeof(uint32_t)*3 + this->filename.size() + this->root_path.size()
+        + sizeof(uint16_t) + sizeof(uint32_t)*2
+        + sizeof(uint16_t) + sizeof(uint32_t) + this->content_pattern.size()
+        + sizeof(uint32_t) + this->predicates.size() * (sizeof(uint16_t)*2 + sizeof(uint64_t))
+        + sizeof(uint32_t)
+        + sizeof(uint32_t)
+        + sizeof(uint32_t)
+        + sizeof(uint32_t) * 2 + this->cursor.size()
+        + sizeof(uint32_t) + this->validation_token.size();
+    for (const auto& pattern : this->exclude_patterns) {
+        payload_size += sizeof(uint32_t) + pattern.size();
+    }
+    for (const auto& root : this->extra_roots) {
+        payload_size += sizeof(uint32_t) + root.size();
+    }
     buffer.reserve(payload_size);
 
-    payload_size = htonl(payload_size);
-    char* payload_size_ptr = (char*)&payload_size;
-    buffer.insert(buffer.end(), payload_size_ptr, payload_size_ptr + sizeof(payload_size));
+    append_u32(buffer, payload_size);
+    append_string(buffer, this->filename);
+    append_string(buffer, this->root_path);
+
+    append_u16(buffer, protocol_version);
+    append_u32(buffer, this->flags);
+    append_u32(buffer, this->exclude_patterns.size());
+    for (const auto& pattern : this->exclude_patterns) {
+        append_string(buffer, pattern);
+    }
+
+    append_u16(buffer, (uint16_t)this->mode);
+    append_string(buffer, this->content_pattern);
 
-    uint32_t filename_size = htonl(this->filename.size());
-    char* filename_size_ptr = (char*)&filename_size;
-    buffer.insert(buffer.end(), filename_size_ptr, filename_size_ptr + sizeof(filename_size));
-    buffer.insert(buffer.end(), this->filename.begin(), this->filename.end());
+    append_u32(buffer, this->predicates.size());
+    for (const auto& predicate : this->predicates) {
+        append_u16(buffer, (uint16_t)predicate.field);
+        append_u16(buffer, (uint16_t)predicate.op);
+        append_u64(buffer, predicate.value);
+    }
+
+    append_u32(buffer, this->request_id);
+    append_u32(buffer, this->max_results);
+
+    append_u32(buffer, this->extra_roots.size());
+    for (const auto& root : this->extra_roots) {
+        append_string(buffer, root);
+    }
 
-    uint32_t root_path_size = htonl(this->root_path.size());
-    char* root_path_size_ptr = (char*)&root_path_size;
-    buffer.insert(buffer.end(), root_path_size_ptr, root_path_size_ptr + sizeof(root_path_size));
-    buffer.insert(buffer.end(), this->root_path.begin(), this->root_path.end());
+    append_u32(buffer, this->page_size);
+    append_string(buffer, this->cursor);
 
+    append_string(buffer, this->validation_token);
     return buffer;
 }
 
@@ -36,20 +148,68 @@ auto proto::file_search_request::parse_from_buffer(
 ) -> file_search_request {
     file_search_request req;
 
-    uint32_t payload_size = ntohl(*(uint32_t*)buffer);
-    buffer += sizeof(payload_size);
-
-    if (payload_size > buffer_size) {
+    buffer_reader reader{buffer, buffer + buffer_size};
+    uint32_t payload_size = reader.read_u32();
+    if (payload_size > buffer_size || payload_size < sizeof(payload_size)) {
         throw std::runtime_error("Invalid buffer size");
     }
+    reader.end = buffer + payload_size;
 
-    uint32_t filename_len = ntohl(*(uint32_t*)buffer);
-    buffer += sizeof(filename_len);
-    req.filename = std::string(buffer, filename_len);
-    buffer += filename_len;
-    uint32_t root_path_len = ntohl(*(uint32_t*)buffer);
-    buffer += sizeof(root_path_len);
-    req.root_path = std::string(buffer, root_path_len);
+    req.filename = reader.read_string();
+    req.root_path = reader.read_string();
+    if (reader.remaining() == 0) {
+        req.version = 1;
+        return req;
+    }
+    req.version = reader.read_u16();
+    req.flags = reader.read_u32();
+    uint32_t exclude_count = reader.read_u32();
+    for (uint32_t i = 0; i < exclude_count; ++i) {
+        req.exclude_patterns.push_back(reader.read_string());
+    }
+    if (req.version < 3) {
+        return req;
+    }
+    req.mode = (search_mode)reader.read_u16();
+    req.content_pattern = reader.read_string();
+    if (req.version < 4) {
+        return req;
+    }
+    uint32_t predicate_count = reader.read_u32();
+    for (uint32_t i = 0; i < predicate_count; ++i) {
+        metadata_predicate predicate;
+        predicate.field = (predicate_field)reader.read_u16();
+        predicate.op = (predicate_op)reader.read_u16();
+        predicate.value = reader.read_u64();
+        if (predicate.field > predicate_field::gid || predicate.op > predicate_op::ge) {
+            throw std::runtime_error("Unknown metadata predicate");
+        }
+        req.predicates.push_back(predicate);
+    }
+    if (req.version < 6) {
+        return req;
+    }
+    req.request_id = reader.read_u32();
+    if (req.version < 8) {
+        return req;
+    }
+    req.max_results = reader.read_u32();
+    if (req.version < 9) {
+        return req;
+    }
+    uint32_t root_count = reader.read_u32();
+    for (uint32_t i = 0; i < root_count; ++i) {
+        req.extra_roots.push_back(reader.read_string());
+    }
+    if (req.version < 10) {
+        return req;
+    }
+    req.page_size = reader.read_u32();
+    req.cursor = reader.read_string();
+    if (req.version < 11) {
+        return req;
+    }
+    req.validation_token = reader.read_string();
     return req;
 }
 
@@ -59,22 +219,35 @@ std::vector<char> proto::file_search_response::serialize() const {
     uint32_t payload_size = sizeof(uint32_t) * 2
         + sizeof(uint16_t)
         + this->payload.size();
+    if (this->status == file_search_status::match) {
+        payload_size += sizeof(uint32_t) * 2 + this->snippet.size();
+    }
+    if (this->status == file_search_status::rejected) {
+        payload_size += sizeof(uint32_t);
+    }
+    payload_size += sizeof(uint32_t);
+    if (this->status == file_search_status::ok) {
+        payload_size += sizeof(uint32_t) * 2 + this->cursor.size() + this->validation_token.size();
+    }
 
     buffer.reserve(payload_size);
 
-    payload_size = htonl(payload_size);
-    char* payload_size_ptr = (char*)&payload_size;
-    buffer.insert(buffer.end(), payload_size_ptr, payload_size_ptr + sizeof(payload_size));
-
-    uint16_t status = htons((uint16_t)this->status);
-    char* status_ptr = (char*)&status;
-    buffer.insert(buffer.end(), status_ptr, status_ptr + sizeof(status));
-
-    uint32_t msg_len = htonl(this->payload.size());
-    char* msg_len_ptr = (char*)&msg_len;
-    buffer.insert(buffer.end(), msg_len_ptr, msg_len_ptr + sizeof(msg_len));
-    buffer.insert(buffer.end(), this->payload.begin(), this->payload.end());
-
+    append_u32(buffer, payload_size);
+    append_u16(buffer, (uint16_t)this->status);
+    append_string(buffer, this->payload);
+    if (this->status == file_search_status::match) {
+        append_u32(buffer, this->line_number);
+        append_string(buffer, this->snippet);
+    }
+    if (this->status == file_search_status::rejected) {
+        append_u32(buffer, this->retry_after_ms);
+    }
+    // trailing, so that parsers predating them just ignore them
+    append_u32(buffer, this->request_id);
+    if (this->status == file_search_status::ok) {
+        append_string(buffer, this->cursor);
+        append_string(buffer, this->validation_token);
+    }
     return buffer;
 }
 
@@ -83,20 +256,198 @@ auto proto::file_search_response::parse_from_buffer(
 ) -> file_search_response {
     file_search_response res;
 
-    uint32_t payload_size = ntohl(*(uint32_t*)buffer);
-    buffer += sizeof(payload_size);
-
-    if (payload_size > size) {
+    buffer_reader reader{buffer, buffer + size};
+    uint32_t payload_size = reader.read_u32();
+    if (payload_size > size || payload_size < sizeof(payload_size)) {
         throw std::runtime_error("Invalid buffer size");
     }
+    reader.end = buffer + payload_size;
+
+    res.status = (proto::file_search_status)reader.read_u16();
+    res.payload = reader.read_string();
+    if (res.status == file_search_status::match) {
+        res.line_number = reader.read_u32();
+        res.snippet = reader.read_string();
+    }
+    if (res.status == file_search_status::rejected) {
+        res.retry_after_ms = reader.read_u32();
+    }
+    if (reader.remaining() >= sizeof(uint32_t)) {
+        res.request_id = reader.read_u32();
+    }
+    if (res.status == file_search_status::ok && reader.remaining() >= sizeof(uint32_t)) {
+        res.cursor = reader.read_string();
+    }
+    if (res.status == file_search_status::ok && reader.remaining() >= sizeof(uint32_t)) {
+        res.validation_token = reader.read_string();
+    }
+    return res;
+}
+
+static uint64_t parse_scaled(std::string_view text, std::string_view suffixes, const uint64_t* scales) {
+    size_t digits = 0;
+    while (digits < text.size() && text[digits] >= '0' && text[digits] <= '9') {
+        ++digits;
+    }
+    if (digits == 0) {
+        throw std::invalid_argument("Expected a number");
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < digits; ++i) {
+        uint64_t digit = text[i] - '0';
+        if (value > (UINT64_MAX - digit) / 10) {
+            throw std::invalid_argument("Value out of range: " + std::string(text));
+        }
+        value = value * 10 + digit;
+    }
+    auto suffix = text.substr(digits);
+    if (suffix.empty()) {
+        return value;
+    }
+    auto pos = suffixes.find(suffix.size() == 1 ? suffix[0] : '\0');
+    if (pos == std::string_view::npos) {
+        throw std::invalid_argument("Unknown unit suffix: " + std::string(suffix));
+    }
+    if (value > UINT64_MAX / scales[pos]) {
+        throw std::invalid_argument("Value out of range: " + std::string(text));
+    }
+    return value * scales[pos];
+}
 
-    uint16_t status = ntohs(*(uint16_t*)buffer);
-    res.status = (proto::file_search_status)status;
-    buffer += sizeof(status);
+auto proto::metadata_predicate::parse(std::string_view expression) -> metadata_predicate {
+    static const char* WHITESPACE = " \t";
+    auto trim = [](std::string_view str) {
+        auto begin = str.find_first_not_of(WHITESPACE);
+        if (begin == std::string_view::npos) {
+            return std::string_view();
+        }
+        return str.substr(begin, str.find_last_not_of(WHITESPACE) - begin + 1);
+    };
+    auto op_pos = expression.find_first_of("<>=!");
+    if (op_pos == std::string_view::npos) {
+        throw std::invalid_argument("Expected a comparison operator");
+    }
+    auto op_end = expression.find_first_not_of("<>=!", op_pos);
+    if (op_end == std::string_view::npos) {
+        throw std::invalid_argument("Expected a value");
+    }
+    auto field = trim(expression.substr(0, op_pos));
+    auto op = expression.substr(op_pos, op_end - op_pos);
+    auto value = trim(expression.substr(op_end));
 
-    uint32_t msg_len = ntohl(*(uint32_t*)buffer);
-    buffer += sizeof(msg_len);
+    metadata_predicate predicate;
+    if (op == "==" || op == "=") {
+        predicate.op = predicate_op::eq;
+    } else if (op == "!=") {
+        predicate.op = predicate_op::ne;
+    } else if (op == "<") {
+        predicate.op = predicate_op::lt;
+    } else if (op == "<=") {
+        predicate.op = predicate_op::le;
+    } else if (op == ">") {
+        predicate.op = predicate_op::gt;
+    } else if (op == ">=") {
+        predicate.op = predicate_op::ge;
+    } else {
+        throw std::invalid_argument("Unknown comparison operator: " + std::string(op));
+    }
 
-    res.payload = std::string(buffer, msg_len);
-    return res;
-}
\ No newline at end of file
+    static const uint64_t SIZE_SCALES[] = {1ull << 10, 1ull << 20, 1ull << 30, 1ull << 40};
+    static const uint64_t AGE_SCALES[] = {1, 60, 60 * 60, 24 * 60 * 60, 7 * 24 * 60 * 60};
+    if (field == "size") {
+        predicate.field = predicate_field::size;
+        predicate.value = parse_scaled(value, "KMGT", SIZE_SCALES);
+    } else if (field == "mtime") {
+        predicate.field = predicate_field::mtime_age;
+        predicate.value = parse_scaled(value, "smhdw", AGE_SCALES);
+    } else if (field == "uid" || field == "gid") {
+        predicate.field = field == "uid" ? predicate_field::uid : predicate_field::gid;
+        predicate.value = parse_scaled(value, "", 0);
+    } else if (field == "type") {
+        if (predicate.op != predicate_op::eq && predicate.op != predicate_op::ne) {
+            throw std::invalid_argument("Type can only be compared with == or !=");
+        }
+        predicate.field = predicate_field::type;
+        if (value == "regular" || value == "f") {
+            predicate.value = (uint64_t)file_type::regular;
+        } else if (value == "directory" || value == "d") {
+            // searches report files only, they never get to test a directory
+            if (predicate.op == predicate_op::eq) {
+                throw std::invalid_argument("Directories are never matched, type == directory matches nothing");
+            }
+            predicate.value = (uint64_t)file_type::directory;
+        } else if (value == "symlink" || value == "l") {
+            predicate.value = (uint64_t)file_type::symlink;
+        } else if (value == "fifo" || value == "p") {
+            predicate.value = (uint64_t)file_type::fifo;
+        } else if (value == "socket" || value == "s") {
+            predicate.value = (uint64_t)file_type::socket;
+        } else if (value == "block" || value == "b") {
+            predicate.value = (uint64_t)file_type::block_device;
+        } else if (value == "char" || value == "c") {
+            predicate.value = (uint64_t)file_type::char_device;
+        } else {
+            throw std::invalid_argument("Unknown file type: " + std::string(value));
+        }
+    } else {
+        throw std::invalid_argument("Unknown field: " + std::string(field));
+    }
+    return predicate;
+}
+
+static void append_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static uint64_t read_varint(std::string_view in, size_t& offset) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (offset >= in.size()) {
+            throw std::runtime_error("Truncated varint");
+        }
+        auto byte = (uint8_t)in[offset++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Varint too long");
+}
+
+void proto::path_batch_encoder::add(std::string_view path) {
+    size_t shared = 0;
+    size_t max_shared = std::min(path.size(), this->previous.size());
+    while (shared < max_shared && path[shared] == this->previous[shared]) {
+        ++shared;
+    }
+    append_varint(this->encoded, shared);
+    append_varint(this->encoded, path.size() - shared);
+    this->encoded.append(path.data() + shared, path.size() - shared);
+    this->previous.assign(path.data(), path.size());
+    ++this->count;
+}
+
+void proto::path_batch_encoder::clear() {
+    this->encoded.clear();
+    this->previous.clear();
+    this->count = 0;
+}
+
+bool proto::path_batch_decoder::next() {
+    if (this->offset >= this->encoded.size()) {
+        return false;
+    }
+    uint64_t shared = read_varint(this->encoded, this->offset);
+    uint64_t suffix = read_varint(this->encoded, this->offset);
+    if (shared > this->path.size() || suffix > this->encoded.size() - this->offset) {
+        throw std::runtime_error("Malformed path batch");
+    }
+    this->path.resize(shared);
+    this->path.append(this->encoded.data() + this->offset, suffix);
+    this->offset += suffix;
+    return true;
+}
@@ -1,14 +1,172 @@
 #ifndef __PROTOCOL_HPP__
 #define __PROTOCOL_HPP__
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace proto {
 
+    /**
+     * Version of the wire format produced by this build.
+     * Version 1 requests carry only the filename and the root path,
+     * every following version appends its fields after the ones of the previous version.
+     */
+    constexpr uint16_t protocol_version = 12;
+
+    /** First version which understands match_batch responses */
+    constexpr uint16_t batch_responses_version = 5;
+
+    /**
+     * First version allowed to send several requests over one connection.
+     * The server keeps reading requests until the client shuts down its sending side
+     * and tags every response with the id of the request it belongs to.
+     */
+    constexpr uint16_t pipelined_requests_version = 6;
+
+    /**
+     * First version which understands rejected responses and server_stats requests.
+     * Older clients get overload rejections as plain errors.
+     */
+    constexpr uint16_t admission_control_version = 7;
+
+    /** First version which carries max_results and understands substring and fuzzy searches */
+    constexpr uint16_t ranked_search_version = 8;
+
+    /** First version which carries extra_roots */
+    constexpr uint16_t multi_root_version = 9;
+
+    /** First version which carries page_size and cursor */
+    constexpr uint16_t paged_search_version = 10;
+
+    /** First version which carries validation tokens and understands not_modified responses */
+    constexpr uint16_t conditional_requests_version = 11;
+
+    /** First version which understands not_found responses, earlier ones get ok with "Not found" */
+    constexpr uint16_t not_found_version = 12;
+
+    enum search_flags : uint32_t {
+        /** Do not leave the filesystem the root path resides on */
+        flag_one_filesystem = 1u << 0,
+        /** Descend into pseudo-filesystems (procfs, sysfs, ...) the server skips by default */
+        flag_include_pseudo_filesystems = 1u << 1,
+        /** Descend into symlinked directories, visiting each directory once */
+        flag_follow_symlinks = 1u << 2,
+        /** Content pattern is an ECMAScript regular expression rather than a literal */
+        flag_content_regex = 1u << 3,
+        /** Report every file with the requested name instead of only the first one */
+        flag_all_matches = 1u << 4,
+        /** Filename is an fnmatch(3) glob rather than an exact name */
+        flag_filename_glob = 1u << 5,
+        /** Sent by a federating server: search the local filesystem only, never forward to peers */
+        flag_no_forward = 1u << 6,
+        /** Compare names case-insensitively, e.g. readme.md finds README.md */
+        flag_ignore_case = 1u << 7,
+        /** Compare names regardless of their Unicode normalization form (NFC or NFD) */
+        flag_ignore_normalization = 1u << 8,
+    };
+
+    enum class search_mode : uint16_t {
+        /** Find the first file with exactly the requested name */
+        filename,
+        /** Stream lines of files matching the content pattern; filename is then a glob, empty for every file */
+        content,
+        /** Answered right away with scheduler counters in Prometheus text format, no search is run */
+        server_stats,
+        /** Answered right away with the sampled request spans as Chrome trace JSON, no search is run */
+        trace_dump,
+        /**
+         * Stream the files whose name contains the filename, ignoring case and normalization,
+         * best ranked first
+         */
+        substring,
+        /** Like substring, but also tolerates a few typos in the filename */
+        fuzzy
+    };
+
+    enum class predicate_field : uint16_t {
+        size,
+        mtime_age,
+        type,
+        uid,
+        gid
+    };
+
+    enum class predicate_op : uint16_t {
+        eq,
+        ne,
+        lt,
+        le,
+        gt,
+        ge
+    };
+
+    enum class file_type : uint64_t {
+        regular,
+        directory,
+        symlink,
+        fifo,
+        socket,
+        block_device,
+        char_device
+    };
+
+    /**
+     * Metadata condition a matched file has to satisfy.
+     * Sizes are in bytes, mtime_age in seconds since the last modification.
+     */
+    struct metadata_predicate final {
+        predicate_field field;
+        predicate_op op;
+        uint64_t value;
+
+        /**
+         * Parses expressions like "size > 1G", "mtime < 7d", "type == regular" or "uid == 1000".
+         * Sizes accept K/M/G/T binary suffixes, ages s/m/h/d/w suffixes (seconds by default).
+         * @throws std::invalid_argument on malformed expressions.
+         */
+        static metadata_predicate parse(std::string_view expression);
+    };
+
     struct file_search_request final {
         std::string filename;
         std::string root_path;
+        // version 2
+        uint16_t version = protocol_version;
+        uint32_t flags = 0;
+        std::vector<std::string> exclude_patterns;
+        // version 3
+        search_mode mode = search_mode::filename;
+        std::string content_pattern;
+        // version 4
+        std::vector<metadata_predicate> predicates;
+        // version 6
+        /** Chosen by the client, echoed in every response to the request */
+        uint32_t request_id = 0;
+        // version 8
+        /** Results a substring or fuzzy search returns at most, 0 for the server default */
+        uint32_t max_results = 0;
+        // version 9
+        /**
+         * Searched together with root_path as one traversal. Nested roots are dropped and files
+         * reachable below several roots are reported once.
+         */
+        std::vector<std::string> extra_roots;
+        // version 10
+        /**
+         * Files an all-matches or glob search reports at most, 0 for all of them. The final
+         * response then carries a cursor asking for the next page.
+         */
+        uint32_t page_size = 0;
+        /** Cursor of the previous page of the same search, empty for the first page */
+        std::string cursor;
+        // version 11
+        /**
+         * Validation token of a previous answer to the same search. The server answers not_modified
+         * instead of searching again if that answer still holds.
+         */
+        std::string validation_token;
 
         std::vector<char> serialize() const;
 
@@ -18,7 +176,17 @@ namespace proto {
     enum class file_search_status {
         pending,
         ok,
-        error
+        error,
+        /** One of possibly many results streamed before the final ok */
+        match,
+        /** Several paths at once, front-coded with path_batch_encoder */
+        match_batch,
+        /** Server is overloaded, the request was not started; retry_after_ms tells when to try again */
+        rejected,
+        /** The answer the validation token of the request was issued with still holds */
+        not_modified,
+        /** A single-file search completed without finding the file */
+        not_found
     };
 
     inline std::string to_string(file_search_status status) {
@@ -26,6 +194,11 @@ namespace proto {
             case file_search_status::pending: return "PENDING";
             case file_search_status::ok: return "OK";
             case file_search_status::error: return "ERROR";
+            case file_search_status::match: return "MATCH";
+            case file_search_status::match_batch: return "MATCH_BATCH";
+            case file_search_status::rejected: return "REJECTED";
+            case file_search_status::not_modified: return "NOT_MODIFIED";
+            case file_search_status::not_found: return "NOT_FOUND";
         }
         return "UNKNOWN";
     }
@@ -33,13 +206,67 @@ namespace proto {
     struct file_search_response final {
         file_search_status status;
         std::string payload;
+        // present in match responses of content searches only
+        uint32_t line_number = 0;
+        std::string snippet;
+        // present in rejected responses only
+        uint32_t retry_after_ms = 0;
+        /** Id of the request the response belongs to */
+        uint32_t request_id = 0;
+        /** In ok responses, continues a paged search; empty once no results are left */
+        std::string cursor;
+        /**
+         * In ok responses, lets a later request with the same search ask whether this answer still
+         * holds; empty if the server cannot tell cheaply
+         */
+        std::string validation_token;
 
         std::vector<char> serialize() const;
 
         static file_search_response parse_from_buffer(const char* buffer, size_t size);
     };
 
+    /**
+     * Front codes a list of paths: each one is stored as the length of the prefix it shares with
+     * the previous path and the remaining suffix, both lengths being LEB128 varints.
+     * Sorted or traversal-ordered absolute paths mostly shrink to their basenames.
+     */
+    struct path_batch_encoder final {
+        std::string encoded;
+        std::string previous;
+        size_t count = 0;
+
+        void add(std::string_view path);
+
+        /** Starts a new batch which does not depend on the paths encoded so far */
+        void clear();
+    };
+
+    /**
+     * Decodes a front-coded batch one path at a time.
+     */
+    struct path_batch_decoder final {
+        std::string_view encoded;
+        size_t offset = 0;
+        /** Last decoded path */
+        std::string path;
+
+        explicit path_batch_decoder(std::string_view encoded)
+            : encoded(encoded) {}
+
+        /**
+         * @throws std::runtime_error on malformed input.
+         * @returns false once the batch is exhausted.
+         */
+        bool next();
+    };
+
+    /**
+     * Every message starts with its total size (including the size field itself) as a network-order uint32.
+     * @returns size of the message which begins in the buffer, 0 if the buffer is too short to tell.
+     */
+    size_t peek_message_size(const char* buffer, size_t size);
+
 } // proto
 
 #endif // __PROTOCOL_HPP__
- 
@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+# Runs an rfinder server indexing a tree and checks substring and fuzzy searches: the indexed and
+# crawled answers agree, typos are tolerated by fuzzy searches only, and -k bounds the results.
+# Usage: ./ranked_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+PORT=$((20000 + RANDOM % 20000))
+ADDRESS=127.0.0.1:$PORT
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-ranked-XXXXXX)
+TREE=$WORK_DIR/tree
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+mkdir -p "$TREE/indexed/a/b" "$TREE/crawled/a/b"
+for dir in indexed crawled; do
+    touch "$TREE/$dir/a/config.yaml" "$TREE/$dir/a/b/config.json" "$TREE/$dir/a/MyConfig.ini" \
+        "$TREE/$dir/a/notes.txt" "$TREE/$dir/a/b/readme.md"
+done
+
+"$SERVER" --index "$TREE/indexed" "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+PIDS+=($!)
+if ! wait_for_port "$PORT"; then
+    echo "Server did not start:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+
+# prints the names a ranked search reports, best first
+names_of() {
+    grep "^$TREE/" <<< "$1" | sed 's|.*/||'
+}
+
+# checks that a search for the query below both trees reports the expected names, in any order
+check() {
+    local what=$1 query=$2 expected=$3
+    shift 3
+    local dir output
+    for dir in indexed crawled; do
+        output=$("$CLIENT" "$@" "$ADDRESS" "$query" "$TREE/$dir" 2>&1)
+        if [ "$(names_of "$output" | sort | tr '\n' ' ')" != "$expected" ]; then
+            fail "$what, $dir" "$output"
+        else
+            pass "$what, $dir"
+        fi
+    done
+}
+
+check "a substring matches regardless of case" config "MyConfig.ini config.json config.yaml " -s
+check "a substring search tolerates no typo" confg "" -s
+check "a fuzzy search tolerates a typo" confg "MyConfig.ini config.json config.yaml " -f
+
+output=$("$CLIENT" -s -k 2 "$ADDRESS" config "$TREE/indexed" 2>&1)
+if [ "$(names_of "$output" | wc -l)" -ne 2 ] || ! grep -qF "(indexed)" <<< "$output"; then
+    fail "-k bounds the results of an indexed search" "$output"
+else
+    pass "top 2 of the index"
+fi
+# exact names rank before longer ones
+best=$(names_of "$output" | head -n 1)
+if [ "$best" != config.json ] && [ "$best" != config.yaml ]; then
+    fail "the closest names come first" "$output"
+else
+    pass "closest names first"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
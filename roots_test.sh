@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+# Runs an rfinder server and checks searches over several roots: the first match below any root
+# answers a lookup, and a file reachable below several roots, nested or through a symlink, is
+# listed once.
+# Usage: ./roots_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+PORT=$((20000 + RANDOM % 20000))
+ADDRESS=127.0.0.1:$PORT
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-roots-XXXXXX)
+TREE=$WORK_DIR/tree
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+mkdir -p "$TREE/a/b" "$TREE/c"
+touch "$TREE/a/b/x.log" "$TREE/c/x.log" "$TREE/a/y.log"
+ln -s "$TREE/a" "$TREE/link"
+
+"$SERVER" "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+PIDS+=($!)
+if ! wait_for_port "$PORT"; then
+    echo "Server did not start:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+
+# checks that a lookup answers the expected message
+check() {
+    local what=$1 expected=$2
+    shift 2
+    local output
+    output=$("$CLIENT" "$ADDRESS" "$@" 2>&1)
+    if ! grep -qxF "Completed with message: \"$expected\"" <<< "$output"; then
+        fail "$what" "$output"
+    else
+        pass "$what"
+    fi
+}
+
+check "a lookup answers the match below a later root" "$TREE/a/y.log" y.log "$TREE/c" "$TREE/a"
+check "a lookup misses below every root" "Not found" z.log "$TREE/c" "$TREE/a"
+
+# checks that listing with -a reports every expected path once and nothing else
+check_all() {
+    local what=$1 expected=$2
+    shift 2
+    local output
+    output=$("$CLIENT" -a "$ADDRESS" x.log "$@" 2>&1)
+    if [ "$(grep "^$TREE/" <<< "$output" | sort)" != "$expected" ]; then
+        fail "$what" "$output"
+    else
+        pass "$what"
+    fi
+}
+
+both=$(printf '%s\n' "$TREE/a/b/x.log" "$TREE/c/x.log" | sort)
+check_all "every root is listed" "$both" "$TREE/a" "$TREE/c"
+check_all "a root nested in another adds nothing" "$both" "$TREE/a" "$TREE/c" "$TREE/a/b"
+check_all "a root reaching the same files through a symlink adds nothing" "$TREE/a/b/x.log" "$TREE/a" "$TREE/link/"
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
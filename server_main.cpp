@@ -1,19 +1,269 @@
 #include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
 
 #include "networking.hpp"
 
+using namespace std::string_view_literals;
+
 static const int DEFAULT_SERVER_PORT = 8080;
 const char* DEFAULT_SERVER_ADDRESS = "127.0.0.1"; //localhost //8.8.8.8
 
+static void print_usage(const char* prog_name) {
+    fprintf(stdout, "Usage: %s [OPTIONS]... [PORT] [unix:PATH]\n", prog_name);
+    fputs("Listens on PORT over TCP and, given unix:PATH, also on a unix domain socket at PATH\n", stdout);
+    fputs("whose file permissions control which local users may connect.\n", stdout);
+    fputs("Options:\n", stdout);
+    fputs("  -x, --exclude GLOB      Never descend into directories matching GLOB (repeatable)\n", stdout);
+    fputs("      --xdev              Do not leave the filesystem of the searched root\n", stdout);
+    fputs("      --include-pseudo-fs Descend into procfs, sysfs and other pseudo-filesystems\n", stdout);
+    fputs("      --content-workers N Threads scanning files, shared by all content searches\n", stdout);
+    fputs("                          (default: one per CPU)\n", stdout);
+    fputs("      --reactors N        Threads accepting connections, each on its own socket (default: one per CPU)\n", stdout);
+    fputs("      --no-pin            Do not pin reactor threads to CPUs\n", stdout);
+    fputs("      --backlog N         Pending connections queued per reactor socket (default: 4096)\n", stdout);
+    fputs("      --max-connections N Connections served at once, more are closed right away (default: 1024)\n", stdout);
+    fputs("      --defer-accept SECONDS\n", stdout);
+    fputs("                          Accept connections only once their request arrived (TCP_DEFER_ACCEPT)\n", stdout);
+    fputs("      --trace-sample RATE Record phase timings of this fraction of requests, e.g. 0.01 (default: 0)\n", stdout);
+    fputs("      --trace-file PATH   Where SIGUSR1 dumps them as Chrome trace JSON\n", stdout);
+    fputs("                          (default: /tmp/rfinder-trace-<pid>.json)\n", stdout);
+    fputs("      --remote-admin      Answer --stats and --trace-dump to any client, not only to local ones\n", stdout);
+    fputs("      --route PREFIX=ADDRESS:PORT\n", stdout);
+    fputs("                          Let the rfinder server at ADDRESS:PORT search below PREFIX (repeatable)\n", stdout);
+    fputs("      --peer-timeout SECONDS\n", stdout);
+    fputs("                          Crawl a routed subtree locally if its peer takes longer (default: 10)\n", stdout);
+    fputs("      --large-dirs        Read directories in multi-megabyte batches and descend in inode order,\n", stdout);
+    fputs("                          for trees with directories of millions of entries\n", stdout);
+    fputs("      --listing-cache MIB Memory for directory listings shared by all searches, 0 to disable\n", stdout);
+    fputs("                          (default: 64)\n", stdout);
+    fputs("      --search-history N  Remember where lookups of up to N names and extensions found them, and\n", stdout);
+    fputs("                          look there first next time, so that the first match reported may be a\n", stdout);
+    fputs("                          deeper one than a breadth-first crawl finds (default: 0, disabled)\n", stdout);
+    fputs("      --search-history-half-life SECONDS\n", stdout);
+    fputs("                          Time after which a remembered hit weighs half as much (default: 604800)\n", stdout);
+    fputs("      --cursor-ttl SECONDS\n", stdout);
+    fputs("                          Time a paged search waits for its next page to be asked (default: 300)\n", stdout);
+    fputs("      --index ROOT        Keep the names below ROOT in a trigram index for substring and fuzzy\n", stdout);
+    fputs("                          searches (repeatable); other roots are crawled for them\n", stdout);
+    fputs("      --index-refresh SECONDS\n", stdout);
+    fputs("                          Rebuild the indexes this often, 0 to build them once (default: 3600)\n", stdout);
+    fputs("      --subtree-filters N Keep a Bloom filter of the names below every indexed directory holding\n", stdout);
+    fputs("                          at least N of them, so that lookups skip subtrees without the name\n", stdout);
+    fputs("      --subtree-filter-kib KIB\n", stdout);
+    fputs("                          Memory of a single filter (default: 256)\n", stdout);
+    fputs("      --subtree-filter-fp RATE\n", stdout);
+    fputs("                          False positive rate filters are sized for (default: 0.01)\n", stdout);
+    fputs("      --prewarm ROOT      Walk ROOT while the server is idle to keep its directories cached\n", stdout);
+    fputs("                          (repeatable), with the lowest CPU and I/O priority\n", stdout);
+    fputs("      --prewarm-rate N    Entries the crawler visits per second, 0 for no limit (default: 5000)\n", stdout);
+    fputs("      --prewarm-idle SECONDS\n", stdout);
+    fputs("                          Time without searches before the crawler runs (default: 30)\n", stdout);
+    fputs("      --prewarm-period SECONDS\n", stdout);
+    fputs("                          Start a crawl this often, 0 to crawl once (default: 3600)\n", stdout);
+    fputs("      --upgrade-socket PATH\n", stdout);
+    fputs("                          Take the listening sockets and warm caches over from the server\n", stdout);
+    fputs("                          listening on PATH, then wait there to hand them to the next one\n", stdout);
+    fputs("      --drain-timeout SECONDS\n", stdout);
+    fputs("                          Time searches in flight get once a successor took over, or once\n", stdout);
+    fputs("                          SIGTERM or SIGINT stopped the server (default: 30)\n", stdout);
+    fputs("      --max-searches N    Searches running at once (default: two per CPU)\n", stdout);
+    fputs("      --max-queue N       Searches waiting for a slot before new ones are rejected (default: 1024)\n", stdout);
+    fputs("      --client-searches N Searches of one client address running at once (default: 4)\n", stdout);
+    fputs("      --client-queue N    Searches of one client address waiting for a slot (default: 64)\n", stdout);
+    fputs("      --client-weight ADDR=W\n", stdout);
+    fputs("                          Give client ADDR W times the share of other clients (repeatable)\n", stdout);
+}
+
 int main(int argc, char** argv) {
     int port = DEFAULT_SERVER_PORT;
-    if (argc > 1) {
-        char* cmdline_port = argv[1];
-        port = std::atoi(cmdline_port);
+    net::tcp_server server;
+    server.address = DEFAULT_SERVER_ADDRESS;
+
+    for (int i = 1; i < argc; ++i) {
+        char* arg = argv[i];
+        if (arg == "-x"sv || arg == "--exclude"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            server.search_config.prune_defaults.exclude_patterns.push_back(argv[i]);
+        } else if (arg == "--xdev"sv) {
+            server.search_config.prune_defaults.one_filesystem = true;
+        } else if (arg == "--include-pseudo-fs"sv) {
+            server.search_config.prune_defaults.skip_pseudo_filesystems = false;
+        } else if (arg == "--content-workers"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            server.search_config.content_workers = std::atoi(argv[i]);
+        } else if (arg == "--reactors"sv || arg == "--backlog"sv || arg == "--defer-accept"sv
+            || arg == "--max-connections"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            int value = std::atoi(argv[i]);
+            if (arg == "--reactors"sv) {
+                server.reactors = value;
+            } else if (arg == "--backlog"sv) {
+                server.backlog = value;
+            } else if (arg == "--max-connections"sv) {
+                if (value < 1) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                server.max_connections = value;
+            } else {
+                server.defer_accept_seconds = value;
+            }
+        } else if (arg == "--trace-sample"sv || arg == "--trace-file"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (arg == "--trace-sample"sv) {
+                server.trace_config.sample_rate = std::atof(argv[i]);
+            } else {
+                server.trace_config.dump_path = argv[i];
+            }
+        } else if (arg == "--no-pin"sv) {
+            server.pin_reactors = false;
+        } else if (arg == "--remote-admin"sv) {
+            server.remote_admin = true;
+        } else if (arg == "--route"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            try {
+                server.search_config.routes.push_back(federation::peer_route::parse(argv[i]));
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Invalid route \"%s\": %s\n", argv[i], e.what());
+                return 1;
+            }
+        } else if (arg == "--peer-timeout"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            server.search_config.peer_timeout = std::chrono::seconds(std::atoi(argv[i]));
+        } else if (arg == "--search-history"sv || arg == "--search-history-half-life"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            auto& history = server.search_config.search_history;
+            if (arg == "--search-history"sv) {
+                history.max_shapes = (size_t)std::atol(argv[i]);
+            } else {
+                history.half_life = std::chrono::seconds(std::atol(argv[i]));
+            }
+        } else if (arg == "--cursor-ttl"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            server.search_config.cursor_ttl = std::chrono::seconds(std::atoi(argv[i]));
+        } else if (arg == "--large-dirs"sv) {
+            server.search_config.large_directories = true;
+        } else if (arg == "--listing-cache"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            server.search_config.listing_cache_bytes = (size_t)std::atoi(argv[i]) << 20;
+        } else if (arg == "--index"sv || arg == "--index-refresh"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (arg == "--index"sv) {
+                server.search_config.index_roots.push_back(argv[i]);
+            } else {
+                server.search_config.index_refresh = std::chrono::seconds(std::atoi(argv[i]));
+            }
+        } else if (arg == "--prewarm"sv || arg == "--prewarm-rate"sv
+                   || arg == "--prewarm-idle"sv || arg == "--prewarm-period"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            auto& crawler = server.prewarm;
+            if (arg == "--prewarm"sv) {
+                crawler.roots.push_back(argv[i]);
+            } else if (arg == "--prewarm-rate"sv) {
+                crawler.entries_per_second = std::atoi(argv[i]);
+            } else if (arg == "--prewarm-idle"sv) {
+                crawler.idle_delay = std::chrono::seconds(std::atoi(argv[i]));
+            } else {
+                crawler.period = std::chrono::seconds(std::atoi(argv[i]));
+            }
+        } else if (arg == "--upgrade-socket"sv || arg == "--drain-timeout"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (arg == "--upgrade-socket"sv) {
+                server.upgrade_socket_path = argv[i];
+            } else {
+                server.drain_timeout = std::chrono::seconds(std::atoi(argv[i]));
+            }
+        } else if (arg == "--subtree-filters"sv || arg == "--subtree-filter-kib"sv || arg == "--subtree-filter-fp"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            auto& filters = server.search_config.subtree_filters;
+            if (arg == "--subtree-filters"sv) {
+                filters.min_names = (size_t)std::atol(argv[i]);
+            } else if (arg == "--subtree-filter-kib"sv) {
+                filters.max_bytes = (size_t)std::atol(argv[i]) << 10;
+            } else {
+                filters.false_positive_rate = std::atof(argv[i]);
+            }
+        } else if (arg == "--max-searches"sv || arg == "--max-queue"sv
+                   || arg == "--client-searches"sv || arg == "--client-queue"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            auto& limits = server.scheduler_config;
+            unsigned value = std::atoi(argv[i]);
+            if (arg == "--max-searches"sv) {
+                limits.max_running = value;
+            } else if (arg == "--max-queue"sv) {
+                limits.max_queued = value;
+            } else if (arg == "--client-searches"sv) {
+                limits.max_running_per_client = value;
+            } else {
+                limits.max_queued_per_client = value;
+            }
+        } else if (arg == "--client-weight"sv) {
+            if (++i >= argc) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            std::string_view weight_arg = argv[i];
+            auto eq = weight_arg.find('=');
+            if (eq == std::string_view::npos) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            server.scheduler_config.client_weights[std::string(weight_arg.substr(0, eq))] =
+                std::atoi(argv[i] + eq + 1);
+        } else if (arg == "-h"sv || arg == "--help"sv) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (std::string_view(arg).substr(0, 5) == "unix:"sv) {
+            server.unix_socket_path = arg + 5;
+        } else {
+            port = std::atoi(arg);
+        }
     }
     try {
-        net::tcp_server server;
-        server.address = DEFAULT_SERVER_ADDRESS;
         server.port = port;
         server.listen();
     } catch (const std::exception& e) {
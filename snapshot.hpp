@@ -0,0 +1,143 @@
+#ifndef __SNAPSHOT_HPP__
+#define __SNAPSHOT_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Binary snapshot of warm server state, handed from a server to its successor on the same host
+ * during an upgrade. Values are stored in host byte order.
+ */
+namespace snapshot {
+
+/** Has to be bumped whenever saved state changes, a successor ignores snapshots of other versions */
+constexpr uint32_t format_version = 2;
+
+struct writer final {
+    std::string out;
+
+    void u8(uint8_t value) {
+        this->out.push_back((char)value);
+    }
+
+    void u32(uint32_t value) {
+        this->out.append((const char*)&value, sizeof(value));
+    }
+
+    void u64(uint64_t value) {
+        this->out.append((const char*)&value, sizeof(value));
+    }
+
+    /** LEB128, for values which are mostly small */
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            this->out.push_back((char)((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        this->out.push_back((char)value);
+    }
+
+    void string(std::string_view s) {
+        this->u64(s.size());
+        this->out.append(s.data(), s.size());
+    }
+
+    /**
+     * Stores the elements as they are in memory, preceded by their size so that a successor
+     * built with another layout rejects them.
+     */
+    template<typename T>
+    void pods(const std::vector<T>& values) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain structures can be copied");
+        this->u32(sizeof(T));
+        this->u64(values.size());
+        this->out.append((const char*)values.data(), values.size() * sizeof(T));
+    }
+};
+
+/**
+ * Reads what a writer wrote in the same order.
+ * Every method throws std::runtime_error on truncated or mismatching data.
+ */
+struct reader final {
+    const char* p;
+    const char* end;
+
+    explicit reader(std::string_view data)
+        : p(data.data()), end(data.data() + data.size()) {}
+
+    bool at_end() const {
+        return this->p == this->end;
+    }
+
+    void need(uint64_t size) const {
+        if ((uint64_t)(this->end - this->p) < size) {
+            throw std::runtime_error("Truncated snapshot");
+        }
+    }
+
+    uint8_t u8() {
+        this->need(1);
+        return (uint8_t)*this->p++;
+    }
+
+    uint32_t u32() {
+        uint32_t value;
+        this->need(sizeof(value));
+        memcpy(&value, this->p, sizeof(value));
+        this->p += sizeof(value);
+        return value;
+    }
+
+    uint64_t u64() {
+        uint64_t value;
+        this->need(sizeof(value));
+        memcpy(&value, this->p, sizeof(value));
+        this->p += sizeof(value);
+        return value;
+    }
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto byte = this->u8();
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Malformed snapshot varint");
+    }
+
+    std::string string() {
+        uint64_t size = this->u64();
+        this->need(size);
+        std::string s(this->p, size);
+        this->p += size;
+        return s;
+    }
+
+    template<typename T>
+    void pods(std::vector<T>& values) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain structures can be copied");
+        if (this->u32() != sizeof(T)) {
+            throw std::runtime_error("Snapshot written with another layout");
+        }
+        uint64_t count = this->u64();
+        if (count > (uint64_t)(this->end - this->p) / sizeof(T)) {
+            throw std::runtime_error("Truncated snapshot");
+        }
+        values.resize(count);
+        memcpy((void*)values.data(), this->p, count * sizeof(T));
+        this->p += count * sizeof(T);
+    }
+};
+
+} // snapshot
+
+#endif // __SNAPSHOT_HPP__
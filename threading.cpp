@@ -1,8 +1,134 @@
+#include <algorithm>
 #include <cassert>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <iterator>
 #include <stdexcept>
 #include "threading.hpp"
 #include "fs.hpp"
+#include "grep.hpp"
+#include "prewarm.hpp"
+#include "tracing.hpp"
+#include "trigram.hpp"
+#include "unicode.hpp"
+
+static fs::metadata_field to_fs_field(proto::predicate_field field) {
+    switch (field) {
+        case proto::predicate_field::size:
+            return fs::metadata_field::size;
+        case proto::predicate_field::mtime_age:
+            return fs::metadata_field::mtime_age;
+        case proto::predicate_field::type:
+            return fs::metadata_field::type;
+        case proto::predicate_field::uid:
+            return fs::metadata_field::uid;
+        case proto::predicate_field::gid:
+            return fs::metadata_field::gid;
+    }
+    throw std::runtime_error("Unknown metadata predicate");
+}
+
+static fs::comparison to_fs_comparison(proto::predicate_op op) {
+    switch (op) {
+        case proto::predicate_op::eq:
+            return fs::comparison::eq;
+        case proto::predicate_op::ne:
+            return fs::comparison::ne;
+        case proto::predicate_op::lt:
+            return fs::comparison::lt;
+        case proto::predicate_op::le:
+            return fs::comparison::le;
+        case proto::predicate_op::gt:
+            return fs::comparison::gt;
+        case proto::predicate_op::ge:
+            return fs::comparison::ge;
+    }
+    throw std::runtime_error("Unknown metadata predicate");
+}
+
+/**
+ * @returns the fs::file_kind of a wire file type, unknown types as they are so that they match nothing.
+ */
+static uint64_t to_fs_kind(uint64_t type) {
+    switch ((proto::file_type)type) {
+        case proto::file_type::regular:
+            return (uint64_t)fs::file_kind::regular;
+        case proto::file_type::directory:
+            return (uint64_t)fs::file_kind::directory;
+        case proto::file_type::symlink:
+            return (uint64_t)fs::file_kind::symlink;
+        case proto::file_type::fifo:
+            return (uint64_t)fs::file_kind::fifo;
+        case proto::file_type::socket:
+            return (uint64_t)fs::file_kind::socket;
+        case proto::file_type::block_device:
+            return (uint64_t)fs::file_kind::block_device;
+        case proto::file_type::char_device:
+            return (uint64_t)fs::file_kind::char_device;
+    }
+    return type;
+}
+
+/**
+ * Applies per-request options on top of the server defaults.
+ */
+static fs::search_options request_search_options(
+    const threading::search_config& config,
+    const proto::file_search_request& req
+) {
+    fs::search_options options;
+    options.large_directories = config.large_directories;
+    auto& rules = options.prune;
+    rules = config.prune_defaults;
+    rules.exclude_patterns.insert(
+        rules.exclude_patterns.end(),
+        req.exclude_patterns.begin(),
+        req.exclude_patterns.end()
+    );
+    if (req.flags & proto::flag_one_filesystem) {
+        rules.one_filesystem = true;
+    }
+    if (req.flags & proto::flag_include_pseudo_filesystems) {
+        rules.skip_pseudo_filesystems = false;
+    }
+    options.follow_symlinks = req.flags & proto::flag_follow_symlinks;
+    if (req.flags & proto::flag_ignore_case) {
+        options.name_fold |= unicode::fold_case;
+    }
+    if (req.flags & proto::flag_ignore_normalization) {
+        options.name_fold |= unicode::fold_normalization;
+    }
+    for (const auto& predicate : req.predicates) {
+        auto field = to_fs_field(predicate.field);
+        options.predicates.push_back(fs::metadata_predicate{
+            field,
+            to_fs_comparison(predicate.op),
+            field == fs::metadata_field::type ? to_fs_kind(predicate.value) : predicate.value
+        });
+    }
+    return options;
+}
+
+threading::priority_class threading::classify(const proto::file_search_request& req) {
+    // "//" or "/." walk the whole filesystem as well; empty roots are rejected by the search
+    std::vector<std::string> roots {req.root_path.empty() ? "/" : req.root_path};
+    std::copy_if(req.extra_roots.begin(), req.extra_roots.end(), std::back_inserter(roots), [](const std::string& root) {
+        return !root.empty();
+    });
+    for (const auto& root : fs::normalize_roots(roots)) {
+        if (root == "/") {
+            return priority_class::crawl;
+        }
+    }
+    if (req.mode == proto::search_mode::content
+        || req.mode == proto::search_mode::substring
+        || req.mode == proto::search_mode::fuzzy
+        || req.flags & (proto::flag_all_matches | proto::flag_filename_glob)) {
+        return priority_class::listing;
+    }
+    return priority_class::scoped;
+}
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
 
@@ -13,6 +139,7 @@ static DWORD WINAPI send_processing_message(LPVOID args) {
     proto::file_search_response msg;
     msg.payload = "Processing...";
     msg.status = proto::file_search_status::pending;
+    msg.request_id = handle->req.request_id;
 
     while (true) {
         if (handle->is_completed()) {
@@ -38,24 +165,38 @@ static DWORD WINAPI search_for_file(LPVOID args) {
     proto::file_search_response res;
 
     auto& req = handle->req;
+    res.request_id = req.request_id;
 
     try {
-        std::string_view root = req.root_path;
-        if (root.empty()) {
-            root = "C:\\";
-        } else if (!fs::dir_exists(root)) {
+        std::vector<std::string> roots {req.root_path.empty() ? "C:\\" : req.root_path};
+        roots.insert(roots.end(), req.extra_roots.begin(), req.extra_roots.end());
+        for (const auto& root : roots) {
+            if (!fs::dir_exists(root)) {
+                res.status = proto::file_search_status::error;
+                res.payload = "Invalid root path";
+                handle->callback(handle.get(), res);
+                return 0; 
+            }
+        }
+        roots = fs::normalize_roots(roots);
+        if (req.mode != proto::search_mode::filename
+            || req.flags & (proto::flag_all_matches | proto::flag_filename_glob)) {
             res.status = proto::file_search_status::error;
-            res.payload = "Invalid root path";
+            res.payload = "Content and multi-match searches are not supported on this platform";
             handle->callback(handle.get(), res);
-            return 0; 
+            return 0;
         }
         print_processing_until_completed(*handle);
-        std::string filepath = fs::find_file(req.filename, root);
+        auto options = request_search_options(handle->config, req);
+        std::string filepath = fs::find_file(req.filename, roots, options);
         handle->end_messaging();
-        res.status = proto::file_search_status::ok;
         if (filepath.empty()) {
+            res.status = req.version >= proto::not_found_version
+                ? proto::file_search_status::not_found
+                : proto::file_search_status::ok;
             res.payload = "Not found";
         } else {
+            res.status = proto::file_search_status::ok;
             res.payload = filepath;
         }
         handle->callback(handle.get(), res);
@@ -80,24 +221,41 @@ void threading::find_file_task(std::unique_ptr<win32_task_handle> handle) {
 
 #elif __unix__
 
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <map>
+#include <random>
+#include <regex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+using namespace std::string_literals;
+
 using repeating_routine = void*(*)(void*);
 
 static void* send_processing_message(void* args) {
     auto* handle = (threading::unix_task_handle*)args;
-    __useconds_t interval = std::chrono::milliseconds(500).count() * 1000;
+    auto interval = std::chrono::milliseconds(500);
 
     proto::file_search_response msg;
     msg.payload = "Processing...";
     msg.status = proto::file_search_status::pending;
+    msg.request_id = handle->req.request_id;
 
     while (true) {
         if (handle->is_completed()) {
             break;
         }
         handle->callback(handle, msg);
-        usleep(interval);
+        if (handle->wait_completed(interval)) {
+            break;
+        }
     }
     return 0;
 }
@@ -111,51 +269,1269 @@ static pthread_t print_processing_until_completed(threading::unix_task_handle& h
     return thread;
 }
 
-static void* search_file(void* args) {
-    std::unique_ptr<threading::unix_task_handle> handle((threading::unix_task_handle*)args);
-    handle->completed = 0;
+/**
+ * @returns true for searches listing their results a page at a time.
+ */
+static bool is_paged(const proto::file_search_request& req) {
+    return req.page_size != 0 && req.mode == proto::search_mode::filename
+        && req.flags & (proto::flag_all_matches | proto::flag_filename_glob);
+}
+
+/**
+ * Threads forwarding searches to peers, shared by every search. Forwards are refused once too
+ * many are waiting for a thread, their subtrees are then crawled locally.
+ */
+struct forward_pool final {
+    static constexpr unsigned THREADS = 16;
+    static constexpr size_t MAX_QUEUED = 256;
+
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::deque<std::function<void()>> jobs;
+    bool started = false;
+
+    bool submit(std::function<void()> job) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->jobs.size() >= MAX_QUEUED) {
+            return false;
+        }
+        if (!this->started) {
+            for (unsigned i = 0; i < THREADS; ++i) {
+                // threads live as long as the process, the pool is never destroyed
+                std::thread([this] { this->run(); }).detach();
+            }
+            this->started = true;
+        }
+        this->jobs.push_back(std::move(job));
+        this->work_available.notify_one();
+        return true;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            this->work_available.wait(lock, [this] { return !this->jobs.empty(); });
+            auto job = std::move(this->jobs.front());
+            this->jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+};
+
+static forward_pool& shared_forwards() {
+    static auto* pool = new forward_pool();
+    return *pool;
+}
+
+/**
+ * Parts of a search handed over to peer servers by the routing table. Peers are queried by the
+ * forward pool while the rest of the tree is crawled locally. Their responses are passed to
+ * on_response between the directories of the local traversal as they arrive, and the rest by
+ * collect once it is done. A peer waits while MAX_BUFFERED of its responses are not passed on yet.
+ * Subtrees whose peer failed or timed out are crawled locally after all, skipping the results
+ * the peer streamed before it failed.
+ */
+struct federated_search final {
+    static constexpr size_t MAX_BUFFERED = 64;
+
+    struct subtree final {
+        std::string dir;
+        /** Guarded by the channel, like finished and completed */
+        std::deque<proto::file_search_response> responses;
+        bool finished = false;
+        bool completed = false;
+        /** Every response was passed on, seen by the search only */
+        bool done = false;
+    };
+
+    /** Outlives the search in the forwards still running */
+    struct channel final {
+        std::mutex mutex;
+        std::condition_variable changed;
+        /** Set once the search no longer takes responses */
+        bool abandoned = false;
+    };
+
+    const threading::unix_task_handle& handle;
+    std::vector<std::shared_ptr<subtree>> subtrees;
+    std::shared_ptr<channel> peers = std::make_shared<channel>();
+    /** Set by searches streaming peer responses during their local traversal */
+    std::function<bool(const proto::file_search_response&)> on_response;
+    /** Subtrees of failed peers not crawled locally yet */
+    std::vector<std::string> failed;
+    /** Results passed on from peers, see remember */
+    std::unordered_set<std::string> peer_results;
+    bool stopped = false;
+
+    explicit federated_search(const threading::unix_task_handle& handle)
+        : handle(handle) {}
+
+    ~federated_search() {
+        std::lock_guard<std::mutex> lock(this->peers->mutex);
+        this->peers->abandoned = true;
+        this->peers->changed.notify_all();
+    }
+
+    bool enabled() const {
+        // the frontier of a paged search only covers the local traversal
+        return !this->handle.config.routes.empty() && !(this->handle.req.flags & proto::flag_no_forward)
+            && !is_paged(this->handle.req);
+    }
+
+    /**
+     * Starts forwarding the directory if it is routed to a peer.
+     * @returns true if the directory is no longer to be crawled locally.
+     */
+    bool delegate(const std::string& dir) {
+        auto* route = federation::find_route(this->handle.config.routes, dir);
+        if (!route) {
+            return false;
+        }
+        auto forwarded = std::make_shared<subtree>();
+        forwarded->dir = dir;
+        auto req = this->handle.req;
+        req.root_path = dir;
+        req.extra_roots.clear();
+        req.validation_token.clear();
+        req.flags |= proto::flag_no_forward;
+        auto deadline = std::chrono::steady_clock::now() + this->handle.config.peer_timeout;
+        // owns copies of everything, the search may finish before the peer does
+        bool queued = shared_forwards().submit([forwarded, peers = this->peers, route = *route, req = std::move(req),
+                                                deadline] {
+            bool completed = false;
+            try {
+                completed = federation::forward(route, req, deadline, [&](proto::file_search_response& res) {
+                    std::unique_lock<std::mutex> lock(peers->mutex);
+                    bool room = peers->changed.wait_until(lock, deadline, [&] {
+                        return peers->abandoned || forwarded->responses.size() < MAX_BUFFERED;
+                    });
+                    if (!room || peers->abandoned) {
+                        return false;
+                    }
+                    forwarded->responses.push_back(std::move(res));
+                    peers->changed.notify_all();
+                    return true;
+                });
+            } catch (const std::exception& e) {
+                fprintf(stderr, "Malformed response of peer %s:%u: %s\n", route.address.c_str(), route.port, e.what());
+            } catch (...) {
+                fprintf(stderr, "Forward to peer %s:%u failed\n", route.address.c_str(), route.port);
+            }
+            std::lock_guard<std::mutex> lock(peers->mutex);
+            forwarded->finished = true;
+            forwarded->completed = completed;
+            peers->changed.notify_all();
+        });
+        if (!queued) {
+            return false;
+        }
+        this->subtrees.push_back(std::move(forwarded));
+        return true;
+    }
+
+    /**
+     * Makes the traversal hand routed directories over to their peers, and pass on the
+     * responses they sent so far before every directory it reads.
+     */
+    void install(fs::search_options& options) {
+        if (!this->enabled()) {
+            return;
+        }
+        options.delegate_subtree = [this](const std::string& dir) { return this->delegate(dir); };
+        options.on_directory = [this, previous = std::move(options.on_directory)](const std::string& dir) {
+            if (previous) {
+                previous(dir);
+            }
+            if (this->on_response && !this->subtrees.empty()) {
+                this->drain();
+            }
+        };
+    }
+
+    /**
+     * Notes a result a peer sent, identified by its path and for content searches its line number,
+     * which the local crawl of the subtree then skips should the peer fail later on.
+     */
+    void remember(std::string key) {
+        this->peer_results.insert(std::move(key));
+    }
+
+    /**
+     * @returns true if a peer already sent the result.
+     */
+    bool was_reported(const std::string& key) const {
+        return this->peer_results.count(key) != 0;
+    }
+
+    /**
+     * Passes the responses peers sent so far to on_response, and notes the subtrees of the
+     * peers which failed to crawl them locally.
+     * @returns false once on_response asked to stop.
+     */
+    bool drain() {
+        std::deque<proto::file_search_response> ready;
+        for (auto& forwarded : this->subtrees) {
+            if (this->stopped) {
+                return false;
+            }
+            if (forwarded->done) {
+                continue;
+            }
+            bool finished;
+            {
+                std::lock_guard<std::mutex> lock(this->peers->mutex);
+                ready.swap(forwarded->responses);
+                finished = forwarded->finished;
+                if (finished && !forwarded->completed) {
+                    // the subtree is crawled again, skipping what the peer sent
+                    this->failed.push_back(forwarded->dir);
+                }
+                this->peers->changed.notify_all();
+            }
+            forwarded->done = finished;
+            for (const auto& res : ready) {
+                if (!this->on_response(res)) {
+                    this->stopped = true;
+                    return false;
+                }
+            }
+            ready.clear();
+        }
+        return true;
+    }
+
+    /**
+     * Passes every response of the peers to on_response as they arrive, and the directories of
+     * the peers which failed to crawl_locally, until every peer is done.
+     * Both return false to stop collecting.
+     */
+    template<typename CrawlLocally>
+    void collect(CrawlLocally&& crawl_locally) {
+        while (this->drain()) {
+            for (size_t i = 0; i < this->failed.size(); ++i) {
+                fprintf(stdout, "Peer did not complete \"%s\", crawling it locally\n", this->failed[i].c_str());
+                if (!crawl_locally(this->failed[i])) {
+                    return;
+                }
+            }
+            this->failed.clear();
+            bool all_done = true;
+            std::unique_lock<std::mutex> lock(this->peers->mutex);
+            this->peers->changed.wait(lock, [&] {
+                all_done = true;
+                for (const auto& forwarded : this->subtrees) {
+                    if (forwarded->done) {
+                        continue;
+                    }
+                    all_done = false;
+                    if (forwarded->finished || !forwarded->responses.empty()) {
+                        return true;
+                    }
+                }
+                return all_done;
+            });
+            if (all_done) {
+                return;
+            }
+        }
+    }
+};
+
+/**
+ * Streams every matching line to the client as a match response and fills in the final one.
+ */
+static void search_contents(
+    threading::unix_task_handle& handle,
+    const std::vector<std::string>& roots,
+    const fs::search_options& options,
+    federated_search& federated,
+    proto::file_search_response& res
+) {
+    const auto& req = handle.req;
+    grep::query query;
+    query.pattern = req.content_pattern;
+    query.regex = req.flags & proto::flag_content_regex;
+    query.filename_glob = req.filename;
+
+    proto::file_search_response match_res;
+    match_res.status = proto::file_search_status::match;
+    match_res.request_id = req.request_id;
+    // grep::search reports from this thread, like the traversal passing on peer matches
+    auto key_of = [](const std::string& path, uint32_t line_number) {
+        return path + '\0' + std::to_string(line_number);
+    };
+    auto send_match = [&](const grep::match& m) {
+        match_res.payload = m.path;
+        match_res.line_number = m.line_number;
+        match_res.snippet = m.line;
+        return handle.callback(&handle, match_res);
+    };
+    try {
+        size_t matches = 0;
+        size_t peer_matches = 0;
+        federated.on_response = [&](const proto::file_search_response& peer_res) {
+            if (peer_res.status != proto::file_search_status::match) {
+                return true;
+            }
+            ++peer_matches;
+            federated.remember(key_of(peer_res.payload, peer_res.line_number));
+            return send_match(grep::match{peer_res.payload, peer_res.line_number, peer_res.snippet});
+        };
+        if (!roots.empty()) {
+            tracing::span span("traversal", handle.trace_id);
+            matches = grep::search(roots, query, options, send_match);
+        }
+        auto local_options = options;
+        local_options.delegate_subtree = nullptr;
+        tracing::span span("peer_results", federated.subtrees.empty() ? 0 : handle.trace_id);
+        federated.collect([&](const std::string& dir) {
+            grep::search(dir, query, local_options, [&](const grep::match& m) {
+                if (federated.was_reported(key_of(m.path, m.line_number))) {
+                    return true;
+                }
+                ++matches;
+                return send_match(m);
+            });
+            return true;
+        });
+        matches += peer_matches;
+        res.status = proto::file_search_status::ok;
+        res.payload = std::to_string(matches) + " matching lines";
+    } catch (const std::regex_error& e) {
+        res.status = proto::file_search_status::error;
+        res.payload = "Invalid regular expression: "s + e.what();
+    }
+}
+
+/**
+ * Sends found paths to the client, front-coded in batches if the client understands them.
+ * A batch goes out once it is full or MAX_BATCH_DELAY old, checked with every path and, through
+ * install(), before every directory the traversal reads, so that sparse matches are not held back.
+ */
+struct path_sender final {
+    static constexpr size_t MAX_BATCH_BYTES = 32 * 1024;
+    static constexpr auto MAX_BATCH_DELAY = std::chrono::milliseconds(50);
+
+    threading::unix_task_handle& handle;
+    bool batched;
+    proto::path_batch_encoder encoder;
+    std::chrono::steady_clock::time_point last_flush = std::chrono::steady_clock::now();
+    bool client_gone = false;
+
+    void install(fs::search_options& options) {
+        if (this->batched) {
+            options.on_directory = [this, previous = std::move(options.on_directory)](const std::string& dir) {
+                if (previous) {
+                    previous(dir);
+                }
+                if (this->encoder.count && std::chrono::steady_clock::now() - this->last_flush >= MAX_BATCH_DELAY) {
+                    this->flush();
+                }
+            };
+        }
+    }
+
+    /**
+     * @returns false once the client is gone.
+     */
+    bool add(const std::string& path) {
+        if (this->client_gone) {
+            return false;
+        }
+        if (!this->batched) {
+            proto::file_search_response res;
+            res.status = proto::file_search_status::match;
+            res.request_id = this->handle.req.request_id;
+            res.payload = path;
+            return this->handle.callback(&this->handle, res);
+        }
+        this->encoder.add(path);
+        if (this->encoder.encoded.size() >= MAX_BATCH_BYTES
+            || std::chrono::steady_clock::now() - this->last_flush >= MAX_BATCH_DELAY) {
+            return this->flush();
+        }
+        return true;
+    }
+
+    bool flush() {
+        this->last_flush = std::chrono::steady_clock::now();
+        if (this->encoder.count == 0) {
+            return true;
+        }
+        proto::file_search_response res;
+        res.status = proto::file_search_status::match_batch;
+        res.request_id = this->handle.req.request_id;
+        res.payload = std::move(this->encoder.encoded);
+        this->encoder.clear();
+        this->client_gone = !this->handle.callback(&this->handle, res);
+        return !this->client_gone;
+    }
+};
+
+/**
+ * Traversal frontiers of paged searches between their pages, known to clients by random ids.
+ * A cursor is dropped once its page is requested, or when it expires. Past either limit the
+ * cursors closest to expiring are dropped first.
+ */
+struct cursor_store final {
+    static constexpr size_t MAX_CURSORS = 4096;
+    /** Frontiers and queries of every cursor, a single one over it is refused */
+    static constexpr size_t MAX_BYTES = 64u << 20;
+
+    /** Ids of the cursors by the time they expire */
+    using expiry_index = std::multimap<std::chrono::steady_clock::time_point, std::string>;
+
+    struct entry final {
+        std::string frontier;
+        /** The request without its paging fields, which the next page has to repeat */
+        std::string query;
+        expiry_index::iterator expiry;
+        size_t size = 0;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, entry> entries;
+    expiry_index by_expiry;
+    size_t bytes = 0;
+    std::mt19937_64 random {std::random_device{}()};
+
+    void erase(std::unordered_map<std::string, entry>::iterator it) {
+        this->bytes -= it->second.size;
+        this->by_expiry.erase(it->second.expiry);
+        this->entries.erase(it);
+    }
+
+    /**
+     * Drops the cursor closest to expiring.
+     */
+    void erase_first() {
+        this->erase(this->entries.find(this->by_expiry.begin()->second));
+    }
+
+    static std::string query_of(proto::file_search_request req) {
+        req.request_id = 0;
+        req.page_size = 0;
+        req.cursor.clear();
+        auto serialized = req.serialize();
+        return std::string(serialized.begin(), serialized.end());
+    }
+
+    /**
+     * @returns the id of the new cursor, empty if the frontier is too large to keep.
+     */
+    std::string put(std::string frontier, std::string query, std::chrono::seconds ttl) {
+        auto now = std::chrono::steady_clock::now();
+        size_t size = frontier.size() + query.size();
+        if (size > MAX_BYTES) {
+            return "";
+        }
+        std::lock_guard<std::mutex> lock(this->mutex);
+        while (!this->by_expiry.empty() && this->by_expiry.begin()->first <= now) {
+            this->erase_first();
+        }
+        while (!this->entries.empty() && (this->entries.size() >= MAX_CURSORS || this->bytes + size > MAX_BYTES)) {
+            this->erase_first();
+        }
+        char id[33];
+        snprintf(id, sizeof(id), "%016llx%016llx", (unsigned long long)this->random(), (unsigned long long)this->random());
+        this->bytes += size;
+        this->entries[id] = entry {std::move(frontier), std::move(query), this->by_expiry.emplace(now + ttl, id), size};
+        return id;
+    }
+
+    /**
+     * @returns false if the cursor is unknown, expired or was issued for another search.
+     */
+    bool take(const std::string& cursor, const std::string& query, std::string& frontier) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto found = this->entries.find(cursor);
+        if (found == this->entries.end()) {
+            return false;
+        }
+        bool valid = found->second.expiry->first > std::chrono::steady_clock::now() && found->second.query == query;
+        if (valid) {
+            frontier = std::move(found->second.frontier);
+            this->erase(found);
+        }
+        return valid;
+    }
+};
+
+static cursor_store cursors;
+
+/**
+ * Streams the next page of files matching the requested name (or glob) and fills in the final
+ * response, with a cursor for the page after it unless the traversal is complete.
+ */
+static void search_page(
+    threading::unix_task_handle& handle,
+    const std::vector<std::string>& roots,
+    const fs::search_options& options,
+    proto::file_search_response& res
+) {
+    const auto& req = handle.req;
+    auto query = cursor_store::query_of(req);
+    std::string frontier;
+    if (!req.cursor.empty() && !cursors.take(req.cursor, query, frontier)) {
+        res.status = proto::file_search_status::error;
+        res.payload = "Unknown or expired cursor";
+        return;
+    }
+    fs::name_matcher matcher;
+    matcher.type = req.flags & proto::flag_filename_glob ? fs::name_matcher::kind::glob : fs::name_matcher::kind::exact;
+    matcher.text = req.filename;
+    path_sender sender {handle, req.version >= proto::batch_responses_version, {}};
+    auto traversal_options = options;
+    sender.install(traversal_options);
+    size_t matches;
+    {
+        tracing::span span("traversal", handle.trace_id);
+        matches = fs::find_page(roots, matcher, traversal_options, req.page_size, frontier, [&](const fs::entry& entry) {
+            return sender.add(entry.path());
+        });
+    }
+    sender.flush();
+    res.status = proto::file_search_status::ok;
+    res.payload = std::to_string(matches) + " matches";
+    if (!frontier.empty()) {
+        res.cursor = cursors.put(std::move(frontier), std::move(query), handle.config.cursor_ttl);
+        if (res.cursor.empty()) {
+            // without a cursor the page would pass for the last one
+            res.status = proto::file_search_status::error;
+            res.payload = "Search too large to page, " + res.payload + " sent";
+        }
+    }
+}
+
+/**
+ * Streams every file matching the requested name (or glob) and fills in the final response.
+ */
+static void search_all_matches(
+    threading::unix_task_handle& handle,
+    const std::vector<std::string>& roots,
+    const fs::search_options& options,
+    federated_search& federated,
+    proto::file_search_response& res
+) {
+    const auto& req = handle.req;
+    fs::name_matcher matcher;
+    matcher.type = req.flags & proto::flag_filename_glob ? fs::name_matcher::kind::glob : fs::name_matcher::kind::exact;
+    matcher.text = req.filename;
+    path_sender sender {handle, req.version >= proto::batch_responses_version, {}};
+    auto traversal_options = options;
+    sender.install(traversal_options);
+    size_t matches = 0;
+    auto visit = [&](const fs::entry& entry) {
+        ++matches;
+        return sender.add(entry.path());
+    };
+    federated.on_response = [&](const proto::file_search_response& peer_res) {
+        if (peer_res.status == proto::file_search_status::match) {
+            ++matches;
+            federated.remember(peer_res.payload);
+            return sender.add(peer_res.payload);
+        }
+        if (peer_res.status == proto::file_search_status::match_batch) {
+            proto::path_batch_decoder decoder(peer_res.payload);
+            while (decoder.next()) {
+                ++matches;
+                federated.remember(decoder.path);
+                if (!sender.add(decoder.path)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    if (!roots.empty()) {
+        tracing::span span("traversal", handle.trace_id);
+        fs::find_all(roots, matcher, traversal_options, visit);
+    }
+    auto local_options = traversal_options;
+    local_options.delegate_subtree = nullptr;
+    tracing::span span("peer_results", federated.subtrees.empty() ? 0 : handle.trace_id);
+    federated.collect([&](const std::string& dir) {
+        fs::find_all(dir, matcher, local_options, [&](const fs::entry& entry) {
+            auto path = entry.path();
+            if (federated.was_reported(path)) {
+                return true;
+            }
+            ++matches;
+            return sender.add(path);
+        });
+        return !sender.client_gone;
+    });
+    sender.flush();
+    res.status = proto::file_search_status::ok;
+    res.payload = std::to_string(matches) + " matches";
+}
+
+static const uint32_t DEFAULT_RANKED_RESULTS = 100;
+static const uint32_t MAX_RANKED_RESULTS = 10000;
+
+/**
+ * Streams the files whose name best matches a partial or misspelled filename, best first.
+ * Requests walking the tree like the index was built are answered from the covering index,
+ * others and roots no index covers are crawled. Ranked searches are never forwarded to peers.
+ */
+static void search_ranked(
+    threading::unix_task_handle& handle,
+    const std::vector<std::string>& roots,
+    const fs::search_options& options,
+    proto::file_search_response& res
+) {
+    const auto& req = handle.req;
+    auto kind = req.mode == proto::search_mode::fuzzy ? trigram::query_kind::fuzzy : trigram::query_kind::substring;
+    auto query = trigram::query::make(kind, req.filename);
+    trigram::top_k results(req.max_results ? std::min(req.max_results, MAX_RANKED_RESULTS) : DEFAULT_RANKED_RESULTS);
+    bool default_traversal = req.exclude_patterns.empty() && req.predicates.empty()
+        && !(req.flags & (proto::flag_one_filesystem | proto::flag_include_pseudo_filesystems | proto::flag_follow_symlinks));
+    bool indexed = false;
+    // the roots no index covers are crawled together, reporting a file below several of them once
+    std::vector<std::string> crawled_roots;
+    for (const auto& root : roots) {
+        auto index = default_traversal ? trigram::find_index(root) : nullptr;
+        if (index) {
+            tracing::span span("index_lookup", handle.trace_id);
+            index->search(query, root, results);
+            indexed = true;
+        } else {
+            crawled_roots.push_back(root);
+        }
+    }
+    if (!crawled_roots.empty()) {
+        tracing::span span("traversal", handle.trace_id);
+        trigram::crawl(query, crawled_roots, options, results);
+    }
+    auto ranked = results.take_sorted();
+    if (indexed) {
+        // an index is as old as its last refresh, files removed since are not sent
+        tracing::span span("revalidation", handle.trace_id);
+        ranked.erase(std::remove_if(ranked.begin(), ranked.end(), [](const trigram::ranked_match& match) {
+            struct stat statbuf;
+            return fstatat(AT_FDCWD, match.path.c_str(), &statbuf, AT_SYMLINK_NOFOLLOW) != 0;
+        }), ranked.end());
+    }
+    path_sender sender {handle, req.version >= proto::batch_responses_version, {}};
+    for (const auto& match : ranked) {
+        if (!sender.add(match.path)) {
+            break;
+        }
+    }
+    sender.flush();
+    res.status = proto::file_search_status::ok;
+    res.payload = std::to_string(ranked.size()) + (indexed ? " matches (indexed)" : " matches");
+}
+
+/**
+ * @returns true for searches answered with a single path, which validation tokens can vouch for.
+ * Predicates on the age of the file may change the answer without any change on disk.
+ */
+static bool is_conditional(const proto::file_search_request& req) {
+    if (req.version < proto::conditional_requests_version || req.mode != proto::search_mode::filename
+        || req.flags & (proto::flag_all_matches | proto::flag_filename_glob)) {
+        return false;
+    }
+    return std::none_of(req.predicates.begin(), req.predicates.end(), [](const proto::metadata_predicate& predicate) {
+        return predicate.field == proto::predicate_field::mtime_age;
+    });
+}
+
+static const size_t FINGERPRINT_DIGITS = 16;
+
+/**
+ * Validation tokens are the fingerprint of the path (see fs::path_fingerprint) followed by the
+ * path itself, so that checking one takes a stat per directory of the path and no state.
+ * A token only vouches that the path is still there and unchanged: a file with the same name
+ * appearing elsewhere in the tree does not invalidate it.
+ * @returns the token, empty if the path cannot be fingerprinted.
+ */
+static std::string make_validation_token(const std::vector<std::string>& roots, const std::string& path) {
+    for (const auto& root : roots) {
+        if (uint64_t fingerprint = fs::path_fingerprint(root, path)) {
+            char digits[FINGERPRINT_DIGITS + 1];
+            snprintf(digits, sizeof(digits), "%016llx", (unsigned long long)fingerprint);
+            return digits + path;
+        }
+    }
+    return "";
+}
+
+/**
+ * @returns true if a traversal under the options would report path as an answer to the request:
+ * the name matches, the walk would reach it (see fs::is_reported) and the predicates hold.
+ * A token may have been issued for another request, or forged, the fingerprint alone cannot tell.
+ */
+static bool answers_request(
+    const proto::file_search_request& req,
+    const std::string& root,
+    const std::string& path,
+    const fs::search_options& options
+) {
+    size_t name_start = path.rfind('/') + 1;
+    std::string_view name(path.c_str() + name_start, path.size() - name_start);
+    bool name_matches = options.name_fold
+        ? unicode::folded_equals(name, unicode::fold(req.filename, options.name_fold), options.name_fold)
+        : name == req.filename;
+    if (!name_matches || !fs::is_reported(root, path, options)) {
+        return false;
+    }
+    std::string_view dir(path.c_str(), name_start);
+    return fs::satisfies_predicates(fs::entry{dir, name, fs::entry_type::other}, options);
+}
+
+/**
+ * @returns the path the token of the request vouches for, empty if it no longer holds.
+ */
+static std::string validate_token(
+    const proto::file_search_request& req,
+    const std::vector<std::string>& roots,
+    const threading::search_config& config,
+    fs::search_options options
+) {
+    const auto& token = req.validation_token;
+    if (token.size() <= FINGERPRINT_DIGITS) {
+        return "";
+    }
+    auto path = token.substr(FINGERPRINT_DIGITS);
+    // paths below routed subtrees are answered by peers, no token is issued for them
+    if (!(req.flags & proto::flag_no_forward)) {
+        options.delegate_subtree = [&config](const std::string& dir) {
+            return federation::find_route(config.routes, dir) != 0;
+        };
+    }
+    for (const auto& root : roots) {
+        if (uint64_t fingerprint = fs::path_fingerprint(root, path)) {
+            char digits[FINGERPRINT_DIGITS + 1];
+            snprintf(digits, sizeof(digits), "%016llx", (unsigned long long)fingerprint);
+            bool valid = token.compare(0, FINGERPRINT_DIGITS, digits) == 0 && answers_request(req, root, path, options);
+            return valid ? path : "";
+        }
+    }
+    return "";
+}
+
+/**
+ * Ends a search that threw, so that the scheduler thread survives to serve the next one.
+ */
+static void fail_search(threading::unix_task_handle& handle, proto::file_search_response& res) {
+    res.status = proto::file_search_status::error;
+    res.payload = "Internal error";
+    if (handle.messaging_thread) {
+        handle.end_messaging(res);
+    } else {
+        handle.callback(&handle, res);
+    }
+}
+
+static void search_file(std::unique_ptr<threading::unix_task_handle> handle) {
+    handle->completed = false;
+    tracing::span search_span("search", handle->trace_id);
 
     proto::file_search_response res;
     auto& req = handle->req;
+    res.request_id = req.request_id;
 
     try {
-        handle->messaging_thread = print_processing_until_completed(*handle);
-        std::string_view root = req.root_path;
-        if (req.root_path.empty()) {
-            root = "/";
-        } else if (!fs::dir_exists(req.root_path)) {
+        std::vector<std::string> roots {req.root_path.empty() ? "/" : req.root_path};
+        roots.insert(roots.end(), req.extra_roots.begin(), req.extra_roots.end());
+        if (std::any_of(roots.begin(), roots.end(), [](const std::string& root) { return root.empty(); })) {
             res.status = proto::file_search_status::error;
             res.payload = "Invalid root path";
+            handle->callback(handle.get(), res);
+            return;
+        }
+        // roots nested in others would only be walked twice; tokens are issued and checked against these
+        roots = fs::normalize_roots(roots);
+        auto options = request_search_options(handle->config, req);
+        bool conditional = is_conditional(req);
+        if (conditional && !req.validation_token.empty()) {
+            tracing::span span("validate_token", handle->trace_id);
+            // answered before any progress message, the whole exchange is a single frame each way
+            if (!validate_token(req, roots, handle->config, options).empty()) {
+                res.status = proto::file_search_status::not_modified;
+                handle->callback(handle.get(), res);
+                return;
+            }
+        }
+        {
+            tracing::span span("start_messaging", handle->trace_id);
+            handle->messaging_thread = print_processing_until_completed(*handle);
+        }
+        {
+            tracing::span span("dir_exists", handle->trace_id);
+            for (const auto& root : roots) {
+                if (!fs::dir_exists(root)) {
+                    res.status = proto::file_search_status::error;
+                    res.payload = "Invalid root path";
+                    handle->end_messaging(res);
+                    return;
+                }
+            }
+        }
+        if (req.mode == proto::search_mode::substring || req.mode == proto::search_mode::fuzzy) {
+            search_ranked(*handle, roots, options, res);
             handle->end_messaging(res);
-            return 0;
+            return;
+        }
+        federated_search federated(*handle);
+        // a root below a routed prefix is forwarded as a whole, the others are walked together
+        std::vector<std::string> local_roots;
+        for (const auto& root : roots) {
+            if (!federated.enabled() || !federated.delegate(root)) {
+                local_roots.push_back(root);
+            }
+        }
+        federated.install(options);
+        if (req.mode == proto::search_mode::content) {
+            search_contents(*handle, local_roots, options, federated, res);
+            handle->end_messaging(res);
+            return;
+        }
+        if (is_paged(req)) {
+            search_page(*handle, local_roots, options, res);
+            handle->end_messaging(res);
+            return;
+        }
+        if (req.flags & (proto::flag_all_matches | proto::flag_filename_glob)) {
+            search_all_matches(*handle, local_roots, options, federated, res);
+            handle->end_messaging(res);
+            return;
+        }
+        std::string filepath;
+        if (!local_roots.empty()) {
+            tracing::span span("traversal", handle->trace_id);
+            filepath = fs::find_file(req.filename, local_roots, options);
+        }
+        // paths answered by peers cannot be checked here
+        bool local_result = !filepath.empty();
+        if (filepath.empty()) {
+            tracing::span span("peer_results", federated.subtrees.empty() ? 0 : handle->trace_id);
+            auto local_options = options;
+            local_options.delegate_subtree = nullptr;
+            // peers answer only once the local traversal found nothing, and not during the crawls
+            // of the subtrees of failed peers, which would overwrite their answer
+            local_options.on_directory = nullptr;
+            federated.on_response = [&](const proto::file_search_response& peer_res) {
+                // forwarded requests carry the current version, peers answer not_found if they found nothing
+                if (peer_res.status == proto::file_search_status::ok) {
+                    filepath = peer_res.payload;
+                    return false;
+                }
+                return true;
+            };
+            federated.collect([&](const std::string& dir) {
+                filepath = fs::find_file(req.filename, dir, local_options);
+                local_result = !filepath.empty();
+                return !local_result;
+            });
         }
-        std::string filepath = fs::find_file(req.filename, root);
-        res.status = proto::file_search_status::ok;
         if (filepath.empty()) {
+            res.status = req.version >= proto::not_found_version
+                ? proto::file_search_status::not_found
+                : proto::file_search_status::ok;
             res.payload = "Not found";
         } else {
+            res.status = proto::file_search_status::ok;
             res.payload = filepath;
         }
+        if (conditional && local_result) {
+            res.validation_token = make_validation_token(roots, filepath);
+        }
         handle->end_messaging(res);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Search failed: %s\n", e.what());
+        fail_search(*handle, res);
     } catch (...) {
-        res.status = proto::file_search_status::error;
-        res.payload = "Internal error";
-        handle->end_messaging(res);
-        // TODO: find out what really happens when throwing from a detached thread
-        // pthread_exit(0);
-        throw;
+        fprintf(stderr, "Search failed with an unknown exception\n");
+        fail_search(*handle, res);
+    }
+}
+
+/**
+ * Admission control and dispatch of searches to a fixed pool of threads.
+ *
+ * Priority classes share the pool by stride scheduling: each dispatch advances the pass of
+ * its class by the inverse of the class weight and the lowest pass goes next, so cheap scoped
+ * searches overtake crawls without starving them. Inside a class clients are served by
+ * weighted fair queuing on the same principle, with per-client virtual times.
+ */
+struct search_scheduler final {
+    static constexpr unsigned CLASS_WEIGHTS[threading::priority_class_count] = {8, 3, 1};
+    static constexpr double SERVICE_TIME_SMOOTHING = 0.2;
+
+    struct queued_search final {
+        std::unique_ptr<threading::unix_task_handle> handle;
+        std::chrono::steady_clock::time_point enqueued;
+        /** Not dispatched until its client was told it is queued, which has to come before any result */
+        bool announcing = false;
+    };
+
+    /** Searches of one client waiting in one class */
+    struct client_lane final {
+        std::deque<queued_search> searches;
+        double virtual_time = 0;
+    };
+
+    struct class_state final {
+        std::map<std::string, client_lane> lanes;
+        double pass = 0;
+        /** Virtual time of the last dispatched search, where clients joining the class start */
+        double virtual_clock = 0;
+        size_t queued = 0;
+        double wait_seconds_sum = 0;
+        double wait_seconds_max = 0;
+        uint64_t dispatched = 0;
+        uint64_t rejected = 0;
+    };
+
+    struct client_usage final {
+        unsigned running = 0;
+        unsigned queued = 0;
+    };
+
+    threading::scheduler_config config;
+    std::mutex mutex;
+    std::condition_variable work_available;
+    /** Notified when the last running search finishes with none queued */
+    std::condition_variable idle;
+    class_state classes[threading::priority_class_count];
+    std::map<std::string, client_usage> clients;
+    size_t queued = 0;
+    size_t running = 0;
+    /** Mirror queued + running and the searches admitted so far for current_activity */
+    std::atomic<unsigned> in_flight {0};
+    std::atomic<uint64_t> admitted {0};
+    double service_seconds = 1.0;
+    /** Spreads the retry hints of clients rejected together */
+    std::mt19937 random {std::random_device{}()};
+
+    unsigned client_weight(const std::string& client) const {
+        auto found = this->config.client_weights.find(client);
+        return found == this->config.client_weights.end() ? 1 : std::max(1u, found->second);
+    }
+
+    /**
+     * Rough time until a search of the client in the class would be dispatched: the searches
+     * served before it, out of the queue and at its share of the dispatches, times the smoothed
+     * service time, with jitter so that clients rejected together do not retry together.
+     */
+    uint32_t retry_after_ms(const std::string& client, threading::priority_class cls) {
+        double class_weights = CLASS_WEIGHTS[(size_t)cls];
+        for (size_t i = 0; i < threading::priority_class_count; ++i) {
+            if (i != (size_t)cls && !this->classes[i].lanes.empty()) {
+                class_weights += CLASS_WEIGHTS[i];
+            }
+        }
+        double weight = this->client_weight(client);
+        double client_weights = weight;
+        for (const auto& lane : this->classes[(size_t)cls].lanes) {
+            if (lane.first != client) {
+                client_weights += this->client_weight(lane.first);
+            }
+        }
+        double share = CLASS_WEIGHTS[(size_t)cls] / class_weights * weight / client_weights;
+        auto usage = this->clients.find(client);
+        double own = usage == this->clients.end() ? 0 : usage->second.queued;
+        double ahead = std::min<double>(this->queued + 1, (own + 1) / share);
+        double seconds = this->service_seconds * ahead / this->config.max_running;
+        seconds *= std::uniform_real_distribution<double>(0.5, 1.5)(this->random);
+        return (uint32_t)std::clamp(seconds * 1000, 100.0, 60000.0);
+    }
+
+    /**
+     * @returns false if the limits do not allow another queued search of the client.
+     */
+    bool admit(const std::string& client, threading::priority_class cls) {
+        auto& usage = this->clients[client];
+        if (this->queued >= this->config.max_queued || usage.queued >= this->config.max_queued_per_client) {
+            ++this->classes[(size_t)cls].rejected;
+            if (usage.running == 0 && usage.queued == 0) {
+                this->clients.erase(client);
+            }
+            return false;
+        }
+        ++usage.queued;
+        ++this->queued;
+        ++this->classes[(size_t)cls].queued;
+        this->in_flight.fetch_add(1, std::memory_order_relaxed);
+        this->admitted.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @returns true if the search cannot start right away.
+     */
+    bool has_to_wait(const std::string& client) {
+        return this->running + this->queued > this->config.max_running
+            || this->clients[client].running >= this->config.max_running_per_client;
+    }
+
+    /**
+     * @returns the queued search, which stays in place while it is announcing.
+     */
+    queued_search& enqueue(threading::priority_class cls, std::unique_ptr<threading::unix_task_handle> handle,
+                           bool announcing) {
+        auto& state = this->classes[(size_t)cls];
+        if (state.lanes.empty()) {
+            // an idle class must not bank the turns it did not use
+            double min_pass = -1;
+            for (const auto& other : this->classes) {
+                if (!other.lanes.empty() && (min_pass < 0 || other.pass < min_pass)) {
+                    min_pass = other.pass;
+                }
+            }
+            state.pass = std::max(state.pass, min_pass);
+        }
+        auto inserted = state.lanes.try_emplace(handle->client_address);
+        auto& lane = inserted.first->second;
+        if (inserted.second) {
+            lane.virtual_time = state.virtual_clock;
+        }
+        lane.searches.push_back(queued_search{std::move(handle), std::chrono::steady_clock::now(), announcing});
+        this->work_available.notify_one();
+        return lane.searches.back();
+    }
+
+    /**
+     * Takes the next search allowed to run, if any.
+     */
+    bool dequeue(queued_search& out, threading::priority_class& out_class) {
+        class_state* best_class = 0;
+        client_lane* best_lane = 0;
+        for (auto& state : this->classes) {
+            if (best_class && state.pass >= best_class->pass) {
+                continue;
+            }
+            client_lane* lane = 0;
+            for (auto& [client, candidate] : state.lanes) {
+                if (this->clients[client].running >= this->config.max_running_per_client
+                    || candidate.searches.front().announcing) {
+                    continue;
+                }
+                if (!lane || candidate.virtual_time < lane->virtual_time) {
+                    lane = &candidate;
+                }
+            }
+            if (lane) {
+                best_class = &state;
+                best_lane = lane;
+            }
+        }
+        if (!best_class) {
+            return false;
+        }
+        size_t cls = best_class - this->classes;
+        out_class = (threading::priority_class)cls;
+        out = std::move(best_lane->searches.front());
+        best_lane->searches.pop_front();
+
+        const auto& client = out.handle->client_address;
+        best_class->pass += 1.0 / CLASS_WEIGHTS[cls];
+        best_class->virtual_clock = best_lane->virtual_time;
+        best_lane->virtual_time += 1.0 / this->client_weight(client);
+        if (best_lane->searches.empty()) {
+            best_class->lanes.erase(client);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        double waited = std::chrono::duration<double>(now - out.enqueued).count();
+        if (out.handle->trace_id) {
+            auto ns = [](std::chrono::steady_clock::time_point t) {
+                return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+            };
+            tracing::record("queue_wait", out.handle->trace_id, ns(out.enqueued), ns(now));
+        }
+        best_class->wait_seconds_sum += waited;
+        best_class->wait_seconds_max = std::max(best_class->wait_seconds_max, waited);
+        ++best_class->dispatched;
+        --best_class->queued;
+        --this->queued;
+        ++this->running;
+        auto& usage = this->clients[client];
+        --usage.queued;
+        ++usage.running;
+        return true;
+    }
+
+    void finish(const std::string& client, double seconds) {
+        --this->running;
+        this->in_flight.fetch_sub(1, std::memory_order_relaxed);
+        auto& usage = this->clients[client];
+        --usage.running;
+        if (usage.running == 0 && usage.queued == 0) {
+            this->clients.erase(client);
+        }
+        this->service_seconds += SERVICE_TIME_SMOOTHING * (seconds - this->service_seconds);
+        // a freed per-client slot may unblock a search other threads have passed over
+        this->work_available.notify_all();
+        if (this->running == 0 && this->queued == 0) {
+            this->idle.notify_all();
+        }
+    }
+
+    void run_worker() {
+        while (true) {
+            queued_search search;
+            threading::priority_class cls;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->work_available.wait(lock, [&] { return this->dequeue(search, cls); });
+            }
+            std::string client = search.handle->client_address;
+            auto started = std::chrono::steady_clock::now();
+            search_file(std::move(search.handle));
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->finish(client, seconds);
+        }
+    }
+};
+
+static search_scheduler scheduler;
+
+void threading::start_scheduler(const scheduler_config& config) {
+    scheduler.config = config;
+    if (scheduler.config.max_running == 0) {
+        scheduler.config.max_running = std::max(1u, std::thread::hardware_concurrency()) * 2;
+    }
+    scheduler.config.max_running_per_client = std::max(1u, scheduler.config.max_running_per_client);
+    for (unsigned i = 0; i < scheduler.config.max_running; ++i) {
+        std::thread([] { scheduler.run_worker(); }).detach();
     }
-    return 0;
+}
+
+bool threading::wait_idle(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(scheduler.mutex);
+    return scheduler.idle.wait_until(lock, deadline, [] { return scheduler.running == 0 && scheduler.queued == 0; });
+}
+
+auto threading::current_activity() -> activity {
+    return activity{
+        scheduler.admitted.load(std::memory_order_relaxed),
+        scheduler.in_flight.load(std::memory_order_relaxed)
+    };
 }
 
 void threading::find_file_task(std::unique_ptr<unix_task_handle> handle) {
-    pthread_t thread;
-    pthread_create(&thread, 0, search_file, handle.get());
-    if (thread == 0) {
-        throw std::runtime_error("pthread_create error");
-    } 
-    handle.release();
-    pthread_detach(thread);
+    auto cls = classify(handle->req);
+    proto::file_search_response res;
+    res.request_id = handle->req.request_id;
+    search_scheduler::queued_search* announcing = 0;
+    uint32_t retry_after_ms = 0;
+    {
+        std::lock_guard<std::mutex> lock(scheduler.mutex);
+        if (!scheduler.admit(handle->client_address, cls)) {
+            retry_after_ms = scheduler.retry_after_ms(handle->client_address, cls);
+        } else if (!scheduler.has_to_wait(handle->client_address)) {
+            scheduler.enqueue(cls, std::move(handle), false);
+            return;
+        } else {
+            announcing = &scheduler.enqueue(cls, std::move(handle), true);
+        }
+    }
+    if (announcing) {
+        // held back from dispatch, the search and its handle stay put until released below
+        auto* task = announcing->handle.get();
+        res.status = proto::file_search_status::pending;
+        res.payload = "Queued";
+        task->callback(task, res);
+        std::lock_guard<std::mutex> lock(scheduler.mutex);
+        announcing->announcing = false;
+        scheduler.work_available.notify_all();
+        return;
+    }
+    if (handle->req.version >= proto::admission_control_version) {
+        res.status = proto::file_search_status::rejected;
+        res.payload = "Server is busy";
+        res.retry_after_ms = retry_after_ms;
+    } else {
+        res.status = proto::file_search_status::error;
+        res.payload = "Server is busy, retry in " + std::to_string(retry_after_ms) + " ms";
+    }
+    handle->callback(handle.get(), res);
+}
+
+std::string threading::scheduler_stats() {
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    std::string out;
+    auto metric = [&out](const char* name, const char* cls, const std::string& value) {
+        out += name;
+        if (cls) {
+            out += "{class=\"";
+            out += cls;
+            out += "\"}";
+        }
+        out += ' ';
+        out += value;
+        out += '\n';
+    };
+    out += "# TYPE rfinder_queue_wait_seconds summary\n";
+    for (size_t i = 0; i < priority_class_count; ++i) {
+        const auto& state = scheduler.classes[i];
+        const char* cls = to_string((priority_class)i);
+        metric("rfinder_queue_wait_seconds_sum", cls, std::to_string(state.wait_seconds_sum));
+        metric("rfinder_queue_wait_seconds_count", cls, std::to_string(state.dispatched));
+    }
+    out += "# TYPE rfinder_queue_wait_seconds_max gauge\n";
+    for (size_t i = 0; i < priority_class_count; ++i) {
+        metric("rfinder_queue_wait_seconds_max", to_string((priority_class)i),
+            std::to_string(scheduler.classes[i].wait_seconds_max));
+    }
+    out += "# TYPE rfinder_queue_depth gauge\n";
+    for (size_t i = 0; i < priority_class_count; ++i) {
+        metric("rfinder_queue_depth", to_string((priority_class)i), std::to_string(scheduler.classes[i].queued));
+    }
+    out += "# TYPE rfinder_rejected_total counter\n";
+    for (size_t i = 0; i < priority_class_count; ++i) {
+        metric("rfinder_rejected_total", to_string((priority_class)i), std::to_string(scheduler.classes[i].rejected));
+    }
+    out += "# TYPE rfinder_running_searches gauge\n";
+    metric("rfinder_running_searches", 0, std::to_string(scheduler.running));
+    out += "# TYPE rfinder_active_clients gauge\n";
+    metric("rfinder_active_clients", 0, std::to_string(scheduler.clients.size()));
+    auto cache = fs::get_listing_cache_stats();
+    out += "# TYPE rfinder_listing_cache_hits_total counter\n";
+    metric("rfinder_listing_cache_hits_total", 0, std::to_string(cache.hits));
+    out += "# TYPE rfinder_listing_cache_misses_total counter\n";
+    metric("rfinder_listing_cache_misses_total", 0, std::to_string(cache.misses));
+    out += "# TYPE rfinder_listing_cache_evictions_total counter\n";
+    metric("rfinder_listing_cache_evictions_total", 0, std::to_string(cache.evictions));
+    out += "# TYPE rfinder_listing_cache_bytes gauge\n";
+    metric("rfinder_listing_cache_bytes", 0, std::to_string(cache.bytes));
+    out += "# TYPE rfinder_listing_cache_listings gauge\n";
+    metric("rfinder_listing_cache_listings", 0, std::to_string(cache.listings));
+    auto filters = fs::get_subtree_filter_stats();
+    out += "# TYPE rfinder_subtree_filters gauge\n";
+    metric("rfinder_subtree_filters", 0, std::to_string(filters.filters));
+    out += "# TYPE rfinder_subtree_filter_bytes gauge\n";
+    metric("rfinder_subtree_filter_bytes", 0, std::to_string(filters.bytes));
+    out += "# TYPE rfinder_subtree_filter_false_positive_rate gauge\n";
+    metric("rfinder_subtree_filter_false_positive_rate", 0, std::to_string(filters.false_positive_rate));
+    out += "# TYPE rfinder_subtree_filter_checks_total counter\n";
+    metric("rfinder_subtree_filter_checks_total", 0, std::to_string(filters.checks));
+    out += "# TYPE rfinder_subtree_filter_skips_total counter\n";
+    metric("rfinder_subtree_filter_skips_total", 0, std::to_string(filters.skipped_subtrees));
+    out += "# TYPE rfinder_subtree_filter_invalidations_total counter\n";
+    metric("rfinder_subtree_filter_invalidations_total", 0, std::to_string(filters.invalidations));
+    auto history = fs::get_search_history_stats();
+    out += "# TYPE rfinder_search_history_shapes gauge\n";
+    metric("rfinder_search_history_shapes", 0, std::to_string(history.shapes));
+    out += "# TYPE rfinder_search_history_guided_lookups_total counter\n";
+    metric("rfinder_search_history_guided_lookups_total", 0, std::to_string(history.guided_lookups));
+    out += "# TYPE rfinder_search_history_guided_hits_total counter\n";
+    metric("rfinder_search_history_guided_hits_total", 0, std::to_string(history.guided_hits));
+    auto crawler = prewarm::get_stats();
+    out += "# TYPE rfinder_prewarm_passes_total counter\n";
+    metric("rfinder_prewarm_passes_total", 0, std::to_string(crawler.passes));
+    out += "# TYPE rfinder_prewarm_entries_total counter\n";
+    metric("rfinder_prewarm_entries_total", 0, std::to_string(crawler.entries));
+    out += "# TYPE rfinder_prewarm_pauses_total counter\n";
+    metric("rfinder_prewarm_pauses_total", 0, std::to_string(crawler.pauses));
+    return out;
 }
 
 #else
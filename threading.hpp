@@ -1,9 +1,85 @@
 #ifndef __THREADING_HPP__
 #define __THREADING_HPP__
 
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "protocol.hpp"
+#include "federation.hpp"
+#include "fs.hpp"
+
+namespace threading {
+
+    /**
+     * Server-wide settings every search task is started with.
+     */
+    struct search_config final {
+        /** Prune rules applied to every search, on top of which requests add their own */
+        fs::prune_rules prune_defaults;
+        /** Threads scanning files, shared by all content searches, 0 for one per CPU */
+        unsigned content_workers = 0;
+        /** Subtrees searched by peer servers instead of crawling them locally */
+        std::vector<federation::peer_route> routes;
+        /** Time a peer gets to complete its part before the subtree is crawled locally */
+        std::chrono::milliseconds peer_timeout {10000};
+        /** Trees whose names are kept in trigram indexes for substring and fuzzy searches */
+        std::vector<std::string> index_roots;
+        /** Period of index rebuilds, 0 to build them once */
+        std::chrono::seconds index_refresh {3600};
+        /** See fs::search_options::large_directories */
+        bool large_directories = false;
+        /** Byte budget of the directory listings shared by all searches, 0 disables sharing them */
+        size_t listing_cache_bytes = 64u << 20;
+        /** Bloom filters of the names below large directories of the indexed trees */
+        fs::subtree_filter_config subtree_filters;
+        /** Where past lookups found their names, expanded first by the next ones */
+        fs::search_history_config search_history;
+        /** Time the frontier of a paged search is kept for its next page */
+        std::chrono::seconds cursor_ttl {300};
+    };
+
+    enum class priority_class {
+        /** Filename lookups below a specific root */
+        scoped,
+        /** Listings and content searches below a specific root */
+        listing,
+        /** Anything walking the whole filesystem */
+        crawl
+    };
+
+    constexpr size_t priority_class_count = 3;
+
+    inline const char* to_string(priority_class cls) {
+        switch (cls) {
+            case priority_class::scoped: return "scoped";
+            case priority_class::listing: return "listing";
+            case priority_class::crawl: return "crawl";
+        }
+        return "unknown";
+    }
+
+    priority_class classify(const proto::file_search_request& req);
+
+    /**
+     * Admission and dispatch limits of the search scheduler.
+     */
+    struct scheduler_config final {
+        /** Searches running at once, 0 for two per CPU */
+        unsigned max_running = 0;
+        unsigned max_running_per_client = 4;
+        /** Searches waiting for a free slot before new ones are rejected */
+        unsigned max_queued = 1024;
+        unsigned max_queued_per_client = 64;
+        /** Share of client addresses relative to the default weight of 1 */
+        std::map<std::string, unsigned> client_weights;
+    };
+
+} // threading
 
 
 #ifdef __unix__
@@ -11,24 +87,70 @@
 
 namespace threading {
 
-    using message_callback = std::function<void(
+    /**
+     * Delivers a response to the client, returns false once the connection is broken.
+     */
+    using message_callback = std::function<bool(
         const void* connection_handle,
         const proto::file_search_response& response
     )>;
 
+    /**
+     * Client connection shared by every search requested over it, closed after the last one.
+     */
+    struct unix_connection final {
+        int fd;
+        /** When the connection was accepted, for tracing the handoff to its reader thread */
+        uint64_t accepted_ns = 0;
+        /** Serializes responses sent from the messaging threads and the search threads */
+        std::mutex write_mutex;
+
+        explicit unix_connection(int fd)
+            : fd(fd) {}
+
+        ~unix_connection() {
+            if (this->fd != -1) {
+                close(this->fd);
+                this->fd = -1;
+            }
+        }
+    };
+
     struct unix_task_handle final {
         proto::file_search_request req;
+        search_config config;
         message_callback callback;
-        pthread_t messaging_thread;
-        int connection_fd;
-        volatile int completed;
+        std::shared_ptr<unix_connection> connection;
+        /** Peer address the scheduler shares capacity by */
+        std::string client_address;
+        /** Tags spans of the request, 0 if it is not sampled */
+        uint32_t trace_id = 0;
+        pthread_t messaging_thread = 0;
+        std::mutex completion_mutex;
+        std::condition_variable completion;
+        bool completed = false;
 
         bool is_completed() {
-            return __atomic_load_n(&this->completed, __ATOMIC_ACQUIRE);
+            std::lock_guard<std::mutex> lock(this->completion_mutex);
+            return this->completed;
+        }
+
+        /**
+         * Sleeps until the timeout elapses or messaging ends.
+         * @returns true if messaging has ended.
+         */
+        template<typename Duration>
+        bool wait_completed(Duration timeout) {
+            std::unique_lock<std::mutex> lock(this->completion_mutex);
+            return this->completion.wait_for(lock, timeout, [this] { return this->completed; });
         }
 
         void end_messaging() {
-            __atomic_store_n(&this->completed, 1, __ATOMIC_RELEASE);
+            {
+                std::lock_guard<std::mutex> lock(this->completion_mutex);
+                this->completed = true;
+            }
+            this->completion.notify_all();
             pthread_join(this->messaging_thread, 0);
             this->messaging_thread = 0;
         }
@@ -42,14 +164,43 @@ namespace threading {
             if (this->messaging_thread) {
                 this->end_messaging();
             }
-            if (this->connection_fd != -1) {
-                close(this->connection_fd);
-                this->connection_fd = -1;
-            }
         }
     };
     
+    /**
+     * Starts the pool of search threads. Has to be called once before searches are submitted.
+     */
+    void start_scheduler(const scheduler_config& config);
+
+    /**
+     * Queues a search. Requests over the admission limits are answered with a rejected
+     * response right away; others wait until their class and client get their fair share.
+     */
     void find_file_task(std::unique_ptr<unix_task_handle> handle);
+
+    /**
+     * Waits until no search is running or queued.
+     * @returns false if searches were still in flight at the deadline.
+     */
+    bool wait_idle(std::chrono::steady_clock::time_point deadline);
+
+    /**
+     * Searches admitted so far, and those of them not finished yet.
+     */
+    struct activity final {
+        uint64_t admitted;
+        unsigned in_flight;
+    };
+
+    /**
+     * Reads the activity without taking the scheduler lock, so that background work can check it often.
+     */
+    activity current_activity();
+
+    /**
+     * Scheduler counters in Prometheus text exposition format.
+     */
+    std::string scheduler_stats();
 } // threading
 
 #elif defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
@@ -61,6 +212,7 @@ namespace threading {
 
     struct win32_task_handle final {
         proto::file_search_request req;
+        search_config config;
         std::function<void(const win32_task_handle*, const proto::file_search_response&)> callback;
         SOCKET connection_socket;
         HANDLE messaging_thread_handle;
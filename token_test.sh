@@ -0,0 +1,121 @@
+#!/usr/bin/env bash
+# Runs an rfinder server and checks the client's result cache: a repeated lookup is answered from
+# the cache once the server vouches for its validation token, and the token stops holding when a
+# shallower match appears, the cached file goes away or a directory on its path is renamed.
+# Usage: ./token_test.sh [DIRECTORY_OF_THE_BINARIES] (default: out)
+set -u
+
+BIN_DIR=${1:-out}
+SERVER=$BIN_DIR/rfinder-server
+CLIENT=$BIN_DIR/rfinder-client
+PORT=$((20000 + RANDOM % 20000))
+ADDRESS=127.0.0.1:$PORT
+
+WORK_DIR=$(mktemp -d /tmp/rfinder-token-XXXXXX)
+TREE=$WORK_DIR/tree
+CACHE_DIR=$WORK_DIR/cache
+PIDS=()
+FAILURES=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "$2" | sed 's/^/    /'
+    FAILURES=$((FAILURES + 1))
+}
+
+pass() {
+    echo "ok: $1"
+}
+
+# @returns 0 once something listens on the port
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+# the server issues no token while a directory on the path changed within the last seconds
+settle() {
+    sleep 3
+}
+
+lookup() {
+    "$CLIENT" --cache-dir "$CACHE_DIR" "$ADDRESS" "$1" "$TREE" 2>&1
+}
+
+# @returns 0 if the output answered path, from the cache if the third argument is "cached"
+answered() {
+    local suffix=""
+    if [ "${3:-}" = cached ]; then
+        suffix=" (cached)"
+    fi
+    grep -qxF "Completed with message: \"$2\"$suffix" <<< "$1"
+}
+
+mkdir -p "$TREE/a/b" "$TREE/c"
+touch "$TREE/a/b/deep.txt" "$TREE/c/moved.txt"
+
+"$SERVER" "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+PIDS+=($!)
+if ! wait_for_port "$PORT"; then
+    echo "Server did not start:"
+    cat "$WORK_DIR/server.log"
+    exit 1
+fi
+settle
+
+first=$(lookup deep.txt)
+second=$(lookup deep.txt)
+if ! answered "$first" "$TREE/a/b/deep.txt" || ! answered "$second" "$TREE/a/b/deep.txt" cached; then
+    fail "a repeated lookup is answered from the cache" "$first"$'\n'"$second"
+else
+    pass "cache round trip"
+fi
+
+touch "$TREE/deep.txt"
+output=$(lookup deep.txt)
+if ! answered "$output" "$TREE/deep.txt"; then
+    fail "a shallower match invalidates the cached answer" "$output"
+else
+    pass "shallower match"
+fi
+
+settle
+lookup deep.txt > /dev/null
+rm "$TREE/deep.txt"
+output=$(lookup deep.txt)
+if ! answered "$output" "$TREE/a/b/deep.txt"; then
+    fail "a removed file invalidates the cached answer" "$output"
+else
+    pass "removed file"
+fi
+
+settle
+lookup moved.txt > /dev/null
+output=$(lookup moved.txt)
+mv "$TREE/c" "$TREE/d"
+moved=$(lookup moved.txt)
+if ! answered "$output" "$TREE/c/moved.txt" cached || ! answered "$moved" "$TREE/d/moved.txt"; then
+    fail "renaming a directory on the path invalidates the cached answer" "$output"$'\n'"$moved"
+else
+    pass "renamed directory"
+fi
+
+if [ "$FAILURES" -ne 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,236 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include "tracing.hpp"
+
+#ifdef __unix__
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#endif
+
+static const size_t RING_SIZE = 1024;
+
+/**
+ * Seqlock protected span: the sequence is odd while the owning thread rewrites the slot,
+ * so a concurrent dump can tell a torn read and skip the slot.
+ */
+struct span_slot final {
+    std::atomic<uint64_t> sequence {0};
+    std::atomic<const char*> name {0};
+    std::atomic<uint32_t> trace_id {0};
+    std::atomic<uint32_t> thread_id {0};
+    std::atomic<uint64_t> start_ns {0};
+    std::atomic<uint64_t> end_ns {0};
+};
+
+/**
+ * Spans of one thread, written by that thread only.
+ */
+struct span_ring final {
+    std::atomic<uint64_t> written {0};
+    span_slot slots[RING_SIZE];
+};
+
+/**
+ * Every ring ever handed out. Rings of exited threads keep their spans for dumps
+ * until a new thread reuses them, so the memory is bounded by the peak number of tracing threads.
+ */
+struct ring_registry final {
+    std::mutex mutex;
+    std::vector<span_ring*> rings;
+    std::vector<span_ring*> free_rings;
+};
+
+static ring_registry registry;
+static std::atomic<uint64_t> sample_threshold {0};
+static std::atomic<uint32_t> next_trace_id {1};
+static std::atomic<uint32_t> next_thread_id {1};
+static std::string dump_path;
+
+/**
+ * Ring of the calling thread, taken on its first span and given back when it exits.
+ */
+struct ring_owner final {
+    span_ring* ring = 0;
+    uint32_t thread_id = 0;
+
+    span_ring& get() {
+        if (!this->ring) {
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            if (!registry.free_rings.empty()) {
+                this->ring = registry.free_rings.back();
+                registry.free_rings.pop_back();
+            } else {
+                this->ring = new span_ring();
+                registry.rings.push_back(this->ring);
+            }
+            this->thread_id = next_thread_id++;
+        }
+        return *this->ring;
+    }
+
+    ~ring_owner() {
+        if (this->ring) {
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.free_rings.push_back(this->ring);
+        }
+    }
+};
+
+static thread_local ring_owner current_ring;
+
+uint64_t tracing::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool tracing::enabled() {
+    return sample_threshold.load(std::memory_order_relaxed) != 0;
+}
+
+uint32_t tracing::sample() {
+    uint64_t threshold = sample_threshold.load(std::memory_order_relaxed);
+    if (threshold == 0) {
+        return 0;
+    }
+    // xorshift64, seeded per thread from the address of its state
+    static thread_local uint64_t state = (uint64_t)(uintptr_t)&state * 0x9e3779b97f4a7c15ull | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    if ((state >> 32) >= threshold) {
+        return 0;
+    }
+    uint32_t id = next_trace_id++;
+    return id ? id : next_trace_id++;
+}
+
+void tracing::record(const char* name, uint32_t trace_id, uint64_t start_ns, uint64_t end_ns) {
+    auto& ring = current_ring.get();
+    uint64_t n = ring.written.load(std::memory_order_relaxed);
+    auto& slot = ring.slots[n % RING_SIZE];
+    slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.trace_id.store(trace_id, std::memory_order_relaxed);
+    slot.thread_id.store(current_ring.thread_id, std::memory_order_relaxed);
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.end_ns.store(end_ns, std::memory_order_relaxed);
+    slot.sequence.store(2 * n + 2, std::memory_order_release);
+    ring.written.store(n + 1, std::memory_order_release);
+}
+
+std::string tracing::chrome_trace_json() {
+#ifdef __unix__
+    long pid = (long)getpid();
+#else
+    long pid = 0;
+#endif
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char event[256];
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (auto* ring : registry.rings) {
+        for (auto& slot : ring->slots) {
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == 0 || sequence % 2) {
+                continue;
+            }
+            const char* name = slot.name.load(std::memory_order_relaxed);
+            uint32_t trace_id = slot.trace_id.load(std::memory_order_relaxed);
+            uint32_t thread_id = slot.thread_id.load(std::memory_order_relaxed);
+            uint64_t start_ns = slot.start_ns.load(std::memory_order_relaxed);
+            uint64_t end_ns = slot.end_ns.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+                continue;
+            }
+            snprintf(event, sizeof(event),
+                "%s{\"name\":\"%s\",\"cat\":\"rfinder\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%ld,\"tid\":%u,\"args\":{\"trace\":%u}}",
+                first ? "" : ",", name, start_ns / 1000.0, (end_ns - start_ns) / 1000.0,
+                pid, thread_id, trace_id);
+            out += event;
+            first = false;
+        }
+    }
+    out += "]}\n";
+    return out;
+}
+
+#ifdef __unix__
+
+/**
+ * The default path is predictable and lives in a shared directory, so the dump never follows a
+ * symlink or opens a file planted there: only a dump this user wrote before is replaced.
+ */
+static FILE* open_dump() {
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    int fd = open(dump_path.c_str(), flags, 0600);
+    struct stat statbuf;
+    if (fd == -1 && errno == EEXIST && lstat(dump_path.c_str(), &statbuf) == 0 && S_ISREG(statbuf.st_mode)
+        && statbuf.st_uid == geteuid() && unlink(dump_path.c_str()) == 0) {
+        fd = open(dump_path.c_str(), flags, 0600);
+    }
+    if (fd == -1) {
+        return 0;
+    }
+    FILE* file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+    }
+    return file;
+}
+
+static void write_dump() {
+    auto json = tracing::chrome_trace_json();
+    FILE* file = open_dump();
+    if (!file) {
+        fprintf(stderr, "Could not write trace to %s\n", dump_path.c_str());
+        return;
+    }
+    fwrite(json.data(), 1, json.size(), file);
+    fclose(file);
+    fprintf(stdout, "Trace written to %s\n", dump_path.c_str());
+}
+
+void tracing::start(const trace_config& config) {
+    double rate = config.sample_rate < 0 ? 0 : config.sample_rate > 1 ? 1 : config.sample_rate;
+    sample_threshold = (uint64_t)(rate * 4294967296.0);
+    if (rate == 0) {
+        return;
+    }
+    dump_path = config.dump_path.empty()
+        ? "/tmp/rfinder-trace-" + std::to_string((long)getpid()) + ".json"
+        : config.dump_path;
+
+    // only the dump thread ever receives SIGUSR1
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, 0);
+    std::thread([signals] {
+        while (true) {
+            int received;
+            if (sigwait(&signals, &received) == 0) {
+                write_dump();
+            }
+        }
+    }).detach();
+}
+
+#else
+
+void tracing::start(const trace_config& config) {
+    double rate = config.sample_rate < 0 ? 0 : config.sample_rate > 1 ? 1 : config.sample_rate;
+    sample_threshold = (uint64_t)(rate * 4294967296.0);
+}
+
+#endif
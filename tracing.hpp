@@ -0,0 +1,71 @@
+#ifndef __TRACING_HPP__
+#define __TRACING_HPP__
+
+#include <cstdint>
+#include <string>
+
+namespace tracing {
+
+struct trace_config final {
+    /** Fraction of requests traced, 0 disables tracing */
+    double sample_rate = 0;
+    /** Written on SIGUSR1, empty for /tmp/rfinder-trace-<pid>.json */
+    std::string dump_path;
+};
+
+/**
+ * Applies the configuration and, on unix, starts the thread writing dumps on SIGUSR1.
+ * Has to be called before any other thread is started, so that all of them inherit the blocked signal.
+ */
+void start(const trace_config& config);
+
+/**
+ * @returns true if some requests are traced, so that callers skip preparing spans otherwise.
+ */
+bool enabled();
+
+/**
+ * Decides whether a new request is traced.
+ * @returns id tagging the spans of the request, 0 if it is not sampled.
+ */
+uint32_t sample();
+
+/** Monotonic timestamp in nanoseconds */
+uint64_t now_ns();
+
+/**
+ * Stores a finished span in the ring buffer of the calling thread, overwriting the oldest one
+ * once it is full. Never blocks. Name has to be a string literal.
+ */
+void record(const char* name, uint32_t trace_id, uint64_t start_ns, uint64_t end_ns);
+
+/**
+ * Records the enclosing scope of a sampled request; costs a single branch otherwise.
+ */
+struct span final {
+    const char* name;
+    uint32_t trace_id;
+    uint64_t start_ns;
+
+    span(const char* name, uint32_t trace_id)
+        : name(name), trace_id(trace_id), start_ns(trace_id ? now_ns() : 0) {}
+
+    span(const span&) = delete;
+    span& operator=(const span&) = delete;
+
+    ~span() {
+        if (this->trace_id) {
+            record(this->name, this->trace_id, this->start_ns, now_ns());
+        }
+    }
+};
+
+/**
+ * Spans currently held by the ring buffers of all threads in Chrome trace event format,
+ * loadable in chrome://tracing and Perfetto.
+ */
+std::string chrome_trace_json();
+
+} // tracing
+
+#endif // __TRACING_HPP__
@@ -0,0 +1,618 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "snapshot.hpp"
+#include "trigram.hpp"
+#include "unicode.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const unsigned FOLD_MODE = unicode::fold_case | unicode::fold_normalization;
+
+/** Longest text a fuzzy query is matched with, longer ones cannot fit any basename anyway */
+static const size_t MAX_FUZZY_TEXT = 255;
+
+static uint32_t pack(std::string_view s, size_t i) {
+    return (uint32_t)(unsigned char)s[i] << 16 | (uint32_t)(unsigned char)s[i + 1] << 8 | (unsigned char)s[i + 2];
+}
+
+/**
+ * @returns the distinct trigrams of a string, sorted.
+ */
+static std::vector<uint32_t> trigrams_of(std::string_view s) {
+    std::vector<uint32_t> grams;
+    for (size_t i = 0; i + 3 <= s.size(); ++i) {
+        grams.push_back(pack(s, i));
+    }
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    return grams;
+}
+
+static void append_varint(std::string& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static uint32_t read_varint(const char*& p) {
+    uint32_t value = 0;
+    for (unsigned shift = 0; ; shift += 7) {
+        auto byte = (unsigned char)*p++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+static uint32_t count_separators(std::string_view path) {
+    return (uint32_t)std::count_if(path.begin(), path.end(), [](char c) { return c == '/' || c == '\\'; });
+}
+
+/**
+ * Edit distance between the pattern and its best matching substring of the text (Sellers),
+ * counting a swap of adjacent characters as one edit like optimal string alignment.
+ * Computed one text character at a time over the last three columns.
+ */
+static unsigned substring_distance(std::string_view pattern, std::string_view text) {
+    unsigned columns[3][MAX_FUZZY_TEXT + 1];
+    size_t m = pattern.size();
+    for (size_t i = 0; i <= m; ++i) {
+        columns[1][i] = columns[2][i] = (unsigned)i;
+    }
+    unsigned best = (unsigned)m;
+    for (size_t j = 0; j < text.size() && best > 0; ++j) {
+        auto& current = columns[j % 3];
+        auto& previous = columns[(j + 2) % 3];
+        auto& before_previous = columns[(j + 1) % 3];
+        // a match may start anywhere, so the empty prefix of the pattern always costs nothing
+        current[0] = 0;
+        for (size_t i = 1; i <= m; ++i) {
+            current[i] = std::min({previous[i] + 1, current[i - 1] + 1, previous[i - 1] + (pattern[i - 1] != text[j])});
+            if (i > 1 && j > 0 && pattern[i - 1] == text[j - 1] && pattern[i - 2] == text[j]) {
+                current[i] = std::min(current[i], before_previous[i - 2] + 1);
+            }
+        }
+        best = std::min(best, current[m]);
+    }
+    return best;
+}
+
+auto trigram::query::make(query_kind kind, std::string_view text) -> query {
+    query q;
+    q.kind = kind;
+    q.text = unicode::fold(text, FOLD_MODE);
+    if (kind == query_kind::fuzzy) {
+        q.max_edits = q.text.size() <= 3 ? 0 : q.text.size() <= 7 ? 1 : 2;
+    }
+    return q;
+}
+
+bool trigram::query::score(std::string_view folded_name, uint32_t& score) const {
+    unsigned distance = 0;
+    if (this->kind == query_kind::substring || this->max_edits == 0) {
+        if (folded_name.find(this->text) == std::string_view::npos) {
+            return false;
+        }
+    } else {
+        if (this->text.size() > MAX_FUZZY_TEXT || folded_name.size() + this->max_edits < this->text.size()) {
+            return false;
+        }
+        distance = substring_distance(this->text, folded_name);
+        if (distance > this->max_edits) {
+            return false;
+        }
+    }
+    score = 1000 - 200 * distance;
+    if (distance == 0 && folded_name.compare(0, this->text.size(), this->text) == 0) {
+        score += folded_name.size() == this->text.size() ? 300 : 100;
+    }
+    size_t extra = folded_name.size() > this->text.size() ? folded_name.size() - this->text.size() : 0;
+    score -= (uint32_t)std::min<size_t>(extra, 100);
+    return true;
+}
+
+/**
+ * Strict order of matches, better first.
+ */
+static bool is_better(const trigram::ranked_match& a, const trigram::ranked_match& b) {
+    if (a.score != b.score) {
+        return a.score > b.score;
+    }
+    if (a.depth != b.depth) {
+        return a.depth < b.depth;
+    }
+    if (a.path.size() != b.path.size()) {
+        return a.path.size() < b.path.size();
+    }
+    return a.path < b.path;
+}
+
+bool trigram::top_k::admits(uint32_t score, uint32_t depth) const {
+    if (this->k == 0) {
+        return false;
+    }
+    if (this->heap.size() < this->k) {
+        return true;
+    }
+    const auto& worst = this->heap.front();
+    return score > worst.score || (score == worst.score && depth <= worst.depth);
+}
+
+void trigram::top_k::offer(ranked_match match) {
+    if (this->k == 0) {
+        return;
+    }
+    if (this->heap.size() < this->k) {
+        this->heap.push_back(std::move(match));
+        std::push_heap(this->heap.begin(), this->heap.end(), is_better);
+        return;
+    }
+    if (!is_better(match, this->heap.front())) {
+        return;
+    }
+    std::pop_heap(this->heap.begin(), this->heap.end(), is_better);
+    this->heap.back() = std::move(match);
+    std::push_heap(this->heap.begin(), this->heap.end(), is_better);
+}
+
+auto trigram::top_k::take_sorted() -> std::vector<ranked_match> {
+    std::sort_heap(this->heap.begin(), this->heap.end(), is_better);
+    std::vector<ranked_match> sorted;
+    sorted.swap(this->heap);
+    return sorted;
+}
+
+auto trigram::name_index::build(
+    std::string_view root,
+    const fs::search_options& options,
+    size_t* filters_built
+) -> std::shared_ptr<const name_index> {
+    auto index = std::make_shared<name_index>();
+    index->root = std::string(root);
+    if (index->root.empty() || (index->root.back() != '/' && index->root.back() != '\\')) {
+        index->root.push_back('/');
+    }
+    auto add = [&](const fs::entry& e) {
+        // a traversal reports the entries of a directory one after another
+        if (index->dirs.empty() || e.dir != index->dirs.back()) {
+            index->dirs.emplace_back(e.dir);
+        }
+        auto folded = unicode::fold(e.name, FOLD_MODE);
+        if (index->files.size() >= UINT32_MAX || index->names.size() + e.name.size() + folded.size() >= UINT32_MAX
+            || folded.size() > UINT16_MAX) {
+            throw std::runtime_error("Tree too large to index");
+        }
+        file f;
+        f.dir = (uint32_t)(index->dirs.size() - 1);
+        f.name_offset = (uint32_t)index->names.size();
+        f.name_size = (uint16_t)e.name.size();
+        index->names += e.name;
+        f.folded_offset = (uint32_t)index->names.size();
+        f.folded_size = (uint16_t)folded.size();
+        index->names += folded;
+        index->files.push_back(f);
+        return true;
+    };
+    if (filters_built) {
+        *filters_built = fs::build_subtree_filters(index->root, options, add);
+    } else {
+        fs::walk(index->root, options, add);
+    }
+
+    // (trigram, file id) pairs sorted once give every posting list in id order
+    std::vector<uint64_t> pairs;
+    for (uint32_t id = 0; id < index->files.size(); ++id) {
+        const auto& f = index->files[id];
+        for (uint32_t gram : trigrams_of(std::string_view(index->names).substr(f.folded_offset, f.folded_size))) {
+            pairs.push_back((uint64_t)gram << 32 | id);
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    uint32_t previous_id = 0;
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        auto gram = (uint32_t)(pairs[i] >> 32);
+        auto id = (uint32_t)pairs[i];
+        if (index->lists.empty() || index->lists.back().trigram != gram) {
+            index->lists.push_back(posting_list{gram, 0, (uint32_t)index->blocks.size()});
+        }
+        auto& list = index->lists.back();
+        if (list.count % BLOCK_SIZE == 0) {
+            index->blocks.push_back(block{id, (uint32_t)index->deltas.size()});
+        } else {
+            append_varint(index->deltas, id - previous_id);
+        }
+        ++list.count;
+        previous_id = id;
+    }
+    return index;
+}
+
+size_t trigram::name_index::memory_usage() const {
+    size_t bytes = this->names.size() + this->deltas.size()
+        + this->files.size() * sizeof(file)
+        + this->lists.size() * sizeof(posting_list)
+        + this->blocks.size() * sizeof(block);
+    for (const auto& dir : this->dirs) {
+        bytes += sizeof(dir) + dir.size();
+    }
+    return bytes;
+}
+
+/**
+ * Sequential access to a posting list, decoding one block at a time.
+ */
+struct posting_cursor final {
+    const trigram::name_index& index;
+    const trigram::name_index::posting_list& list;
+    uint32_t block_count;
+    /** Block held in decoded, block_count if none */
+    uint32_t current;
+    std::vector<uint32_t> decoded;
+
+    posting_cursor(const trigram::name_index& index, const trigram::name_index::posting_list& list)
+        : index(index), list(list),
+          block_count((list.count + trigram::name_index::BLOCK_SIZE - 1) / trigram::name_index::BLOCK_SIZE),
+          current(block_count) {}
+
+    uint32_t first_id(uint32_t b) const {
+        return this->index.blocks[this->list.first_block + b].first_id;
+    }
+
+    void decode(uint32_t b) {
+        if (b == this->current) {
+            return;
+        }
+        this->current = b;
+        this->decoded.clear();
+        const auto& skip = this->index.blocks[this->list.first_block + b];
+        uint32_t size = std::min(trigram::name_index::BLOCK_SIZE, this->list.count - b * trigram::name_index::BLOCK_SIZE);
+        const char* p = this->index.deltas.data() + skip.deltas_offset;
+        uint32_t id = skip.first_id;
+        this->decoded.push_back(id);
+        for (uint32_t i = 1; i < size; ++i) {
+            id += read_varint(p);
+            this->decoded.push_back(id);
+        }
+    }
+
+    void decode_all(std::vector<uint32_t>& out) {
+        for (uint32_t b = 0; b < this->block_count; ++b) {
+            this->decode(b);
+            out.insert(out.end(), this->decoded.begin(), this->decoded.end());
+        }
+    }
+
+    /**
+     * Decodes the block which may hold id, galloping over the skip table from the last block used.
+     * Ids are looked up in increasing order.
+     * @returns false if no block can hold id.
+     */
+    bool seek(uint32_t id, uint32_t& block_hint) {
+        uint32_t low = block_hint;
+        if (low >= this->block_count || this->first_id(low) > id) {
+            return false;
+        }
+        uint32_t step = 1;
+        while (low + step < this->block_count && this->first_id(low + step) <= id) {
+            low += step;
+            step *= 2;
+        }
+        uint32_t high = std::min(low + step, this->block_count);
+        while (high - low > 1) {
+            uint32_t middle = low + (high - low) / 2;
+            if (this->first_id(middle) <= id) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        block_hint = low;
+        this->decode(low);
+        return true;
+    }
+
+    /**
+     * @returns true if ids from id on belong to a later block than the one decoded.
+     */
+    bool past_block(uint32_t id) const {
+        return this->current + 1 < this->block_count && this->first_id(this->current + 1) <= id;
+    }
+};
+
+/**
+ * Copies the sorted ids found in the sorted block to out, which may be ids itself.
+ * @returns the number of ids copied.
+ */
+static size_t intersect_block(const uint32_t* ids, size_t count, const std::vector<uint32_t>& block, uint32_t* out) {
+    size_t kept = 0;
+    size_t i = 0;
+    size_t j = 0;
+    const size_t size = block.size();
+#if defined(__SSE2__)
+    // every id is compared with the 4 block ids which may hold it at once
+    for (; i < count; ++i) {
+        uint32_t id = ids[i];
+        while (j + 4 <= size && block[j + 3] < id) {
+            j += 4;
+        }
+        if (j + 4 > size) {
+            break;
+        }
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(block.data() + j)), _mm_set1_epi32((int)id));
+        if (_mm_movemask_epi8(equal)) {
+            out[kept++] = id;
+        }
+    }
+#endif
+    while (i < count && j < size) {
+        if (block[j] < ids[i]) {
+            ++j;
+        } else {
+            if (block[j] == ids[i]) {
+                out[kept++] = ids[i];
+            }
+            ++i;
+        }
+    }
+    return kept;
+}
+
+void trigram::name_index::search(const query& q, std::string_view dir, top_k& results) const {
+    // depth of every directory below dir, -1 for the others
+    std::vector<int32_t> dir_depths(this->dirs.size(), -1);
+    uint32_t base_depth = count_separators(dir);
+    for (size_t i = 0; i < this->dirs.size(); ++i) {
+        if (this->dirs[i].compare(0, dir.size(), dir) == 0) {
+            dir_depths[i] = (int32_t)(count_separators(this->dirs[i]) - base_depth);
+        }
+    }
+
+    std::vector<const posting_list*> lists;
+    for (uint32_t gram : trigrams_of(q.text)) {
+        auto found = std::lower_bound(this->lists.begin(), this->lists.end(), gram,
+            [](const posting_list& list, uint32_t value) { return list.trigram < value; });
+        if (found != this->lists.end() && found->trigram == gram) {
+            lists.push_back(&*found);
+        } else if (q.kind == query_kind::substring || q.max_edits == 0) {
+            // a trigram no name has rules out every exact match
+            return;
+        }
+    }
+
+    std::vector<uint32_t> candidates;
+    bool scan_all = false;
+    if (q.kind == query_kind::substring || q.max_edits == 0) {
+        scan_all = lists.empty();
+        if (!scan_all) {
+            std::sort(lists.begin(), lists.end(),
+                [](const posting_list* a, const posting_list* b) { return a->count < b->count; });
+            posting_cursor(*this, *lists.front()).decode_all(candidates);
+            for (size_t i = 1; i < lists.size() && !candidates.empty(); ++i) {
+                posting_cursor cursor(*this, *lists[i]);
+                uint32_t block_hint = 0;
+                size_t kept = 0;
+                // the candidates falling into a block are intersected with it as a whole
+                for (size_t run = 0; run < candidates.size(); ) {
+                    if (!cursor.seek(candidates[run], block_hint)) {
+                        ++run;
+                        continue;
+                    }
+                    size_t run_end = run + 1;
+                    while (run_end < candidates.size() && !cursor.past_block(candidates[run_end])) {
+                        ++run_end;
+                    }
+                    kept += intersect_block(candidates.data() + run, run_end - run, cursor.decoded,
+                        candidates.data() + kept);
+                    run = run_end;
+                }
+                candidates.resize(kept);
+            }
+        }
+    } else {
+        // an edit destroys at most three trigrams of the text, a swap of adjacent characters four
+        int64_t threshold = (int64_t)trigrams_of(q.text).size() - 4 * (int64_t)q.max_edits;
+        scan_all = threshold <= 0;
+        if (!scan_all) {
+            std::vector<uint32_t> ids;
+            for (const auto* list : lists) {
+                posting_cursor(*this, *list).decode_all(ids);
+            }
+            std::sort(ids.begin(), ids.end());
+            for (size_t i = 0; i < ids.size(); ) {
+                size_t run = i;
+                while (run < ids.size() && ids[run] == ids[i]) {
+                    ++run;
+                }
+                if ((int64_t)(run - i) >= threshold) {
+                    candidates.push_back(ids[i]);
+                }
+                i = run;
+            }
+        }
+    }
+
+    std::string_view names = this->names;
+    auto consider = [&](uint32_t id) {
+        const auto& f = this->files[id];
+        int32_t depth = dir_depths[f.dir];
+        uint32_t score;
+        if (depth < 0 || !q.score(names.substr(f.folded_offset, f.folded_size), score)) {
+            return;
+        }
+        if (results.admits(score, depth)) {
+            results.offer(ranked_match{
+                this->dirs[f.dir] + std::string(names.substr(f.name_offset, f.name_size)), score, (uint32_t)depth});
+        }
+    };
+    if (scan_all) {
+        for (uint32_t id = 0; id < this->files.size(); ++id) {
+            consider(id);
+        }
+    } else {
+        for (uint32_t id : candidates) {
+            consider(id);
+        }
+    }
+}
+
+void trigram::crawl(const query& q, std::string_view root, const fs::search_options& options, top_k& results) {
+    trigram::crawl(q, std::vector<std::string>{std::string(root)}, options, results);
+}
+
+void trigram::crawl(const query& q, const std::vector<std::string>& roots, const fs::search_options& options, top_k& results) {
+    fs::walk(roots, options, [&](const fs::entry& e) {
+        uint32_t score;
+        if (!q.score(unicode::fold(e.name, FOLD_MODE), score)) {
+            return true;
+        }
+        // roots are not nested, a single one is a prefix of the directory
+        uint32_t base_depth = 0;
+        for (const auto& root : roots) {
+            if (e.dir.compare(0, root.size(), root) == 0) {
+                base_depth = count_separators(root);
+                break;
+            }
+        }
+        uint32_t depth = count_separators(e.dir) - base_depth;
+        if (results.admits(score, depth) && fs::satisfies_predicates(e, options)) {
+            results.offer(ranked_match{e.path(), score, depth});
+        }
+        return true;
+    });
+}
+
+struct index_registry final {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<const trigram::name_index>> indexes;
+
+    void publish(std::shared_ptr<const trigram::name_index> index) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (auto& existing : this->indexes) {
+            if (existing->root == index->root) {
+                existing = std::move(index);
+                return;
+            }
+        }
+        this->indexes.push_back(std::move(index));
+    }
+};
+
+static index_registry registry;
+
+void trigram::start_indexing(std::vector<std::string> roots, fs::search_options options, std::chrono::seconds refresh) {
+    if (roots.empty()) {
+        return;
+    }
+    std::thread([roots = std::move(roots), options = std::move(options), refresh] {
+        bool first_pass = true;
+        while (true) {
+            for (const auto& root : roots) {
+                // an index handed over by the previous server waits for the next refresh, as do its filters
+                if (first_pass) {
+                    auto dir = root;
+                    if (dir.empty() || (dir.back() != '/' && dir.back() != '\\')) {
+                        dir.push_back('/');
+                    }
+                    auto restored = find_index(dir);
+                    if (restored && restored->root == dir) {
+                        continue;
+                    }
+                }
+                auto started = std::chrono::steady_clock::now();
+                try {
+                    size_t filters = 0;
+                    auto index = name_index::build(root, options, &filters);
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+                    fprintf(stdout, "Indexed %zu files below %s in %.1f s, %zu KiB, %zu subtree filters\n",
+                        index->files.size(), index->root.c_str(), seconds, index->memory_usage() / 1024, filters);
+                    registry.publish(std::move(index));
+                } catch (const std::exception& e) {
+                    fprintf(stderr, "Could not index %s: %s\n", root.c_str(), e.what());
+                }
+            }
+            if (refresh.count() <= 0) {
+                return;
+            }
+            first_pass = false;
+            std::this_thread::sleep_for(refresh);
+        }
+    }).detach();
+}
+
+auto trigram::find_index(std::string_view dir) -> std::shared_ptr<const name_index> {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    std::shared_ptr<const name_index> best;
+    for (const auto& index : registry.indexes) {
+        if (dir.compare(0, index->root.size(), index->root) != 0) {
+            continue;
+        }
+        if (!best || index->root.size() > best->root.size()) {
+            best = index;
+        }
+    }
+    return best;
+}
+
+void trigram::save_indexes(snapshot::writer& out) {
+    std::vector<std::shared_ptr<const name_index>> indexes;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        indexes = registry.indexes;
+    }
+    out.u64(indexes.size());
+    for (const auto& index : indexes) {
+        out.string(index->root);
+        out.u64(index->dirs.size());
+        for (const auto& dir : index->dirs) {
+            out.string(dir);
+        }
+        out.pods(index->files);
+        out.string(index->names);
+        out.pods(index->lists);
+        out.pods(index->blocks);
+        out.string(index->deltas);
+    }
+}
+
+void trigram::load_indexes(snapshot::reader& in) {
+    uint64_t count = in.u64();
+    for (uint64_t i = 0; i < count; ++i) {
+        auto index = std::make_shared<name_index>();
+        index->root = in.string();
+        uint64_t dir_count = in.u64();
+        for (uint64_t j = 0; j < dir_count; ++j) {
+            index->dirs.push_back(in.string());
+        }
+        in.pods(index->files);
+        index->names = in.string();
+        in.pods(index->lists);
+        in.pods(index->blocks);
+        index->deltas = in.string();
+        for (const auto& f : index->files) {
+            if (f.dir >= index->dirs.size() || (uint64_t)f.name_offset + f.name_size > index->names.size()
+                || (uint64_t)f.folded_offset + f.folded_size > index->names.size()) {
+                throw std::runtime_error("Malformed index in snapshot");
+            }
+        }
+        for (const auto& list : index->lists) {
+            if ((uint64_t)list.first_block + (list.count + name_index::BLOCK_SIZE - 1) / name_index::BLOCK_SIZE > index->blocks.size()) {
+                throw std::runtime_error("Malformed index in snapshot");
+            }
+        }
+        for (const auto& b : index->blocks) {
+            if (b.first_id >= index->files.size() || b.deltas_offset > index->deltas.size()) {
+                throw std::runtime_error("Malformed index in snapshot");
+            }
+        }
+        registry.publish(std::move(index));
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef __TRIGRAM_HPP__
+#define __TRIGRAM_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "fs.hpp"
+
+namespace snapshot {
+    struct writer;
+    struct reader;
+}
+
+namespace trigram {
+
+enum class query_kind {
+    /** Names containing the text */
+    substring,
+    /** Names containing the text with a few typos */
+    fuzzy
+};
+
+/**
+ * Partial filename query. Names and text are compared folded, ignoring case and normalization.
+ */
+struct query final {
+    query_kind kind = query_kind::substring;
+    /** Folded with unicode::fold */
+    std::string text;
+    /** Insertions, deletions and substitutions a fuzzy match may need, by length of the text */
+    unsigned max_edits = 0;
+
+    static query make(query_kind kind, std::string_view text);
+
+    /**
+     * Rates a folded basename, higher is more similar: fewer edits, then names starting with
+     * or equal to the text, then names with fewer characters beyond it.
+     * @returns false if the name does not match.
+     */
+    bool score(std::string_view folded_name, uint32_t& score) const;
+};
+
+struct ranked_match final {
+    std::string path;
+    uint32_t score;
+    /** Directories between the search root and the file */
+    uint32_t depth;
+};
+
+/**
+ * Keeps the k best matches offered to it without holding the others: higher score first,
+ * then shallower, then shorter path.
+ */
+struct top_k final {
+    size_t k;
+    /** Worst kept match on top */
+    std::vector<ranked_match> heap;
+
+    explicit top_k(size_t k)
+        : k(k) {}
+
+    /**
+     * @returns false if a match ranked like this would be dropped right away,
+     * so that its path does not have to be built.
+     */
+    bool admits(uint32_t score, uint32_t depth) const;
+
+    void offer(ranked_match match);
+
+    /** Empties the heap, best match first */
+    std::vector<ranked_match> take_sorted();
+};
+
+/**
+ * Trigram posting lists over the folded basenames of the non-directory entries of a tree.
+ * Lists are sorted file ids split in blocks; a block stores its first id uncompressed in a skip
+ * table and the others as varint deltas, so intersections skip whole blocks without decoding them.
+ */
+struct name_index final {
+    static constexpr uint32_t BLOCK_SIZE = 128;
+
+    struct file final {
+        uint32_t dir;
+        uint32_t name_offset;
+        uint32_t folded_offset;
+        uint16_t name_size;
+        uint16_t folded_size;
+    };
+
+    struct posting_list final {
+        uint32_t trigram;
+        uint32_t count;
+        uint32_t first_block;
+    };
+
+    struct block final {
+        uint32_t first_id;
+        uint32_t deltas_offset;
+    };
+
+    /** Ends with a path separator */
+    std::string root;
+    /** Directories holding indexed files, ending with a path separator */
+    std::vector<std::string> dirs;
+    std::vector<file> files;
+    /** Basenames and their folded keys */
+    std::string names;
+    /** Sorted by trigram */
+    std::vector<posting_list> lists;
+    std::vector<block> blocks;
+    std::string deltas;
+
+    /**
+     * Walks the tree below root with the options and indexes every file it meets. With filters_built,
+     * the same crawl replaces the subtree filters of root, see fs::build_subtree_filters, and how
+     * many were built is stored there.
+     * @throws std::runtime exceptions on system errors.
+     */
+    static std::shared_ptr<const name_index> build(
+        std::string_view root,
+        const fs::search_options& options,
+        size_t* filters_built = nullptr
+    );
+
+    /**
+     * Offers every indexed file below dir (ending with a path separator) matching the query.
+     */
+    void search(const query& q, std::string_view dir, top_k& results) const;
+
+    size_t memory_usage() const;
+};
+
+/**
+ * Ranks the files below root by walking the tree, for roots no index covers.
+ * Honors the predicates of the options.
+ */
+void crawl(const query& q, std::string_view root, const fs::search_options& options, top_k& results);
+
+/**
+ * Like crawl, for the files below several roots (as fs::normalize_roots leaves them) walked as a
+ * single traversal, see fs::walk. Depths count from the root a file was found below.
+ */
+void crawl(const query& q, const std::vector<std::string>& roots, const fs::search_options& options, top_k& results);
+
+/**
+ * Builds an index of every root on a background thread, then rebuilds them every refresh period
+ * (never if it is zero). Searches use the previous index of a root while it is rebuilt.
+ * The same crawls rebuild the subtree filters of the roots, see fs::build_subtree_filters.
+ */
+void start_indexing(std::vector<std::string> roots, fs::search_options options, std::chrono::seconds refresh);
+
+/**
+ * @returns the index with the longest root covering dir (ending with a path separator), null if none is built.
+ */
+std::shared_ptr<const name_index> find_index(std::string_view dir);
+
+/**
+ * Saves the built indexes for a successor process.
+ */
+void save_indexes(snapshot::writer& out);
+
+/**
+ * Publishes the indexes save_indexes saved. start_indexing rebuilds them at the next refresh only.
+ * @throws std::runtime_error on malformed snapshots.
+ */
+void load_indexes(snapshot::reader& in);
+
+} // trigram
+
+#endif // __TRIGRAM_HPP__
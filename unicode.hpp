@@ -0,0 +1,36 @@
+#ifndef __UNICODE_HPP__
+#define __UNICODE_HPP__
+
+#include <string>
+#include <string_view>
+
+namespace unicode {
+
+enum fold_mode : unsigned {
+    /** Simple case folding, "README.md" and "readme.md" compare equal */
+    fold_case = 1u << 0,
+    /**
+     * Canonical decomposition, so that NFC names (Linux, Windows) and NFD names
+     * (files synced from macOS) compare equal
+     */
+    fold_normalization = 1u << 1,
+};
+
+/**
+ * Key of a UTF-8 string under the fold mode. Two strings compare equal under the mode iff their keys
+ * are byte-equal, so indexes store keys and lookups fold the query once.
+ * Covers Latin, Greek and Cyrillic; other code points and invalid UTF-8 bytes are kept as they are.
+ */
+std::string fold(std::string_view s, unsigned mode);
+
+bool is_ascii(std::string_view s);
+
+/**
+ * Compares a name with a key folded in the same mode. ASCII names are compared a word at a time
+ * without allocating; only non-ASCII names are folded.
+ */
+bool folded_equals(std::string_view name, std::string_view folded, unsigned mode);
+
+} // unicode
+
+#endif // __UNICODE_HPP__